@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "atrace"
+
+#include "FlightRecorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <functional>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/macros.h>
+#include <log/log.h>
+
+using android::base::unique_fd;
+
+namespace {
+
+// Clients beyond this many at a time are turned away.
+const size_t k_maxClients = 4;
+
+// Compress data into a single gzip member.
+bool gzipChunk(const std::string& data, std::string* out)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 asks for a gzip header. The recorder runs all the time, so it favors
+    // speed over size.
+    int result = deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    if (result != Z_OK) {
+        fprintf(stderr, "error initializing zlib: %d\n", result);
+        return false;
+    }
+    out->resize(deflateBound(&zs, data.size()));
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = data.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+    zs.avail_out = out->size();
+    result = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (result != Z_STREAM_END) {
+        fprintf(stderr, "error deflating trace: %d\n", result);
+        return false;
+    }
+    out->resize(zs.total_out);
+    return true;
+}
+
+// Turn the pending trace into a chunk. Must be called with the lock held.
+void sealChunk(FlightRecorder* recorder)
+{
+    auto chunk = std::make_shared<std::string>();
+    if (gzipChunk(recorder->pending, chunk.get())) {
+        recorder->bytes += chunk->size();
+        recorder->chunks.push_back(std::move(chunk));
+    }
+    recorder->pending.clear();
+    while (recorder->bytes > recorder->maxBytes && recorder->chunks.size() > 1) {
+        recorder->bytes -= recorder->chunks.front()->size();
+        recorder->chunks.pop_front();
+        recorder->droppedChunks++;
+    }
+}
+
+// Hand each chunk of a snapshot to write, stopping at the first that fails.
+bool writeSnapshot(FlightRecorder* recorder,
+                   const std::function<bool(const std::string&)>& write)
+{
+    std::vector<std::shared_ptr<const std::string>> chunks;
+    uint64_t droppedChunks;
+    {
+        std::lock_guard<std::mutex> guard(recorder->lock);
+        if (!recorder->pending.empty()) {
+            sealChunk(recorder);
+        }
+        chunks.assign(recorder->chunks.begin(), recorder->chunks.end());
+        droppedChunks = recorder->droppedChunks;
+    }
+
+    size_t bytes = 0;
+    for (const auto& chunk : chunks) {
+        if (!write(*chunk)) {
+            fprintf(stderr, "error writing trace snapshot: %s (%d)\n", strerror(errno), errno);
+            return false;
+        }
+        bytes += chunk->size();
+    }
+    ALOGI("Wrote a trace snapshot of %zu chunks (%zu bytes), %" PRIu64 " older ones dropped",
+          chunks.size(), bytes, droppedChunks);
+    return true;
+}
+
+// Send all of data, without raising SIGPIPE if the client has gone away.
+bool sendFully(int fd, const std::string& data)
+{
+    for (size_t pos = 0; pos < data.size();) {
+        ssize_t n = TEMP_FAILURE_RETRY(send(fd, data.data() + pos, data.size() - pos,
+                                            MSG_NOSIGNAL));
+        if (n <= 0) {
+            return false;
+        }
+        pos += n;
+    }
+    return true;
+}
+
+void serveClient(FlightRecorder* recorder, FlightRecorderClient* client)
+{
+    int clientFd = client->fd.get();
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(clientFd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+            (cred.uid != 0 && cred.uid != getuid())) {
+        fprintf(stderr, "rejecting flight recorder client\n");
+    } else {
+        // A client that stops reading only ties up its own thread, but not
+        // for long.
+        struct timeval timeout = { 10, 0 };
+        setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char command[64];
+        ssize_t n = TEMP_FAILURE_RETRY(read(clientFd, command, sizeof(command) - 1));
+        if (n > 0) {
+            command[n] = '\0';
+            if (strcmp(command, "snapshot") == 0 || strcmp(command, "snapshot\n") == 0) {
+                writeSnapshot(recorder, [clientFd](const std::string& chunk) {
+                    return sendFully(clientFd, chunk);
+                });
+            } else {
+                fprintf(stderr, "unknown flight recorder command: %s\n", command);
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(recorder->clientsLock);
+    client->fd.reset();
+    client->done = true;
+}
+
+}  // unnamed namespace
+
+void addFlightRecorderTrace(FlightRecorder* recorder, const char* data, size_t size)
+{
+    std::lock_guard<std::mutex> guard(recorder->lock);
+    recorder->pending.append(data, size);
+    if (recorder->pending.size() >= recorder->chunkSize) {
+        sealChunk(recorder);
+    }
+}
+
+bool writeFlightRecorderSnapshot(FlightRecorder* recorder, int fd)
+{
+    return writeSnapshot(recorder, [fd](const std::string& chunk) {
+        return android::base::WriteFully(fd, chunk.data(), chunk.size());
+    });
+}
+
+bool writeFlightRecorderSnapshotFile(FlightRecorder* recorder, const char* path)
+{
+    std::string tmpPath = std::string(path) + ".tmp";
+    unique_fd fd(open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd == -1) {
+        fprintf(stderr, "error opening %s: %s (%d)\n", tmpPath.c_str(), strerror(errno), errno);
+        return false;
+    }
+    if (!writeFlightRecorderSnapshot(recorder, fd) || rename(tmpPath.c_str(), path) == -1) {
+        fprintf(stderr, "error writing %s: %s (%d)\n", path, strerror(errno), errno);
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+void serveFlightRecorderClient(FlightRecorder* recorder, unique_fd clientFd)
+{
+    std::lock_guard<std::mutex> guard(recorder->clientsLock);
+    size_t busy = 0;
+    for (auto it = recorder->clients.begin(); it != recorder->clients.end();) {
+        if (it->done) {
+            it->thread.join();
+            it = recorder->clients.erase(it);
+        } else {
+            busy++;
+            ++it;
+        }
+    }
+    if (busy >= k_maxClients) {
+        fprintf(stderr, "too many flight recorder clients, rejecting one\n");
+        return;
+    }
+
+    recorder->clients.emplace_back();
+    FlightRecorderClient* client = &recorder->clients.back();
+    client->fd = std::move(clientFd);
+    client->thread = std::thread(serveClient, recorder, client);
+}
+
+void stopFlightRecorderClients(FlightRecorder* recorder)
+{
+    std::list<FlightRecorderClient> clients;
+    {
+        std::lock_guard<std::mutex> guard(recorder->clientsLock);
+        // Wakes up the threads blocked on their client.
+        for (FlightRecorderClient& client : recorder->clients) {
+            if (client.fd != -1) {
+                shutdown(client.fd, SHUT_RDWR);
+            }
+        }
+        clients.swap(recorder->clients);
+    }
+    for (FlightRecorderClient& client : clients) {
+        client.thread.join();
+    }
+}
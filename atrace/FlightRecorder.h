@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ATRACE_FLIGHT_RECORDER_H
+#define ATRACE_FLIGHT_RECORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <android-base/unique_fd.h>
+
+// A connection to the recorder socket, served on its own thread.
+struct FlightRecorderClient {
+    std::thread thread;
+    // Closed by the thread once it's done with the client.
+    android::base::unique_fd fd;
+    bool done = false;
+};
+
+// A rolling history of the trace: the kernel buffer is drained into chunks of
+// gzip data, which are dropped oldest first once they take more than maxBytes.
+struct FlightRecorder {
+    std::mutex lock;
+    size_t maxBytes = 0;
+    // How much trace goes into each chunk.
+    size_t chunkSize = 0;
+    // Each chunk is a gzip member, so that any run of them concatenated is a
+    // valid gzip file.
+    std::deque<std::shared_ptr<const std::string>> chunks;
+    size_t bytes = 0;
+    uint64_t droppedChunks = 0;
+    // Trace read since the last chunk was made.
+    std::string pending;
+
+    // Guards clients, and the fd and done flag of each of them.
+    std::mutex clientsLock;
+    std::list<FlightRecorderClient> clients;
+};
+
+// Add trace to the recorder, making a new chunk once there's enough of it.
+void addFlightRecorderTrace(FlightRecorder* recorder, const char* data, size_t size);
+
+// Write the history kept by the recorder as a gzip file. Tracing carries on
+// meanwhile: only the list of chunks is copied under the lock.
+bool writeFlightRecorderSnapshot(FlightRecorder* recorder, int fd);
+
+// Write a snapshot to the given file, replacing the previous one.
+bool writeFlightRecorderSnapshotFile(FlightRecorder* recorder, const char* path);
+
+// Serve a client of the recorder socket on a thread of its own, so that a
+// client that is slow to read holds up neither the recorder nor the others.
+// The only command is "snapshot", which is answered with the snapshot itself;
+// the connection is closed after it.
+void serveFlightRecorderClient(FlightRecorder* recorder, android::base::unique_fd clientFd);
+
+// Disconnect the clients still being served and wait for their threads. Must
+// be called before the recorder is destroyed.
+void stopFlightRecorderClients(FlightRecorder* recorder);
+
+#endif // ATRACE_FLIGHT_RECORDER_H
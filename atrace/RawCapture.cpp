@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RawCapture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include <android-base/file.h>
+#include <android-base/macros.h>
+#include <android-base/unique_fd.h>
+
+using android::base::unique_fd;
+
+bool copyRawCpuTrace(int rawFd, int outFd, const std::atomic<bool>& stopped, uint64_t* bytes,
+                     const std::string& name)
+{
+    static const useconds_t k_rawIdleUs = 100 * 1000;
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t spliceSize = 16 * pageSize;
+
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) == -1) {
+        fprintf(stderr, "error capturing %s: %s (%d)\n", name.c_str(), strerror(errno), errno);
+        return false;
+    }
+    unique_fd pipeRead(pipeFds[0]);
+    unique_fd pipeWrite(pipeFds[1]);
+    fcntl(pipeWrite, F_SETPIPE_SZ, spliceSize);
+
+    // The kernel only splices full pages, so this keeps going until tracing
+    // has stopped and every full page has been moved.
+    bool sawStop = false;
+    while (true) {
+        ssize_t n = splice(rawFd, nullptr, pipeWrite, nullptr, spliceSize,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0 || (n == -1 && errno == EAGAIN)) {
+            if (sawStop) {
+                break;
+            }
+            sawStop = stopped;
+            if (!sawStop) {
+                usleep(k_rawIdleUs);
+            }
+            continue;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "error splicing %s: %s (%d)\n", name.c_str(), strerror(errno),
+                    errno);
+            return false;
+        }
+        for (ssize_t left = n; left > 0;) {
+            ssize_t written = splice(pipeRead, nullptr, outFd, nullptr, left, SPLICE_F_MOVE);
+            if (written <= 0) {
+                if (written == -1 && errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "error writing %s: %s (%d)\n", name.c_str(), strerror(errno),
+                        errno);
+                return false;
+            }
+            left -= written;
+        }
+        *bytes += n;
+    }
+
+    // Reads do return partially filled pages.
+    std::unique_ptr<char[]> page(new char[pageSize]);
+    ssize_t n;
+    while ((n = TEMP_FAILURE_RETRY(read(rawFd, page.get(), pageSize))) > 0) {
+        if (!android::base::WriteFully(outFd, page.get(), n)) {
+            fprintf(stderr, "error writing %s: %s (%d)\n", name.c_str(), strerror(errno),
+                    errno);
+            return false;
+        }
+        *bytes += n;
+    }
+    return true;
+}
+
+uint64_t parseCpuStat(const std::string& stats, const char* name)
+{
+    std::string key = std::string("\n") + name + ": ";
+    size_t pos = ("\n" + stats).find(key);
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    return strtoull(stats.c_str() + pos + key.size() - 1, nullptr, 10);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ATRACE_RAW_CAPTURE_H
+#define ATRACE_RAW_CAPTURE_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+// Move the pages of a CPU's trace_pipe_raw, opened non-blocking as rawFd, to
+// outFd until stopped is set, then read what's left of the buffer. The number
+// of bytes copied is added to *bytes. name is what errors are reported as.
+bool copyRawCpuTrace(int rawFd, int outFd, const std::atomic<bool>& stopped, uint64_t* bytes,
+                     const std::string& name);
+
+// Read a counter from a CPU's stats file, e.g. "overrun: 12", or 0 if it isn't
+// there.
+uint64_t parseCpuStat(const std::string& stats, const char* name);
+
+#endif // ATRACE_RAW_CAPTURE_H
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ServicePokes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+// Shared with the poking threads, which are detached so that a hung service
+// can't keep atrace from exiting.
+struct PokeQueue {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<ServicePoke> pokes;
+    std::vector<PokeResult> results;
+    // When each poke was started, or 0 if it hasn't been yet.
+    std::vector<nsecs_t> starts;
+    // Whether each poke was acknowledged or given up on.
+    std::vector<bool> done;
+    size_t next = 0;
+    size_t finished = 0;
+};
+
+// Run pokes from the queue until it's empty, or until the poke this thread is
+// running gets abandoned for taking too long.
+static void servicePokeThread(std::shared_ptr<PokeQueue> queue)
+{
+    std::unique_lock<std::mutex> lock(queue->lock);
+    while (queue->next < queue->pokes.size()) {
+        size_t i = queue->next++;
+        queue->starts[i] = systemTime(SYSTEM_TIME_MONOTONIC);
+        const std::function<bool()>& poke = queue->pokes[i].poke;
+        lock.unlock();
+        bool ok = poke();
+        nsecs_t end = systemTime(SYSTEM_TIME_MONOTONIC);
+        lock.lock();
+        PokeResult& result = queue->results[i];
+        if (result.timedOut) {
+            // Another thread has taken over the rest of the queue.
+            return;
+        }
+        result.latency = end - queue->starts[i];
+        result.ok = ok;
+        queue->done[i] = true;
+        queue->finished++;
+        queue->cv.notify_all();
+    }
+}
+
+}  // unnamed namespace
+
+std::vector<PokeResult> runServicePokes(std::vector<ServicePoke> pokes, size_t maxThreads,
+                                        nsecs_t deadline)
+{
+    auto queue = std::make_shared<PokeQueue>();
+    queue->results.resize(pokes.size());
+    queue->starts.resize(pokes.size(), 0);
+    queue->done.resize(pokes.size(), false);
+    for (size_t i = 0; i < pokes.size(); i++) {
+        queue->results[i].name = pokes[i].name;
+    }
+    queue->pokes = std::move(pokes);
+
+    size_t threads = std::min(maxThreads, queue->pokes.size());
+    for (size_t i = 0; i < threads; i++) {
+        std::thread(servicePokeThread, queue).detach();
+    }
+
+    std::unique_lock<std::mutex> lock(queue->lock);
+    while (queue->finished < queue->pokes.size()) {
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        nsecs_t wakeup = now + deadline;
+        for (size_t i = 0; i < queue->next; i++) {
+            PokeResult& result = queue->results[i];
+            if (queue->done[i]) {
+                continue;
+            }
+            nsecs_t pokeDeadline = queue->starts[i] + deadline;
+            if (pokeDeadline > now) {
+                wakeup = std::min(wakeup, pokeDeadline);
+                continue;
+            }
+            result.timedOut = true;
+            result.latency = now - queue->starts[i];
+            queue->done[i] = true;
+            queue->finished++;
+            if (queue->next < queue->pokes.size()) {
+                std::thread(servicePokeThread, queue).detach();
+            }
+        }
+        if (queue->finished == queue->pokes.size()) {
+            break;
+        }
+        queue->cv.wait_for(lock, std::chrono::nanoseconds(wakeup - now));
+    }
+    return queue->results;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ATRACE_SERVICE_POKES_H
+#define ATRACE_SERVICE_POKES_H
+
+#include <stddef.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <utils/Timers.h>
+
+// A notification asking one process to re-read its system properties.
+struct ServicePoke {
+    // How the service is reported, e.g. "binder:activity".
+    std::string name;
+
+    // Delivers the notification, returning true if the service acknowledged it.
+    std::function<bool()> poke;
+};
+
+struct PokeResult {
+    std::string name;
+    nsecs_t latency = 0;
+    bool ok = false;
+    bool timedOut = false;
+};
+
+// Run the pokes on at most maxThreads threads at a time, and return once
+// every one of them has either been acknowledged or missed its deadline, which
+// is the given time after it started. The results are in the order of pokes.
+//
+// Binder and HIDL calls can't be cancelled, so a poke that misses its deadline
+// is left running, and a new thread is started in place of the one stuck on it.
+std::vector<PokeResult> runServicePokes(std::vector<ServicePoke> pokes, size_t maxThreads,
+                                        nsecs_t deadline);
+
+#endif // ATRACE_SERVICE_POKES_H
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TraceFiles.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <android-base/macros.h>
+#include <android-base/unique_fd.h>
+
+using android::base::unique_fd;
+
+namespace {
+
+// Check whether a file reads back as str, ignoring a trailing newline.
+bool readsBackAs(int fd, const char* str)
+{
+    char current[64];
+    ssize_t n = TEMP_FAILURE_RETRY(pread(fd, current, sizeof(current) - 1, 0));
+    if (n <= 0) {
+        return false;
+    }
+    current[n] = '\0';
+    if (current[n - 1] == '\n') {
+        current[n - 1] = '\0';
+    }
+    return strcmp(current, str) == 0;
+}
+
+}  // unnamed namespace
+
+const TraceFileProbe& probeTraceFile(int folderFd, const char* filename, TraceFileProbes* probes)
+{
+    auto it = probes->find(filename);
+    if (it == probes->end()) {
+        TraceFileProbe probe;
+        probe.exists = faccessat(folderFd, filename, F_OK, 0) == 0;
+        probe.writable = probe.exists && faccessat(folderFd, filename, W_OK, 0) == 0;
+        it = probes->emplace(filename, probe).first;
+    }
+    return it->second;
+}
+
+bool writeTraceFile(int folderFd, const char* filename, const char* str)
+{
+    unique_fd fd(openat(folderFd, filename, O_RDWR | O_CLOEXEC));
+    if (fd != -1) {
+        if (readsBackAs(fd, str)) {
+            return true;
+        }
+    } else {
+        // Some files can only be written.
+        fd.reset(openat(folderFd, filename, O_WRONLY | O_CLOEXEC));
+        if (fd == -1) {
+            return false;
+        }
+    }
+
+    ssize_t len = strlen(str);
+    ssize_t written = write(fd, str, len);
+    if (written != len) {
+        if (written >= 0) {
+            errno = EIO;
+        }
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ATRACE_TRACE_FILES_H
+#define ATRACE_TRACE_FILES_H
+
+#include <string>
+#include <unordered_map>
+
+// What's known about a file of the trace folder. The same files are checked
+// over and over (for every category, when setting up and cleaning up), so each
+// one is only probed the first time.
+struct TraceFileProbe {
+    bool exists;
+    bool writable;
+};
+
+typedef std::unordered_map<std::string, TraceFileProbe> TraceFileProbes;
+
+// Probe a file of the trace folder opened as folderFd, or return what an
+// earlier probe saved in probes.
+const TraceFileProbe& probeTraceFile(int folderFd, const char* filename, TraceFileProbes* probes);
+
+// Write a string to a file of the trace folder opened as folderFd, returning
+// true if the write was successful. errno is set when it isn't.
+//
+// Nothing is written if the file already reads back as that string: rewriting
+// a setting isn't free for the kernel (e.g. an event's enable file), and most
+// of them don't change from one trace to the next.
+bool writeTraceFile(int folderFd, const char* filename, const char* str);
+
+#endif // ATRACE_TRACE_FILES_H
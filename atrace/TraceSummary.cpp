@@ -0,0 +1,948 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TraceSummary.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+
+using android::base::unique_fd;
+using std::string_view;
+
+namespace {
+
+// Number of threads listed, by runtime.
+static const size_t k_maxThreads = 30;
+
+// Number of processes listed, by their longest slice, and of slices listed
+// for each of them.
+static const size_t k_maxProcesses = 20;
+static const size_t k_maxSlicesPerProcess = 5;
+
+// Upper bounds of the wakeup latency buckets, in ns; the last bucket has no
+// upper bound.
+static const uint64_t k_latencyBounds[] = {
+    10 * 1000, 100 * 1000, 1000 * 1000, 10 * 1000 * 1000, 100 * 1000 * 1000,
+};
+static const size_t k_latencyBuckets = sizeof(k_latencyBounds) / sizeof(k_latencyBounds[0]) + 1;
+
+// Flags of a raw page's commit field.
+static const uint64_t k_rawMissedEvents = 1ULL << 31;
+static const uint64_t k_rawCommitMask = (1ULL << 30) - 1;
+
+// Types of the events of a raw page, as found in their type_len.
+static const uint32_t k_rawTypePadding = 29;
+static const uint32_t k_rawTypeTimeExtend = 30;
+static const uint32_t k_rawTypeTimeStamp = 31;
+
+enum EventType : uint8_t {
+    SCHED_SWITCH,
+    SCHED_WAKEUP,
+    SLICE_BEGIN,
+    SLICE_END,
+};
+
+// The parts of a trace event the summary needs. Strings point into the trace
+// itself, which stays mapped until the summary is printed.
+struct Event {
+    uint64_t ts;
+    EventType type;
+    uint16_t cpu;
+    // SCHED_SWITCH: the previous pid; SCHED_WAKEUP: the woken pid;
+    // SLICE_*: the pid that wrote the marker.
+    int32_t pid;
+    // SCHED_SWITCH: the next pid; SLICE_BEGIN: the tgid.
+    int32_t otherPid;
+    // SCHED_SWITCH: the next comm; SCHED_WAKEUP: the woken comm;
+    // SLICE_BEGIN: the name of the slice.
+    string_view name;
+};
+
+// A read-only mapping of a whole file.
+class MappedFile {
+  public:
+    ~MappedFile()
+    {
+        if (data_ != nullptr) {
+            munmap(data_, size_);
+        }
+    }
+
+    bool map(const std::string& path)
+    {
+        unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            fprintf(stderr, "error opening %s: %s (%d)\n", path.c_str(), strerror(errno), errno);
+            return false;
+        }
+        size_ = st.st_size;
+        if (size_ == 0) {
+            return true;
+        }
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "error mapping %s: %s (%d)\n", path.c_str(), strerror(errno), errno);
+            return false;
+        }
+        data_ = data;
+        return true;
+    }
+
+    const char* data() const { return static_cast<const char*>(data_); }
+    size_t size() const { return size_; }
+
+  private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+static string_view trim(string_view s)
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\n' ||
+            s.back() == '\r' || s.back() == '\0')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// Parse a decimal number, ignoring anything after it.
+static bool parseInt(string_view s, int64_t* value)
+{
+    bool negative = !s.empty() && s[0] == '-';
+    size_t i = negative ? 1 : 0;
+    int64_t result = 0;
+    size_t digits = 0;
+    for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; i++, digits++) {
+        result = result * 10 + (s[i] - '0');
+    }
+    *value = negative ? -result : result;
+    return digits > 0;
+}
+
+// Parse a timestamp in seconds, e.g. "1234.567890", into ns.
+static bool parseTimestamp(string_view s, uint64_t* ns)
+{
+    size_t dot = s.find('.');
+    int64_t seconds;
+    if (dot == string_view::npos || !parseInt(s.substr(0, dot), &seconds)) {
+        return false;
+    }
+    uint64_t fraction = 0;
+    size_t digits = 0;
+    for (size_t i = dot + 1; i < s.size() && s[i] >= '0' && s[i] <= '9'; i++) {
+        if (digits < 9) {
+            fraction = fraction * 10 + (s[i] - '0');
+            digits++;
+        }
+    }
+    for (; digits < 9; digits++) {
+        fraction *= 10;
+    }
+    *ns = static_cast<uint64_t>(seconds) * 1000000000ULL + fraction;
+    return true;
+}
+
+// Return the value of "key=value" in the arguments of a text event, up to the
+// next space, or up to `until` when the value itself may contain spaces.
+static string_view argValue(string_view args, string_view key, string_view until = " ")
+{
+    size_t pos = args.find(key);
+    if (pos == string_view::npos) {
+        return string_view();
+    }
+    args.remove_prefix(pos + key.size());
+    return args.substr(0, args.find(until));
+}
+
+static int32_t argInt(string_view args, string_view key)
+{
+    int64_t value;
+    string_view s = argValue(args, key);
+    return parseInt(s, &value) ? static_cast<int32_t>(value) : -1;
+}
+
+// Add the event for an atrace marker, e.g. "B|1234|name" or "E|1234".
+static void addMarker(string_view marker, uint64_t ts, uint16_t cpu, int32_t pid,
+                      std::vector<Event>* events)
+{
+    marker = trim(marker);
+    if (marker.size() >= 2 && marker[0] == 'B' && marker[1] == '|') {
+        marker.remove_prefix(2);
+        size_t bar = marker.find('|');
+        int64_t tgid;
+        if (bar == string_view::npos || !parseInt(marker.substr(0, bar), &tgid)) {
+            return;
+        }
+        events->push_back({ts, SLICE_BEGIN, cpu, pid, static_cast<int32_t>(tgid),
+                           marker.substr(bar + 1)});
+    } else if (!marker.empty() && marker[0] == 'E' && (marker.size() == 1 || marker[1] == '|')) {
+        events->push_back({ts, SLICE_END, cpu, pid, 0, string_view()});
+    }
+}
+
+// Parse a line of a text trace, e.g.
+//   "  surfaceflinger-601   (  601) [002] d..2  1234.567890: sched_switch: prev_comm=..."
+// where the tgid and the flags are optional.
+static void parseTextLine(string_view line, std::vector<Event>* events)
+{
+    if (line.empty() || line[0] == '#') {
+        return;
+    }
+
+    // The CPU is the first bracketed number; the task comes before it.
+    size_t open = line.find('[');
+    size_t close = string_view::npos;
+    int64_t cpu = -1;
+    while (open != string_view::npos) {
+        close = line.find(']', open);
+        if (close == string_view::npos) {
+            return;
+        }
+        string_view number = line.substr(open + 1, close - open - 1);
+        if (!number.empty() && parseInt(number, &cpu) &&
+                number.find_first_not_of("0123456789") == string_view::npos) {
+            break;
+        }
+        cpu = -1;
+        open = line.find('[', open + 1);
+    }
+    if (cpu < 0 || cpu > UINT16_MAX) {
+        return;
+    }
+
+    string_view task = trim(line.substr(0, open));
+    if (!task.empty() && task.back() == ')') {
+        size_t paren = task.rfind('(');
+        if (paren == string_view::npos) {
+            return;
+        }
+        task = trim(task.substr(0, paren));
+    }
+    size_t dash = task.rfind('-');
+    int64_t pid;
+    if (dash == string_view::npos || !parseInt(task.substr(dash + 1), &pid)) {
+        return;
+    }
+
+    // The flags, if any, then the timestamp.
+    string_view rest = trim(line.substr(close + 1));
+    size_t space = rest.find(' ');
+    string_view token = rest.substr(0, space);
+    if (!token.empty() && token.back() != ':' && space != string_view::npos) {
+        rest = trim(rest.substr(space + 1));
+        space = rest.find(' ');
+        token = rest.substr(0, space);
+    }
+    uint64_t ts;
+    if (token.size() < 2 || token.back() != ':' ||
+            !parseTimestamp(token.substr(0, token.size() - 1), &ts) ||
+            space == string_view::npos) {
+        return;
+    }
+    rest = trim(rest.substr(space + 1));
+    size_t colon = rest.find(':');
+    if (colon == string_view::npos) {
+        return;
+    }
+    string_view name = rest.substr(0, colon);
+    string_view args = trim(rest.substr(colon + 1));
+
+    if (name == "sched_switch") {
+        events->push_back({ts, SCHED_SWITCH, static_cast<uint16_t>(cpu),
+                           argInt(args, "prev_pid="), argInt(args, "next_pid="),
+                           argValue(args, "next_comm=", " next_pid=")});
+    } else if (name == "sched_wakeup" || name == "sched_waking") {
+        events->push_back({ts, SCHED_WAKEUP, static_cast<uint16_t>(cpu), argInt(args, " pid="),
+                           0, argValue(args, "comm=", " pid=")});
+    } else if (name == "tracing_mark_write") {
+        addMarker(args, ts, static_cast<uint16_t>(cpu), static_cast<int32_t>(pid), events);
+    }
+}
+
+static void parseTextTrace(string_view text, std::vector<Event>* events)
+{
+    while (!text.empty()) {
+        size_t end = text.find('\n');
+        parseTextLine(text.substr(0, end), events);
+        if (end == string_view::npos) {
+            break;
+        }
+        text.remove_prefix(end + 1);
+    }
+}
+
+// Inflate zlib or gzip data, including several gzip members in a row like the
+// flight recorder writes.
+static bool inflateTrace(string_view in, std::string* out)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 32 detects whether there's a zlib or a gzip header.
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        fprintf(stderr, "error initializing zlib\n");
+        return false;
+    }
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    zs.avail_in = in.size();
+    constexpr size_t bufSize = 1024 * 1024;
+    int result = Z_OK;
+    while (zs.avail_in > 0 || result == Z_OK) {
+        size_t size = out->size();
+        out->resize(size + bufSize);
+        zs.next_out = reinterpret_cast<Bytef*>(&(*out)[size]);
+        zs.avail_out = bufSize;
+        result = inflate(&zs, Z_NO_FLUSH);
+        out->resize(size + bufSize - zs.avail_out);
+        if (result == Z_STREAM_END) {
+            if (zs.avail_in == 0) {
+                break;
+            }
+            inflateReset(&zs);
+            result = Z_OK;
+        } else if (result == Z_BUF_ERROR && zs.avail_in == 0) {
+            // The trace was cut short; summarize what there is of it.
+            fprintf(stderr, "warning: compressed trace is truncated\n");
+            break;
+        } else if (result != Z_OK) {
+            fprintf(stderr, "error inflating trace: %s\n", zs.msg ? zs.msg : "");
+            inflateEnd(&zs);
+            return false;
+        }
+    }
+    inflateEnd(&zs);
+    return true;
+}
+
+// Parse a text trace, splitting it at line boundaries so that each thread
+// parses a part of it.
+static bool parseTextFile(const MappedFile& file, std::string* inflated,
+                          std::vector<std::vector<Event>>* parts)
+{
+    string_view text(file.data(), file.size());
+    // atrace prints "TRACE:" before the trace itself.
+    size_t header = text.substr(0, 256).find("TRACE:\n");
+    if (header != string_view::npos) {
+        text.remove_prefix(header + strlen("TRACE:\n"));
+    }
+    if (text.size() >= 2 && ((text[0] == '\x78') || (text[0] == '\x1f' && text[1] == '\x8b'))) {
+        if (!inflateTrace(text, inflated)) {
+            return false;
+        }
+        text = *inflated;
+    }
+
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t partSize = text.size() / threads + 1;
+    std::vector<string_view> texts;
+    while (!text.empty()) {
+        size_t end = text.size() <= partSize ? string_view::npos : text.find('\n', partSize);
+        end = end == string_view::npos ? text.size() : end + 1;
+        texts.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+
+    parts->resize(texts.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < texts.size(); i++) {
+        workers.emplace_back(parseTextTrace, texts[i], &(*parts)[i]);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return true;
+}
+
+struct FieldFormat {
+    uint32_t offset = 0;
+    // 0 for a string that takes the rest of the event.
+    uint32_t size = 0;
+    bool found = false;
+};
+
+// The fields of an event, from its format file, e.g.
+//   "field:pid_t next_pid;	offset:56;	size:4;	signed:1;"
+struct EventFormat {
+    int64_t id = -1;
+    std::unordered_map<std::string, FieldFormat> fields;
+
+    FieldFormat field(const char* name) const
+    {
+        auto it = fields.find(name);
+        return it == fields.end() ? FieldFormat() : it->second;
+    }
+};
+
+static void parseFormat(const std::string& text, EventFormat* format)
+{
+    string_view s(text);
+    while (!s.empty()) {
+        size_t end = s.find('\n');
+        string_view line = trim(s.substr(0, end));
+        s.remove_prefix(end == string_view::npos ? s.size() : end + 1);
+
+        if (line.substr(0, 3) == "ID:") {
+            parseInt(trim(line.substr(3)), &format->id);
+            continue;
+        }
+        if (line.substr(0, 6) != "field:") {
+            continue;
+        }
+        size_t semicolon = line.find(';');
+        if (semicolon == string_view::npos) {
+            continue;
+        }
+        // The name is the last word of the declaration, without any [size].
+        string_view decl = line.substr(6, semicolon - 6);
+        string_view name = decl.substr(decl.rfind(' ') + 1);
+        name = name.substr(0, name.find('['));
+        int64_t offset;
+        int64_t size;
+        if (!parseInt(argValue(line, "offset:"), &offset) ||
+                !parseInt(argValue(line, "size:"), &size)) {
+            continue;
+        }
+        FieldFormat& field = format->fields[std::string(name)];
+        field.offset = offset;
+        field.size = size;
+        field.found = true;
+    }
+}
+
+// What's needed to decode the pages of a raw trace.
+struct RawFormats {
+    size_t pageSize = 0;
+    FieldFormat pageTimestamp;
+    FieldFormat pageCommit;
+    FieldFormat pageData;
+
+    FieldFormat commonType;
+    FieldFormat commonPid;
+
+    int64_t switchId = -1;
+    FieldFormat switchPrevPid;
+    FieldFormat switchNextPid;
+    FieldFormat switchNextComm;
+
+    int64_t wakeupId = -1;
+    int64_t wakingId = -1;
+    FieldFormat wakeupPid;
+    FieldFormat wakeupComm;
+    FieldFormat wakingPid;
+    FieldFormat wakingComm;
+
+    int64_t printId = -1;
+    FieldFormat printBuf;
+};
+
+static bool readFormat(const std::string& dir, const char* path, EventFormat* format)
+{
+    std::string text;
+    if (!android::base::ReadFileToString(dir + "/" + path, &text)) {
+        return false;
+    }
+    parseFormat(text, format);
+    return true;
+}
+
+static bool readRawFormats(const std::string& dir, RawFormats* formats)
+{
+    EventFormat page;
+    if (!readFormat(dir, "header_page", &page)) {
+        fprintf(stderr, "error reading %s/header_page: %s (%d)\n", dir.c_str(),
+                strerror(errno), errno);
+        return false;
+    }
+    formats->pageTimestamp = page.field("timestamp");
+    formats->pageCommit = page.field("commit");
+    formats->pageData = page.field("data");
+    if (!formats->pageTimestamp.found || !formats->pageCommit.found ||
+            !formats->pageData.found) {
+        fprintf(stderr, "error parsing %s/header_page\n", dir.c_str());
+        return false;
+    }
+    formats->pageSize = formats->pageData.offset + formats->pageData.size;
+
+    EventFormat sched_switch;
+    if (readFormat(dir, "events/sched/sched_switch/format", &sched_switch)) {
+        formats->switchId = sched_switch.id;
+        formats->switchPrevPid = sched_switch.field("prev_pid");
+        formats->switchNextPid = sched_switch.field("next_pid");
+        formats->switchNextComm = sched_switch.field("next_comm");
+        formats->commonType = sched_switch.field("common_type");
+        formats->commonPid = sched_switch.field("common_pid");
+    }
+    EventFormat sched_wakeup;
+    if (readFormat(dir, "events/sched/sched_wakeup/format", &sched_wakeup)) {
+        formats->wakeupId = sched_wakeup.id;
+        formats->wakeupPid = sched_wakeup.field("pid");
+        formats->wakeupComm = sched_wakeup.field("comm");
+    }
+    EventFormat sched_waking;
+    if (readFormat(dir, "events/sched/sched_waking/format", &sched_waking)) {
+        formats->wakingId = sched_waking.id;
+        formats->wakingPid = sched_waking.field("pid");
+        formats->wakingComm = sched_waking.field("comm");
+    }
+    EventFormat print;
+    if (readFormat(dir, "events/ftrace/print/format", &print)) {
+        formats->printId = print.id;
+        formats->printBuf = print.field("buf");
+        if (!formats->commonType.found) {
+            formats->commonType = print.field("common_type");
+            formats->commonPid = print.field("common_pid");
+        }
+    }
+    if (!formats->commonType.found || !formats->commonPid.found) {
+        fprintf(stderr, "error: %s has neither the sched_switch nor the print format\n",
+                dir.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Read a little-endian integer field; the raw trace is read on the device
+// that wrote it, or one of the same endianness.
+static int64_t readInt(const char* data, size_t len, const FieldFormat& field)
+{
+    if (!field.found || field.offset + field.size > len) {
+        return -1;
+    }
+    const char* p = data + field.offset;
+    switch (field.size) {
+        case 1: return static_cast<int8_t>(*p);
+        case 2: { int16_t v; memcpy(&v, p, sizeof(v)); return v; }
+        case 4: { int32_t v; memcpy(&v, p, sizeof(v)); return v; }
+        case 8: { int64_t v; memcpy(&v, p, sizeof(v)); return v; }
+        default: return -1;
+    }
+}
+
+static string_view readString(const char* data, size_t len, const FieldFormat& field)
+{
+    if (!field.found || field.offset >= len) {
+        return string_view();
+    }
+    size_t size = field.size == 0 ? len - field.offset : std::min<size_t>(field.size,
+                                                                         len - field.offset);
+    string_view s(data + field.offset, size);
+    return s.substr(0, s.find('\0'));
+}
+
+static void parseRawRecord(const char* data, size_t len, uint64_t ts, uint16_t cpu,
+                           const RawFormats& f, std::vector<Event>* events)
+{
+    int64_t type = readInt(data, len, f.commonType);
+    if (type < 0) {
+        return;
+    }
+    if (type == f.switchId) {
+        events->push_back({ts, SCHED_SWITCH, cpu,
+                           static_cast<int32_t>(readInt(data, len, f.switchPrevPid)),
+                           static_cast<int32_t>(readInt(data, len, f.switchNextPid)),
+                           readString(data, len, f.switchNextComm)});
+    } else if (type == f.wakeupId || type == f.wakingId) {
+        bool wakeup = type == f.wakeupId;
+        events->push_back({ts, SCHED_WAKEUP, cpu,
+                           static_cast<int32_t>(readInt(data, len,
+                                                        wakeup ? f.wakeupPid : f.wakingPid)),
+                           0, readString(data, len, wakeup ? f.wakeupComm : f.wakingComm)});
+    } else if (type == f.printId) {
+        addMarker(readString(data, len, f.printBuf), ts, cpu,
+                  static_cast<int32_t>(readInt(data, len, f.commonPid)), events);
+    }
+}
+
+// Parse the pages of a CPU's raw trace, each made of a header and events
+// whose headers hold the time since the previous event.
+static void parseRawPages(string_view pages, uint16_t cpu, const RawFormats& f,
+                          std::vector<Event>* events, size_t* missedPages)
+{
+    *missedPages = 0;
+    for (size_t offset = 0; offset + f.pageSize <= pages.size(); offset += f.pageSize) {
+        const char* page = pages.data() + offset;
+        uint64_t ts = readInt(page, f.pageSize, f.pageTimestamp);
+        uint64_t commit = readInt(page, f.pageSize, f.pageCommit);
+        if (commit & k_rawMissedEvents) {
+            (*missedPages)++;
+        }
+        size_t len = std::min<size_t>(commit & k_rawCommitMask, f.pageSize - f.pageData.offset);
+        const char* p = page + f.pageData.offset;
+        const char* end = p + len;
+        while (end - p >= 4) {
+            uint32_t header;
+            memcpy(&header, p, sizeof(header));
+            uint32_t typeLen = header & 0x1f;
+            uint32_t delta = header >> 5;
+            uint32_t array0 = 0;
+            if (end - p >= 8) {
+                memcpy(&array0, p + 4, sizeof(array0));
+            }
+            if (typeLen == k_rawTypePadding) {
+                if (delta == 0 || array0 == 0) {
+                    break;
+                }
+                p += 4 + array0;
+            } else if (typeLen == k_rawTypeTimeExtend) {
+                ts += (static_cast<uint64_t>(array0) << 27) | delta;
+                p += 8;
+            } else if (typeLen == k_rawTypeTimeStamp) {
+                ts = (static_cast<uint64_t>(array0) << 27) | delta;
+                p += 8;
+            } else {
+                // Small events have their length in the header, others in
+                // the word after it, which counts itself.
+                const char* data = typeLen == 0 ? p + 8 : p + 4;
+                size_t size = typeLen == 0 ? (array0 >= 4 ? array0 - 4 : 0) : typeLen * 4;
+                if (typeLen == 0 && array0 < 4) {
+                    break;
+                }
+                if (data + size > end) {
+                    break;
+                }
+                ts += delta;
+                parseRawRecord(data, size, ts, cpu, f, events);
+                p = data + size;
+            }
+        }
+    }
+}
+
+// Parse a directory written by atrace --raw, one thread per CPU.
+static bool parseRawDir(const std::string& dir, std::vector<std::unique_ptr<MappedFile>>* files,
+                        std::vector<std::vector<Event>>* parts, FILE* out)
+{
+    RawFormats formats;
+    if (!readRawFormats(dir, &formats)) {
+        return false;
+    }
+
+    std::vector<int> cpus;
+    for (int cpu = 0;; cpu++) {
+        std::string path = android::base::StringPrintf("%s/per_cpu/cpu%d/trace_pipe_raw",
+                                                       dir.c_str(), cpu);
+        if (access(path.c_str(), F_OK) == -1) {
+            break;
+        }
+        auto file = std::make_unique<MappedFile>();
+        if (!file->map(path)) {
+            return false;
+        }
+        files->push_back(std::move(file));
+        cpus.push_back(cpu);
+    }
+    if (cpus.empty()) {
+        fprintf(stderr, "error: no per_cpu/cpuN/trace_pipe_raw in %s\n", dir.c_str());
+        return false;
+    }
+
+    parts->resize(cpus.size());
+    std::vector<size_t> missedPages(cpus.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < cpus.size(); i++) {
+        string_view pages((*files)[i]->data(), (*files)[i]->size());
+        workers.emplace_back(parseRawPages, pages, static_cast<uint16_t>(cpus[i]),
+                             std::cref(formats), &(*parts)[i], &missedPages[i]);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    for (size_t i = 0; i < cpus.size(); i++) {
+        if (missedPages[i] > 0) {
+            fprintf(out, "cpu%d: events were lost before %zu of its pages\n", cpus[i],
+                    missedPages[i]);
+        }
+    }
+    return true;
+}
+
+struct ThreadStats {
+    string_view comm;
+    uint64_t runtime = 0;
+    uint32_t switches = 0;
+    uint32_t wakeups = 0;
+    uint32_t latency[k_latencyBuckets] = {};
+    uint64_t maxLatency = 0;
+    // When the thread was woken up, if it hasn't run since.
+    uint64_t wokenAt = 0;
+};
+
+struct CpuStats {
+    bool seen = false;
+    int32_t pid = -1;
+    uint64_t since = 0;
+    uint64_t busy = 0;
+};
+
+struct Slice {
+    uint64_t ts;
+    uint64_t duration;
+    int32_t pid;
+    string_view name;
+};
+
+struct OpenSlice {
+    uint64_t ts;
+    int32_t tgid;
+    string_view name;
+};
+
+struct Summary {
+    uint64_t start = UINT64_MAX;
+    uint64_t end = 0;
+    size_t events = 0;
+    std::vector<CpuStats> cpus;
+    std::unordered_map<int32_t, ThreadStats> threads;
+    std::unordered_map<int32_t, std::vector<OpenSlice>> openSlices;
+    // The longest slices of each process, longest first.
+    std::unordered_map<int32_t, std::vector<Slice>> slices;
+};
+
+static void addRuntime(Summary* summary, CpuStats* cpu, uint64_t until)
+{
+    if (cpu->pid > 0 && until > cpu->since) {
+        cpu->busy += until - cpu->since;
+        summary->threads[cpu->pid].runtime += until - cpu->since;
+    }
+}
+
+static void addSlice(std::vector<Slice>* slices, const Slice& slice)
+{
+    if (slices->size() == k_maxSlicesPerProcess &&
+            slices->back().duration >= slice.duration) {
+        return;
+    }
+    auto pos = std::upper_bound(slices->begin(), slices->end(), slice,
+                                [](const Slice& a, const Slice& b) {
+                                    return a.duration > b.duration;
+                                });
+    slices->insert(pos, slice);
+    if (slices->size() > k_maxSlicesPerProcess) {
+        slices->pop_back();
+    }
+}
+
+static void addEvent(Summary* summary, const Event& event)
+{
+    summary->events++;
+    summary->start = std::min(summary->start, event.ts);
+    summary->end = std::max(summary->end, event.ts);
+
+    switch (event.type) {
+        case SCHED_SWITCH: {
+            if (event.cpu >= summary->cpus.size()) {
+                summary->cpus.resize(event.cpu + 1);
+            }
+            CpuStats& cpu = summary->cpus[event.cpu];
+            if (!cpu.seen) {
+                // The previous task ran at least since the start of the trace.
+                cpu.seen = true;
+                cpu.pid = event.pid;
+                cpu.since = summary->start;
+            }
+            addRuntime(summary, &cpu, event.ts);
+            cpu.pid = event.otherPid;
+            cpu.since = event.ts;
+            if (event.otherPid > 0) {
+                ThreadStats& thread = summary->threads[event.otherPid];
+                thread.comm = event.name;
+                thread.switches++;
+                if (thread.wokenAt != 0) {
+                    uint64_t latency = event.ts - thread.wokenAt;
+                    size_t bucket = 0;
+                    while (bucket < k_latencyBuckets - 1 && latency >= k_latencyBounds[bucket]) {
+                        bucket++;
+                    }
+                    thread.latency[bucket]++;
+                    thread.maxLatency = std::max(thread.maxLatency, latency);
+                    thread.wakeups++;
+                    thread.wokenAt = 0;
+                }
+            }
+            break;
+        }
+        case SCHED_WAKEUP: {
+            if (event.pid <= 0) {
+                break;
+            }
+            ThreadStats& thread = summary->threads[event.pid];
+            if (thread.comm.empty()) {
+                thread.comm = event.name;
+            }
+            // sched_waking comes before sched_wakeup; the first one counts.
+            if (thread.wokenAt == 0) {
+                thread.wokenAt = event.ts;
+            }
+            break;
+        }
+        case SLICE_BEGIN:
+            summary->openSlices[event.pid].push_back({event.ts, event.otherPid, event.name});
+            break;
+        case SLICE_END: {
+            std::vector<OpenSlice>& open = summary->openSlices[event.pid];
+            if (open.empty()) {
+                break;
+            }
+            const OpenSlice& begin = open.back();
+            addSlice(&summary->slices[begin.tgid],
+                     {begin.ts, event.ts - begin.ts, event.pid, begin.name});
+            open.pop_back();
+            break;
+        }
+    }
+}
+
+static std::string formatName(string_view name)
+{
+    return name.empty() ? std::string("<unknown>") : std::string(name);
+}
+
+static void printSummary(Summary* summary, FILE* out)
+{
+    for (CpuStats& cpu : summary->cpus) {
+        if (cpu.seen) {
+            addRuntime(summary, &cpu, summary->end);
+        }
+    }
+    uint64_t window = summary->end > summary->start ? summary->end - summary->start : 0;
+    fprintf(out, "%.6fs, %zu CPUs, %zu events\n\n", window / 1e9, summary->cpus.size(),
+            summary->events);
+
+    fprintf(out, "CPU          busy   util\n");
+    for (size_t i = 0; i < summary->cpus.size(); i++) {
+        const CpuStats& cpu = summary->cpus[i];
+        fprintf(out, "%3zu %10.3fms %5.1f%%\n", i, cpu.busy / 1e6,
+                window ? 100.0 * cpu.busy / window : 0.0);
+    }
+
+    std::vector<std::pair<int32_t, const ThreadStats*>> threads;
+    for (const auto& thread : summary->threads) {
+        threads.emplace_back(thread.first, &thread.second);
+    }
+    size_t threadCount = std::min(k_maxThreads, threads.size());
+    std::partial_sort(threads.begin(), threads.begin() + threadCount, threads.end(),
+                      [](const auto& a, const auto& b) {
+                          return a.second->runtime > b.second->runtime;
+                      });
+    fprintf(out, "\nThreads by runtime, with their wakeup latencies:\n");
+    fprintf(out, "    pid comm                  runtime switches wakeups  <10us <100us   <1ms  "
+            "<10ms <100ms  >=100ms       max\n");
+    for (size_t i = 0; i < threadCount; i++) {
+        const ThreadStats& thread = *threads[i].second;
+        fprintf(out, "%7d %-16.16s %10.3fms %8u %7u", threads[i].first,
+                formatName(thread.comm).c_str(), thread.runtime / 1e6, thread.switches,
+                thread.wakeups);
+        for (size_t bucket = 0; bucket < k_latencyBuckets; bucket++) {
+            fprintf(out, bucket == k_latencyBuckets - 1 ? " %8u" : " %6u", thread.latency[bucket]);
+        }
+        fprintf(out, " %8.3fms\n", thread.maxLatency / 1e6);
+    }
+
+    std::vector<std::pair<int32_t, const std::vector<Slice>*>> processes;
+    for (const auto& process : summary->slices) {
+        processes.emplace_back(process.first, &process.second);
+    }
+    size_t processCount = std::min(k_maxProcesses, processes.size());
+    std::partial_sort(processes.begin(), processes.begin() + processCount, processes.end(),
+                      [](const auto& a, const auto& b) {
+                          return a.second->front().duration > b.second->front().duration;
+                      });
+    fprintf(out, "\nLongest slices by process:\n");
+    for (size_t i = 0; i < processCount; i++) {
+        auto thread = summary->threads.find(processes[i].first);
+        string_view comm = thread == summary->threads.end() ? string_view() : thread->second.comm;
+        fprintf(out, "%7d %s\n", processes[i].first, formatName(comm).c_str());
+        for (const Slice& slice : *processes[i].second) {
+            fprintf(out, "        %10.3fms at %.6fs tid %d: %s\n", slice.duration / 1e6,
+                    (slice.ts - summary->start) / 1e9, slice.pid,
+                    formatName(slice.name).c_str());
+        }
+    }
+}
+
+}  // unnamed namespace
+
+bool summarizeTrace(const char* path, FILE* out)
+{
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        fprintf(stderr, "error opening %s: %s (%d)\n", path, strerror(errno), errno);
+        return false;
+    }
+
+    // The events point into these until the summary is printed.
+    std::vector<std::unique_ptr<MappedFile>> files;
+    std::string inflated;
+    std::vector<std::vector<Event>> parts;
+    bool sorted;
+    if (S_ISDIR(st.st_mode)) {
+        if (!parseRawDir(path, &files, &parts, out)) {
+            return false;
+        }
+        sorted = false;
+    } else {
+        files.push_back(std::make_unique<MappedFile>());
+        if (!files.back()->map(path) || !parseTextFile(*files.back(), &inflated, &parts)) {
+            return false;
+        }
+        // Text traces are in order already, and split in order.
+        sorted = true;
+    }
+
+    size_t count = 0;
+    for (const auto& part : parts) {
+        count += part.size();
+    }
+    std::vector<Event> events;
+    events.reserve(count);
+    for (auto& part : parts) {
+        events.insert(events.end(), part.begin(), part.end());
+        std::vector<Event>().swap(part);
+    }
+    auto byTime = [](const Event& a, const Event& b) { return a.ts < b.ts; };
+    if (!sorted || !std::is_sorted(events.begin(), events.end(), byTime)) {
+        std::stable_sort(events.begin(), events.end(), byTime);
+    }
+
+    Summary summary;
+    for (const Event& event : events) {
+        addEvent(&summary, event);
+    }
+    printSummary(&summary, out);
+    return true;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ATRACE_TRACE_SUMMARY_H
+#define ATRACE_TRACE_SUMMARY_H
+
+#include <stdio.h>
+
+// Summarize a captured trace without exporting it: the utilization of each
+// CPU, the runtime and wakeup latencies of each thread, and the longest
+// atrace slices of each process.
+//
+// path is either a text trace, as written by atrace (plain, compressed with
+// -z, or a gzip snapshot of the flight recorder), or a directory written by
+// atrace --raw. Returns false if it can't be read.
+bool summarizeTrace(const char* path, FILE* out);
+
+#endif // ATRACE_TRACE_SUMMARY_H
@@ -16,22 +16,34 @@
 
 #define LOG_TAG "atrace"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 #include <binder/IBinder.h>
 #include <binder/IServiceManager.h>
@@ -41,6 +53,7 @@
 #include <android/hidl/manager/1.0/IServiceManager.h>
 #include <hidl/ServiceManagement.h>
 
+#include <cutils/sockets.h>
 #include <pdx/default_transport/service_utility.h>
 #include <utils/String8.h>
 #include <utils/Timers.h>
@@ -50,6 +63,13 @@
 #include <android-base/macros.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+
+#include "FlightRecorder.h"
+#include "RawCapture.h"
+#include "ServicePokes.h"
+#include "TraceFiles.h"
+#include "TraceSummary.h"
 
 using namespace android;
 using pdx::default_transport::ServiceUtility;
@@ -60,6 +80,7 @@ using hardware::atrace::V1_0::IAtraceDevice;
 using hardware::atrace::V1_0::Status;
 using hardware::atrace::V1_0::toString;
 
+using android::base::unique_fd;
 using std::string;
 
 #define MAX_SYS_FILES 11
@@ -73,6 +94,16 @@ const char* k_coreServiceCategory = "core_services";
 const char* k_pdxServiceCategory = "pdx";
 const char* k_coreServicesProp = "ro.atrace.core.services";
 
+// Services are poked from this many threads at a time, and given this long to
+// acknowledge before they're reported and no longer waited for.
+static const size_t k_pokeThreads = 8;
+static const nsecs_t k_pokeDeadline = ms2ns(500);
+
+// The flight recorder compresses the trace in chunks of this size, and hands
+// out snapshots to the clients of this abstract socket.
+static const size_t k_flightRecorderChunkSize = 256 * 1024;
+static const char* k_flightRecorderSocket = "atrace_flight_recorder";
+
 typedef enum { OPT, REQ } requiredness  ;
 
 struct TracingCategory {
@@ -266,12 +297,18 @@ static const char* g_categoriesFile = nullptr;
 static const char* g_kernelTraceFuncs = nullptr;
 static const char* g_debugAppCmdLine = "";
 static const char* g_outputFile = nullptr;
+static bool g_pokeStats = false;
+static bool g_setupStats = false;
+static size_t g_flightRecorderBytes = 0;
 
 /* Global state */
 static bool g_tracePdx = false;
-static bool g_traceAborted = false;
+static std::atomic<bool> g_traceAborted{false};
+static volatile sig_atomic_t g_snapshotRequested = false;
 static bool g_categoryEnables[arraysize(k_categories)] = {};
 static std::string g_traceFolder;
+static int g_traceFolderFd = -1;
+static TraceFileProbes g_traceFileProbes;
 static sp<IAtraceDevice> g_atraceHal;
 static std::vector<TracingVendorCategory> g_vendorCategories;
 
@@ -327,14 +364,38 @@ static const char* k_traceStreamPath =
 static const char* k_traceMarkerPath =
     "trace_marker";
 
+static const char* k_perCpuPath =
+    "per_cpu";
+
+// Files needed to decode a raw trace, in addition to the formats of the
+// enabled events.
+static const char* k_rawHeaderPaths[] = {
+    "header_page",
+    "header_event",
+    "trace_clock",
+    "events/ftrace/print/format",
+};
+
+// Files describing the processes in a raw trace, saved once it's captured.
+static const char* k_rawTrailerPaths[] = {
+    "saved_cmdlines",
+    "saved_tgids",
+};
+
 // Check whether a file exists.
 static bool fileExists(const char* filename) {
-    return access((g_traceFolder + filename).c_str(), F_OK) != -1;
+    return probeTraceFile(g_traceFolderFd, filename, &g_traceFileProbes).exists;
 }
 
 // Check whether a file is writable.
 static bool fileIsWritable(const char* filename) {
-    return access((g_traceFolder + filename).c_str(), W_OK) != -1;
+    return probeTraceFile(g_traceFolderFd, filename, &g_traceFileProbes).writable;
+}
+
+// Open a file of the trace folder.
+static int openTraceFile(const char* filename, int flags)
+{
+    return openat(g_traceFolderFd, filename, flags | O_CLOEXEC);
 }
 
 // Truncate a file.
@@ -343,7 +404,7 @@ static bool truncateFile(const char* path)
     // This uses creat rather than truncate because some of the debug kernel
     // device nodes (e.g. k_ftraceFilterPath) currently aren't changed by
     // calls to truncate, but they are cleared by calls to creat.
-    int traceFD = creat((g_traceFolder + path).c_str(), 0);
+    int traceFD = openat(g_traceFolderFd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0);
     if (traceFD == -1) {
         fprintf(stderr, "error truncating %s: %s (%d)\n", (g_traceFolder + path).c_str(),
             strerror(errno), errno);
@@ -358,7 +419,7 @@ static bool truncateFile(const char* path)
 static bool _writeStr(const char* filename, const char* str, int flags)
 {
     std::string fullFilename = g_traceFolder + filename;
-    int fd = open(fullFilename.c_str(), flags);
+    int fd = openTraceFile(filename, flags);
     if (fd == -1) {
         fprintf(stderr, "error opening %s: %s (%d)\n", fullFilename.c_str(),
                 strerror(errno), errno);
@@ -379,9 +440,15 @@ static bool _writeStr(const char* filename, const char* str, int flags)
 }
 
 // Write a string to a file, returning true if the write was successful.
+// Unchanged settings are left alone.
 static bool writeStr(const char* filename, const char* str)
 {
-    return _writeStr(filename, str, O_WRONLY);
+    if (!writeTraceFile(g_traceFolderFd, filename, str)) {
+        fprintf(stderr, "error writing to %s%s: %s (%d)\n", g_traceFolder.c_str(), filename,
+                strerror(errno), errno);
+        return false;
+    }
+    return true;
 }
 
 // Append a string to a file, returning true if the write was successful.
@@ -394,7 +461,7 @@ static void writeClockSyncMarker()
 {
   char buffer[128];
   int len = 0;
-  int fd = open((g_traceFolder + k_traceMarkerPath).c_str(), O_WRONLY);
+  int fd = openTraceFile(k_traceMarkerPath, O_WRONLY);
   if (fd == -1) {
       fprintf(stderr, "error opening %s: %s (%d)\n", k_traceMarkerPath,
               strerror(errno), errno);
@@ -535,9 +602,11 @@ static bool setCmdlineSize()
 // update it if the requested value is not the current value.
 static bool setClock()
 {
-    std::ifstream clockFile((g_traceFolder + k_traceClockPath).c_str(), O_RDONLY);
-    std::string clockStr((std::istreambuf_iterator<char>(clockFile)),
-        std::istreambuf_iterator<char>());
+    unique_fd clockFd(openTraceFile(k_traceClockPath, O_RDONLY));
+    std::string clockStr;
+    if (clockFd != -1) {
+        android::base::ReadFdToString(clockFd, &clockStr);
+    }
 
     std::string newClock;
     if (clockStr.find("boot") != std::string::npos) {
@@ -570,36 +639,36 @@ static bool setPrintTgidEnableIfPresent(bool enable)
     return true;
 }
 
-// Poke all the binder-enabled processes in the system to get them to re-read
-// their system properties.
-static bool pokeBinderServices()
+// Add a poke for every binder-enabled process in the system.
+static void addBinderServicePokes(std::vector<ServicePoke>* pokes)
 {
     sp<IServiceManager> sm = defaultServiceManager();
+    if (sm == nullptr) {
+        fprintf(stderr, "failed to get IServiceManager to poke binder services\n");
+        return;
+    }
+
     Vector<String16> services = sm->listServices();
     for (size_t i = 0; i < services.size(); i++) {
-        sp<IBinder> obj = sm->checkService(services[i]);
-        if (obj != nullptr) {
-            Parcel data;
-            if (obj->transact(IBinder::SYSPROPS_TRANSACTION, data,
-                    nullptr, 0) != OK) {
-                if (false) {
-                    // XXX: For some reason this fails on tablets trying to
-                    // poke the "phone" service.  It's not clear whether some
-                    // are expected to fail.
-                    String8 svc(services[i]);
-                    fprintf(stderr, "error poking binder service %s\n",
-                        svc.string());
+        String16 service = services[i];
+        pokes->push_back({
+            string("binder:") + String8(service).string(),
+            [sm, service]() {
+                sp<IBinder> obj = sm->checkService(service);
+                if (obj == nullptr) {
                     return false;
                 }
-            }
-        }
+                // XXX: Some services, like "phone" on tablets, are known to
+                // fail this, so it's only reported.
+                Parcel data;
+                return obj->transact(IBinder::SYSPROPS_TRANSACTION, data, nullptr, 0) == OK;
+            },
+        });
     }
-    return true;
 }
 
-// Poke all the HAL processes in the system to get them to re-read
-// their system properties.
-static void pokeHalServices()
+// Add a poke for every HAL process in the system.
+static void addHalServicePokes(std::vector<ServicePoke>* pokes)
 {
     using ::android::hidl::base::V1_0::IBase;
     using ::android::hidl::manager::V1_0::IServiceManager;
@@ -621,22 +690,24 @@ static void pokeHalServices()
                 continue;
             hidl_string fqInterfaceName = fqInstanceName.substr(0, n);
             hidl_string instanceName = fqInstanceName.substr(n+1, std::string::npos);
-            Return<sp<IBase>> interfaceRet = sm->get(fqInterfaceName, instanceName);
-            if (!interfaceRet.isOk()) {
-                // ignore
-                continue;
-            }
+            pokes->push_back({
+                "hal:" + fqInstanceName,
+                [sm, fqInterfaceName, instanceName]() {
+                    Return<sp<IBase>> interfaceRet = sm->get(fqInterfaceName, instanceName);
+                    if (!interfaceRet.isOk()) {
+                        return false;
+                    }
 
-            sp<IBase> interface = interfaceRet;
-            if (interface == nullptr) {
-                // ignore
-                continue;
-            }
+                    sp<IBase> interface = interfaceRet;
+                    if (interface == nullptr) {
+                        return false;
+                    }
 
-            auto notifyRet = interface->notifySyspropsChanged();
-            if (!notifyRet.isOk()) {
-                // ignore
-            }
+                    // This is a oneway call, so it completes once the HAL
+                    // has been sent the notification.
+                    return interface->notifySyspropsChanged().isOk();
+                },
+            });
         }
     });
     if (!listRet.isOk()) {
@@ -645,6 +716,45 @@ static void pokeHalServices()
     }
 }
 
+// Poke all the binder-enabled and HAL processes in the system to get them to
+// re-read their system properties, and wait until they all have.
+static void pokeServices()
+{
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::vector<ServicePoke> pokes;
+    addBinderServicePokes(&pokes);
+    addHalServicePokes(&pokes);
+    std::vector<PokeResult> results =
+            runServicePokes(std::move(pokes), k_pokeThreads, k_pokeDeadline);
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    size_t failed = 0;
+    size_t timedOut = 0;
+    for (const PokeResult& result : results) {
+        if (result.timedOut) {
+            timedOut++;
+            fprintf(stderr, "warning: %s did not acknowledge the poke in %" PRId64 "ms\n",
+                    result.name.c_str(), ns2ms(k_pokeDeadline));
+        } else if (!result.ok) {
+            failed++;
+        }
+    }
+    ALOGI("Poked %zu services in %.1fms (%zu failed, %zu timed out)", results.size(),
+          elapsed / 1e6, failed, timedOut);
+
+    if (g_pokeStats) {
+        std::sort(results.begin(), results.end(),
+                  [](const PokeResult& a, const PokeResult& b) { return a.latency > b.latency; });
+        fprintf(stderr, "poked %zu services in %.1fms (%zu failed, %zu timed out):\n",
+                results.size(), elapsed / 1e6, failed, timedOut);
+        for (const PokeResult& result : results) {
+            fprintf(stderr, "  %9.2fms %-7s %s\n", result.latency / 1e6,
+                    result.timedOut ? "TIMEOUT" : result.ok ? "ok" : "FAILED",
+                    result.name.c_str());
+        }
+    }
+}
+
 // Set the trace tags that userland tracing uses, and poke the running
 // processes to pick up the new value.
 static bool setTagsProperty(uint64_t tags)
@@ -699,11 +809,12 @@ static bool setAppCmdlineProperty(char* cmdline)
 // Disable all /sys/ enable files.
 static bool disableKernelTraceEvents() {
     bool ok = true;
+    std::unordered_set<std::string> disabled;
     for (size_t i = 0; i < arraysize(k_categories); i++) {
         const TracingCategory &c = k_categories[i];
         for (int j = 0; j < MAX_SYS_FILES; j++) {
             const char* path = c.sysfiles[j].path;
-            if (path != nullptr && fileIsWritable(path)) {
+            if (path != nullptr && fileIsWritable(path) && disabled.insert(path).second) {
                 ok &= setKernelOptionEnable(path, false);
             }
         }
@@ -875,8 +986,7 @@ static bool setUpUserspaceTracing()
         packageList += android::base::GetProperty(k_coreServicesProp, "");
     }
     ok &= setAppCmdlineProperty(&packageList[0]);
-    ok &= pokeBinderServices();
-    pokeHalServices();
+    pokeServices();
 
     if (g_tracePdx) {
         ok &= ServiceUtility::PokeServices();
@@ -889,8 +999,7 @@ static void cleanUpUserspaceTracing()
 {
     setTagsProperty(0);
     clearAppProperties();
-    pokeBinderServices();
-    pokeHalServices();
+    pokeServices();
 
     if (g_tracePdx) {
         ServiceUtility::PokeServices();
@@ -916,11 +1025,10 @@ static bool setUpKernelTracing()
     ok &= setPrintTgidEnableIfPresent(true);
     ok &= setKernelTraceFuncs(g_kernelTraceFuncs);
 
-    // Disable all the sysfs enables.  This is done as a separate loop from
-    // the enables to allow the same enable to exist in multiple categories.
-    ok &= disableKernelTraceEvents();
-
-    // Enable all the sysfs enables that are in an enabled category.
+    // Work out which sysfs enables are in an enabled category first, so that
+    // each one is written at most once even when it's in several categories.
+    std::vector<const char*> enables;
+    std::unordered_set<std::string> enabled;
     for (size_t i = 0; i < arraysize(k_categories); i++) {
         if (g_categoryEnables[i]) {
             const TracingCategory &c = k_categories[i];
@@ -929,7 +1037,9 @@ static bool setUpKernelTracing()
                 bool required = c.sysfiles[j].required == REQ;
                 if (path != nullptr) {
                     if (fileIsWritable(path)) {
-                        ok &= setKernelOptionEnable(path, true);
+                        if (enabled.insert(path).second) {
+                            enables.push_back(path);
+                        }
                     } else if (required) {
                         fprintf(stderr, "error writing file %s\n", path);
                         ok = false;
@@ -939,6 +1049,23 @@ static bool setUpKernelTracing()
         }
     }
 
+    // Disable the other sysfs enables before enabling these ones, since a
+    // subsystem's enable also covers the events in it.
+    std::unordered_set<std::string> disabled;
+    for (size_t i = 0; i < arraysize(k_categories); i++) {
+        const TracingCategory &c = k_categories[i];
+        for (int j = 0; j < MAX_SYS_FILES; j++) {
+            const char* path = c.sysfiles[j].path;
+            if (path != nullptr && fileIsWritable(path) && !enabled.count(path) &&
+                    disabled.insert(path).second) {
+                ok &= setKernelOptionEnable(path, false);
+            }
+        }
+    }
+    for (const char* path : enables) {
+        ok &= setKernelOptionEnable(path, true);
+    }
+
     return ok;
 }
 
@@ -1097,6 +1224,316 @@ static void dumpTrace(int outFd)
     close(traceFD);
 }
 
+// Create a directory and its missing parents.
+static bool makeDirs(const std::string& path)
+{
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i < path.size() && path[i] != '/') {
+            continue;
+        }
+        std::string dir = path.substr(0, i);
+        if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "error creating %s: %s (%d)\n", dir.c_str(), strerror(errno), errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copy a file of the trace folder to the same path under outDir.
+static bool copyTraceFile(const std::string& path, const std::string& outDir)
+{
+    std::string content;
+    if (!android::base::ReadFileToString(g_traceFolder + path, &content)) {
+        fprintf(stderr, "error reading %s: %s (%d)\n", path.c_str(), strerror(errno), errno);
+        return false;
+    }
+    std::string outPath = outDir + "/" + path;
+    if (!makeDirs(outPath.substr(0, outPath.rfind('/')))) {
+        return false;
+    }
+    if (!android::base::WriteStringToFile(content, outPath)) {
+        fprintf(stderr, "error writing %s: %s (%d)\n", outPath.c_str(), strerror(errno), errno);
+        return false;
+    }
+    return true;
+}
+
+// Copy the format of the events that an enable file turns on, which is either
+// a single event or every event of a subsystem.
+static bool copyEventFormats(const std::string& enablePath, const std::string& outDir)
+{
+    std::string dir = enablePath.substr(0, enablePath.rfind('/'));
+    if (fileExists((dir + "/format").c_str())) {
+        return copyTraceFile(dir + "/format", outDir);
+    }
+
+    std::unique_ptr<DIR, int (*)(DIR*)> d(opendir((g_traceFolder + dir).c_str()), closedir);
+    if (d == nullptr) {
+        fprintf(stderr, "error opening %s: %s (%d)\n", dir.c_str(), strerror(errno), errno);
+        return false;
+    }
+    bool ok = true;
+    while (struct dirent* entry = readdir(d.get())) {
+        std::string format = dir + "/" + entry->d_name + "/format";
+        if (entry->d_name[0] != '.' && fileExists(format.c_str())) {
+            ok &= copyTraceFile(format, outDir);
+        }
+    }
+    return ok;
+}
+
+// Return the CPUs that have a trace buffer.
+static std::vector<int> listTraceCpus()
+{
+    std::vector<int> cpus;
+    std::unique_ptr<DIR, int (*)(DIR*)> d(opendir((g_traceFolder + k_perCpuPath).c_str()),
+                                          closedir);
+    if (d == nullptr) {
+        fprintf(stderr, "error opening %s: %s (%d)\n", k_perCpuPath, strerror(errno), errno);
+        return cpus;
+    }
+    while (struct dirent* entry = readdir(d.get())) {
+        int cpu;
+        char extra;
+        if (sscanf(entry->d_name, "cpu%d%c", &cpu, &extra) == 1) {
+            cpus.push_back(cpu);
+        }
+    }
+    std::sort(cpus.begin(), cpus.end());
+    return cpus;
+}
+
+// Per-CPU capture of the binary trace, which the kernel hands out a page at a
+// time without formatting it.
+struct RawCpuCapture {
+    int cpu = 0;
+    std::thread thread;
+    uint64_t bytes = 0;
+    bool ok = true;
+};
+
+struct RawCapture {
+    std::string outDir;
+    std::vector<RawCpuCapture> cpus;
+    std::atomic<bool> stopped{false};
+};
+
+// Capture a CPU's trace_pipe_raw into a file until the capture is stopped.
+static void captureRawCpu(RawCapture* capture, RawCpuCapture* cpuCapture)
+{
+    std::string rawPath = android::base::StringPrintf("%s/cpu%d/trace_pipe_raw", k_perCpuPath,
+                                                      cpuCapture->cpu);
+    std::string outPath = capture->outDir + "/" + rawPath;
+    unique_fd rawFd(open((g_traceFolder + rawPath).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    unique_fd outFd(open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (rawFd == -1 || outFd == -1) {
+        fprintf(stderr, "error capturing %s: %s (%d)\n", rawPath.c_str(), strerror(errno), errno);
+        cpuCapture->ok = false;
+        return;
+    }
+    cpuCapture->ok = copyRawCpuTrace(rawFd, outFd, capture->stopped, &cpuCapture->bytes,
+                                     rawPath);
+}
+
+// Save the files needed to decode a raw trace, and start capturing every CPU
+// into outDir, mirroring the layout of the trace folder.
+static bool startRawCapture(RawCapture* capture, const char* outDir)
+{
+    capture->outDir = outDir;
+    bool ok = makeDirs(capture->outDir);
+    for (const char* path : k_rawHeaderPaths) {
+        ok &= copyTraceFile(path, capture->outDir);
+    }
+    for (size_t i = 0; i < arraysize(k_categories); i++) {
+        if (!g_categoryEnables[i]) {
+            continue;
+        }
+        for (int j = 0; j < MAX_SYS_FILES; j++) {
+            const char* path = k_categories[i].sysfiles[j].path;
+            if (path != nullptr && fileIsWritable(path)) {
+                ok &= copyEventFormats(path, capture->outDir);
+            }
+        }
+    }
+    if (!ok) {
+        return false;
+    }
+
+    std::vector<int> cpus = listTraceCpus();
+    if (cpus.empty()) {
+        return false;
+    }
+    capture->cpus.resize(cpus.size());
+    for (size_t i = 0; i < cpus.size(); i++) {
+        capture->cpus[i].cpu = cpus[i];
+        std::string dir = android::base::StringPrintf("%s/%s/cpu%d", outDir, k_perCpuPath,
+                                                      cpus[i]);
+        if (!makeDirs(dir)) {
+            return false;
+        }
+    }
+    for (RawCpuCapture& cpuCapture : capture->cpus) {
+        cpuCapture.thread = std::thread(captureRawCpu, capture, &cpuCapture);
+    }
+    return true;
+}
+
+// Wait for every CPU to be drained once tracing has stopped, then save the
+// stats of each buffer and report the events they lost.
+static bool stopRawCapture(RawCapture* capture)
+{
+    capture->stopped = true;
+    bool ok = true;
+    for (RawCpuCapture& cpuCapture : capture->cpus) {
+        cpuCapture.thread.join();
+        ok &= cpuCapture.ok;
+    }
+    for (const char* path : k_rawTrailerPaths) {
+        if (fileExists(path)) {
+            ok &= copyTraceFile(path, capture->outDir);
+        }
+    }
+
+    uint64_t totalBytes = 0;
+    for (const RawCpuCapture& cpuCapture : capture->cpus) {
+        std::string path = android::base::StringPrintf("%s/cpu%d/stats", k_perCpuPath,
+                                                       cpuCapture.cpu);
+        std::string stats;
+        android::base::ReadFileToString(g_traceFolder + path, &stats);
+        android::base::WriteStringToFile(stats, capture->outDir + "/" + path);
+
+        // Events are overrun when the buffer wraps around in overwrite mode,
+        // and dropped when it's full otherwise.
+        uint64_t overrun = parseCpuStat(stats, "overrun");
+        uint64_t commitOverrun = parseCpuStat(stats, "commit overrun");
+        uint64_t dropped = parseCpuStat(stats, "dropped events");
+        if (overrun || commitOverrun || dropped) {
+            fprintf(stderr, "cpu%d: lost events: %" PRIu64 " overrun, %" PRIu64
+                    " commit overrun, %" PRIu64 " dropped\n", cpuCapture.cpu, overrun,
+                    commitOverrun, dropped);
+        }
+        ALOGI("cpu%d: captured %" PRIu64 " bytes, %" PRIu64 " overrun, %" PRIu64
+              " commit overrun, %" PRIu64 " dropped", cpuCapture.cpu, cpuCapture.bytes, overrun,
+              commitOverrun, dropped);
+        totalBytes += cpuCapture.bytes;
+    }
+    ALOGI("Captured %" PRIu64 " bytes of raw trace into %s", totalBytes,
+          capture->outDir.c_str());
+    return ok;
+}
+
+// Drain the kernel trace into the recorder until tracing is aborted.
+static void readFlightRecorderTrace(FlightRecorder* recorder, int traceFd)
+{
+    constexpr size_t bufSize = 64 * 1024;
+    std::unique_ptr<char[]> buf(new char[bufSize]);
+    while (!g_traceAborted) {
+        struct pollfd pfd = { traceFd, POLLIN, 0 };
+        int ret = poll(&pfd, 1, 200);
+        if (ret <= 0) {
+            if (ret == -1 && errno != EINTR) {
+                fprintf(stderr, "error polling %s: %s (%d)\n", k_traceStreamPath,
+                        strerror(errno), errno);
+                return;
+            }
+            continue;
+        }
+        ssize_t n = read(traceFd, buf.get(), bufSize);
+        if (n == 0) {
+            fprintf(stderr, "unexpected end of %s\n", k_traceStreamPath);
+            return;
+        } else if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            fprintf(stderr, "error reading %s: %s (%d)\n", k_traceStreamPath,
+                    strerror(errno), errno);
+            return;
+        }
+        addFlightRecorderTrace(recorder, buf.get(), n);
+    }
+}
+
+// Keep recording the trace until tracing is aborted, handing out snapshots on
+// SIGUSR1 (to g_outputFile) and to clients of k_flightRecorderSocket. The last
+// snapshot is taken when recording stops.
+static bool runFlightRecorder()
+{
+    FlightRecorder recorder;
+    recorder.maxBytes = g_flightRecorderBytes;
+    recorder.chunkSize = k_flightRecorderChunkSize;
+
+    unique_fd traceFd(open((g_traceFolder + k_traceStreamPath).c_str(),
+                           O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    if (traceFd == -1) {
+        fprintf(stderr, "error opening %s: %s (%d)\n", k_traceStreamPath,
+                strerror(errno), errno);
+        return false;
+    }
+
+    unique_fd serverFd(socket_local_server(k_flightRecorderSocket,
+                                           ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM));
+    if (serverFd == -1) {
+        fprintf(stderr, "error creating socket %s: %s (%d); snapshots can only be taken "
+                "with SIGUSR1\n", k_flightRecorderSocket, strerror(errno), errno);
+    }
+
+    std::thread reader(readFlightRecorderTrace, &recorder, traceFd.get());
+    while (!g_traceAborted) {
+        if (g_snapshotRequested) {
+            g_snapshotRequested = false;
+            if (g_outputFile != nullptr) {
+                writeFlightRecorderSnapshotFile(&recorder, g_outputFile);
+            }
+        }
+
+        struct pollfd pfd = { serverFd, POLLIN, 0 };
+        int ret = poll(&pfd, serverFd == -1 ? 0 : 1, 200);
+        if (ret > 0 && (pfd.revents & POLLIN)) {
+            unique_fd clientFd(accept4(serverFd, nullptr, nullptr, SOCK_CLOEXEC));
+            if (clientFd != -1) {
+                serveFlightRecorderClient(&recorder, std::move(clientFd));
+            }
+        }
+    }
+    reader.join();
+    stopFlightRecorderClients(&recorder);
+
+    if (g_outputFile != nullptr) {
+        return writeFlightRecorderSnapshotFile(&recorder, g_outputFile);
+    }
+    return true;
+}
+
+// When each step of setting up the trace finished, or 0 if it didn't run.
+struct SetupTimes {
+    nsecs_t start = 0;
+    nsecs_t userspace = 0;
+    nsecs_t kernel = 0;
+    nsecs_t vendor = 0;
+    // When the clock sync marker, the first event of the trace, was written.
+    nsecs_t firstEvent = 0;
+};
+
+// Report how long it took to get to the first event of the trace, and where
+// that time went.
+static void reportSetupTimes(const SetupTimes& times)
+{
+    auto ms = [](nsecs_t from, nsecs_t to) { return from && to ? (to - from) / 1e6 : 0.0; };
+    double total = ms(times.start, times.firstEvent);
+    double userspace = ms(times.start, times.userspace);
+    double kernel = ms(times.userspace, times.kernel);
+    double vendor = ms(times.kernel, times.vendor);
+    double start = ms(times.vendor, times.firstEvent);
+    ALOGI("First event after %.1fms: userspace %.1fms, kernel %.1fms, vendor %.1fms, "
+          "start %.1fms", total, userspace, kernel, vendor, start);
+    if (g_setupStats) {
+        fprintf(stderr, "first event after %.1fms: userspace %.1fms, kernel %.1fms, "
+                "vendor %.1fms, start %.1fms\n", total, userspace, kernel, vendor, start);
+    }
+}
+
 static void handleSignal(int /*signo*/)
 {
     if (!g_nohup) {
@@ -1104,6 +1541,11 @@ static void handleSignal(int /*signo*/)
     }
 }
 
+static void handleSnapshotSignal(int /*signo*/)
+{
+    g_snapshotRequested = true;
+}
+
 static void registerSigHandler()
 {
     struct sigaction sa;
@@ -1114,6 +1556,11 @@ static void registerSigHandler()
     sigaction(SIGINT, &sa, nullptr);
     sigaction(SIGQUIT, &sa, nullptr);
     sigaction(SIGTERM, &sa, nullptr);
+
+    if (g_flightRecorderBytes > 0) {
+        sa.sa_handler = handleSnapshotSignal;
+        sigaction(SIGUSR1, &sa, nullptr);
+    }
 }
 
 static void listSupportedCategories()
@@ -1149,10 +1596,25 @@ static void showHelp(const char *cmd)
                     "  --async_dump    dump the current contents of circular trace buffer\n"
                     "  --async_stop    stop tracing and dump the current contents of circular\n"
                     "                    trace buffer\n"
+                    "  --raw           capture the binary per-CPU buffers into the directory\n"
+                    "                    given with -o, along with the formats needed to\n"
+                    "                    decode them; lost events are reported per CPU\n"
+                    "  --flight_recorder N\n"
+                    "                  keep tracing until stopped, holding on to the last N MB\n"
+                    "                    of compressed trace; a gzip snapshot of it is written\n"
+                    "                    to -o on SIGUSR1 and on exit, and sent to clients\n"
+                    "                    of the atrace_flight_recorder socket\n"
                     "  --stream        stream trace to stdout as it enters the trace buffer\n"
                     "                    Note: this can take significant CPU time, and is best\n"
                     "                    used for measuring things that are not affected by\n"
                     "                    CPU performance, like pagecache usage.\n"
+                    "  --poke_stats    print how long each service took to acknowledge that\n"
+                    "                    the tracing tags changed\n"
+                    "  --setup_stats   print how long it took to set up the trace, up to its\n"
+                    "                    first event\n"
+                    "  --summary path  print the CPU utilization, thread runtimes and wakeup\n"
+                    "                    latencies, and longest slices of a trace captured\n"
+                    "                    with -o (text, compressed or not) or --raw\n"
                     "  --list_categories\n"
                     "                  list the available tracing categories\n"
                     " -o filename      write the trace to the specified file instead\n"
@@ -1180,6 +1642,13 @@ bool findTraceFiles()
         g_traceFolder = debugfs_path;
     }
 
+    g_traceFolderFd = open(g_traceFolder.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (g_traceFolderFd == -1) {
+        fprintf(stderr, "error opening %s: %s (%d)\n", g_traceFolder.c_str(),
+                strerror(errno), errno);
+        return false;
+    }
+
     return true;
 }
 
@@ -1263,6 +1732,7 @@ int main(int argc, char **argv)
     bool traceStop = true;
     bool traceDump = true;
     bool traceStream = false;
+    bool traceRaw = false;
     bool onlyUserspace = false;
 
     if (argc == 2 && 0 == strcmp(argv[1], "--help")) {
@@ -1287,6 +1757,11 @@ int main(int argc, char **argv)
             {"only_userspace",    no_argument, nullptr,  0 },
             {"list_categories",   no_argument, nullptr,  0 },
             {"stream",            no_argument, nullptr,  0 },
+            {"poke_stats",        no_argument, nullptr,  0 },
+            {"setup_stats",       no_argument, nullptr,  0 },
+            {"raw",               no_argument, nullptr,  0 },
+            {"flight_recorder",   required_argument, nullptr,  0 },
+            {"summary",           required_argument, nullptr,  0 },
             {nullptr,                       0, nullptr,  0 }
         };
 
@@ -1362,6 +1837,24 @@ int main(int argc, char **argv)
                 } else if (!strcmp(long_options[option_index].name, "stream")) {
                     traceStream = true;
                     traceDump = false;
+                } else if (!strcmp(long_options[option_index].name, "poke_stats")) {
+                    g_pokeStats = true;
+                } else if (!strcmp(long_options[option_index].name, "setup_stats")) {
+                    g_setupStats = true;
+                } else if (!strcmp(long_options[option_index].name, "raw")) {
+                    traceRaw = true;
+                    traceDump = false;
+                } else if (!strcmp(long_options[option_index].name, "flight_recorder")) {
+                    int sizeMB = atoi(optarg);
+                    if (sizeMB <= 0) {
+                        fprintf(stderr, "--flight_recorder needs a size in MB\n");
+                        exit(1);
+                    }
+                    g_flightRecorderBytes = static_cast<size_t>(sizeMB) * 1024 * 1024;
+                    g_traceOverwrite = true;
+                    traceDump = false;
+                } else if (!strcmp(long_options[option_index].name, "summary")) {
+                    exit(summarizeTrace(optarg, stdout) ? 0 : 1);
                 } else if (!strcmp(long_options[option_index].name, "list_categories")) {
                     listSupportedCategories();
                     exit(0);
@@ -1384,6 +1877,20 @@ int main(int argc, char **argv)
         }
     }
 
+    if (traceRaw) {
+        if (g_outputFile == nullptr || async || traceStream || g_compress) {
+            fprintf(stderr, "--raw needs -o, and can't be used with --async_*, --stream "
+                    "or -z\n");
+            exit(1);
+        }
+    }
+
+    if (g_flightRecorderBytes > 0 && (async || traceStream || traceRaw || g_compress)) {
+        fprintf(stderr, "--flight_recorder can't be used with --async_*, --stream, --raw "
+                "or -z\n");
+        exit(1);
+    }
+
     registerSigHandler();
 
     if (g_initialSleepSecs > 0) {
@@ -1391,20 +1898,27 @@ int main(int argc, char **argv)
     }
 
     bool ok = true;
+    RawCapture rawCapture;
+    bool rawCaptureStarted = false;
 
+    SetupTimes setupTimes;
+    setupTimes.start = systemTime(SYSTEM_TIME_MONOTONIC);
     if (traceStart) {
         ok &= setUpUserspaceTracing();
+        setupTimes.userspace = systemTime(SYSTEM_TIME_MONOTONIC);
     }
 
     if (ok && traceStart && !onlyUserspace) {
         ok &= setUpKernelTracing();
+        setupTimes.kernel = systemTime(SYSTEM_TIME_MONOTONIC);
         ok &= setUpVendorTracing();
+        setupTimes.vendor = systemTime(SYSTEM_TIME_MONOTONIC);
         ok &= startTrace();
     }
 
     if (ok && traceStart) {
 
-        if (!traceStream && !onlyUserspace) {
+        if (!traceStream && !onlyUserspace && g_flightRecorderBytes == 0) {
             printf("capturing trace...");
             fflush(stdout);
         }
@@ -1418,7 +1932,16 @@ int main(int argc, char **argv)
             ok = clearTrace();
 
         writeClockSyncMarker();
-        if (ok && !async && !traceStream) {
+        if (ok && !onlyUserspace) {
+            setupTimes.firstEvent = systemTime(SYSTEM_TIME_MONOTONIC);
+            reportSetupTimes(setupTimes);
+        }
+        if (ok && traceRaw) {
+            ok = rawCaptureStarted = startRawCapture(&rawCapture, g_outputFile);
+        }
+        if (ok && g_flightRecorderBytes > 0) {
+            ok = runFlightRecorder();
+        } else if (ok && !async && !traceStream) {
             // Sleep to allow the trace to be captured.
             struct timespec timeLeft;
             timeLeft.tv_sec = g_traceDurationSeconds;
@@ -1439,6 +1962,16 @@ int main(int argc, char **argv)
     if (traceStop && !onlyUserspace)
         stopTrace();
 
+    if (rawCaptureStarted) {
+        // What was captured is kept even if the trace was aborted.
+        if (stopRawCapture(&rawCapture)) {
+            printf(" done\n");
+        } else {
+            printf("\nerror capturing raw trace.\n");
+        }
+        fflush(stdout);
+    }
+
     if (ok && traceDump && !onlyUserspace) {
         if (!g_traceAborted) {
             printf(" done\n");
@@ -1473,5 +2006,6 @@ int main(int argc, char **argv)
             cleanUpKernelTracing();
     }
 
-    return g_traceAborted ? 1 : 0;
+    // Stopping is the normal end of a flight recording.
+    return g_traceAborted && g_flightRecorderBytes == 0 ? 1 : 0;
 }
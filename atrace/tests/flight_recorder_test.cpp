@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FlightRecorder.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+using android::base::unique_fd;
+
+// Trace that doesn't compress, so that chunks are about as big as their input.
+std::string makeTrace(size_t size, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::string trace(size, '\0');
+    for (char& c : trace) {
+        c = static_cast<char>(random());
+    }
+    return trace;
+}
+
+// Decompress a run of gzip members.
+std::string gunzip(const std::string& data)
+{
+    z_stream zs = {};
+    EXPECT_EQ(Z_OK, inflateInit2(&zs, 15 + 16));
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = data.size();
+    std::string out;
+    char buf[64 * 1024];
+    while (zs.avail_in > 0) {
+        zs.next_out = reinterpret_cast<Bytef*>(buf);
+        zs.avail_out = sizeof(buf);
+        int result = inflate(&zs, Z_NO_FLUSH);
+        out.append(buf, sizeof(buf) - zs.avail_out);
+        if (result == Z_STREAM_END) {
+            inflateReset(&zs);
+        } else if (result != Z_OK) {
+            ADD_FAILURE() << "inflate failed: " << result;
+            break;
+        }
+    }
+    inflateEnd(&zs);
+    return out;
+}
+
+std::string takeSnapshot(FlightRecorder* recorder)
+{
+    TemporaryFile file;
+    EXPECT_TRUE(writeFlightRecorderSnapshot(recorder, file.fd));
+    std::string snapshot;
+    EXPECT_TRUE(android::base::ReadFileToString(file.path, &snapshot));
+    return snapshot;
+}
+
+// Connect a client to the recorder and send it a command.
+unique_fd connectClient(FlightRecorder* recorder, const char* command)
+{
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+    unique_fd clientFd(fds[0]);
+    EXPECT_TRUE(android::base::WriteFully(clientFd, command, strlen(command)));
+    serveFlightRecorderClient(recorder, unique_fd(fds[1]));
+    return clientFd;
+}
+
+TEST(FlightRecorderTest, SnapshotIncludesPendingTrace)
+{
+    FlightRecorder recorder;
+    recorder.maxBytes = 1024 * 1024;
+    recorder.chunkSize = 64 * 1024;
+    std::string trace = makeTrace(100 * 1024, 1);
+    addFlightRecorderTrace(&recorder, trace.data(), trace.size());
+    addFlightRecorderTrace(&recorder, "tail", 4);
+
+    EXPECT_EQ(trace + "tail", gunzip(takeSnapshot(&recorder)));
+    EXPECT_EQ(0U, recorder.droppedChunks);
+}
+
+TEST(FlightRecorderTest, DropsOldestChunksPastTheLimit)
+{
+    FlightRecorder recorder;
+    recorder.maxBytes = 3500;
+    recorder.chunkSize = 1000;
+    std::string trace;
+    for (unsigned i = 0; i < 10; i++) {
+        std::string chunk = makeTrace(recorder.chunkSize, i);
+        addFlightRecorderTrace(&recorder, chunk.data(), chunk.size());
+        trace += chunk;
+    }
+
+    EXPECT_LE(recorder.bytes, recorder.maxBytes);
+    EXPECT_EQ(10U, recorder.droppedChunks + recorder.chunks.size());
+    EXPECT_GT(recorder.droppedChunks, 0U);
+    std::string snapshot = gunzip(takeSnapshot(&recorder));
+    EXPECT_EQ(trace.substr(recorder.droppedChunks * recorder.chunkSize), snapshot);
+}
+
+TEST(FlightRecorderTest, StalledClientDoesNotHoldUpRecording)
+{
+    FlightRecorder recorder;
+    recorder.maxBytes = 16 * 1024 * 1024;
+    recorder.chunkSize = 256 * 1024;
+    std::string trace = makeTrace(2 * 1024 * 1024, 1);
+    addFlightRecorderTrace(&recorder, trace.data(), trace.size());
+
+    // The snapshot is bigger than the socket buffers, so this client's thread
+    // gets stuck sending it.
+    unique_fd stalled = connectClient(&recorder, "snapshot");
+    usleep(100 * 1000);
+
+    // Chunks keep being made while it's stuck, and other clients are served.
+    std::string more = makeTrace(recorder.chunkSize, 2);
+    addFlightRecorderTrace(&recorder, more.data(), more.size());
+    unique_fd client = connectClient(&recorder, "snapshot\n");
+    std::string snapshot;
+    ASSERT_TRUE(android::base::ReadFdToString(client, &snapshot));
+    EXPECT_EQ(trace + more, gunzip(snapshot));
+
+    auto start = std::chrono::steady_clock::now();
+    stopFlightRecorderClients(&recorder);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+    EXPECT_TRUE(recorder.clients.empty());
+}
+
+TEST(FlightRecorderTest, IgnoresUnknownCommands)
+{
+    FlightRecorder recorder;
+    recorder.maxBytes = 1024 * 1024;
+    recorder.chunkSize = 64 * 1024;
+    addFlightRecorderTrace(&recorder, "trace", 5);
+
+    unique_fd client = connectClient(&recorder, "dump");
+    std::string reply;
+    ASSERT_TRUE(android::base::ReadFdToString(client, &reply));
+    EXPECT_EQ("", reply);
+    stopFlightRecorderClients(&recorder);
+}
+
+}  // namespace
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RawCapture.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+using android::base::unique_fd;
+
+std::string makeTrace(size_t size)
+{
+    std::string trace(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+        trace[i] = static_cast<char>(i * 7 + i / 4096);
+    }
+    return trace;
+}
+
+std::string readAll(int fd)
+{
+    std::string content;
+    lseek(fd, 0, SEEK_SET);
+    android::base::ReadFdToString(fd, &content);
+    return content;
+}
+
+TEST(RawCaptureTest, CopiesPartialPagesOnceStopped)
+{
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    std::string trace = makeTrace(20 * pageSize + pageSize / 2);
+    TemporaryFile raw;
+    ASSERT_TRUE(android::base::WriteFully(raw.fd, trace.data(), trace.size()));
+    unique_fd rawFd(open(raw.path, O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    TemporaryFile out;
+
+    std::atomic<bool> stopped{true};
+    uint64_t bytes = 0;
+    EXPECT_TRUE(copyRawCpuTrace(rawFd, out.fd, stopped, &bytes, "cpu0"));
+    EXPECT_EQ(trace.size(), bytes);
+    EXPECT_EQ(trace, readAll(out.fd));
+}
+
+TEST(RawCaptureTest, KeepsCopyingUntilStopped)
+{
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    int pipeFds[2];
+    ASSERT_EQ(0, pipe2(pipeFds, O_NONBLOCK));
+    unique_fd rawFd(pipeFds[0]);
+    unique_fd traceFd(pipeFds[1]);
+    TemporaryFile out;
+
+    std::atomic<bool> stopped{false};
+    uint64_t bytes = 0;
+    bool ok = false;
+    std::thread copier([&]() { ok = copyRawCpuTrace(rawFd, out.fd, stopped, &bytes, "cpu0"); });
+
+    // The trace keeps coming in while the buffer is being drained, and the
+    // last of it only shows up after the copy has gone idle.
+    std::string trace = makeTrace(8 * pageSize + 100);
+    for (size_t pos = 0; pos < trace.size(); pos += pageSize) {
+        size_t size = std::min(pageSize, trace.size() - pos);
+        ASSERT_TRUE(android::base::WriteFully(traceFd, trace.data() + pos, size));
+        if (pos == 4 * pageSize) {
+            usleep(300 * 1000);
+        }
+    }
+    stopped = true;
+    copier.join();
+
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(trace.size(), bytes);
+    EXPECT_EQ(trace, readAll(out.fd));
+}
+
+TEST(RawCaptureTest, ReportsWriteErrors)
+{
+    std::string trace = makeTrace(4 * sysconf(_SC_PAGESIZE));
+    TemporaryFile raw;
+    ASSERT_TRUE(android::base::WriteFully(raw.fd, trace.data(), trace.size()));
+    unique_fd rawFd(open(raw.path, O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    unique_fd outFd(open("/dev/full", O_WRONLY | O_CLOEXEC));
+    ASSERT_NE(-1, outFd.get());
+
+    std::atomic<bool> stopped{true};
+    uint64_t bytes = 0;
+    EXPECT_FALSE(copyRawCpuTrace(rawFd, outFd, stopped, &bytes, "cpu0"));
+}
+
+TEST(RawCaptureTest, ParsesCpuStats)
+{
+    std::string stats =
+            "entries: 1043\n"
+            "overrun: 12\n"
+            "commit overrun: 3\n"
+            "bytes: 65536\n"
+            "dropped events: 0\n";
+    EXPECT_EQ(1043U, parseCpuStat(stats, "entries"));
+    EXPECT_EQ(12U, parseCpuStat(stats, "overrun"));
+    EXPECT_EQ(3U, parseCpuStat(stats, "commit overrun"));
+    EXPECT_EQ(0U, parseCpuStat(stats, "dropped events"));
+    EXPECT_EQ(0U, parseCpuStat(stats, "read events"));
+}
+
+}  // namespace
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ServicePokes.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+TEST(ServicePokesTest, ReportsEachPokeInOrder)
+{
+    std::vector<ServicePoke> pokes;
+    for (int i = 0; i < 20; i++) {
+        pokes.push_back({"binder:" + std::to_string(i), [i]() { return i % 3 != 0; }});
+    }
+    std::vector<PokeResult> results = runServicePokes(std::move(pokes), 4, ms2ns(1000));
+
+    ASSERT_EQ(20U, results.size());
+    for (int i = 0; i < 20; i++) {
+        EXPECT_EQ("binder:" + std::to_string(i), results[i].name);
+        EXPECT_EQ(i % 3 != 0, results[i].ok);
+        EXPECT_FALSE(results[i].timedOut);
+    }
+}
+
+TEST(ServicePokesTest, PokesConcurrently)
+{
+    std::atomic<int> running{0};
+    std::atomic<int> maxRunning{0};
+    std::vector<ServicePoke> pokes;
+    for (int i = 0; i < 16; i++) {
+        pokes.push_back({"hal:" + std::to_string(i), [&running, &maxRunning]() {
+            int now = ++running;
+            int max = maxRunning;
+            while (now > max && !maxRunning.compare_exchange_weak(max, now)) {
+            }
+            usleep(50 * 1000);
+            running--;
+            return true;
+        }});
+    }
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::vector<PokeResult> results = runServicePokes(std::move(pokes), 8, ms2ns(5000));
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    // 16 pokes of 50ms on 8 threads take about 100ms, not 800ms.
+    EXPECT_LT(elapsed, ms2ns(400));
+    EXPECT_EQ(8, maxRunning);
+    for (const PokeResult& result : results) {
+        EXPECT_TRUE(result.ok);
+    }
+}
+
+TEST(ServicePokesTest, HungPokeMissesItsDeadline)
+{
+    // Released once the test is over; the poke outlives runServicePokes().
+    auto release = std::make_shared<std::promise<void>>();
+    std::shared_future<void> released = release->get_future().share();
+
+    std::vector<ServicePoke> pokes;
+    pokes.push_back({"binder:hung", [released]() {
+        released.wait();
+        return true;
+    }});
+    for (int i = 0; i < 5; i++) {
+        pokes.push_back({"binder:" + std::to_string(i), []() { return true; }});
+    }
+    // A single thread, so the other pokes only run if a new thread replaces
+    // the one stuck on the hung poke.
+    std::vector<PokeResult> results = runServicePokes(std::move(pokes), 1, ms2ns(100));
+    release->set_value();
+
+    ASSERT_EQ(6U, results.size());
+    EXPECT_TRUE(results[0].timedOut);
+    EXPECT_GE(results[0].latency, ms2ns(100));
+    for (size_t i = 1; i < results.size(); i++) {
+        EXPECT_TRUE(results[i].ok) << results[i].name;
+        EXPECT_FALSE(results[i].timedOut) << results[i].name;
+    }
+}
+
+}  // namespace
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TraceFiles.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+class TraceFilesTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        folderFd_.reset(open(dir_.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        ASSERT_NE(-1, folderFd_.get());
+    }
+
+    void TearDown() override
+    {
+        for (const std::string& name : files_) {
+            unlinkat(folderFd_, name.c_str(), 0);
+        }
+    }
+
+    std::string path(const std::string& name)
+    {
+        return std::string(dir_.path) + "/" + name;
+    }
+
+    void createFile(const std::string& name, const std::string& content)
+    {
+        files_.push_back(name);
+        ASSERT_TRUE(android::base::WriteStringToFile(content, path(name)));
+    }
+
+    std::string readFile(const std::string& name)
+    {
+        std::string content;
+        EXPECT_TRUE(android::base::ReadFileToString(path(name), &content));
+        return content;
+    }
+
+    // Set a file's modification time far in the past, so that a write to it
+    // shows.
+    void ageFile(const std::string& name)
+    {
+        struct timespec times[2] = { { 1, 0 }, { 1, 0 } };
+        ASSERT_EQ(0, utimensat(folderFd_, name.c_str(), times, 0));
+    }
+
+    time_t modifiedAt(const std::string& name)
+    {
+        struct stat st;
+        EXPECT_EQ(0, fstatat(folderFd_, name.c_str(), &st, 0));
+        return st.st_mtime;
+    }
+
+    TemporaryDir dir_;
+    android::base::unique_fd folderFd_;
+    std::vector<std::string> files_;
+};
+
+TEST_F(TraceFilesTest, ProbesEachFileOnce)
+{
+    createFile("tracing_on", "1\n");
+    TraceFileProbes probes;
+
+    EXPECT_TRUE(probeTraceFile(folderFd_, "tracing_on", &probes).exists);
+    EXPECT_TRUE(probeTraceFile(folderFd_, "tracing_on", &probes).writable);
+    EXPECT_FALSE(probeTraceFile(folderFd_, "events/sched/enable", &probes).exists);
+    EXPECT_FALSE(probeTraceFile(folderFd_, "events/sched/enable", &probes).writable);
+    EXPECT_EQ(2U, probes.size());
+
+    // What's found is kept, even once the folder has changed.
+    unlinkat(folderFd_, "tracing_on", 0);
+    EXPECT_TRUE(probeTraceFile(folderFd_, "tracing_on", &probes).exists);
+
+    // Other folders don't share the probes.
+    TraceFileProbes others;
+    EXPECT_FALSE(probeTraceFile(folderFd_, "tracing_on", &others).exists);
+}
+
+TEST_F(TraceFilesTest, SkipsUnchangedSettings)
+{
+    createFile("tracing_on", "1\n");
+    createFile("trace_clock", "boot");
+    ageFile("tracing_on");
+    ageFile("trace_clock");
+
+    EXPECT_TRUE(writeTraceFile(folderFd_, "tracing_on", "1"));
+    EXPECT_TRUE(writeTraceFile(folderFd_, "trace_clock", "boot"));
+    EXPECT_EQ(1, modifiedAt("tracing_on"));
+    EXPECT_EQ(1, modifiedAt("trace_clock"));
+}
+
+TEST_F(TraceFilesTest, WritesChangedSettings)
+{
+    createFile("tracing_on", "0\n");
+    createFile("buffer_size_kb", "");
+    ageFile("tracing_on");
+
+    EXPECT_TRUE(writeTraceFile(folderFd_, "tracing_on", "1"));
+    EXPECT_NE(1, modifiedAt("tracing_on"));
+    EXPECT_EQ("1\n", readFile("tracing_on"));
+    EXPECT_TRUE(writeTraceFile(folderFd_, "buffer_size_kb", "2048"));
+    EXPECT_EQ("2048", readFile("buffer_size_kb"));
+}
+
+TEST_F(TraceFilesTest, FailsOnMissingFiles)
+{
+    errno = 0;
+    EXPECT_FALSE(writeTraceFile(folderFd_, "tracing_on", "1"));
+    EXPECT_EQ(ENOENT, errno);
+}
+
+}  // namespace
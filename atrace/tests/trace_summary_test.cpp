@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TraceSummary.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+using android::base::WriteStringToFile;
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+namespace {
+
+static const char* k_textTrace =
+    "TRACE:\n"
+    "# tracer: nop\n"
+    "#\n"
+    "#           TASK-PID    TGID   CPU#  ||||    TIMESTAMP  FUNCTION\n"
+    "#              | |        |      |   ||||       |         |\n"
+    "          <idle>-0     (-----) [000] d..2  100.000000: sched_switch: prev_comm=swapper/0 "
+    "prev_pid=0 prev_prio=120 prev_state=R ==> next_comm=surfaceflinger next_pid=601 "
+    "next_prio=97\n"
+    "  surfaceflinger-601   (  601) [000] ...1  100.000100: tracing_mark_write: "
+    "B|601|onMessageReceived\n"
+    "  surfaceflinger-601   (  601) [000] ...1  100.002100: tracing_mark_write: E|601\n"
+    "          <idle>-0     (-----) [001] d.h3  100.003000: sched_waking: comm=RenderThread "
+    "pid=700 prio=110 target_cpu=001\n"
+    "          <idle>-0     (-----) [001] d..2  100.003050: sched_switch: prev_comm=swapper/1 "
+    "prev_pid=0 prev_prio=120 prev_state=R ==> next_comm=RenderThread next_pid=700 "
+    "next_prio=110\n"
+    "  surfaceflinger-601   (  601) [000] d..2  100.004000: sched_switch: "
+    "prev_comm=surfaceflinger prev_pid=601 prev_prio=97 prev_state=S ==> next_comm=swapper/0 "
+    "next_pid=0 next_prio=120\n"
+    "    RenderThread-700   (  650) [001] d..2  100.005000: sched_switch: prev_comm=RenderThread "
+    "prev_pid=700 prev_prio=110 prev_state=S ==> next_comm=swapper/1 next_pid=0 "
+    "next_prio=120\n";
+
+// Formats of the files written by atrace --raw, as found on a 64-bit device.
+static const char* k_headerPage =
+    "\tfield: u64 timestamp;\toffset:0;\tsize:8;\tsigned:0;\n"
+    "\tfield: local_t commit;\toffset:8;\tsize:8;\tsigned:1;\n"
+    "\tfield: int overwrite;\toffset:8;\tsize:1;\tsigned:1;\n"
+    "\tfield: char data;\toffset:16;\tsize:4080;\tsigned:1;\n";
+static const size_t k_pageSize = 4096;
+static const size_t k_pageHeaderSize = 16;
+
+static const uint16_t k_switchId = 68;
+static const char* k_switchFormat =
+    "name: sched_switch\n"
+    "ID: 68\n"
+    "format:\n"
+    "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+    "\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+    "\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+    "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+    "\n"
+    "\tfield:char prev_comm[16];\toffset:8;\tsize:16;\tsigned:1;\n"
+    "\tfield:pid_t prev_pid;\toffset:24;\tsize:4;\tsigned:1;\n"
+    "\tfield:int prev_prio;\toffset:28;\tsize:4;\tsigned:1;\n"
+    "\tfield:long prev_state;\toffset:32;\tsize:8;\tsigned:1;\n"
+    "\tfield:char next_comm[16];\toffset:40;\tsize:16;\tsigned:1;\n"
+    "\tfield:pid_t next_pid;\toffset:56;\tsize:4;\tsigned:1;\n"
+    "\tfield:int next_prio;\toffset:60;\tsize:4;\tsigned:1;\n";
+
+static const uint16_t k_printId = 5;
+static const char* k_printFormat =
+    "name: print\n"
+    "ID: 5\n"
+    "format:\n"
+    "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+    "\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+    "\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+    "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+    "\n"
+    "\tfield:unsigned long ip;\toffset:8;\tsize:8;\tsigned:0;\n"
+    "\tfield:char buf[];\toffset:16;\tsize:0;\tsigned:1;\n";
+
+// Types of the events of a raw page, as found in their type_len.
+static const uint32_t k_typePadding = 29;
+static const uint32_t k_typeTimeExtend = 30;
+
+// Builds a page of a CPU's raw trace, the way the kernel's ring buffer lays
+// it out.
+class RawPage {
+  public:
+    RawPage(uint64_t ts, bool missedEvents) : missedEvents_(missedEvents)
+    {
+        put(0, &ts, sizeof(ts));
+    }
+
+    void switchTo(uint32_t delta, int32_t prevPid, int32_t nextPid, const char* nextComm)
+    {
+        std::string record(64, '\0');
+        put(&record, 0, &k_switchId, sizeof(k_switchId));
+        put(&record, 4, &prevPid, sizeof(prevPid));
+        put(&record, 24, &prevPid, sizeof(prevPid));
+        put(&record, 40, nextComm, strlen(nextComm));
+        put(&record, 56, &nextPid, sizeof(nextPid));
+        event(delta, record);
+    }
+
+    void print(uint32_t delta, int32_t pid, const std::string& buf)
+    {
+        std::string record(16, '\0');
+        put(&record, 0, &k_printId, sizeof(k_printId));
+        put(&record, 4, &pid, sizeof(pid));
+        record += buf + "\n";
+        record.resize((record.size() + 3) & ~3, '\0');
+        event(delta, record);
+    }
+
+    // An event that was discarded after it was reserved.
+    void padding(uint32_t size)
+    {
+        word(k_typePadding | (1 << 5));
+        word(size);
+        data_.append(size - 4, '\0');
+    }
+
+    void timeExtend(uint64_t delta)
+    {
+        word(k_typeTimeExtend | static_cast<uint32_t>(delta & ((1 << 27) - 1)) << 5);
+        word(static_cast<uint32_t>(delta >> 27));
+    }
+
+    std::string bytes() const
+    {
+        std::string page(k_pageSize, '\0');
+        memcpy(&page[0], data_.data(), std::min(data_.size(), k_pageSize));
+        uint64_t commit = data_.size() - k_pageHeaderSize;
+        if (missedEvents_) {
+            commit |= 1ULL << 31;
+        }
+        memcpy(&page[8], &commit, sizeof(commit));
+        return page;
+    }
+
+  private:
+    void put(size_t offset, const void* value, size_t size)
+    {
+        data_.resize(std::max(data_.size(), k_pageHeaderSize));
+        memcpy(&data_[offset], value, size);
+    }
+
+    static void put(std::string* record, size_t offset, const void* value, size_t size)
+    {
+        memcpy(&(*record)[offset], value, size);
+    }
+
+    void word(uint32_t value)
+    {
+        data_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void event(uint32_t delta, const std::string& record)
+    {
+        if (record.size() <= 28 * 4) {
+            word(static_cast<uint32_t>(record.size() / 4) | delta << 5);
+        } else {
+            word(delta << 5);
+            word(static_cast<uint32_t>(record.size() + 4));
+        }
+        data_ += record;
+    }
+
+    bool missedEvents_;
+    std::string data_;
+};
+
+class TraceSummaryTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        char dir[] = "/data/local/tmp/trace_summary_test.XXXXXX";
+        ASSERT_NE(nullptr, mkdtemp(dir)) << strerror(errno);
+        dir_ = dir;
+    }
+
+    void TearDown() override
+    {
+        std::string command = "rm -rf " + dir_;
+        system(command.c_str());
+    }
+
+    std::string summarize(const std::string& path)
+    {
+        char* buf = nullptr;
+        size_t size = 0;
+        FILE* out = open_memstream(&buf, &size);
+        bool ok = summarizeTrace(path.c_str(), out);
+        fclose(out);
+        std::string summary(buf, size);
+        free(buf);
+        return ok ? summary : "failed";
+    }
+
+    void makeDirs(const std::string& path)
+    {
+        for (size_t slash = path.find('/', dir_.size() + 1); slash != std::string::npos;
+                slash = path.find('/', slash + 1)) {
+            mkdir(path.substr(0, slash).c_str(), 0700);
+        }
+        mkdir(path.c_str(), 0700);
+    }
+
+    std::string dir_;
+};
+
+TEST_F(TraceSummaryTest, TextTrace)
+{
+    std::string path = dir_ + "/trace.txt";
+    ASSERT_TRUE(WriteStringToFile(k_textTrace, path));
+    std::string summary = summarize(path);
+
+    EXPECT_THAT(summary, HasSubstr("0.005000s, 2 CPUs, 7 events\n"));
+    EXPECT_THAT(summary, HasSubstr("  0      4.000ms  80.0%\n"));
+    EXPECT_THAT(summary, HasSubstr("  1      1.950ms  39.0%\n"));
+    // RenderThread ran 50us after it was woken up.
+    EXPECT_THAT(summary, HasSubstr("    700 RenderThread          1.950ms        1       1"
+                                   "      0      1      0      0      0        0    0.050ms\n"));
+    EXPECT_THAT(summary, HasSubstr("    601 surfaceflinger\n"
+                                   "             2.000ms at 0.000100s tid 601: "
+                                   "onMessageReceived\n"));
+}
+
+TEST_F(TraceSummaryTest, CompressedTextTrace)
+{
+    std::string text = k_textTrace;
+    text = text.substr(strlen("TRACE:\n"));
+    uLongf size = compressBound(text.size());
+    std::string compressed(size, '\0');
+    ASSERT_EQ(Z_OK, compress(reinterpret_cast<Bytef*>(&compressed[0]), &size,
+                             reinterpret_cast<const Bytef*>(text.data()), text.size()));
+    compressed.resize(size);
+
+    std::string path = dir_ + "/trace.txt";
+    std::string plainPath = dir_ + "/plain.txt";
+    ASSERT_TRUE(WriteStringToFile("TRACE:\n" + compressed, path));
+    ASSERT_TRUE(WriteStringToFile(k_textTrace, plainPath));
+    EXPECT_EQ(summarize(plainPath), summarize(path));
+}
+
+TEST_F(TraceSummaryTest, RawTrace)
+{
+    makeDirs(dir_ + "/events/sched/sched_switch");
+    makeDirs(dir_ + "/events/ftrace/print");
+    makeDirs(dir_ + "/per_cpu/cpu0");
+    ASSERT_TRUE(WriteStringToFile(k_headerPage, dir_ + "/header_page"));
+    ASSERT_TRUE(WriteStringToFile(k_switchFormat, dir_ + "/events/sched/sched_switch/format"));
+    ASSERT_TRUE(WriteStringToFile(k_printFormat, dir_ + "/events/ftrace/print/format"));
+
+    RawPage first(1000000000, false);
+    first.switchTo(0, 0, 100, "worker");
+    first.print(1000, 100, "B|100|work");
+    // Neither a discarded event nor its delta move the time.
+    first.padding(8);
+    // An extension that doesn't fit in the 27 bits of a delta.
+    first.timeExtend(1000000000);
+    // A marker longer than a small event, with its length in the word after
+    // its header.
+    first.print(0, 100, "B|100|" + std::string(120, 'x'));
+
+    // The ring buffer wrapped: events before this page were overwritten, and
+    // the slices begun in the previous page end in this one.
+    RawPage second(2500000000, true);
+    second.print(0, 100, "E|100");
+    second.timeExtend(500000000);
+    second.print(0, 100, "E|100");
+    second.switchTo(1000, 100, 0, "swapper/0");
+
+    ASSERT_TRUE(WriteStringToFile(first.bytes() + second.bytes(),
+                                  dir_ + "/per_cpu/cpu0/trace_pipe_raw"));
+    std::string summary = summarize(dir_);
+
+    EXPECT_THAT(summary, HasSubstr("cpu0: events were lost before 1 of its pages\n"));
+    EXPECT_THAT(summary, HasSubstr("2.000001s, 1 CPUs, 6 events\n"));
+    EXPECT_THAT(summary, HasSubstr("  0   2000.001ms 100.0%\n"));
+    EXPECT_THAT(summary, HasSubstr("    100 worker             2000.001ms"));
+    EXPECT_THAT(summary, HasSubstr("    100 worker\n"
+                                   "          1999.999ms at 0.000001s tid 100: work\n"
+                                   "           499.999ms at 1.000001s tid 100: xxxx"));
+}
+
+TEST_F(TraceSummaryTest, RawTraceIgnoresDataPastCommit)
+{
+    makeDirs(dir_ + "/events/ftrace/print");
+    makeDirs(dir_ + "/per_cpu/cpu0");
+    ASSERT_TRUE(WriteStringToFile(k_headerPage, dir_ + "/header_page"));
+    ASSERT_TRUE(WriteStringToFile(k_printFormat, dir_ + "/events/ftrace/print/format"));
+
+    RawPage page(1000000000, false);
+    page.print(0, 100, "B|100|kept");
+    page.print(1000000, 100, "E|100");
+    std::string bytes = page.bytes();
+    // A slice past the commit, which was reserved but never committed.
+    RawPage uncommitted(1000000000, false);
+    uncommitted.print(0, 100, "B|100|kept");
+    uncommitted.print(1000000, 100, "E|100");
+    uncommitted.print(0, 100, "B|100|uncommitted");
+    uncommitted.print(2000000, 100, "E|100");
+    std::string full = uncommitted.bytes();
+    memcpy(&full[8], &bytes[8], 8);
+
+    ASSERT_TRUE(WriteStringToFile(full, dir_ + "/per_cpu/cpu0/trace_pipe_raw"));
+    std::string summary = summarize(dir_);
+
+    EXPECT_THAT(summary, HasSubstr("1.000ms at 0.000000s tid 100: kept\n"));
+    EXPECT_THAT(summary, Not(HasSubstr("uncommitted")));
+}
+
+TEST_F(TraceSummaryTest, MissingFile)
+{
+    EXPECT_EQ("failed", summarize(dir_ + "/missing"));
+}
+
+}  // namespace
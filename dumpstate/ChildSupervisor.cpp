@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "dumpstate"
+
+#include "ChildSupervisor.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include <android-base/macros.h>
+#include <log/log.h>
+
+#include "DumpstateInternal.h"
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+namespace {
+
+// epoll tokens; children are registered with their pid.
+static constexpr uint64_t kWakeToken = UINT64_MAX;
+static constexpr uint64_t kSignalToken = UINT64_MAX - 1;
+
+// How often children are polled when relying on SIGCHLD.
+static constexpr int kSweepIntervalMs = 100;
+
+static constexpr uint64_t NANOS_PER_MSEC = 1000000;
+
+// CPU time of the children waited for on each thread, see WaitedChildrenCpuNanotime().
+static thread_local uint64_t waited_children_cpu_ns = 0;
+
+static int pidfd_open(pid_t pid) {
+    return syscall(__NR_pidfd_open, pid, 0);
+}
+
+}  // unnamed namespace
+
+ChildSupervisor& ChildSupervisor::GetInstance() {
+    // Never destroyed: the supervisor thread is detached and outlives static destructors.
+    static ChildSupervisor* instance = new ChildSupervisor();
+    return *instance;
+}
+
+ChildSupervisor::ChildSupervisor() {
+}
+
+bool ChildSupervisor::Init() {
+    epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
+    if (epoll_fd_.get() == -1) {
+        MYLOGE("*** epoll_create1 failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    wake_fd_.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (wake_fd_.get() == -1) {
+        MYLOGE("*** eventfd failed: %s\n", strerror(errno));
+        return false;
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = kWakeToken;
+    if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, wake_fd_.get(), &ev) == -1) {
+        MYLOGE("*** epoll_ctl failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    android::base::unique_fd self(pidfd_open(getpid()));
+    if (self.get() == -1) {
+        // Kernel without pidfd_open(), or blocked by seccomp.
+        use_pidfd_ = false;
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        signal_fd_.reset(signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK));
+        if (signal_fd_.get() == -1) {
+            MYLOGE("*** signalfd failed: %s\n", strerror(errno));
+            return false;
+        }
+        ev.data.u64 = kSignalToken;
+        if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, signal_fd_.get(), &ev) == -1) {
+            MYLOGE("*** epoll_ctl failed: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    std::thread([this]() { Loop(); }).detach();
+    initialized_ = true;
+    return true;
+}
+
+bool ChildSupervisor::Watch(pid_t pid, int64_t timeout_ms) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (!initialized_ && !Init()) {
+        return false;
+    }
+
+    Child child;
+    child.start_ns = Nanotime();
+    child.deadline_ns = child.start_ns + static_cast<uint64_t>(timeout_ms) * NANOS_PER_MSEC;
+    if (use_pidfd_) {
+        child.pidfd.reset(pidfd_open(pid));
+        if (child.pidfd.get() == -1) {
+            return false;
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = static_cast<uint64_t>(pid);
+        if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, child.pidfd.get(), &ev) == -1) {
+            return false;
+        }
+    }
+    children_[pid] = std::move(child);
+
+    // Makes the loop pick up the new deadline (and sweep, in case SIGCHLD was already missed).
+    uint64_t one = 1;
+    TEMP_FAILURE_RETRY(write(wake_fd_.get(), &one, sizeof(one)));
+    return true;
+}
+
+ChildSupervisor::Result ChildSupervisor::Wait(pid_t pid) {
+    std::unique_lock<std::mutex> lock(lock_);
+    auto it = children_.find(pid);
+    if (it == children_.end()) {
+        return Result();
+    }
+    cv_.wait(lock, [&it]() { return it->second.stage == DONE; });
+    Result result = it->second.result;
+    children_.erase(it);
+    waited_children_cpu_ns += result.cpu_ns;
+    return result;
+}
+
+uint64_t ChildSupervisor::WaitedChildrenCpuNanotime() {
+    return waited_children_cpu_ns;
+}
+
+void ChildSupervisor::TryReapLocked(pid_t pid, Child* child) {
+    int status;
+    struct rusage usage;
+    pid_t ret = TEMP_FAILURE_RETRY(wait4(pid, &status, WNOHANG, &usage));
+    if (ret == 0) {
+        return;
+    }
+    if (ret == pid) {
+        child->result.status = status;
+        child->result.reaped = true;
+        for (const timeval& tv : {usage.ru_utime, usage.ru_stime}) {
+            child->result.cpu_ns +=
+                static_cast<uint64_t>(tv.tv_sec) * NANOS_PER_SEC + tv.tv_usec * 1000ULL;
+        }
+    } else {
+        MYLOGE("*** wait4(%d) failed: %s\n", pid, strerror(errno));
+    }
+    if (!child->result.timed_out) {
+        child->result.elapsed_ns = Nanotime() - child->start_ns;
+    }
+    child->stage = DONE;
+    child->pidfd.reset();
+}
+
+void ChildSupervisor::CheckDeadlineLocked(pid_t pid, Child* child, uint64_t now) {
+    if (child->stage == DONE || now < child->deadline_ns) {
+        return;
+    }
+    child->deadline_ns = now + kKillGraceMs * NANOS_PER_MSEC;
+    switch (child->stage) {
+        case RUNNING:
+            child->result.timed_out = true;
+            child->result.elapsed_ns = now - child->start_ns;
+            kill(pid, SIGTERM);
+            child->stage = TERMINATING;
+            break;
+        case TERMINATING:
+            kill(pid, SIGKILL);
+            child->stage = KILLING;
+            break;
+        default:
+            // Still not gone after SIGKILL (e.g. stuck in the kernel); give up on it.
+            child->stage = DONE;
+            child->pidfd.reset();
+            break;
+    }
+}
+
+int ChildSupervisor::NextTimeoutMsLocked(uint64_t now) const {
+    int64_t next_ms = -1;
+    for (const auto& it : children_) {
+        const Child& child = it.second;
+        if (child.stage == DONE) {
+            continue;
+        }
+        int64_t ms = child.deadline_ns > now
+                         ? (child.deadline_ns - now + NANOS_PER_MSEC - 1) / NANOS_PER_MSEC
+                         : 0;
+        if (!use_pidfd_ && ms > kSweepIntervalMs) {
+            ms = kSweepIntervalMs;
+        }
+        if (next_ms == -1 || ms < next_ms) {
+            next_ms = ms;
+        }
+    }
+    return static_cast<int>(next_ms);
+}
+
+void ChildSupervisor::Loop() {
+    if (!use_pidfd_) {
+        // SIGCHLD must be blocked for the signalfd to see it, at least on this thread.
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    }
+
+    epoll_event events[16];
+    while (true) {
+        int timeout_ms;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            timeout_ms = NextTimeoutMsLocked(Nanotime());
+        }
+        int n = TEMP_FAILURE_RETRY(epoll_wait(epoll_fd_.get(), events, arraysize(events),
+                                              timeout_ms));
+        if (n == -1) {
+            MYLOGE("*** epoll_wait failed: %s\n", strerror(errno));
+            n = 0;
+        }
+
+        std::lock_guard<std::mutex> guard(lock_);
+        bool sweep = !use_pidfd_;
+        for (int i = 0; i < n; i++) {
+            uint64_t token = events[i].data.u64;
+            if (token == kWakeToken) {
+                uint64_t count;
+                TEMP_FAILURE_RETRY(read(wake_fd_.get(), &count, sizeof(count)));
+            } else if (token == kSignalToken) {
+                signalfd_siginfo info;
+                while (TEMP_FAILURE_RETRY(read(signal_fd_.get(), &info, sizeof(info))) > 0) {
+                }
+            } else {
+                pid_t pid = static_cast<pid_t>(token);
+                auto it = children_.find(pid);
+                if (it != children_.end() && it->second.stage != DONE) {
+                    TryReapLocked(pid, &it->second);
+                }
+            }
+        }
+
+        uint64_t now = Nanotime();
+        for (auto& it : children_) {
+            if (sweep && it.second.stage != DONE) {
+                TryReapLocked(it.first, &it.second);
+            }
+            CheckDeadlineLocked(it.first, &it.second, now);
+        }
+        cv_.notify_all();
+    }
+}
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
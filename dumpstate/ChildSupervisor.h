@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_OS_DUMPSTATE_CHILD_SUPERVISOR_H_
+#define ANDROID_OS_DUMPSTATE_CHILD_SUPERVISOR_H_
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+/*
+ * Tracks any number of concurrently running child processes from a single background thread.
+ *
+ * Children are watched through a pidfd each (Linux 5.3+) registered on an epoll set. On older
+ * kernels a signalfd for SIGCHLD is used instead, plus a periodic sweep, since SIGCHLD may be
+ * consumed by any other thread of the process that does not block it.
+ *
+ * Unlike sigtimedwait(), none of this depends on the process-wide signal state, so commands can
+ * be waited for from several threads at once.
+ */
+class ChildSupervisor {
+  public:
+    /* Time given to a child to exit after SIGTERM (and then SIGKILL) before giving up on it. */
+    static constexpr int64_t kKillGraceMs = 5000;
+
+    struct Result {
+        /* Raw wait status; only valid when `reaped` is true. */
+        int status = 0;
+        /* Whether the child was reaped (possibly after being killed). */
+        bool reaped = false;
+        /* Whether the timeout expired and the child had to be killed. */
+        bool timed_out = false;
+        /* Time from Watch() until the child exited or timed out. */
+        uint64_t elapsed_ns = 0;
+        /* User and system CPU time of the child; only valid when `reaped` is true. */
+        uint64_t cpu_ns = 0;
+    };
+
+    static ChildSupervisor& GetInstance();
+
+    /*
+     * Starts supervising `pid`, which must be an unreaped child of this process. Once
+     * `timeout_ms` expires the child gets SIGTERM, and SIGKILL if it is still alive
+     * kKillGraceMs later.
+     *
+     * Returns false (with errno set) if the child cannot be supervised.
+     */
+    bool Watch(pid_t pid, int64_t timeout_ms);
+
+    /* Blocks until a child previously passed to Watch() was reaped or abandoned. */
+    Result Wait(pid_t pid);
+
+    /*
+     * Returns the total CPU time of the children whose Wait() returned on the calling thread, so
+     * that it can be attributed to that thread even while other threads reap children too.
+     */
+    static uint64_t WaitedChildrenCpuNanotime();
+
+  private:
+    enum Stage { RUNNING, TERMINATING, KILLING, DONE };
+
+    struct Child {
+        android::base::unique_fd pidfd;
+        uint64_t start_ns;
+        uint64_t deadline_ns;
+        Stage stage = RUNNING;
+        Result result;
+    };
+
+    ChildSupervisor();
+
+    bool Init();
+    void Loop();
+    void TryReapLocked(pid_t pid, Child* child);
+    void CheckDeadlineLocked(pid_t pid, Child* child, uint64_t now);
+    int NextTimeoutMsLocked(uint64_t now) const;
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::map<pid_t, Child> children_;
+
+    bool initialized_ = false;
+    bool use_pidfd_ = true;
+    android::base::unique_fd epoll_fd_;
+    android::base::unique_fd wake_fd_;
+    android::base::unique_fd signal_fd_;
+};
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
+
+#endif  // ANDROID_OS_DUMPSTATE_CHILD_SUPERVISOR_H_
@@ -33,6 +33,7 @@
 #include <android-base/unique_fd.h>
 #include <log/log.h>
 
+#include "ChildSupervisor.h"
 #include "DumpstateInternal.h"
 
 namespace android {
@@ -43,50 +44,6 @@ namespace {
 
 static constexpr const char* kSuPath = "/system/xbin/su";
 
-static bool waitpid_with_timeout(pid_t pid, int timeout_ms, int* status) {
-    sigset_t child_mask, old_mask;
-    sigemptyset(&child_mask);
-    sigaddset(&child_mask, SIGCHLD);
-
-    if (sigprocmask(SIG_BLOCK, &child_mask, &old_mask) == -1) {
-        printf("*** sigprocmask failed: %s\n", strerror(errno));
-        return false;
-    }
-
-    timespec ts;
-    ts.tv_sec = MSEC_TO_SEC(timeout_ms);
-    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
-    int ret = TEMP_FAILURE_RETRY(sigtimedwait(&child_mask, nullptr, &ts));
-    int saved_errno = errno;
-
-    // Set the signals back the way they were.
-    if (sigprocmask(SIG_SETMASK, &old_mask, nullptr) == -1) {
-        printf("*** sigprocmask failed: %s\n", strerror(errno));
-        if (ret == 0) {
-            return false;
-        }
-    }
-    if (ret == -1) {
-        errno = saved_errno;
-        if (errno == EAGAIN) {
-            errno = ETIMEDOUT;
-        } else {
-            printf("*** sigtimedwait failed: %s\n", strerror(errno));
-        }
-        return false;
-    }
-
-    pid_t child_pid = waitpid(pid, status, WNOHANG);
-    if (child_pid != pid) {
-        if (child_pid != -1) {
-            printf("*** Waiting for pid %d, got pid %d instead\n", pid, child_pid);
-        } else {
-            printf("*** waitpid failed: %s\n", strerror(errno));
-        }
-        return false;
-    }
-    return true;
-}
 }  // unnamed namespace
 
 CommandOptions CommandOptions::DEFAULT = CommandOptions::WithTimeout(10).Build();
@@ -284,7 +241,6 @@ int RunCommandToFd(int fd, const std::string& title, const std::vector<std::stri
 
     const char* path = args[0];
 
-    uint64_t start = Nanotime();
     pid_t pid = fork();
 
     /* handle error case */
@@ -324,7 +280,7 @@ int RunCommandToFd(int fd, const std::string& title, const std::vector<std::stri
         sigaction(SIGPIPE, &sigact, nullptr);
 
         execvp(path, (char**)args.data());
-        // execvp's result will be handled after waitpid_with_timeout() below, but
+        // execvp's result will be handled by the ChildSupervisor below, but
         // if it failed, it's safer to exit dumpstate.
         MYLOGD("execvp on command '%s' failed (error: %s)\n", command, strerror(errno));
         // Must call _exit (instead of exit), otherwise it will corrupt the zip
@@ -333,38 +289,43 @@ int RunCommandToFd(int fd, const std::string& title, const std::vector<std::stri
     }
 
     /* handle parent case */
-    int status;
-    bool ret = waitpid_with_timeout(pid, options.TimeoutInMs(), &status);
+    ChildSupervisor& supervisor = ChildSupervisor::GetInstance();
+    if (!supervisor.Watch(pid, options.TimeoutInMs())) {
+        if (!silent)
+            dprintf(fd, "*** command '%s': could not supervise pid %d: %s\n", command, pid,
+                    strerror(errno));
+        MYLOGE("*** command '%s': could not supervise pid %d: %s\n", command, pid,
+               strerror(errno));
+        kill(pid, SIGKILL);
+        TEMP_FAILURE_RETRY(waitpid(pid, nullptr, 0));
+        return -1;
+    }
+    ChildSupervisor::Result result = supervisor.Wait(pid);
     fsync(fd);
 
-    uint64_t elapsed = Nanotime() - start;
-    if (!ret) {
-        if (errno == ETIMEDOUT) {
-            if (!silent)
-                dprintf(fd, "*** command '%s' timed out after %.3fs (killing pid %d)\n", command,
-                        static_cast<float>(elapsed) / NANOS_PER_SEC, pid);
-            MYLOGE("*** command '%s' timed out after %.3fs (killing pid %d)\n", command,
-                   static_cast<float>(elapsed) / NANOS_PER_SEC, pid);
-        } else {
+    float elapsed = static_cast<float>(result.elapsed_ns) / NANOS_PER_SEC;
+    if (result.timed_out) {
+        if (!silent)
+            dprintf(fd, "*** command '%s' timed out after %.3fs (killing pid %d)\n", command,
+                    elapsed, pid);
+        MYLOGE("*** command '%s' timed out after %.3fs (killing pid %d)\n", command, elapsed,
+               pid);
+        if (!result.reaped) {
             if (!silent)
-                dprintf(fd, "*** command '%s': Error after %.4fs (killing pid %d)\n", command,
-                        static_cast<float>(elapsed) / NANOS_PER_SEC, pid);
-            MYLOGE("command '%s': Error after %.4fs (killing pid %d)\n", command,
-                   static_cast<float>(elapsed) / NANOS_PER_SEC, pid);
-        }
-        kill(pid, SIGTERM);
-        if (!waitpid_with_timeout(pid, 5000, nullptr)) {
-            kill(pid, SIGKILL);
-            if (!waitpid_with_timeout(pid, 5000, nullptr)) {
-                if (!silent)
-                    dprintf(fd, "could not kill command '%s' (pid %d) even with SIGKILL.\n",
-                            command, pid);
-                MYLOGE("could not kill command '%s' (pid %d) even with SIGKILL.\n", command, pid);
-            }
+                dprintf(fd, "could not kill command '%s' (pid %d) even with SIGKILL.\n", command,
+                        pid);
+            MYLOGE("could not kill command '%s' (pid %d) even with SIGKILL.\n", command, pid);
         }
         return -1;
     }
+    if (!result.reaped) {
+        if (!silent)
+            dprintf(fd, "*** command '%s': Error after %.4fs (pid %d)\n", command, elapsed, pid);
+        MYLOGE("command '%s': Error after %.4fs (pid %d)\n", command, elapsed, pid);
+        return -1;
+    }
 
+    int status = result.status;
     if (WIFSIGNALED(status)) {
         if (!silent)
             dprintf(fd, "*** command '%s' failed: killed by signal %d\n", command, WTERMSIG(status));
@@ -406,6 +367,35 @@ int GetPidByName(const std::string& ps_name) {
     return -1;
 }
 
+void FailureStreak::Record(size_t index, bool failed) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (index >= outcomes_.size()) {
+        outcomes_.resize(index + 1, PENDING);
+    }
+    outcomes_[index] = failed ? FAILED : SUCCEEDED;
+    if (!failed) {
+        return;
+    }
+
+    // Length of the run of failures that |index| is part of.
+    size_t first = index;
+    while (first > 0 && outcomes_[first - 1] == FAILED) {
+        first--;
+    }
+    size_t last = index;
+    while (last + 1 < outcomes_.size() && outcomes_[last + 1] == FAILED) {
+        last++;
+    }
+    if (last - first + 1 >= max_failures_) {
+        exceeded_ = true;
+    }
+}
+
+bool FailureStreak::Exceeded() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return exceeded_;
+}
+
 }  // namespace dumpstate
 }  // namespace os
 }  // namespace android
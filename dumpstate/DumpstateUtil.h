@@ -17,7 +17,9 @@
 #define ANDROID_OS_DUMPSTATE_UTIL_H_
 
 #include <cstdint>
+#include <mutex>
 #include <string>
+#include <vector>
 
 /*
  * Converts seconds to milliseconds.
@@ -211,6 +213,32 @@ int DumpFileToFd(int fd, const std::string& title, const std::string& path);
  */
 int GetPidByName(const std::string& ps_name);
 
+/*
+ * Tells when too many commands failed in a row, for commands that are issued one after the
+ * other but run concurrently. "In a row" refers to the order in which the commands were
+ * issued, not the order in which they finished, so the outcome does not depend on how the
+ * children happened to be scheduled. Thread-safe.
+ */
+class FailureStreak {
+  public:
+    explicit FailureStreak(size_t max_failures) : max_failures_(max_failures) {
+    }
+
+    /* Records the outcome of the |index|-th command issued. */
+    void Record(size_t index, bool failed);
+
+    /* Whether |max_failures| consecutively issued commands have all failed. */
+    bool Exceeded() const;
+
+  private:
+    enum Outcome : uint8_t { PENDING, SUCCEEDED, FAILED };
+
+    const size_t max_failures_;
+    mutable std::mutex lock_;
+    std::vector<Outcome> outcomes_;
+    bool exceeded_ = false;
+};
+
 }  // namespace dumpstate
 }  // namespace os
 }  // namespace android
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "dumpstate"
+
+#include "LogCollector.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <android-base/stringprintf.h>
+#include <log/event_tag_map.h>
+#include <log/log.h>
+#include <log/log_read.h>
+#include <log/log_time.h>
+#include <log/logprint.h>
+
+#include "DumpstateInternal.h"
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+namespace {
+
+// Same as logcat.
+static constexpr size_t kBinaryMessageSize = 1024;
+
+static bool IsBinary(log_id_t id) {
+    return id == LOG_ID_EVENTS || id == LOG_ID_STATS || id == LOG_ID_SECURITY;
+}
+
+// Reads the buffers of `section`, passing each line to `append`, until it returns false. Returns
+// false, with an error message, if they couldn't be read.
+static bool ReadLogs(const LogCollector::Section& section, uint32_t window_sec,
+                     const std::function<bool(const char*, size_t)>& append, std::string* error) {
+    const int mode = ANDROID_LOG_RDONLY | ANDROID_LOG_NONBLOCK;
+    std::unique_ptr<logger_list, decltype(&android_logger_list_free)> logger_list(
+        nullptr, android_logger_list_free);
+    if (window_sec > 0) {
+        log_time start(CLOCK_REALTIME);
+        start.tv_sec = start.tv_sec > window_sec ? start.tv_sec - window_sec : 0;
+        logger_list.reset(android_logger_list_alloc_time(mode, start, 0));
+    } else {
+        logger_list.reset(android_logger_list_alloc(mode, 0, 0));
+    }
+    if (logger_list == nullptr) {
+        *error = "could not allocate logger list";
+        return false;
+    }
+    for (log_id_t id : section.buffers) {
+        if (android_logger_open(logger_list.get(), id) == nullptr) {
+            *error = android::base::StringPrintf("could not open '%s' log buffer",
+                                                 android_log_id_to_name(id));
+            return false;
+        }
+    }
+
+    std::unique_ptr<AndroidLogFormat, decltype(&android_log_format_free)> format(
+        android_log_format_new(), android_log_format_free);
+    android_log_setPrintFormat(format.get(), FORMAT_THREADTIME);
+    android_log_setPrintFormat(format.get(), FORMAT_MODIFIER_PRINTABLE);
+    android_log_setPrintFormat(format.get(), FORMAT_MODIFIER_UID);
+
+    std::unique_ptr<EventTagMap, decltype(&android_closeEventTagMap)> event_tag_map(
+        nullptr, android_closeEventTagMap);
+    for (log_id_t id : section.buffers) {
+        if (IsBinary(id)) {
+            event_tag_map.reset(android_openEventTagMap(nullptr));
+            break;
+        }
+    }
+
+    char line_buffer[1024];
+    char binary_buffer[kBinaryMessageSize];
+    bool printed[LOG_ID_MAX] = {};
+    log_id_t last_id = LOG_ID_MAX;
+    while (true) {
+        log_msg msg;
+        int ret = android_logger_list_read(logger_list.get(), &msg);
+        if (ret == -EAGAIN) {
+            // Everything was read.
+            return true;
+        }
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            *error = ret == 0 ? "unexpected EOF" : strerror(-ret);
+            return false;
+        }
+
+        log_id_t id = msg.id();
+        if (id >= LOG_ID_MAX) {
+            continue;
+        }
+        AndroidLogEntry entry;
+        int err;
+        if (IsBinary(id)) {
+            err = android_log_processBinaryLogBuffer(&msg.entry_v1, &entry, event_tag_map.get(),
+                                                     binary_buffer, sizeof(binary_buffer));
+        } else {
+            err = android_log_processLogBuffer(&msg.entry_v1, &entry);
+        }
+        if (err < 0) {
+            continue;
+        }
+
+        // Like logcat, marks where each buffer starts when there are several of them.
+        if (section.buffers.size() > 1 && id != last_id && !printed[id]) {
+            std::string divider = android::base::StringPrintf("--------- beginning of %s\n",
+                                                              android_log_id_to_name(id));
+            if (!append(divider.data(), divider.size())) {
+                return true;
+            }
+            printed[id] = true;
+        }
+        last_id = id;
+
+        size_t len;
+        char* line = android_log_formatLogLine(format.get(), line_buffer, sizeof(line_buffer),
+                                               &entry, &len);
+        if (line == nullptr) {
+            continue;
+        }
+        bool appended = append(line, len);
+        if (line != line_buffer) {
+            free(line);
+        }
+        if (!appended) {
+            return true;
+        }
+    }
+}
+
+struct CollectorJob {
+    LogCollector::Section section;
+    // The lines read so far, until the result is ready.
+    std::unique_ptr<LogTail> tail;
+    bool done = false;
+    // Set when Wait() gave up on the job; the thread stops at the next line it reads.
+    bool abandoned = false;
+    LogCollector::Result result;
+};
+
+}  // unnamed namespace
+
+// Shared with the collecting threads, which are detached so a stuck logd can't hold up the whole
+// dump. The lock also guards the tails, so that Wait() can take what was read when it times out.
+struct LogCollector::State {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<CollectorJob> jobs;
+};
+
+LogTail::LogTail(size_t max_bytes) : max_bytes_(max_bytes) {
+}
+
+void LogTail::Append(const char* line, size_t len) {
+    if (len > max_bytes_ || max_bytes_ == 0) {
+        dropped_lines_ += lengths_.size() + 1;
+        dropped_bytes_ += size_ + len;
+        buffer_.clear();
+        lengths_.clear();
+        head_ = 0;
+        size_ = 0;
+        return;
+    }
+    while (size_ + len > max_bytes_) {
+        dropped_lines_++;
+        dropped_bytes_ += lengths_.front();
+        head_ = (head_ + lengths_.front()) % max_bytes_;
+        size_ -= lengths_.front();
+        lengths_.pop_front();
+    }
+    lengths_.push_back(static_cast<uint32_t>(len));
+
+    // Until the buffer is as large as the budget, the kept lines end where the buffer does.
+    if (buffer_.size() < max_bytes_) {
+        size_t end = buffer_.size() + len;
+        if (end <= max_bytes_) {
+            if (end > buffer_.capacity()) {
+                // Grows like std::string would, but never past the budget.
+                buffer_.reserve(std::min(max_bytes_, std::max(end, 2 * buffer_.capacity())));
+            }
+            buffer_.append(line, len);
+            size_ += len;
+            return;
+        }
+        buffer_.resize(max_bytes_);
+    }
+    size_t pos = (head_ + size_) % max_bytes_;
+    size_t first = std::min(len, max_bytes_ - pos);
+    memcpy(&buffer_[pos], line, first);
+    memcpy(&buffer_[0], line + first, len - first);
+    size_ += len;
+}
+
+std::string LogTail::Lines() const {
+    if (head_ + size_ <= buffer_.size()) {
+        return buffer_.substr(head_, size_);
+    }
+    size_t first = buffer_.size() - head_;
+    return buffer_.substr(head_) + buffer_.substr(0, size_ - first);
+}
+
+std::string LogTail::TakeLines() {
+    std::rotate(buffer_.begin(), buffer_.begin() + head_, buffer_.end());
+    buffer_.resize(size_);
+    std::string lines = std::move(buffer_);
+    buffer_.clear();
+    lengths_.clear();
+    head_ = 0;
+    size_ = 0;
+    return lines;
+}
+
+LogCollector::LogCollector(const std::vector<Section>& sections, uint32_t window_sec)
+    : state_(std::make_shared<State>()), start_(std::chrono::steady_clock::now()) {
+    state_->jobs.resize(sections.size());
+    for (size_t i = 0; i < sections.size(); i++) {
+        state_->jobs[i].section = sections[i];
+        state_->jobs[i].tail.reset(new LogTail(sections[i].max_bytes));
+        std::thread([state = state_, i, window_sec]() {
+            CollectorJob& job = state->jobs[i];
+            auto append = [&state, &job](const char* line, size_t len) {
+                std::lock_guard<std::mutex> guard(state->lock);
+                if (job.abandoned) {
+                    return false;
+                }
+                job.tail->Append(line, len);
+                return true;
+            };
+            Result result;
+            result.ok = ReadLogs(job.section, window_sec, append, &result.error);
+
+            std::lock_guard<std::mutex> guard(state->lock);
+            if (job.abandoned) {
+                return;
+            }
+            result.output = job.tail->TakeLines();
+            result.dropped_lines = job.tail->dropped_lines();
+            result.dropped_bytes = job.tail->dropped_bytes();
+            job.result = std::move(result);
+            job.done = true;
+            state->cv.notify_all();
+        }).detach();
+    }
+}
+
+LogCollector::Result LogCollector::Wait(size_t index, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(state_->lock);
+    CollectorJob& job = state_->jobs[index];
+    if (!state_->cv.wait_until(lock, start_ + timeout, [&job]() { return job.done; })) {
+        // Keeps what was read so far, and lets the thread go.
+        job.abandoned = true;
+        Result result;
+        result.timed_out = true;
+        result.output = job.tail->TakeLines();
+        result.dropped_lines = job.tail->dropped_lines();
+        result.dropped_bytes = job.tail->dropped_bytes();
+        return result;
+    }
+    return std::move(job.result);
+}
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
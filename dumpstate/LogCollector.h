@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_OS_DUMPSTATE_LOG_COLLECTOR_H_
+#define ANDROID_OS_DUMPSTATE_LOG_COLLECTOR_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/macros.h>
+#include <log/log_id.h>
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+/*
+ * Newest lines of a log that fit in a budget of bytes; older lines are dropped as new ones come.
+ * The lines are kept in a ring buffer, so no more than the budget is ever held.
+ */
+class LogTail {
+  public:
+    explicit LogTail(size_t max_bytes);
+
+    /* Appends a line, which should include its trailing newline. */
+    void Append(const char* line, size_t len);
+
+    /* Returns the lines kept, oldest first. */
+    std::string Lines() const;
+
+    /* Same as Lines(), but hands over the buffer instead of copying it, and empties the tail. */
+    std::string TakeLines();
+
+    size_t max_bytes() const {
+        return max_bytes_;
+    }
+    size_t dropped_lines() const {
+        return dropped_lines_;
+    }
+    size_t dropped_bytes() const {
+        return dropped_bytes_;
+    }
+
+  private:
+    size_t max_bytes_;
+    // Kept lines are the size_ bytes from buffer_[head_], wrapping around at the end of buffer_,
+    // which never grows past max_bytes_; lengths_ has the length of each of them.
+    std::string buffer_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+    std::deque<uint32_t> lengths_;
+    size_t dropped_lines_ = 0;
+    size_t dropped_bytes_ = 0;
+
+    DISALLOW_COPY_AND_ASSIGN(LogTail);
+};
+
+/*
+ * Reads log buffers from logd in binary form and formats them in-process, the same way
+ * `logcat -d -v threadtime -v printable -v uid` does, several sections at once.
+ *
+ * Each section is bounded by a budget of bytes (keeping the newest lines), and all of them by an
+ * optional time window.
+ */
+class LogCollector {
+  public:
+    struct Section {
+        std::vector<log_id_t> buffers;
+        size_t max_bytes;
+    };
+
+    struct Result {
+        /* False if the logs couldn't be read. */
+        bool ok = false;
+        bool timed_out = false;
+        std::string error;
+        std::string output;
+        size_t dropped_lines = 0;
+        size_t dropped_bytes = 0;
+    };
+
+    /*
+     * Starts reading every section on its own thread. Only entries logged in the last
+     * `window_sec` seconds are read, unless it's 0.
+     */
+    LogCollector(const std::vector<Section>& sections, uint32_t window_sec);
+
+    /*
+     * Returns the result of the section at `index`, waiting until `timeout` since the collector
+     * was created at most. On timeout, returns the lines read so far, and the section stops being
+     * read.
+     */
+    Result Wait(size_t index, std::chrono::milliseconds timeout);
+
+  private:
+    struct State;
+
+    std::shared_ptr<State> state_;
+    std::chrono::steady_clock::time_point start_;
+
+    DISALLOW_COPY_AND_ASSIGN(LogCollector);
+};
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
+
+#endif  // ANDROID_OS_DUMPSTATE_LOG_COLLECTOR_H_
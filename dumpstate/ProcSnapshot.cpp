@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "dumpstate"
+
+#include "ProcSnapshot.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <log/log.h>
+
+#include "DumpstateInternal.h"
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+namespace {
+
+// Large enough for any stat file and for the argv[0] of any sane process.
+static constexpr size_t kBufferSize = 4096;
+
+// Returns the numeric value of a /proc entry name, or 0 if it's not a pid.
+static int ParsePid(const char* name) {
+    int pid = 0;
+    for (const char* c = name; *c; c++) {
+        if (*c < '0' || *c > '9') {
+            return 0;
+        }
+        pid = pid * 10 + (*c - '0');
+    }
+    return pid;
+}
+
+// Opens the directory at path relative to dirfd for readdir().
+static std::unique_ptr<DIR, decltype(&closedir)> OpenDirAt(int dirfd, const char* path) {
+    int fd = TEMP_FAILURE_RETRY(openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1) {
+        return std::unique_ptr<DIR, decltype(&closedir)>(nullptr, closedir);
+    }
+    DIR* dir = fdopendir(fd);
+    if (dir == nullptr) {
+        close(fd);
+    }
+    return std::unique_ptr<DIR, decltype(&closedir)>(dir, closedir);
+}
+
+}  // unnamed namespace
+
+bool ParseProcStat(const char* data, size_t len, ProcSnapshot::Process* process) {
+    // The comm field is in parentheses and may itself contain spaces and parentheses, so
+    // everything up to the last ')' belongs to it.
+    const char* end = data + len;
+    const char* comm_start = static_cast<const char*>(memchr(data, '(', len));
+    const char* comm_end = end;
+    while (comm_end > data && *(comm_end - 1) != ')') {
+        comm_end--;
+    }
+    if (comm_start == nullptr || comm_end == data || comm_end - 1 <= comm_start) {
+        return false;
+    }
+    process->comm.assign(comm_start + 1, comm_end - 1);
+
+    // Fields are numbered from 1 (pid); comm is field 2.
+    int field = 2;
+    const char* p = comm_end;
+    while (p < end && field < 42) {
+        while (p < end && (*p == ' ' || *p == '\n')) {
+            p++;
+        }
+        if (p == end || *p == '\0') {
+            break;
+        }
+        field++;
+        const char* token = p;
+        uint64_t value = 0;
+        while (p < end && *p != ' ' && *p != '\n' && *p != '\0') {
+            if (*p >= '0' && *p <= '9') {
+                value = value * 10 + (*p - '0');
+            }
+            p++;
+        }
+        switch (field) {
+            case 3:
+                process->state = *token;
+                break;
+            case 4:
+                process->ppid = static_cast<int>(value);
+                break;
+            case 14:
+                process->utime = value;
+                break;
+            case 15:
+                process->stime = value;
+                break;
+            case 42:
+                // delayacct_blkio_ticks
+                process->iotime = value;
+                break;
+        }
+    }
+    // Kernels without block I/O delay accounting stop before field 42.
+    return field >= 15;
+}
+
+ProcSnapshot::ProcSnapshot() : buffer_(kBufferSize) {
+}
+
+ssize_t ProcSnapshot::ReadAt(const char* path) {
+    android::base::unique_fd fd(
+        TEMP_FAILURE_RETRY(openat(proc_fd_.get(), path, O_RDONLY | O_CLOEXEC)));
+    if (fd.get() == -1) {
+        return -1;
+    }
+    size_t total = 0;
+    while (total < buffer_.size() - 1) {
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd.get(), buffer_.data() + total,
+                                            buffer_.size() - 1 - total));
+        if (n <= 0) {
+            if (n == -1 && total == 0) {
+                return -1;
+            }
+            break;
+        }
+        total += n;
+    }
+    buffer_[total] = '\0';
+    return total;
+}
+
+void ProcSnapshot::ReadProcess(int pid, int flags, Process* process) {
+    char path[64];
+    process->pid = pid;
+
+    if (!(flags & EXE_ONLY)) {
+        snprintf(path, sizeof(path), "%d/stat", pid);
+        ssize_t len = ReadAt(path);
+        if (len > 0) {
+            process->has_stat = ParseProcStat(buffer_.data(), len, process);
+        } else if (len < 0) {
+            process->stat_errno = errno;
+        }
+
+        process->name = ReadName(*process);
+    }
+
+    if (flags & (WITH_EXE | EXE_ONLY)) {
+        snprintf(path, sizeof(path), "%d/exe", pid);
+        ssize_t n = readlinkat(proc_fd_.get(), path, buffer_.data(), buffer_.size() - 1);
+        if (n > 0) {
+            process->exe.assign(buffer_.data(), n);
+        }
+    }
+
+    if (flags & WITH_THREADS) {
+        ReadThreads(pid, process);
+    }
+}
+
+std::string ProcSnapshot::ReadName(const Process& process) {
+    char path[64];
+    snprintf(path, sizeof(path), "%d/cmdline", process.pid);
+    if (ReadAt(path) > 0 && buffer_[0] != '\0') {
+        // argv[0] only.
+        return buffer_.data();
+    }
+    if (!process.comm.empty()) {
+        // No cmdline: a kernel thread.
+        return "[" + process.comm + "]";
+    }
+    return "N/A";
+}
+
+void ProcSnapshot::ReadThreads(int pid, Process* process) {
+    char path[64];
+    snprintf(path, sizeof(path), "%d/task", pid);
+    auto task_dir = OpenDirAt(proc_fd_.get(), path);
+    if (task_dir == nullptr) {
+        return;
+    }
+
+    struct dirent* de;
+    while ((de = readdir(task_dir.get()))) {
+        int tid = ParsePid(de->d_name);
+        if (tid <= 0 || tid == pid) {
+            continue;
+        }
+        Thread thread;
+        thread.tid = tid;
+        snprintf(path, sizeof(path), "%d/task/%d/comm", pid, tid);
+        ssize_t len = ReadAt(path);
+        if (len < 0) {
+            thread.comm = "N/A";
+        } else {
+            thread.comm.assign(buffer_.data(), len);
+            size_t newline = thread.comm.rfind('\n');
+            if (newline != std::string::npos) {
+                thread.comm.resize(newline);
+            }
+        }
+        process->threads.push_back(std::move(thread));
+    }
+    std::sort(process->threads.begin(), process->threads.end(),
+              [](const Thread& a, const Thread& b) { return a.tid < b.tid; });
+}
+
+bool ProcSnapshot::Capture(int flags) {
+    processes_.clear();
+    if (proc_fd_.get() == -1) {
+        proc_fd_.reset(TEMP_FAILURE_RETRY(open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+        if (proc_fd_.get() == -1) {
+            MYLOGE("Failed to open /proc: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    auto proc_dir = OpenDirAt(proc_fd_.get(), ".");
+    if (proc_dir == nullptr) {
+        MYLOGE("Failed to read /proc: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct dirent* de;
+    while ((de = readdir(proc_dir.get()))) {
+        int pid = ParsePid(de->d_name);
+        if (pid <= 0) {
+            continue;
+        }
+        processes_.emplace_back();
+        ReadProcess(pid, flags, &processes_.back());
+    }
+    std::sort(processes_.begin(), processes_.end(),
+              [](const Process& a, const Process& b) { return a.pid < b.pid; });
+    return true;
+}
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
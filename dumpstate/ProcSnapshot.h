@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_OS_DUMPSTATE_PROC_SNAPSHOT_H_
+#define ANDROID_OS_DUMPSTATE_PROC_SNAPSHOT_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <android-base/macros.h>
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+/*
+ * Point-in-time listing of the processes (and optionally threads) of the system, read from /proc
+ * in a single pass so the per-process sections don't each have to walk it again.
+ *
+ * Files are opened relative to a cached /proc directory fd and read into a reusable buffer.
+ */
+class ProcSnapshot {
+  public:
+    enum Flags {
+        /* Also list the threads of each process. */
+        WITH_THREADS = 1 << 0,
+        /* Also resolve /proc/<pid>/exe. */
+        WITH_EXE = 1 << 1,
+        /* Only resolve /proc/<pid>/exe, leaving the name and times unset (see ReadName()). */
+        EXE_ONLY = 1 << 2,
+    };
+
+    struct Thread {
+        int tid;
+        std::string comm;
+    };
+
+    struct Process {
+        int pid = 0;
+        int ppid = 0;
+        char state = '?';
+        /* argv[0], or "[comm]" for kernel threads, or "N/A". */
+        std::string name;
+        std::string comm;
+        /* Target of /proc/<pid>/exe; only set with WITH_EXE. */
+        std::string exe;
+        /* Whether /proc/<pid>/stat could be read; the times below are in clock ticks. */
+        bool has_stat = false;
+        /* errno of the failed read of /proc/<pid>/stat, or 0. */
+        int stat_errno = 0;
+        uint64_t utime = 0;
+        uint64_t stime = 0;
+        uint64_t iotime = 0;
+        /* All threads but the main one; only set with WITH_THREADS. */
+        std::vector<Thread> threads;
+    };
+
+    ProcSnapshot();
+
+    /*
+     * Replaces the current snapshot with a new one, ordered by pid.
+     *
+     * Returns false if /proc could not be read.
+     */
+    bool Capture(int flags = 0);
+
+    const std::vector<Process>& processes() const {
+        return processes_;
+    }
+
+    /* Reads the name of a process captured with EXE_ONLY. */
+    std::string ReadName(const Process& process);
+
+  private:
+    ssize_t ReadAt(const char* path);
+    void ReadProcess(int pid, int flags, Process* process);
+    void ReadThreads(int pid, Process* process);
+
+    android::base::unique_fd proc_fd_;
+    std::vector<char> buffer_;
+    std::vector<Process> processes_;
+
+    DISALLOW_COPY_AND_ASSIGN(ProcSnapshot);
+};
+
+/*
+ * Parses the contents of /proc/<pid>/stat into `process` (comm, state, ppid and times).
+ *
+ * Returns false if the content is malformed.
+ */
+bool ParseProcStat(const char* data, size_t len, ProcSnapshot::Process* process);
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
+
+#endif  // ANDROID_OS_DUMPSTATE_PROC_SNAPSHOT_H_
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "dumpstate"
+
+#include "SectionHistory.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <log/log.h>
+
+#include "DumpstateInternal.h"
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+namespace {
+
+// First line of the file; bumped when the format changes, which discards older histories.
+static const char kHeader[] = "sections v2";
+
+static constexpr float NANOS_PER_MSEC = 1000000.0f;
+
+// Title the untitled sections are accounted for under.
+static const char kUntitledTitle[] = "(untitled)";
+
+// Parses a "<duration_ms> <bytes> <runs> <missed_runs> <progress> <title>" line.
+static bool ParseLine(const std::string& line, std::string* title,
+                      SectionHistory::Section* section) {
+    const char* p = line.c_str();
+    char* end;
+    section->duration_ms = strtof(p, &end);
+    if (end == p || *end != ' ') {
+        return false;
+    }
+    p = end;
+    section->bytes = strtof(p, &end);
+    if (end == p || *end != ' ') {
+        return false;
+    }
+    p = end;
+    section->runs = strtof(p, &end);
+    if (end == p || *end != ' ') {
+        return false;
+    }
+    p = end;
+    section->missed_runs = strtol(p, &end, 10);
+    if (end == p || *end != ' ') {
+        return false;
+    }
+    p = end;
+    long progress = strtol(p, &end, 10);
+    if (end == p || *end != ' ' || *(end + 1) == '\0') {
+        return false;
+    }
+    section->progress = progress != 0;
+    title->assign(end + 1);
+    return section->duration_ms >= 0 && section->bytes >= 0 && section->runs >= 0 &&
+           section->missed_runs >= 0;
+}
+
+}  // unnamed namespace
+
+SectionHistory::SectionHistory(const std::string& path) : path_(path) {
+}
+
+bool SectionHistory::Load() {
+    std::string content;
+    if (path_.empty() || !android::base::ReadFileToString(path_, &content)) {
+        MYLOGI("No section history on %s\n", path_.c_str());
+        return false;
+    }
+    std::vector<std::string> lines = android::base::Split(content, "\n");
+    if (lines[0] != kHeader) {
+        MYLOGE("Ignoring section history on %s: unknown format\n", path_.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    sections_.clear();
+    for (size_t i = 1; i < lines.size(); i++) {
+        if (lines[i].empty()) {
+            continue;
+        }
+        std::string title;
+        Section section;
+        if (!ParseLine(lines[i], &title, &section)) {
+            MYLOGE("Invalid section history line on %s: %s\n", path_.c_str(), lines[i].c_str());
+            continue;
+        }
+        sections_[title] = section;
+    }
+    MYLOGI("Loaded history of %zu sections from %s\n", sections_.size(), path_.c_str());
+    return !sections_.empty();
+}
+
+void SectionHistory::Save() {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto it = sections_.begin(); it != sections_.end();) {
+        if (current_.find(it->first) == current_.end() &&
+            ++it->second.missed_runs > kMaxMissedRuns) {
+            it = sections_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto& it : current_) {
+        Section& latest = it.second;
+        if (latest.runs > 0) {
+            latest.duration_ms /= latest.runs;
+            latest.bytes /= latest.runs;
+        }
+        auto old = sections_.find(it.first);
+        if (old == sections_.end()) {
+            sections_[it.first] = latest;
+            continue;
+        }
+        Section& section = old->second;
+        section.duration_ms = kAlpha * latest.duration_ms + (1 - kAlpha) * section.duration_ms;
+        section.bytes = kAlpha * latest.bytes + (1 - kAlpha) * section.bytes;
+        section.runs = kAlpha * latest.runs + (1 - kAlpha) * section.runs;
+        section.missed_runs = 0;
+        section.progress = latest.progress;
+    }
+    current_.clear();
+
+    MYLOGI("Saving history of %zu sections on %s\n", sections_.size(), path_.c_str());
+    if (path_.empty()) {
+        return;
+    }
+    std::string content = kHeader;
+    content += "\n";
+    for (const auto& it : sections_) {
+        const Section& section = it.second;
+        android::base::StringAppendF(&content, "%.1f %.0f %.2f %d %d %s\n", section.duration_ms,
+                                     section.bytes, section.runs, section.missed_runs,
+                                     section.progress ? 1 : 0, it.first.c_str());
+    }
+    if (!android::base::WriteStringToFile(content, path_)) {
+        MYLOGE("Could not save section history on %s\n", path_.c_str());
+    }
+}
+
+void SectionHistory::Record(const std::string& title, uint64_t duration_ns, uint64_t bytes) {
+    if (title.empty() || title.find('\n') != std::string::npos) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    // Totals of the current run; Save() turns them into averages per run.
+    Section& section = current_[title];
+    section.duration_ms += duration_ns / NANOS_PER_MSEC;
+    section.bytes += bytes;
+    section.runs++;
+}
+
+void SectionHistory::MarkProgress(const std::string& title) {
+    if (title.empty() || title.find('\n') != std::string::npos) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    current_[title].progress = true;
+}
+
+void SectionHistory::RecordUntitledProgress(float weight_ms) {
+    std::lock_guard<std::mutex> guard(lock_);
+    Section& section = current_[kUntitledTitle];
+    section.duration_ms += weight_ms;
+    section.runs++;
+    section.progress = true;
+}
+
+float SectionHistory::ExpectedDurationMs(const std::string& title) const {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = sections_.find(title);
+    return it == sections_.end() ? -1 : it->second.duration_ms;
+}
+
+float SectionHistory::ExpectedProgressDurationMs() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    float total = 0;
+    for (const auto& it : sections_) {
+        // Sections missing from the last run are likely not going to run this time either.
+        if (it.second.progress && it.second.missed_runs == 0) {
+            total += it.second.duration_ms * it.second.runs;
+        }
+    }
+    return total;
+}
+
+std::vector<size_t> SectionHistory::SlowestFirst(const std::vector<std::string>& titles) const {
+    std::vector<float> durations;
+    for (const std::string& title : titles) {
+        durations.push_back(ExpectedDurationMs(title));
+    }
+    std::vector<size_t> order(titles.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&durations](size_t a, size_t b) { return durations[a] > durations[b]; });
+    return order;
+}
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_OS_DUMPSTATE_SECTION_HISTORY_H_
+#define ANDROID_OS_DUMPSTATE_SECTION_HISTORY_H_
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/macros.h>
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+/*
+ * Per-section model of how long each section of a bugreport takes and how much it prints, built
+ * from previous runs and persisted in a file.
+ *
+ * Sections are identified by their title. Each one keeps an exponentially weighted moving average
+ * of its duration and size, so the model follows devices whose sections get slower or faster over
+ * time. Sections that stop showing up are eventually forgotten.
+ *
+ * A title can run several times per bugreport (e.g. "DUMPSYS"), so the duration and size are
+ * averages per run, and the number of runs per bugreport is averaged too.
+ */
+class SectionHistory {
+  public:
+    /* Weight given to the latest run in the moving averages. */
+    static constexpr float kAlpha = 0.3f;
+
+    /* Number of runs a section can be missing from before it's forgotten. */
+    static constexpr int kMaxMissedRuns = 5;
+
+    struct Section {
+        /* Duration and size of a single run of the section. */
+        float duration_ms = 0;
+        float bytes = 0;
+        /* Number of times the section runs in a bugreport. */
+        float runs = 0;
+        /* Number of runs since the section was last seen. */
+        int missed_runs = 0;
+        /* Whether the section contributes to the progress (see MarkProgress()). */
+        bool progress = false;
+    };
+
+    explicit SectionHistory(const std::string& path = "");
+
+    /*
+     * Loads the history from the file.
+     *
+     * Returns false if there's no usable history.
+     */
+    bool Load();
+
+    /* Folds the current run into the history and persists it. */
+    void Save();
+
+    /* Adds the duration and size of a section of the current run. Thread-safe. */
+    void Record(const std::string& title, uint64_t duration_ns, uint64_t bytes);
+
+    /* Flags `title` as a section that updates the progress. Thread-safe. */
+    void MarkProgress(const std::string& title);
+
+    /*
+     * Adds the weight of an untitled section that updates the progress. Untitled sections are
+     * accounted for together. Thread-safe.
+     */
+    void RecordUntitledProgress(float weight_ms);
+
+    /* Returns the expected duration of one run of `title`, or -1 if it's unknown. */
+    float ExpectedDurationMs(const std::string& title) const;
+
+    /* Returns the expected duration of all the runs of the sections that update the progress. */
+    float ExpectedProgressDurationMs() const;
+
+    /*
+     * Returns the indexes of `titles`, ordered from the historically slowest to the fastest.
+     * Unknown titles come last, in their original order.
+     */
+    std::vector<size_t> SlowestFirst(const std::vector<std::string>& titles) const;
+
+    const std::map<std::string, Section>& sections() const {
+        return sections_;
+    }
+
+  private:
+    std::string path_;
+    mutable std::mutex lock_;
+    std::map<std::string, Section> sections_;
+    // Sections seen in the current run, with their total duration and size so far.
+    std::map<std::string, Section> current_;
+
+    DISALLOW_COPY_AND_ASSIGN(SectionHistory);
+};
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
+
+#endif  // ANDROID_OS_DUMPSTATE_SECTION_HISTORY_H_
@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "dumpstate"
+
+#include "SectionReport.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <android-base/stringprintf.h>
+
+#include "ChildSupervisor.h"
+#include "DumpstateInternal.h"
+
+using android::base::StringAppendF;
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+namespace {
+
+// Number of sections listed in the summary of the slowest ones.
+static constexpr size_t kMaxSlowestSections = 20;
+
+enum WireType {
+    VARINT = 0,
+    FIXED64 = 1,
+    LENGTH_DELIMITED = 2,
+    FIXED32 = 5,
+};
+
+enum Field {
+    SECTIONS_SECTION = 1,
+    SECTION_TITLE = 1,
+    SECTION_KIND = 2,
+    SECTION_DEPTH = 3,
+    SECTION_START_NS = 4,
+    SECTION_DURATION_NS = 5,
+    SECTION_CPU_NS = 6,
+    SECTION_BYTES = 7,
+    SECTION_STATUS = 8,
+    SECTION_TIMED_OUT = 9,
+};
+
+static void AppendVarint(uint64_t value, std::string* out) {
+    while (value >= 0x80) {
+        out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+}
+
+static void AppendTag(int field, WireType type, std::string* out) {
+    AppendVarint((static_cast<uint64_t>(field) << 3) | type, out);
+}
+
+// Default values are omitted, like protobuf does.
+static void AppendVarintField(int field, uint64_t value, std::string* out) {
+    if (value != 0) {
+        AppendTag(field, VARINT, out);
+        AppendVarint(value, out);
+    }
+}
+
+static void AppendBytesField(int field, const std::string& value, std::string* out) {
+    AppendTag(field, LENGTH_DELIMITED, out);
+    AppendVarint(value.size(), out);
+    out->append(value);
+}
+
+static uint64_t ZigZag(int32_t value) {
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+static int32_t UnZigZag(uint64_t value) {
+    return static_cast<int32_t>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+static bool ReadVarint(const char** p, const char* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*(*p)++);
+        *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the next field; `value` is set for varints, `bytes` for length-delimited fields, and
+// other types are skipped.
+static bool ReadField(const char** p, const char* end, int* field, WireType* type,
+                      uint64_t* value, std::string* bytes) {
+    uint64_t tag;
+    if (!ReadVarint(p, end, &tag)) {
+        return false;
+    }
+    *field = static_cast<int>(tag >> 3);
+    *type = static_cast<WireType>(tag & 7);
+    switch (*type) {
+        case VARINT:
+            return ReadVarint(p, end, value);
+        case FIXED64:
+        case FIXED32: {
+            size_t size = *type == FIXED64 ? 8 : 4;
+            if (static_cast<size_t>(end - *p) < size) {
+                return false;
+            }
+            *p += size;
+            return true;
+        }
+        case LENGTH_DELIMITED:
+            if (!ReadVarint(p, end, value) || *value > static_cast<uint64_t>(end - *p)) {
+                return false;
+            }
+            bytes->assign(*p, *value);
+            *p += *value;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool ParseSection(const std::string& data, SectionReport::Section* section) {
+    const char* p = data.data();
+    const char* end = p + data.size();
+    while (p < end) {
+        int field;
+        WireType type;
+        uint64_t value = 0;
+        std::string bytes;
+        if (!ReadField(&p, end, &field, &type, &value, &bytes)) {
+            return false;
+        }
+        if (field == SECTION_TITLE) {
+            if (type != LENGTH_DELIMITED) {
+                return false;
+            }
+            section->title = std::move(bytes);
+            continue;
+        }
+        if (type != VARINT) {
+            continue;
+        }
+        switch (field) {
+            case SECTION_KIND:
+                section->kind = static_cast<SectionReport::Kind>(value);
+                break;
+            case SECTION_DEPTH:
+                section->depth = static_cast<uint32_t>(value);
+                break;
+            case SECTION_START_NS:
+                section->start_ns = value;
+                break;
+            case SECTION_DURATION_NS:
+                section->duration_ns = value;
+                break;
+            case SECTION_CPU_NS:
+                section->cpu_ns = value;
+                break;
+            case SECTION_BYTES:
+                section->bytes = value;
+                break;
+            case SECTION_STATUS:
+                section->status = UnZigZag(value);
+                break;
+            case SECTION_TIMED_OUT:
+                section->timed_out = value != 0;
+                break;
+        }
+    }
+    return true;
+}
+
+static const char* StatusString(const SectionReport::Section& section) {
+    if (section.timed_out) {
+        return "TIMEOUT";
+    }
+    return section.status == 0 ? "ok" : "FAILED";
+}
+
+static void AppendSection(const SectionReport::Section& section, bool with_start,
+                          std::string* out) {
+    if (with_start) {
+        StringAppendF(out, "%8.3fs ", (float)section.start_ns / NANOS_PER_SEC);
+    }
+    StringAppendF(out, "%8.3fs %8.3fs %12" PRIu64 " %7s %4d ",
+                  (float)section.duration_ns / NANOS_PER_SEC,
+                  (float)section.cpu_ns / NANOS_PER_SEC, section.bytes, StatusString(section),
+                  section.status);
+    if (with_start) {
+        out->append(2 * section.depth, ' ');
+    }
+    if (section.kind == SectionReport::ZIP_ENTRY) {
+        out->append("[zip] ");
+    }
+    out->append(section.title);
+    out->append("\n");
+}
+
+}  // unnamed namespace
+
+SectionReport::SectionReport() : start_ns_(Nanotime()) {
+}
+
+void SectionReport::Add(Section section) {
+    section.start_ns = section.start_ns > start_ns_ ? section.start_ns - start_ns_ : 0;
+    std::lock_guard<std::mutex> guard(lock_);
+    sections_.push_back(std::move(section));
+}
+
+uint64_t SectionReport::CpuNanotime() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    uint64_t cpu_ns = static_cast<uint64_t>(ts.tv_sec) * NANOS_PER_SEC + ts.tv_nsec;
+    // Not getrusage(RUSAGE_CHILDREN): it covers the whole process, so sections running at the same
+    // time would be charged for each other's children.
+    return cpu_ns + ChildSupervisor::WaitedChildrenCpuNanotime();
+}
+
+std::vector<SectionReport::Section> SectionReport::sections() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return sections_;
+}
+
+std::string SectionReport::Serialize() const {
+    std::string out;
+    std::string message;
+    for (const Section& section : sections()) {
+        message.clear();
+        AppendBytesField(SECTION_TITLE, section.title, &message);
+        AppendVarintField(SECTION_KIND, section.kind, &message);
+        AppendVarintField(SECTION_DEPTH, section.depth, &message);
+        AppendVarintField(SECTION_START_NS, section.start_ns, &message);
+        AppendVarintField(SECTION_DURATION_NS, section.duration_ns, &message);
+        AppendVarintField(SECTION_CPU_NS, section.cpu_ns, &message);
+        AppendVarintField(SECTION_BYTES, section.bytes, &message);
+        AppendVarintField(SECTION_STATUS, ZigZag(section.status), &message);
+        AppendVarintField(SECTION_TIMED_OUT, section.timed_out, &message);
+        AppendBytesField(SECTIONS_SECTION, message, &out);
+    }
+    return out;
+}
+
+bool SectionReport::Parse(const std::string& data, std::vector<Section>* sections) {
+    sections->clear();
+    const char* p = data.data();
+    const char* end = p + data.size();
+    while (p < end) {
+        int field;
+        WireType type;
+        uint64_t value;
+        std::string bytes;
+        if (!ReadField(&p, end, &field, &type, &value, &bytes)) {
+            return false;
+        }
+        if (field != SECTIONS_SECTION || type != LENGTH_DELIMITED) {
+            continue;
+        }
+        Section section;
+        if (!ParseSection(bytes, &section)) {
+            return false;
+        }
+        sections->push_back(std::move(section));
+    }
+    return true;
+}
+
+std::string SectionReport::Format() const {
+    std::vector<Section> sections = this->sections();
+    // Nested sections are already accounted for by their parents.
+    uint64_t end_ns = 0, cpu_ns = 0, bytes = 0;
+    int timed_out = 0, failed = 0;
+    for (const Section& section : sections) {
+        end_ns = std::max(end_ns, section.start_ns + section.duration_ns);
+        if (section.depth == 0) {
+            cpu_ns += section.cpu_ns;
+            bytes += section.bytes;
+        }
+        if (section.timed_out) {
+            timed_out++;
+        } else if (section.status != 0) {
+            failed++;
+        }
+    }
+
+    std::string out;
+    StringAppendF(&out,
+                  "%zu sections (%d timed out, %d failed): %.3fs elapsed, %.3fs of CPU, %" PRIu64
+                  " bytes\n",
+                  sections.size(), timed_out, failed, (float)end_ns / NANOS_PER_SEC,
+                  (float)cpu_ns / NANOS_PER_SEC, bytes);
+
+    std::vector<const Section*> slowest;
+    for (const Section& section : sections) {
+        slowest.push_back(&section);
+    }
+    size_t count = std::min(kMaxSlowestSections, slowest.size());
+    std::partial_sort(slowest.begin(), slowest.begin() + count, slowest.end(),
+                      [](const Section* a, const Section* b) {
+                          return a->duration_ns > b->duration_ns;
+                      });
+    out.append("\nSlowest sections:\n");
+    out.append(" duration       cpu        bytes  status code title\n");
+    for (size_t i = 0; i < count; i++) {
+        AppendSection(*slowest[i], false, &out);
+    }
+
+    // Sections are added when they finish; list them in the order they started.
+    std::stable_sort(sections.begin(), sections.end(), [](const Section& a, const Section& b) {
+        return a.start_ns < b.start_ns;
+    });
+    out.append("\nAll sections:\n");
+    out.append("    start  duration       cpu        bytes  status code title\n");
+    for (const Section& section : sections) {
+        AppendSection(section, true, &out);
+    }
+    return out;
+}
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
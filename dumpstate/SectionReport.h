@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_OS_DUMPSTATE_SECTION_REPORT_H_
+#define ANDROID_OS_DUMPSTATE_SECTION_REPORT_H_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/macros.h>
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+/*
+ * Where the time and bytes of a bugreport went: one record per section, added to the zip file so
+ * regressions can be tracked across many bugreports.
+ *
+ * The binary form uses the protobuf wire format, so it can be decoded without dumpstate:
+ *
+ *   message DumpstateSections {
+ *       repeated Section section = 1;
+ *   }
+ *   message Section {
+ *       enum Kind { SECTION = 0; ZIP_ENTRY = 1; }
+ *       string title = 1;
+ *       Kind kind = 2;
+ *       uint32 depth = 3;
+ *       uint64 start_ns = 4;
+ *       uint64 duration_ns = 5;
+ *       uint64 cpu_ns = 6;
+ *       uint64 bytes = 7;
+ *       sint32 status = 8;
+ *       bool timed_out = 9;
+ *   }
+ */
+class SectionReport {
+  public:
+    enum Kind {
+        /* A section of the main entry, or work done on its behalf. */
+        SECTION = 0,
+        /* A separate entry of the zip file. */
+        ZIP_ENTRY = 1,
+    };
+
+    struct Section {
+        std::string title;
+        Kind kind = SECTION;
+        /* Number of sections this one is nested in. */
+        uint32_t depth = 0;
+        /* Relative to the start of the report. */
+        uint64_t start_ns = 0;
+        uint64_t duration_ns = 0;
+        /*
+         * CPU time of the thread that ran the section, plus the one of the children that thread
+         * waited for through ChildSupervisor.
+         */
+        uint64_t cpu_ns = 0;
+        uint64_t bytes = 0;
+        int32_t status = 0;
+        bool timed_out = false;
+    };
+
+    SectionReport();
+
+    /*
+     * Adds a finished section. Its `start_ns` is a Nanotime() timestamp, which is made relative to
+     * the start of the report. Thread-safe.
+     */
+    void Add(Section section);
+
+    /* Returns the CPU time to be used for Section::cpu_ns. */
+    static uint64_t CpuNanotime();
+
+    std::vector<Section> sections() const;
+
+    /* Returns the sections in the protobuf wire format described above. */
+    std::string Serialize() const;
+
+    /*
+     * Parses the output of Serialize().
+     *
+     * Returns false if `data` is malformed.
+     */
+    static bool Parse(const std::string& data, std::vector<Section>* sections);
+
+    /* Returns a human-readable summary of the sections. */
+    std::string Format() const;
+
+  private:
+    uint64_t start_ns_;
+    mutable std::mutex lock_;
+    std::vector<Section> sections_;
+
+    DISALLOW_COPY_AND_ASSIGN(SectionReport);
+};
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
+
+#endif  // ANDROID_OS_DUMPSTATE_SECTION_REPORT_H_
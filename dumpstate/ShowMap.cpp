@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "dumpstate"
+
+#include "ShowMap.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <log/log.h>
+
+#include "DumpstateInternal.h"
+
+using android::base::StringAppendF;
+using android::base::StringPrintf;
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+namespace {
+
+// Maximum number of processes whose smaps are read at the same time by CollectShowMaps().
+static constexpr size_t kMaxConcurrentShowMaps = 4;
+
+// Same per-process timeout that `showmap` had when it was run for each process.
+static constexpr int64_t kShowMapTimeoutMs = 10000;
+
+// showmap copies names into a 128 byte buffer.
+static constexpr size_t kMaxNameLength = 127;
+
+static bool IsLibrary(const std::string& name) {
+    return name.size() >= 4 && name[0] == '/' && android::base::EndsWith(name, ".so");
+}
+
+// Parses a "Name:    123 kB" line. Returns false if the line is not an attribute.
+static bool ParseField(const char* line, const char* end, MapInfo* map) {
+    const char* colon = static_cast<const char*>(memchr(line, ':', end - line));
+    if (colon == nullptr || memchr(line, ' ', colon - line) != nullptr) {
+        return false;
+    }
+    uint64_t* field = nullptr;
+    std::string key(line, colon);
+    if (key == "Size") {
+        field = &map->size;
+    } else if (key == "Rss") {
+        field = &map->rss;
+    } else if (key == "Pss") {
+        field = &map->pss;
+    } else if (key == "Shared_Clean") {
+        field = &map->shared_clean;
+    } else if (key == "Shared_Dirty") {
+        field = &map->shared_dirty;
+    } else if (key == "Private_Clean") {
+        field = &map->private_clean;
+    } else if (key == "Private_Dirty") {
+        field = &map->private_dirty;
+    } else if (key == "Swap") {
+        field = &map->swap;
+    } else if (key == "SwapPss") {
+        field = &map->swap_pss;
+    }
+    if (field != nullptr) {
+        *field = strtoull(colon + 1, nullptr, 10);
+    }
+    return true;
+}
+
+// Parses a "start-end perms offset dev inode name" line.
+static bool ParseHeader(const char* line, const char* end, const MapInfo* prev, uint64_t prev_end,
+                        MapInfo* map, uint64_t* map_end) {
+    char* p;
+    uint64_t start = strtoull(line, &p, 16);
+    if (p == end || *p != '-') {
+        return false;
+    }
+    *map_end = strtoull(p + 1, &p, 16);
+
+    // Skip perms, offset, dev and inode.
+    for (int i = 0; i < 4; i++) {
+        while (p < end && *p == ' ') p++;
+        while (p < end && *p != ' ') p++;
+    }
+    while (p < end && *p == ' ') p++;
+
+    map->count = 1;
+    if (p < end) {
+        map->name.assign(p, std::min(static_cast<size_t>(end - p), kMaxNameLength));
+    } else if (prev != nullptr && start == prev_end && IsLibrary(prev->name)) {
+        // Anonymous mappings immediately adjacent to shared libraries usually correspond to the
+        // library BSS segment, so use the library's own name.
+        map->name = prev->name;
+        map->is_bss = true;
+    } else {
+        map->name = "[anon]";
+    }
+    return true;
+}
+
+static void AddTo(const MapInfo& map, MapInfo* total) {
+    total->size += map.size;
+    total->rss += map.rss;
+    total->pss += map.pss;
+    total->shared_clean += map.shared_clean;
+    total->shared_dirty += map.shared_dirty;
+    total->private_clean += map.private_clean;
+    total->private_dirty += map.private_dirty;
+    total->swap += map.swap;
+    total->swap_pss += map.swap_pss;
+    total->count += map.count;
+}
+
+static void AppendHeader(std::string* out) {
+    out->append(" virtual                     shared   shared  private  private\n");
+    out->append("    size      RSS      PSS    clean    dirty    clean    dirty     swap  swapPSS"
+                "   # object\n");
+}
+
+static void AppendDivider(std::string* out) {
+    out->append("-------- -------- -------- -------- -------- -------- -------- -------- -------- "
+                "---- ------------------------------\n");
+}
+
+static void AppendMapInfo(const MapInfo& map, std::string* out) {
+    StringAppendF(out,
+                  "%8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+                  " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %4d ",
+                  map.size, map.rss, map.pss, map.shared_clean, map.shared_dirty,
+                  map.private_clean, map.private_dirty, map.swap, map.swap_pss, map.count);
+}
+
+struct ShowMapJob {
+    int pid;
+    std::string name;
+    // Child reading the smaps of `pid`, and the pipe it writes the table to.
+    pid_t reader = -1;
+    android::base::unique_fd pipe;
+    uint64_t deadline_ns = 0;
+    std::string output;
+    bool done = false;
+};
+
+// Writes the showmap table of `pid` to `fd`.
+static void WriteShowMap(int pid, int fd) {
+    std::string smaps;
+    // Like `showmap -q`, processes whose maps can't be read (e.g. kernel threads) show nothing.
+    if (!android::base::ReadFileToString(android::base::StringPrintf("/proc/%d/smaps", pid),
+                                         &smaps)) {
+        return;
+    }
+    std::vector<MapInfo> maps = ParseSmaps(smaps);
+    if (!maps.empty()) {
+        std::string output;
+        FormatShowMap(maps, &output);
+        android::base::WriteStringToFd(output, fd);
+    }
+}
+
+// Forks a child that writes the showmap table of job->pid to a new pipe.
+static bool StartReader(ShowMapJob* job, int64_t timeout_ms) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        return false;
+    }
+    android::base::unique_fd read_end(fds[0]);
+    android::base::unique_fd write_end(fds[1]);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        return false;
+    }
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        WriteShowMap(job->pid, write_end.get());
+        _exit(EXIT_SUCCESS);
+    }
+    job->reader = pid;
+    job->pipe = std::move(read_end);
+    job->deadline_ns = Nanotime() + timeout_ms * 1000000;
+    return true;
+}
+
+// Reads what is available from the reader of `job`, and reaps it once it is done.
+static void ReadFromReader(ShowMapJob* job) {
+    char buffer[4096];
+    ssize_t n = TEMP_FAILURE_RETRY(read(job->pipe.get(), buffer, sizeof(buffer)));
+    if (n > 0) {
+        job->output.append(buffer, n);
+        return;
+    }
+    job->pipe.reset();
+    TEMP_FAILURE_RETRY(waitpid(job->reader, nullptr, 0));
+    job->done = true;
+}
+
+}  // unnamed namespace
+
+std::vector<MapInfo> ParseSmaps(const std::string& smaps) {
+    std::map<std::string, MapInfo> by_name;
+    MapInfo current;
+    MapInfo prev;
+    uint64_t current_end = 0;
+    uint64_t prev_end = 0;
+    bool has_current = false;
+    bool has_prev = false;
+
+    auto flush = [&]() {
+        if (!has_current) {
+            return;
+        }
+        auto it = by_name.find(current.name);
+        if (it == by_name.end()) {
+            by_name.emplace(current.name, current);
+        } else {
+            AddTo(current, &it->second);
+        }
+        prev = current;
+        prev_end = current_end;
+        has_prev = true;
+    };
+
+    const char* p = smaps.data();
+    const char* end = p + smaps.size();
+    while (p < end) {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (eol == nullptr) {
+            eol = end;
+        }
+        if (eol > p && !(has_current && ParseField(p, eol, &current))) {
+            MapInfo map;
+            uint64_t map_end;
+            if (ParseHeader(p, eol, has_prev ? &prev : nullptr, prev_end, &map, &map_end)) {
+                flush();
+                current = std::move(map);
+                current_end = map_end;
+                has_current = true;
+            }
+        }
+        p = eol + 1;
+    }
+    flush();
+
+    std::vector<MapInfo> maps;
+    maps.reserve(by_name.size());
+    for (auto& it : by_name) {
+        maps.push_back(std::move(it.second));
+    }
+    return maps;
+}
+
+void FormatShowMap(const std::vector<MapInfo>& maps, std::string* out) {
+    MapInfo total;
+    AppendHeader(out);
+    AppendDivider(out);
+    for (const MapInfo& map : maps) {
+        AddTo(map, &total);
+        AppendMapInfo(map, out);
+        out->append(map.name);
+        out->append(map.is_bss ? " [bss]\n" : "\n");
+    }
+    AppendDivider(out);
+    AppendHeader(out);
+    AppendDivider(out);
+    AppendMapInfo(total, out);
+    out->append("TOTAL\n");
+}
+
+void DumpShowMaps(const ProcSnapshot& snapshot, int fd, size_t max_readers, int64_t timeout_ms) {
+    std::vector<ShowMapJob> jobs;
+    for (const ProcSnapshot::Process& process : snapshot.processes()) {
+        ShowMapJob job;
+        job.pid = process.pid;
+        job.name = process.name;
+        jobs.push_back(std::move(job));
+    }
+
+    size_t next_start = 0;
+    size_t next_print = 0;
+    size_t running = 0;
+    while (next_print < jobs.size()) {
+        while (running < max_readers && next_start < jobs.size()) {
+            ShowMapJob& job = jobs[next_start++];
+            if (StartReader(&job, timeout_ms)) {
+                running++;
+            } else {
+                job.output = StringPrintf("*** could not read /proc/%d/smaps: %s\n", job.pid,
+                                          strerror(errno));
+                job.done = true;
+            }
+        }
+
+        // The tables are written in pid order, whatever the order in which the readers finish.
+        for (; next_print < jobs.size() && jobs[next_print].done; next_print++) {
+            ShowMapJob& job = jobs[next_print];
+            std::string output = StringPrintf("------ SHOW MAP %d (%s) (showmap -q %d) ------\n",
+                                              job.pid, job.name.c_str(), job.pid);
+            output.append(job.output);
+            android::base::WriteStringToFd(output, fd);
+            job.output.clear();
+        }
+        if (running == 0) {
+            continue;
+        }
+
+        std::vector<pollfd> fds;
+        std::vector<ShowMapJob*> polled;
+        uint64_t now = Nanotime();
+        uint64_t wait_ns = UINT64_MAX;
+        for (size_t i = next_print; i < next_start; i++) {
+            ShowMapJob& job = jobs[i];
+            if (job.done) {
+                continue;
+            }
+            fds.push_back({job.pipe.get(), POLLIN, 0});
+            polled.push_back(&job);
+            wait_ns = std::min(wait_ns, job.deadline_ns > now ? job.deadline_ns - now : 0);
+        }
+        int timeout = static_cast<int>(std::min<uint64_t>(wait_ns / 1000000 + 1, INT_MAX));
+        TEMP_FAILURE_RETRY(poll(fds.data(), fds.size(), timeout));
+
+        now = Nanotime();
+        for (size_t i = 0; i < fds.size(); i++) {
+            ShowMapJob* job = polled[i];
+            if (fds[i].revents != 0) {
+                ReadFromReader(job);
+            }
+            if (!job->done && now >= job->deadline_ns) {
+                // The reader is stuck reading this process; leave it behind. It is killed, and
+                // reaped once it gets out of the kernel, or by init after we exit.
+                kill(job->reader, SIGKILL);
+                waitpid(job->reader, nullptr, WNOHANG);
+                job->pipe.reset();
+                job->output = StringPrintf("*** reading /proc/%d/smaps timed out after %.3fs\n",
+                                           job->pid, timeout_ms / 1000.0f);
+                job->done = true;
+            }
+            if (job->done) {
+                running--;
+            }
+        }
+    }
+}
+
+int CollectShowMaps(int fd) {
+    ProcSnapshot snapshot;
+    if (!snapshot.Capture()) {
+        dprintf(fd, "*** Failed to list processes: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    DumpShowMaps(snapshot, fd, kMaxConcurrentShowMaps, kShowMapTimeoutMs);
+    return EXIT_SUCCESS;
+}
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_OS_DUMPSTATE_SHOW_MAP_H_
+#define ANDROID_OS_DUMPSTATE_SHOW_MAP_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ProcSnapshot.h"
+
+namespace android {
+namespace os {
+namespace dumpstate {
+
+/*
+ * Memory usage of all the mappings of a process sharing the same name, in kB.
+ */
+struct MapInfo {
+    std::string name;
+    /* Whether the first mapping was the anonymous BSS segment of the library `name`. */
+    bool is_bss = false;
+    uint64_t size = 0;
+    uint64_t rss = 0;
+    uint64_t pss = 0;
+    uint64_t shared_clean = 0;
+    uint64_t shared_dirty = 0;
+    uint64_t private_clean = 0;
+    uint64_t private_dirty = 0;
+    uint64_t swap = 0;
+    uint64_t swap_pss = 0;
+    /* Number of mappings coalesced into this entry. */
+    int count = 0;
+};
+
+/*
+ * Parses the contents of /proc/<pid>/smaps into one entry per mapping name, sorted by name, the
+ * same way `showmap` does by default.
+ */
+std::vector<MapInfo> ParseSmaps(const std::string& smaps);
+
+/*
+ * Appends `maps` to `out` formatted like the output of `showmap -q`.
+ */
+void FormatShowMap(const std::vector<MapInfo>& maps, std::string* out);
+
+/*
+ * Writes the showmap table of every process of `snapshot` to `fd` in pid order, reading up to
+ * `max_readers` processes at once. Processes whose smaps can't be read within `timeout_ms` are
+ * reported and skipped.
+ *
+ * Each process is read by a child forked for it, so that a process stuck in the kernel can be
+ * left behind. No thread is started, so this can run in a child forked from the multithreaded
+ * dumpstate without exec'ing anything.
+ */
+void DumpShowMaps(const ProcSnapshot& snapshot, int fd, size_t max_readers, int64_t timeout_ms);
+
+/*
+ * Writes the showmap tables of all processes to `fd` and returns the exit status. Meant to run in
+ * a child forked by dumpstate while it is still root.
+ */
+int CollectShowMaps(int fd);
+
+}  // namespace dumpstate
+}  // namespace os
+}  // namespace android
+
+#endif  // ANDROID_OS_DUMPSTATE_SHOW_MAP_H_
@@ -22,26 +22,37 @@
 #include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
+#include <linux/magic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/poll.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <fstream>
 #include <functional>
 #include <future>
 #include <memory>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -58,6 +69,7 @@
 #include <binder/IServiceManager.h>
 #include <cutils/native_handle.h>
 #include <cutils/properties.h>
+#include <cutils/sockets.h>
 #include <debuggerd/client.h>
 #include <dumpsys.h>
 #include <dumputils/dump_utils.h>
@@ -67,9 +79,12 @@
 #include <private/android_logger.h>
 #include <serviceutils/PriorityDumper.h>
 #include <utils/StrongPointer.h>
+#include "ChildSupervisor.h"
 #include "DumpstateInternal.h"
 #include "DumpstateSectionReporter.h"
 #include "DumpstateService.h"
+#include "LogCollector.h"
+#include "ShowMap.h"
 #include "dumpstate.h"
 
 using ::android::hardware::dumpstate::V1_0::IDumpstateDevice;
@@ -91,11 +106,17 @@ using android::UNKNOWN_ERROR;
 using android::Vector;
 using android::base::StringPrintf;
 using android::os::IDumpstateListener;
+using android::os::dumpstate::ChildSupervisor;
 using android::os::dumpstate::CommandOptions;
 using android::os::dumpstate::DumpFileToFd;
 using android::os::dumpstate::DumpstateSectionReporter;
+using android::os::dumpstate::FailureStreak;
 using android::os::dumpstate::GetPidByName;
+using android::os::dumpstate::LogCollector;
+using android::os::dumpstate::ProcSnapshot;
 using android::os::dumpstate::PropertiesHelper;
+using android::os::dumpstate::SectionHistory;
+using android::os::dumpstate::SectionReport;
 
 typedef Dumpstate::ConsentCallback::ConsentResult UserConsentResult;
 
@@ -165,11 +186,49 @@ static int OpenForRead(std::string path) {
     return Open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
 }
 
+static constexpr size_t kCopyChunkSize = 1 << 20;
+
+// Lets the kernel move the data from in_fd, when it supports doing so for this pair of files.
+// Returns 1 when done, 0 when the caller should fall back to read()/write() from the current
+// offset, and -1 on errors.
+static int KernelCopyFile(int in_fd, int out_fd) {
+    // copy_file_range() only works between regular files, but may then share extents instead of
+    // copying; sendfile() works from a regular file to anything, including the caller's socket.
+    bool use_copy_file_range = true;
+    while (true) {
+        ssize_t byte_count;
+        if (use_copy_file_range) {
+            byte_count = TEMP_FAILURE_RETRY(syscall(__NR_copy_file_range, in_fd, nullptr, out_fd,
+                                                    nullptr, kCopyChunkSize, 0));
+        } else {
+            byte_count = TEMP_FAILURE_RETRY(sendfile(out_fd, in_fd, nullptr, kCopyChunkSize));
+        }
+        if (byte_count > 0) {
+            continue;
+        }
+        if (byte_count == 0) {
+            return 1;
+        }
+        if (errno != EINVAL && errno != ENOSYS && errno != EXDEV && errno != EBADF &&
+            errno != EOPNOTSUPP) {
+            return -1;
+        }
+        if (!use_copy_file_range) {
+            return 0;
+        }
+        use_copy_file_range = false;
+    }
+}
+
 bool CopyFile(int in_fd, int out_fd) {
-    char buf[4096];
+    int ret = KernelCopyFile(in_fd, out_fd);
+    if (ret != 0) {
+        return ret == 1;
+    }
+    std::vector<char> buf(65536);
     ssize_t byte_count;
-    while ((byte_count = TEMP_FAILURE_RETRY(read(in_fd, buf, sizeof(buf)))) > 0) {
-        if (!android::base::WriteFully(out_fd, buf, byte_count)) {
+    while ((byte_count = TEMP_FAILURE_RETRY(read(in_fd, buf.data(), buf.size()))) > 0) {
+        if (!android::base::WriteFully(out_fd, buf.data(), byte_count)) {
             return false;
         }
     }
@@ -251,6 +310,7 @@ static int DumpFile(const std::string& title, const std::string& path) {
 // Relative directory (inside the zip) for all files copied as-is into the bugreport.
 static const std::string ZIP_ROOT_DIR = "FS";
 
+static constexpr int kMainEntryPipeSize = 1 << 20;
 static const std::string kProtoPath = "proto/";
 static const std::string kProtoExt = ".proto";
 static const std::string kDumpstateBoardFiles[] = {
@@ -523,6 +583,46 @@ static bool dump_anrd_trace() {
     return false;
 }
 
+// Adds the snapshot of `atrace --flight_recorder`, if it's running, so the bugreport has the trace
+// of what happened right before it was taken.
+static void DumpFlightRecorderTrace() {
+    static const char* kSocketName = "atrace_flight_recorder";
+    if (!ds.IsZipping() || PropertiesHelper::IsDryRun()) {
+        return;
+    }
+    android::base::unique_fd fd(
+        socket_local_client(kSocketName, ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM));
+    if (fd == -1) {
+        MYLOGD("atrace flight recorder is not running\n");
+        return;
+    }
+    // Any app can bind an abstract socket, so only a recorder run by root or shell (atrace runs as
+    // either of them) is trusted with a section of the bugreport.
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd.get(), SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+        MYLOGE("Can't get the credentials of %s: %s\n", kSocketName, strerror(errno));
+        return;
+    }
+    if (cred.uid != AID_ROOT && cred.uid != AID_SHELL) {
+        MYLOGE("Ignoring %s of uid %d, pid %d\n", kSocketName, cred.uid, cred.pid);
+        return;
+    }
+    DurationReporter duration_reporter("ATRACE FLIGHT RECORDER", true);
+    if (!android::base::WriteStringToFd("snapshot\n", fd.get()) || shutdown(fd.get(), SHUT_WR)) {
+        int err = errno;
+        MYLOGE("Can't request a trace snapshot: %s\n", strerror(err));
+        duration_reporter.SetStatus(-err);
+        return;
+    }
+    // The snapshot is gzip data, which is stored in the zip file as is.
+    status_t status = ds.AddZipEntryFromFd("atrace_flight_recorder.trace.gz", fd.get(), 10s);
+    if (status != OK) {
+        MYLOGE("Can't add the trace snapshot: %d\n", status);
+    }
+    duration_reporter.SetStatus(status, status == TIMED_OUT);
+}
+
 static bool skip_not_stat(const char *path) {
     static const char stat[] = "/stat";
     size_t len = strlen(path);
@@ -793,6 +893,59 @@ static const std::set<std::string> PROBLEMATIC_FILE_EXTENSIONS = {
       ".shb", ".sys", ".vb",  ".vbe", ".vbs", ".vxd", ".wsc", ".wsf", ".wsh"
 };
 
+// Reads fd until EOF, or until max_bytes were read if it is not negative, passing the data to
+// write_bytes. When timeout is non-zero, gives up if the data doesn't arrive in time.
+static status_t ReadFromFd(const std::string& entry_name, int fd, std::chrono::milliseconds timeout,
+                           const std::function<status_t(const uint8_t*, size_t)>& write_bytes,
+                           int64_t max_bytes = -1) {
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + timeout;
+    struct pollfd pfd = {fd, POLLIN};
+
+    std::vector<uint8_t> buffer(65536);
+    while (max_bytes != 0) {
+        if (timeout.count() > 0) {
+            // lambda to recalculate the timeout.
+            auto time_left_ms = [end]() {
+                auto now = std::chrono::steady_clock::now();
+                auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - now);
+                return std::max(diff.count(), 0LL);
+            };
+
+            int rc = TEMP_FAILURE_RETRY(poll(&pfd, 1, time_left_ms()));
+            if (rc < 0) {
+                MYLOGE("Error in poll while adding from fd to zip entry %s:%s\n",
+                       entry_name.c_str(), strerror(errno));
+                return -errno;
+            } else if (rc == 0) {
+                MYLOGE("Timed out adding from fd to zip entry %s:%s Timeout:%lldms\n",
+                       entry_name.c_str(), strerror(errno), timeout.count());
+                return TIMED_OUT;
+            }
+        }
+
+        size_t to_read = buffer.size();
+        if (max_bytes > 0) {
+            to_read = std::min(to_read, static_cast<size_t>(max_bytes));
+        }
+        ssize_t bytes_read = TEMP_FAILURE_RETRY(read(fd, buffer.data(), to_read));
+        if (bytes_read == 0) {
+            break;
+        } else if (bytes_read == -1) {
+            MYLOGE("read(%s): %s\n", entry_name.c_str(), strerror(errno));
+            return -errno;
+        }
+        if (max_bytes > 0) {
+            max_bytes -= bytes_read;
+        }
+        status_t status = write_bytes(buffer.data(), bytes_read);
+        if (status != OK) {
+            return status;
+        }
+    }
+    return OK;
+}
+
 status_t Dumpstate::AddZipEntryFromFd(const std::string& entry_name, int fd,
                                       std::chrono::milliseconds timeout = 0ms) {
     if (!IsZipping()) {
@@ -813,18 +966,63 @@ status_t Dumpstate::AddZipEntryFromFd(const std::string& entry_name, int fd,
         }
     }
 
+    if (IsStreamingMainEntry()) {
+        return DeferZipEntryFromFd(valid_name, fd, timeout);
+    }
+    return WriteZipEntryFromFd(valid_name, fd, get_mtime(fd, ds.now_), timeout);
+}
+
+bool IsCompressedData(const uint8_t* data, size_t len) {
+    static const std::vector<std::string> kMagics = {
+        std::string("\x1f\x8b", 2),          // gzip
+        std::string("PK\x03\x04", 4),        // zip, apk, jar
+        std::string("\x89PNG", 4),           // png
+        std::string("\xff\xd8\xff", 3),      // jpeg
+        std::string("\xfd" "7zXZ", 5),       // xz
+        std::string("\x28\xb5\x2f\xfd", 4),  // zstd
+        std::string("\x04\x22\x4d\x18", 4),  // lz4
+        std::string("BZh", 3),               // bzip2
+    };
+    for (const std::string& magic : kMagics) {
+        if (len >= magic.size() && memcmp(data, magic.data(), magic.size()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t ThreadCpuNanotime() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * NANOS_PER_SEC + ts.tv_nsec;
+}
+
+status_t Dumpstate::WriteZipEntryFromFd(const std::string& entry_name, int fd, time_t mtime,
+                                        std::chrono::milliseconds timeout, int64_t max_bytes) {
+    last_deferred_zip_entry_size_ = -1;
+    uint64_t start_ns = Nanotime();
+    uint64_t start_cpu_ns = ThreadCpuNanotime();
+
     // Logging statement  below is useful to time how long each entry takes, but it's too verbose.
     // MYLOGD("Adding zip entry %s\n", entry_name.c_str());
-    int32_t err = zip_writer_->StartEntryWithTime(valid_name.c_str(), ZipWriter::kCompress,
-                                                  get_mtime(fd, ds.now_));
-    if (err != 0) {
-        MYLOGE("zip_writer_->StartEntryWithTime(%s): %s\n", valid_name.c_str(),
-               ZipWriter::ErrorCodeString(err));
-        return UNKNOWN_ERROR;
-    }
+    bool started_entry = false;
     bool finished_entry = false;
-    auto finish_entry = [this, &finished_entry] {
-        if (!finished_entry) {
+    // The entry is started once the first bytes tell whether the data is already compressed, in
+    // which case deflating it again would only burn CPU.
+    auto start_entry = [this, &entry_name, mtime, &started_entry](const uint8_t* data,
+                                                                   size_t len) -> status_t {
+        size_t flags = IsCompressedData(data, len) ? 0 : ZipWriter::kCompress;
+        int32_t err = zip_writer_->StartEntryWithTime(entry_name.c_str(), flags, mtime);
+        if (err != 0) {
+            MYLOGE("zip_writer_->StartEntryWithTime(%s): %s\n", entry_name.c_str(),
+                   ZipWriter::ErrorCodeString(err));
+            return UNKNOWN_ERROR;
+        }
+        started_entry = true;
+        return OK;
+    };
+    auto finish_entry = [this, &started_entry, &finished_entry] {
+        if (started_entry && !finished_entry) {
             // This should only be called when we're going to return an earlier error,
             // which would've been logged. This may imply the file is already corrupt
             // and any further logging from FinishEntry is more likely to mislead than
@@ -833,54 +1031,155 @@ status_t Dumpstate::AddZipEntryFromFd(const std::string& entry_name, int fd,
         }
     };
     auto scope_guard = android::base::make_scope_guard(finish_entry);
-    auto start = std::chrono::steady_clock::now();
-    auto end = start + timeout;
-    struct pollfd pfd = {fd, POLLIN};
-
-    std::vector<uint8_t> buffer(65536);
-    while (1) {
-        if (timeout.count() > 0) {
-            // lambda to recalculate the timeout.
-            auto time_left_ms = [end]() {
-                auto now = std::chrono::steady_clock::now();
-                auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - now);
-                return std::max(diff.count(), 0LL);
-            };
 
-            int rc = TEMP_FAILURE_RETRY(poll(&pfd, 1, time_left_ms()));
-            if (rc < 0) {
-                MYLOGE("Error in poll while adding from fd to zip entry %s:%s\n",
-                       entry_name.c_str(), strerror(errno));
-                return -errno;
-            } else if (rc == 0) {
-                MYLOGE("Timed out adding from fd to zip entry %s:%s Timeout:%lldms\n",
-                       entry_name.c_str(), strerror(errno), timeout.count());
-                return TIMED_OUT;
+    status_t status = ReadFromFd(entry_name, fd, timeout,
+                                 [this, &start_entry, &started_entry](const uint8_t* data,
+                                                                      size_t len) -> status_t {
+        if (!started_entry) {
+            status_t status = start_entry(data, len);
+            if (status != OK) {
+                return status;
             }
         }
-
-        ssize_t bytes_read = TEMP_FAILURE_RETRY(read(fd, buffer.data(), buffer.size()));
-        if (bytes_read == 0) {
-            break;
-        } else if (bytes_read == -1) {
-            MYLOGE("read(%s): %s\n", entry_name.c_str(), strerror(errno));
-            return -errno;
-        }
-        err = zip_writer_->WriteBytes(buffer.data(), bytes_read);
+        int32_t err = zip_writer_->WriteBytes(data, len);
         if (err) {
             MYLOGE("zip_writer_->WriteBytes(): %s\n", ZipWriter::ErrorCodeString(err));
             return UNKNOWN_ERROR;
         }
+        return OK;
+    }, max_bytes);
+    if (!started_entry && (status == OK || status == TIMED_OUT)) {
+        // Empty (so far); still add the entry.
+        if (start_entry(nullptr, 0) != OK) {
+            return UNKNOWN_ERROR;
+        }
+    }
+    if (status != OK && status != TIMED_OUT) {
+        return status;
     }
 
-    err = zip_writer_->FinishEntry();
+    // Entries that timed out keep what was read so far.
+    int32_t err = zip_writer_->FinishEntry();
     finished_entry = true;
     if (err != 0) {
         MYLOGE("zip_writer_->FinishEntry(): %s\n", ZipWriter::ErrorCodeString(err));
         return UNKNOWN_ERROR;
     }
+    RecordZipEntryStats(entry_name, start_ns, ThreadCpuNanotime() - start_cpu_ns, status);
 
-    return OK;
+    return status;
+}
+
+void Dumpstate::RecordZipEntryStats(const std::string& entry_name, uint64_t start_ns,
+                                    uint64_t cpu_ns, status_t status) {
+    ZipWriter::FileEntry file_entry;
+    if (zip_writer_->GetLastEntry(&file_entry) != 0) {
+        return;
+    }
+    ZipEntryStats stats;
+    stats.name = entry_name;
+    stats.compressed = file_entry.compression_method != 0;
+    stats.uncompressed_size = file_entry.uncompressed_size;
+    stats.compressed_size = file_entry.compressed_size;
+    stats.cpu_ns = cpu_ns;
+
+    if (section_report_ != nullptr) {
+        SectionReport::Section section;
+        section.title = entry_name;
+        section.kind = SectionReport::ZIP_ENTRY;
+        section.start_ns = start_ns;
+        section.duration_ns = Nanotime() - start_ns;
+        section.cpu_ns = cpu_ns;
+        section.bytes = stats.uncompressed_size;
+        section.status = status;
+        section.timed_out = status == TIMED_OUT;
+        section_report_->Add(std::move(section));
+    }
+    zip_entry_stats_.push_back(std::move(stats));
+}
+
+void Dumpstate::PrintZipEntryStats() const {
+    static constexpr size_t kMaxEntries = 20;
+    uint64_t uncompressed_size = 0;
+    uint64_t compressed_size = 0;
+    uint64_t cpu_ns = 0;
+    size_t stored = 0;
+    for (const ZipEntryStats& stats : zip_entry_stats_) {
+        uncompressed_size += stats.uncompressed_size;
+        compressed_size += stats.compressed_size;
+        cpu_ns += stats.cpu_ns;
+        stored += stats.compressed ? 0 : 1;
+    }
+    fprintf(stderr,
+            "Zipped %zu entries (%zu stored): %" PRIu64 " bytes into %" PRIu64
+            " bytes, using %.3fs of CPU\n",
+            zip_entry_stats_.size(), stored, uncompressed_size, compressed_size,
+            (float)cpu_ns / NANOS_PER_SEC);
+
+    std::vector<const ZipEntryStats*> entries;
+    for (const ZipEntryStats& stats : zip_entry_stats_) {
+        entries.push_back(&stats);
+    }
+    size_t count = std::min(kMaxEntries, entries.size());
+    std::partial_sort(entries.begin(), entries.begin() + count, entries.end(),
+                      [](const ZipEntryStats* a, const ZipEntryStats* b) {
+                          return a->cpu_ns > b->cpu_ns;
+                      });
+    fprintf(stderr, "Most expensive entries:\n");
+    for (size_t i = 0; i < count; i++) {
+        const ZipEntryStats& stats = *entries[i];
+        fprintf(stderr, "  %8.3fs %12" PRIu64 " -> %12" PRIu64 " %s %s\n",
+                (float)stats.cpu_ns / NANOS_PER_SEC, stats.uncompressed_size,
+                stats.compressed_size, stats.compressed ? "deflated" : "stored  ",
+                stats.name.c_str());
+    }
+}
+
+status_t Dumpstate::DeferZipEntryFromFd(const std::string& entry_name, int fd,
+                                        std::chrono::milliseconds timeout) {
+    DeferredZipEntry entry;
+    entry.name = entry_name;
+    entry.mtime = get_mtime(fd, now_);
+
+    // Regular files stay put, so they're only read once the main entry is done. The contents of
+    // pipes, and of /proc and /sys files (which depend on when they're read), are copied now, and
+    // so are the files past max_deferred_zip_entry_fds_, so that AddDir() doesn't run out of fds.
+    struct stat st;
+    struct statfs sfs;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && fstatfs(fd, &sfs) == 0 &&
+        sfs.f_type != PROC_SUPER_MAGIC && sfs.f_type != SYSFS_MAGIC) {
+        std::lock_guard<std::mutex> guard(zip_entries_lock_);
+        if (deferred_zip_entry_fds_ < max_deferred_zip_entry_fds_) {
+            entry.offset = lseek(fd, 0, SEEK_CUR);
+            entry.fd.reset(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+            if (entry.fd.get() != -1) {
+                deferred_zip_entry_fds_++;
+            }
+        }
+    }
+
+    status_t status = OK;
+    if (entry.fd.get() == -1) {
+        // No lock is held while reading, since the data may take up to `timeout` to arrive. Like
+        // when writing directly to the zip file, a timeout keeps what was read so far.
+        std::string& content = entry.content;
+        status = ReadFromFd(entry_name, fd, timeout, [&content](const uint8_t* data, size_t len) {
+            content.append(reinterpret_cast<const char*>(data), len);
+            return OK;
+        });
+        if (status != OK && status != TIMED_OUT) {
+            MYLOGE("Could not defer zip entry %s; it is left out of the bugreport\n",
+                   entry_name.c_str());
+            return status;
+        }
+        last_deferred_zip_entry_size_ = entry.content.size();
+    } else {
+        last_deferred_zip_entry_size_ = st.st_size - entry.offset;
+    }
+
+    std::lock_guard<std::mutex> guard(zip_entries_lock_);
+    deferred_zip_entries_.push_back(std::move(entry));
+    return status;
 }
 
 bool Dumpstate::AddZipEntry(const std::string& entry_name, const std::string& entry_path) {
@@ -915,8 +1214,30 @@ bool Dumpstate::AddTextZipEntry(const std::string& entry_name, const std::string
                entry_name.c_str());
         return false;
     }
+    if (IsStreamingMainEntry()) {
+        DeferredZipEntry entry;
+        entry.name = entry_name;
+        entry.mtime = now_;
+        entry.content = content;
+        last_deferred_zip_entry_size_ = content.size();
+        std::lock_guard<std::mutex> guard(zip_entries_lock_);
+        deferred_zip_entries_.push_back(std::move(entry));
+        return true;
+    }
     MYLOGD("Adding zip text entry %s\n", entry_name.c_str());
-    int32_t err = zip_writer_->StartEntryWithTime(entry_name.c_str(), ZipWriter::kCompress, ds.now_);
+    return WriteZipEntryFromContent(entry_name, content, now_);
+}
+
+bool Dumpstate::WriteZipEntryFromContent(const std::string& entry_name,
+                                         const std::string& content, time_t mtime) {
+    last_deferred_zip_entry_size_ = -1;
+    uint64_t start_ns = Nanotime();
+    uint64_t start_cpu_ns = ThreadCpuNanotime();
+    size_t flags =
+        IsCompressedData(reinterpret_cast<const uint8_t*>(content.data()), content.size())
+            ? 0
+            : ZipWriter::kCompress;
+    int32_t err = zip_writer_->StartEntryWithTime(entry_name.c_str(), flags, mtime);
     if (err != 0) {
         MYLOGE("zip_writer_->StartEntryWithTime(%s): %s\n", entry_name.c_str(),
                ZipWriter::ErrorCodeString(err));
@@ -935,10 +1256,283 @@ bool Dumpstate::AddTextZipEntry(const std::string& entry_name, const std::string
         MYLOGE("zip_writer_->FinishEntry(): %s\n", ZipWriter::ErrorCodeString(err));
         return false;
     }
+    RecordZipEntryStats(entry_name, start_ns, ThreadCpuNanotime() - start_cpu_ns, OK);
 
     return true;
 }
 
+// The read end of the pipe stdout is redirected to while the main entry is streamed, and the
+// outcome of streaming it. Shared with the thread compressing the entry.
+struct Dumpstate::MainEntryStream {
+    std::string name;
+    android::base::unique_fd read_fd;
+    // Written to once nothing else is expected on stdout.
+    android::base::unique_fd stop_fd;
+    // tmp_path_, which gets a copy of the text. Reset if it can't be written to.
+    android::base::unique_fd text_fd;
+    // Number of entries in the zip file before the main entry.
+    size_t entries_before = 0;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool done = false;
+    bool ok = false;
+    // Whether tmp_path_ holds all of the text.
+    bool text_ok = false;
+    uint64_t start_ns = 0;
+    // CPU time spent compressing the entry.
+    uint64_t cpu_ns = 0;
+    // Bytes read from stdout so far.
+    std::atomic<uint64_t> bytes{0};
+};
+
+// Compresses the data coming from stdout into the main entry. Runs until the pipe is closed, or
+// until it's drained after being told to stop (children that outlived their timeout may still
+// have stdout open).
+void Dumpstate::StreamMainEntry(std::shared_ptr<MainEntryStream> stream, ZipWriter* zip_writer,
+                                time_t mtime) {
+    uint64_t start_cpu_ns = ThreadCpuNanotime();
+    int32_t err = zip_writer->StartEntryWithTime(stream->name.c_str(), ZipWriter::kCompress, mtime);
+    const bool started = err == 0;
+    if (!started) {
+        // Keep draining the pipe anyway, otherwise whatever writes to stdout would block.
+        MYLOGE("zip_writer_->StartEntryWithTime(%s): %s\n", stream->name.c_str(),
+               ZipWriter::ErrorCodeString(err));
+    }
+    bool ok = started;
+
+    struct pollfd pfds[] = {{stream->read_fd.get(), POLLIN}, {stream->stop_fd.get(), POLLIN}};
+    bool stopping = false;
+    std::vector<uint8_t> buffer(65536);
+    while (true) {
+        if (!stopping) {
+            if (TEMP_FAILURE_RETRY(poll(pfds, arraysize(pfds), -1)) == -1) {
+                MYLOGE("Error in poll while streaming zip entry %s: %s\n", stream->name.c_str(),
+                       strerror(errno));
+                ok = false;
+                break;
+            }
+            stopping = pfds[1].revents != 0;
+        }
+        ssize_t bytes_read =
+            TEMP_FAILURE_RETRY(read(stream->read_fd.get(), buffer.data(), buffer.size()));
+        if (bytes_read == 0 || (bytes_read == -1 && errno == EAGAIN && stopping)) {
+            break;
+        } else if (bytes_read == -1) {
+            if (errno == EAGAIN) {
+                continue;
+            }
+            MYLOGE("read(%s): %s\n", stream->name.c_str(), strerror(errno));
+            ok = false;
+            break;
+        }
+        stream->bytes += bytes_read;
+        if (stream->text_fd.get() != -1 &&
+            !android::base::WriteFully(stream->text_fd.get(), buffer.data(), bytes_read)) {
+            MYLOGE("write(%s): %s\n", stream->name.c_str(), strerror(errno));
+            stream->text_fd.reset();
+        }
+        if (ok) {
+            err = zip_writer->WriteBytes(buffer.data(), bytes_read);
+            if (err != 0) {
+                MYLOGE("zip_writer_->WriteBytes(): %s\n", ZipWriter::ErrorCodeString(err));
+                ok = false;
+            }
+        }
+    }
+
+    if (started) {
+        err = zip_writer->FinishEntry();
+        if (err != 0) {
+            MYLOGE("zip_writer_->FinishEntry(): %s\n", ZipWriter::ErrorCodeString(err));
+            ok = false;
+        }
+    }
+    // Anything still trying to write to stdout gets EPIPE from now on.
+    stream->read_fd.reset();
+    bool text_ok = stream->text_fd.get() != -1;
+    stream->text_fd.reset();
+
+    std::lock_guard<std::mutex> guard(stream->lock);
+    stream->done = true;
+    stream->ok = ok;
+    stream->text_ok = text_ok;
+    stream->cpu_ns = ThreadCpuNanotime() - start_cpu_ns;
+    stream->cv.notify_all();
+}
+
+bool Dumpstate::StartMainEntry() {
+    if (!IsZipping()) {
+        return false;
+    }
+    auto stream = std::make_shared<MainEntryStream>();
+    stream->name = base_name_ + "-" + name_ + ".txt";
+    stream->start_ns = Nanotime();
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+        MYLOGE("pipe2: %s\n", strerror(errno));
+        return false;
+    }
+    stream->read_fd.reset(fds[0]);
+    android::base::unique_fd write_fd(fds[1]);
+    // Writers (including child processes) must block rather than get EAGAIN.
+    fcntl(write_fd.get(), F_SETFL, fcntl(write_fd.get(), F_GETFL) & ~O_NONBLOCK);
+    // A larger pipe keeps commands from waiting on the compression.
+    fcntl(write_fd.get(), F_SETPIPE_SZ, kMainEntryPipeSize);
+
+    stream->stop_fd.reset(eventfd(0, EFD_CLOEXEC));
+    if (stream->stop_fd.get() == -1) {
+        MYLOGE("eventfd: %s\n", strerror(errno));
+        return false;
+    }
+
+    int text_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW;
+    stream->text_fd.reset(TEMP_FAILURE_RETRY(
+        open(tmp_path_.c_str(), text_flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)));
+    if (stream->text_fd.get() == -1) {
+        MYLOGE("open(%s): %s\n", tmp_path_.c_str(), strerror(errno));
+        return false;
+    }
+    if (fchown(stream->text_fd.get(), AID_SHELL, AID_SHELL)) {
+        MYLOGE("Unable to change ownership of temporary bugreport file %s: %s\n",
+               tmp_path_.c_str(), strerror(errno));
+    }
+
+    // Regular files added meanwhile are kept open until the main entry is finished, so use as
+    // many fds as allowed.
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+        if (rlim.rlim_cur < rlim.rlim_max) {
+            rlim.rlim_cur = rlim.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &rlim) == -1) {
+                getrlimit(RLIMIT_NOFILE, &rlim);
+            }
+        }
+        if (rlim.rlim_cur > kMinDeferredZipEntryFds + kReservedFds) {
+            max_deferred_zip_entry_fds_ = rlim.rlim_cur - kReservedFds;
+        }
+    }
+
+    fflush(stdout);
+    if (TEMP_FAILURE_RETRY(dup2(write_fd.get(), fileno(stdout))) == -1) {
+        MYLOGE("dup2: %s\n", strerror(errno));
+        return false;
+    }
+
+    MYLOGD("Streaming main entry (%s) into .zip bugreport\n", stream->name.c_str());
+    stream->entries_before = zip_entry_stats_.size();
+    {
+        std::lock_guard<std::mutex> guard(zip_entries_lock_);
+        streaming_main_entry_ = true;
+    }
+    main_entry_stream_ = stream;
+    // Detached, since StopMainEntry() waits for the outcome rather than for the thread.
+    std::thread(StreamMainEntry, stream, zip_writer_.get(), now_).detach();
+    return true;
+}
+
+bool Dumpstate::IsStreamingMainEntry() {
+    std::lock_guard<std::mutex> guard(zip_entries_lock_);
+    return streaming_main_entry_;
+}
+
+bool Dumpstate::StopMainEntry() {
+    std::shared_ptr<MainEntryStream> stream = main_entry_stream_;
+    // stdout must no longer point to the pipe, see RunInternal().
+    uint64_t one = 1;
+    TEMP_FAILURE_RETRY(write(stream->stop_fd.get(), &one, sizeof(one)));
+    {
+        std::unique_lock<std::mutex> lock(stream->lock);
+        stream->cv.wait(lock, [&stream]() { return stream->done; });
+    }
+    std::lock_guard<std::mutex> guard(zip_entries_lock_);
+    streaming_main_entry_ = false;
+    return stream->ok;
+}
+
+std::vector<Dumpstate::DeferredZipEntry> Dumpstate::TakeDeferredZipEntries() {
+    std::vector<DeferredZipEntry> entries;
+    std::lock_guard<std::mutex> guard(zip_entries_lock_);
+    entries.swap(deferred_zip_entries_);
+    deferred_zip_entry_fds_ = 0;
+    return entries;
+}
+
+void Dumpstate::AbandonMainEntry() {
+    if (main_entry_stream_ == nullptr || !IsStreamingMainEntry()) {
+        return;
+    }
+    MYLOGD("Abandoning main entry (%s)\n", main_entry_stream_->name.c_str());
+    StopMainEntry();
+    TakeDeferredZipEntries();
+}
+
+void Dumpstate::WriteDeferredZipEntries(std::vector<DeferredZipEntry> entries) {
+    MYLOGD("Adding %zu entries deferred while streaming the main entry\n", entries.size());
+    // Files are read ahead a few entries in advance, so that the disk isn't idle while an entry is
+    // being compressed. Copied entries have nothing to read.
+    auto read_ahead = [](const DeferredZipEntry& entry) {
+        if (entry.fd.get() != -1) {
+            posix_fadvise(entry.fd.get(), entry.offset, 0, POSIX_FADV_WILLNEED);
+        }
+    };
+    static constexpr size_t kReadAheadEntries = 4;
+    for (size_t i = 0; i < std::min(kReadAheadEntries, entries.size()); i++) {
+        read_ahead(entries[i]);
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        DeferredZipEntry& entry = entries[i];
+        if (i + kReadAheadEntries < entries.size()) {
+            read_ahead(entries[i + kReadAheadEntries]);
+        }
+        if (entry.fd.get() == -1) {
+            WriteZipEntryFromContent(entry.name, entry.content, entry.mtime);
+            continue;
+        }
+        if (lseek(entry.fd.get(), entry.offset, SEEK_SET) != entry.offset) {
+            MYLOGE("Unable to add %s to zip file, lseek failed: %s\n", entry.name.c_str(),
+                   strerror(errno));
+            continue;
+        }
+        WriteZipEntryFromFd(entry.name, entry.fd.get(), entry.mtime, 0ms);
+        // Closes the file right away, rather than once all entries are written.
+        entry.fd.reset();
+    }
+}
+
+// The name of an entry can't be changed once it's written, so the zip file is written again, from
+// the entries it had before the main entry (only version.txt) and the copy of the text.
+bool Dumpstate::RewriteZipFile(const std::string& entry_name) {
+    zip_writer_.reset();
+    if (fflush(zip_file.get()) != 0 || ftruncate(fileno(zip_file.get()), 0) == -1 ||
+        fseeko(zip_file.get(), 0, SEEK_SET) != 0) {
+        MYLOGE("Unable to truncate zip file %s: %s\n", path_.c_str(), strerror(errno));
+        return false;
+    }
+    zip_writer_.reset(new ZipWriter(zip_file.get()));
+    zip_entry_stats_.clear();
+    return AddTextZipEntry("version.txt", version_) && AddZipEntry(entry_name, tmp_path_);
+}
+
+uint64_t Dumpstate::GetOutputBytes() const {
+    if (main_entry_stream_ != nullptr) {
+        return main_entry_stream_->bytes;
+    }
+    off_t offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    return offset > 0 ? offset : 0;
+}
+
+int64_t Dumpstate::GetLastZipEntrySize() const {
+    if (last_deferred_zip_entry_size_ != -1) {
+        return last_deferred_zip_entry_size_;
+    }
+    ZipWriter::FileEntry file_entry;
+    if (zip_writer_ == nullptr || zip_writer_->GetLastEntry(&file_entry) != 0) {
+        return 0;
+    }
+    return file_entry.compressed_size;
+}
+
 static void DoKmsg() {
     struct stat st;
     if (!stat(PSTORE_LAST_KMSG, &st)) {
@@ -952,37 +1546,103 @@ static void DoKmsg() {
     }
 }
 
+// A logcat section, read by LogCollector.
+struct LogSection {
+    std::string title;
+    std::vector<std::string> buffers;
+    // Budget of the section; the newest lines are kept.
+    size_t max_bytes;
+};
+
+static constexpr size_t kSystemLogMaxBytes = 32 * 1024 * 1024;
+static constexpr size_t kLogMaxBytes = 8 * 1024 * 1024;
+
+// Only keep logs from the last given seconds; all of them if 0.
+static constexpr char PROPERTY_LOGCAT_WINDOW[] = "dumpstate.logcat.window_sec";
+
+static std::vector<std::string> LogcatCommand(const LogSection& section) {
+    std::vector<std::string> command = {"logcat"};
+    // The main, system and crash buffers are what logcat reads by default.
+    if (section.buffers != std::vector<std::string>{"main", "system", "crash"}) {
+        command.push_back("-b");
+        command.push_back(android::base::Join(section.buffers, ","));
+    }
+    command.insert(command.end(),
+                   {"-v", "threadtime", "-v", "printable", "-v", "uid", "-d", "*:v"});
+    return command;
+}
+
+/*
+ * Dumps the log sections, all read from logd at once and formatted in-process. Sections that can't
+ * be read that way are dumped by running logcat instead.
+ */
+static void DumpLogSections(const std::vector<LogSection>& sections) {
+    if (PropertiesHelper::IsDryRun()) {
+        for (const LogSection& section : sections) {
+            RunCommand(section.title, LogcatCommand(section),
+                       CommandOptions::WithTimeoutInMs(logcat_timeout(section.buffers)).Build());
+        }
+        return;
+    }
+
+    std::vector<LogCollector::Section> collector_sections;
+    for (const LogSection& section : sections) {
+        LogCollector::Section collector_section;
+        for (const std::string& buffer : section.buffers) {
+            collector_section.buffers.push_back(android_name_to_log_id(buffer.c_str()));
+        }
+        collector_section.max_bytes = section.max_bytes;
+        collector_sections.push_back(std::move(collector_section));
+    }
+    uint32_t window_sec = android::base::GetUintProperty<uint32_t>(PROPERTY_LOGCAT_WINDOW, 0);
+    LogCollector collector(collector_sections, window_sec);
+
+    for (size_t i = 0; i < sections.size(); i++) {
+        const LogSection& section = sections[i];
+        const std::vector<std::string> command = LogcatCommand(section);
+        const unsigned long timeout_ms = logcat_timeout(section.buffers);
+        LogCollector::Result result;
+        {
+            DurationReporter duration_reporter(section.title);
+            result = collector.Wait(i, std::chrono::milliseconds(timeout_ms));
+            if (result.ok || result.timed_out) {
+                printf("------ %s (%s) ------\n", section.title.c_str(),
+                       android::base::Join(command, " ").c_str());
+                if (result.dropped_lines > 0) {
+                    printf("*** %zu older lines (%zu bytes) dropped to stay within %zu bytes\n",
+                           result.dropped_lines, result.dropped_bytes, section.max_bytes);
+                }
+                android::base::WriteStringToFd(result.output, STDOUT_FILENO);
+            }
+            if (result.timed_out) {
+                printf("*** %s timed out after %.3fs\n", section.title.c_str(),
+                       timeout_ms / 1000.0f);
+                MYLOGE("*** %s timed out after %lums\n", section.title.c_str(), timeout_ms);
+                duration_reporter.SetStatus(-1, true);
+            }
+        }
+        if (result.ok || result.timed_out) {
+            ds.UpdateSectionProgress(section.title, timeout_ms / 1000);
+            continue;
+        }
+        MYLOGE("Could not read %s (%s), running logcat instead\n", section.title.c_str(),
+               result.error.c_str());
+        RunCommand(section.title, command, CommandOptions::WithTimeoutInMs(timeout_ms).Build());
+    }
+}
+
 static void DoKernelLogcat() {
-    unsigned long timeout_ms = logcat_timeout({"kernel"});
-    RunCommand(
-        "KERNEL LOG",
-        {"logcat", "-b", "kernel", "-v", "threadtime", "-v", "printable", "-v", "uid", "-d", "*:v"},
-        CommandOptions::WithTimeoutInMs(timeout_ms).Build());
+    DumpLogSections({{"KERNEL LOG", {"kernel"}, kLogMaxBytes}});
 }
 
 static void DoLogcat() {
-    unsigned long timeout_ms;
     // DumpFile("EVENT LOG TAGS", "/etc/event-log-tags");
-    // calculate timeout
-    timeout_ms = logcat_timeout({"main", "system", "crash"});
-    RunCommand("SYSTEM LOG",
-               {"logcat", "-v", "threadtime", "-v", "printable", "-v", "uid", "-d", "*:v"},
-               CommandOptions::WithTimeoutInMs(timeout_ms).Build());
-    timeout_ms = logcat_timeout({"events"});
-    RunCommand(
-        "EVENT LOG",
-        {"logcat", "-b", "events", "-v", "threadtime", "-v", "printable", "-v", "uid", "-d", "*:v"},
-        CommandOptions::WithTimeoutInMs(timeout_ms).Build());
-    timeout_ms = logcat_timeout({"stats"});
-    RunCommand(
-        "STATS LOG",
-        {"logcat", "-b", "stats", "-v", "threadtime", "-v", "printable", "-v", "uid", "-d", "*:v"},
-        CommandOptions::WithTimeoutInMs(timeout_ms).Build());
-    timeout_ms = logcat_timeout({"radio"});
-    RunCommand(
-        "RADIO LOG",
-        {"logcat", "-b", "radio", "-v", "threadtime", "-v", "printable", "-v", "uid", "-d", "*:v"},
-        CommandOptions::WithTimeoutInMs(timeout_ms).Build());
+    DumpLogSections({
+        {"SYSTEM LOG", {"main", "system", "crash"}, kSystemLogMaxBytes},
+        {"EVENT LOG", {"events"}, kLogMaxBytes},
+        {"STATS LOG", {"stats"}, kLogMaxBytes},
+        {"RADIO LOG", {"radio"}, kLogMaxBytes},
+    });
 
     RunCommand("LOG STATISTICS", {"logcat", "-b", "all", "-S"});
 
@@ -1122,6 +1782,7 @@ static Dumpstate::RunStatus RunDumpsysTextByPriority(const std::string& title, i
         std::string path(title);
         path.append(" - ").append(String8(service).c_str());
         DumpstateSectionReporter section_reporter(path, ds.listener_, ds.report_section_);
+        DurationReporter service_reporter(path, true);
         size_t bytes_written = 0;
         status_t status = dumpsys.startDumpThread(service, args);
         if (status == OK) {
@@ -1135,6 +1796,7 @@ static Dumpstate::RunStatus RunDumpsysTextByPriority(const std::string& title, i
             dumpsys.stopDumpThread(dump_complete);
         }
         section_reporter.setStatus(status);
+        service_reporter.SetStatus(status, status == TIMED_OUT);
 
         auto elapsed_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::steady_clock::now() - start);
@@ -1198,16 +1860,16 @@ static Dumpstate::RunStatus RunDumpsysProto(const std::string& title, int priori
         }
         path.append(kProtoExt);
         DumpstateSectionReporter section_reporter(path, ds.listener_, ds.report_section_);
+        DurationReporter service_reporter(path, true);
         status_t status = dumpsys.startDumpThread(service, args);
         if (status == OK) {
             status = ds.AddZipEntryFromFd(path, dumpsys.getDumpFd(), service_timeout);
             bool dumpTerminated = (status == OK);
             dumpsys.stopDumpThread(dumpTerminated);
         }
-        ZipWriter::FileEntry file_entry;
-        ds.zip_writer_->GetLastEntry(&file_entry);
-        section_reporter.setSize(file_entry.compressed_size);
+        section_reporter.setSize(ds.GetLastZipEntrySize());
         section_reporter.setStatus(status);
+        service_reporter.SetStatus(status, status == TIMED_OUT);
 
         auto elapsed_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::steady_clock::now() - start);
@@ -1314,6 +1976,97 @@ static void DumpHals() {
     }
 }
 
+// Upper bound for collecting "SMAPS OF ALL PROCESSES".
+static const int64_t kShowMapsTotalTimeoutMs = SEC_TO_MSEC(600);
+
+// Child process collecting "SMAPS OF ALL PROCESSES", and the unlinked file it writes to.
+static pid_t show_maps_pid = -1;
+static android::base::unique_fd show_maps_fd;
+
+/*
+ * Starts collecting the smaps of all processes in the background.
+ *
+ * Reading other processes' smaps requires root, which dumpstate drops before the section is
+ * printed, so the tables are built by a child forked now. It parses and formats the smaps of
+ * several processes at once, instead of exec'ing `showmap` for each of them. The child doesn't
+ * exec anything (which the dumpstate domain isn't allowed to do without a transition) and doesn't
+ * start threads either (see DumpShowMaps()); it only relies on malloc, which bionic keeps usable
+ * in the child of fork().
+ */
+static void StartShowMaps() {
+    // `showmap` used to run through su, so keep the output limited to where that worked.
+    if (PropertiesHelper::IsDryRun() || PropertiesHelper::IsUserBuild() ||
+        PropertiesHelper::IsUnroot()) {
+        return;
+    }
+
+    std::string path = ds.bugreport_internal_dir_ + "/showmap_XXXXXX";
+    android::base::unique_fd fd(mkostemp(&path[0], O_CLOEXEC));
+    if (fd.get() == -1) {
+        MYLOGE("mkostemp on pattern %s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    unlink(path.c_str());
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        MYLOGE("*** fork: %s\n", strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        // Exits without waiting for readers stuck on a process.
+        _exit(android::os::dumpstate::CollectShowMaps(fd.get()));
+    }
+
+    if (!ChildSupervisor::GetInstance().Watch(pid, kShowMapsTotalTimeoutMs)) {
+        MYLOGE("*** could not supervise showmap collector (pid %d): %s\n", pid, strerror(errno));
+        kill(pid, SIGKILL);
+        TEMP_FAILURE_RETRY(waitpid(pid, nullptr, 0));
+        return;
+    }
+    show_maps_pid = pid;
+    show_maps_fd = std::move(fd);
+}
+
+// Kills and reaps the collector started by StartShowMaps() if its result was never printed, e.g.
+// because the user denied consent or the bugreport was cancelled.
+static void StopShowMaps() {
+    if (show_maps_pid == -1) {
+        return;
+    }
+    kill(show_maps_pid, SIGKILL);
+    ChildSupervisor::GetInstance().Wait(show_maps_pid);
+    show_maps_pid = -1;
+    show_maps_fd.reset();
+}
+
+// Prints the result of StartShowMaps(), or runs `showmap` for each process if it wasn't started.
+static void PrintShowMaps() {
+    if (show_maps_pid == -1) {
+        for_each_pid(do_showmap, "SMAPS OF ALL PROCESSES");
+        return;
+    }
+
+    DurationReporter duration_reporter("SMAPS OF ALL PROCESSES");
+    printf("\n------ SMAPS OF ALL PROCESSES ------\n");
+    ChildSupervisor::Result result = ChildSupervisor::GetInstance().Wait(show_maps_pid);
+    show_maps_pid = -1;
+
+    fflush(stdout);
+    if (lseek(show_maps_fd.get(), 0, SEEK_SET) == -1 ||
+        !android::os::CopyFile(show_maps_fd.get(), STDOUT_FILENO)) {
+        MYLOGE("Failed to copy smaps: %s\n", strerror(errno));
+    }
+    show_maps_fd.reset();
+    if (result.timed_out) {
+        printf("*** smaps collection timed out after %.3fs\n",
+               static_cast<float>(result.elapsed_ns) / NANOS_PER_SEC);
+    } else if (result.reaped && result.status != 0) {
+        printf("*** smaps collector failed with status 0x%x\n", result.status);
+    }
+}
+
 // Dumps various things. Returns early with status USER_CONSENT_DENIED if user denies consent
 // via the consent they are shown. Ignores other errors that occur while running various
 // commands. The consent checking is currently done around long running tasks, which happen to
@@ -1372,10 +2125,18 @@ static Dumpstate::RunStatus dumpstate() {
 
     RunCommand("LIST OF OPEN FILES", {"lsof"}, CommandOptions::AS_ROOT);
 
-    RUN_SLOW_FUNCTION_WITH_CONSENT_CHECK(for_each_pid, do_showmap, "SMAPS OF ALL PROCESSES");
+    RUN_SLOW_FUNCTION_WITH_CONSENT_CHECK(PrintShowMaps);
+
+    // The per-process sections below are all rendered from a single pass over /proc, taken
+    // after the slow sections above so that it is not stale.
+    ProcSnapshot proc_snapshot;
+    if (!PropertiesHelper::IsDryRun() && !proc_snapshot.Capture(ProcSnapshot::WITH_THREADS)) {
+        printf("Failed to open /proc (%s)\n", strerror(errno));
+    }
 
-    for_each_tid(show_wchan, "BLOCKED PROCESS WAIT-CHANNELS");
-    for_each_pid(show_showtime, "PROCESS TIMES (pid cmd user system iowait+percentage)");
+    for_each_tid(proc_snapshot, show_wchan, "BLOCKED PROCESS WAIT-CHANNELS");
+    for_each_process(proc_snapshot, show_showtime,
+                     "PROCESS TIMES (pid cmd user system iowait+percentage)");
 
     /* Dump Bluetooth HCI logs */
     ds.AddDir("/data/misc/bluetooth/logs", true);
@@ -1542,6 +2303,9 @@ static Dumpstate::RunStatus DumpstateDefault() {
     // Try to dump anrd trace if the daemon is running.
     dump_anrd_trace();
 
+    // Taken first, before the rest of the bugreport fills the trace.
+    DumpFlightRecorderTrace();
+
     // Invoking the following dumpsys calls before DumpTraces() to try and
     // keep the system stats as close to its initial state as possible.
     RUN_SLOW_FUNCTION_WITH_CONSENT_CHECK(RunDumpsysCritical);
@@ -1549,6 +2313,10 @@ static Dumpstate::RunStatus DumpstateDefault() {
     /* collect stack traces from Dalvik and native processes (needs root) */
     RUN_SLOW_FUNCTION_WITH_CONSENT_CHECK(ds.DumpTraces, &dump_traces_path);
 
+    /* start collecting the smaps of all processes while still running as root */
+    StartShowMaps();
+    auto stop_show_maps = android::base::make_scope_guard(StopShowMaps);
+
     /* Run some operations that require root. */
     ds.tombstone_data_ = GetDumpFds(TOMBSTONE_DIR, TOMBSTONE_FILE_PREFIX, !ds.IsZipping());
     ds.anr_data_ = GetDumpFds(ANR_DIR, ANR_FILE_PREFIX, !ds.IsZipping());
@@ -1681,6 +2449,70 @@ static void DumpstateWifiOnly() {
     printf("========================================================\n");
 }
 
+// Maximum number of processes whose backtraces are requested from debuggerd at the same time.
+static constexpr size_t kMaxConcurrentBacktraces = 4;
+
+// Number of consecutive backtrace failures after which debuggerd is considered dead.
+static constexpr int kMaxBacktraceFailures = 3;
+
+struct BacktraceJob {
+    BacktraceJob(int pid, const std::string& name, bool is_java_process)
+        : pid(pid), title("BACKTRACE " + name), is_java_process(is_java_process) {
+    }
+
+    int pid;
+    // Identifies the process in the section history.
+    std::string title;
+    bool is_java_process;
+    // Unlinked temporary file holding the dump.
+    android::base::unique_fd output;
+    int ret = 0;
+    uint64_t elapsed_ns = 0;
+    // Not attempted because debuggerd was considered dead or the dump was cancelled.
+    bool skipped = false;
+    bool done = false;
+};
+
+// Dumps the backtrace of job->pid into a new anonymous temporary file.
+static void DumpBacktrace(BacktraceJob* job, const std::string& temp_file_pattern) {
+    std::vector<char> file_name(temp_file_pattern.begin(), temp_file_pattern.end());
+    file_name.push_back('\0');
+    job->output.reset(mkostemp(file_name.data(), O_CLOEXEC));
+    if (job->output.get() == -1) {
+        MYLOGE("mkostemp on pattern %s: %s\n", temp_file_pattern.c_str(), strerror(errno));
+        job->ret = -1;
+        return;
+    }
+    unlink(file_name.data());
+
+    const uint64_t start = Nanotime();
+    const uint64_t start_cpu = SectionReport::CpuNanotime();
+    job->ret = dump_backtrace_to_file_timeout(
+        job->pid, job->is_java_process ? kDebuggerdJavaBacktrace : kDebuggerdNativeBacktrace,
+        job->is_java_process ? 5 : 20, job->output.get());
+    job->elapsed_ns = Nanotime() - start;
+
+    struct stat st;
+    if (fstat(job->output.get(), &st) != 0) {
+        st.st_size = 0;
+    }
+    if (ds.section_history_ != nullptr) {
+        ds.section_history_->Record(job->title, job->elapsed_ns, st.st_size);
+    }
+    if (ds.section_report_ != nullptr) {
+        SectionReport::Section section;
+        section.title = job->title;
+        // Nested in DUMP TRACES, but run by a worker thread.
+        section.depth = 1;
+        section.start_ns = start;
+        section.duration_ns = job->elapsed_ns;
+        section.cpu_ns = SectionReport::CpuNanotime() - start_cpu;
+        section.bytes = st.st_size;
+        section.status = job->ret;
+        ds.section_report_->Add(std::move(section));
+    }
+}
+
 Dumpstate::RunStatus Dumpstate::DumpTraces(const char** path) {
     DurationReporter duration_reporter("DUMP TRACES");
 
@@ -1710,30 +2542,21 @@ Dumpstate::RunStatus Dumpstate::DumpTraces(const char** path) {
         return RunStatus::OK;
     }
 
-    std::unique_ptr<DIR, decltype(&closedir)> proc(opendir("/proc"), closedir);
-    if (proc.get() == nullptr) {
-        MYLOGE("opendir /proc failed: %s\n", strerror(errno));
+    ProcSnapshot proc_snapshot;
+    if (!proc_snapshot.Capture(ProcSnapshot::EXE_ONLY)) {
         return RunStatus::OK;
     }
 
-    // Number of times process dumping has timed out. If we encounter too many
-    // failures, we'll give up.
-    int timeout_failures = 0;
     bool dalvik_found = false;
 
     const std::set<int> hal_pids = get_interesting_hal_pids();
 
-    struct dirent* d;
-    while ((d = readdir(proc.get()))) {
+    std::vector<BacktraceJob> jobs;
+    for (const ProcSnapshot::Process& process : proc_snapshot.processes()) {
         RETURN_IF_USER_DENIED_CONSENT();
-        int pid = atoi(d->d_name);
-        if (pid <= 0) {
-            continue;
-        }
-
-        const std::string link_name = android::base::StringPrintf("/proc/%d/exe", pid);
-        std::string exe;
-        if (!android::base::Readlink(link_name, &exe)) {
+        const int pid = process.pid;
+        const std::string& exe = process.exe;
+        if (exe.empty()) {
             continue;
         }
 
@@ -1752,36 +2575,93 @@ Dumpstate::RunStatus Dumpstate::DumpTraces(const char** path) {
             // Probably a native process we don't care about, continue.
             continue;
         }
+        jobs.emplace_back(pid, proc_snapshot.ReadName(process), is_java_process);
+    }
+
+    // The slowest processes (in previous runs) are dumped first, so that they don't end up
+    // running alone at the end.
+    std::vector<size_t> order;
+    if (ds.section_history_ != nullptr) {
+        std::vector<std::string> titles;
+        for (const BacktraceJob& job : jobs) {
+            titles.push_back(job.title);
+        }
+        order = ds.section_history_->SlowestFirst(titles);
+    } else {
+        for (size_t i = 0; i < jobs.size(); i++) {
+            order.push_back(i);
+        }
+    }
+
+    // Backtraces are requested from debuggerd for several processes at once, each into its own
+    // buffer; the buffers are then appended to the traces file in pid order, whatever the order in
+    // which they were requested.
+    std::mutex lock;
+    std::condition_variable done_cv;
+    std::atomic<size_t> next_job(0);
+    // If too many dumps in a row (in the order they were requested) fail, we'll consider
+    // debuggerd dead and give up.
+    FailureStreak timeout_failures(kMaxBacktraceFailures);
+    std::atomic<bool> cancelled(false);
+
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next_job++) < jobs.size()) {
+            BacktraceJob& job = jobs[order[i]];
+            if (cancelled || timeout_failures.Exceeded()) {
+                job.skipped = true;
+            } else {
+                DumpBacktrace(&job, temp_file_pattern);
+                timeout_failures.Record(i, job.ret == -1);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            job.done = true;
+            done_cv.notify_all();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < std::min(kMaxConcurrentBacktraces, jobs.size()); i++) {
+        workers.emplace_back(worker);
+    }
 
-        // If 3 backtrace dumps fail in a row, consider debuggerd dead.
-        if (timeout_failures == 3) {
+    for (BacktraceJob& job : jobs) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            done_cv.wait(guard, [&job]() { return job.done; });
+        }
+        if (ds.IsUserConsentDenied()) {
+            cancelled = true;
+            break;
+        }
+        if (job.skipped) {
             dprintf(fd, "ERROR: Too many stack dump failures, exiting.\n");
+            cancelled = true;
             break;
         }
 
-        const uint64_t start = Nanotime();
-        const int ret = dump_backtrace_to_file_timeout(
-            pid, is_java_process ? kDebuggerdJavaBacktrace : kDebuggerdNativeBacktrace,
-            is_java_process ? 5 : 20, fd);
-
-        if (ret == -1) {
+        if (job.ret == -1) {
             // For consistency, the header and footer to this message match those
             // dumped by debuggerd in the success case.
-            dprintf(fd, "\n---- pid %d at [unknown] ----\n", pid);
+            dprintf(fd, "\n---- pid %d at [unknown] ----\n", job.pid);
             dprintf(fd, "Dump failed, likely due to a timeout.\n");
-            dprintf(fd, "---- end %d ----", pid);
-            timeout_failures++;
+            dprintf(fd, "---- end %d ----", job.pid);
             continue;
         }
 
-        // We've successfully dumped stack traces, reset the failure count
-        // and write a summary of the elapsed time to the file and continue with the
-        // next process.
-        timeout_failures = 0;
-
-        dprintf(fd, "[dump %s stack %d: %.3fs elapsed]\n", is_java_process ? "dalvik" : "native",
-                pid, (float)(Nanotime() - start) / NANOS_PER_SEC);
+        // Write the dump, followed by a summary of the elapsed time.
+        if (lseek(job.output.get(), 0, SEEK_SET) == -1 ||
+            !android::os::CopyFile(job.output.get(), fd)) {
+            MYLOGE("Failed to copy backtrace of pid %d: %s\n", job.pid, strerror(errno));
+        }
+        job.output.reset();
+        dprintf(fd, "[dump %s stack %d: %.3fs elapsed]\n",
+                job.is_java_process ? "dalvik" : "native", job.pid,
+                (float)job.elapsed_ns / NANOS_PER_SEC);
     }
+    for (auto& t : workers) {
+        t.join();
+    }
+    RETURN_IF_USER_DENIED_CONSENT();
 
     if (!dalvik_found) {
         MYLOGE("Warning: no Dalvik processes found to dump stacks\n");
@@ -1791,24 +2671,34 @@ Dumpstate::RunStatus Dumpstate::DumpTraces(const char** path) {
     return RunStatus::OK;
 }
 
-void Dumpstate::DumpstateBoard() {
-    DurationReporter duration_reporter("dumpstate_board()");
-    printf("========================================================\n");
-    printf("== Board\n");
-    printf("========================================================\n");
+using ScopedNativeHandle = std::unique_ptr<native_handle_t, std::function<void(native_handle_t*)>>;
+
+// IDumpstateDevice::dumpstateBoard() call started by StartDumpstateBoard(). Shared with the thread
+// making the call, which may outlive DumpstateBoard() if the HAL hangs.
+struct Dumpstate::BoardDump {
+    ~BoardDump() {
+        for (const std::string& path : paths) {
+            android::os::UnlinkAndLogOnError(path);
+        }
+    }
+
+    std::vector<std::string> paths;
+    // Holds the fds the HAL writes to.
+    ScopedNativeHandle handle;
+    std::future<bool> result;
+    std::chrono::steady_clock::time_point start;
+};
 
+void Dumpstate::StartDumpstateBoard() {
     if (!IsZipping()) {
         MYLOGD("Not dumping board info because it's not a zipped bugreport\n");
         return;
     }
 
-    std::vector<std::string> paths;
-    std::vector<android::base::ScopeGuard<std::function<void()>>> remover;
+    auto board = std::make_shared<BoardDump>();
     for (int i = 0; i < NUM_OF_DUMPS; i++) {
-        paths.emplace_back(StringPrintf("%s/%s", ds.bugreport_internal_dir_.c_str(),
-                                        kDumpstateBoardFiles[i].c_str()));
-        remover.emplace_back(android::base::make_scope_guard(
-            std::bind([](std::string path) { android::os::UnlinkAndLogOnError(path); }, paths[i])));
+        board->paths.emplace_back(StringPrintf("%s/%s", ds.bugreport_internal_dir_.c_str(),
+                                               kDumpstateBoardFiles[i].c_str()));
     }
 
     sp<IDumpstateDevice> dumpstate_device(IDumpstateDevice::getService());
@@ -1817,51 +2707,92 @@ void Dumpstate::DumpstateBoard() {
         return;
     }
 
-    using ScopedNativeHandle =
-            std::unique_ptr<native_handle_t, std::function<void(native_handle_t*)>>;
-    ScopedNativeHandle handle(native_handle_create(static_cast<int>(paths.size()), 0),
-                              [](native_handle_t* handle) {
-                                  native_handle_close(handle);
-                                  native_handle_delete(handle);
-                              });
-    if (handle == nullptr) {
+    board->handle =
+        ScopedNativeHandle(native_handle_create(static_cast<int>(board->paths.size()), 0),
+                           [](native_handle_t* handle) {
+                               native_handle_close(handle);
+                               native_handle_delete(handle);
+                           });
+    if (board->handle == nullptr) {
         MYLOGE("Could not create native_handle\n");
         return;
     }
 
     // TODO(128270426): Check for consent in between?
-    for (size_t i = 0; i < paths.size(); i++) {
-        MYLOGI("Calling IDumpstateDevice implementation using path %s\n", paths[i].c_str());
+    for (size_t i = 0; i < board->paths.size(); i++) {
+        const std::string& path = board->paths[i];
+        MYLOGI("Calling IDumpstateDevice implementation using path %s\n", path.c_str());
 
         android::base::unique_fd fd(TEMP_FAILURE_RETRY(
-            open(paths[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
+            open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)));
         if (fd < 0) {
-            MYLOGE("Could not open file %s: %s\n", paths[i].c_str(), strerror(errno));
+            MYLOGE("Could not open file %s: %s\n", path.c_str(), strerror(errno));
             return;
         }
-        handle.get()->data[i] = fd.release();
+        // Created while still running as root; the entries are added after dropping it.
+        if (fchown(fd.get(), AID_SHELL, AID_SHELL)) {
+            MYLOGE("Unable to change ownership of %s: %s\n", path.c_str(), strerror(errno));
+        }
+        board->handle.get()->data[i] = fd.release();
+    }
+
+    // The HAL dumps in the background while the framework sections run, so its latency only
+    // delays the bugreport when it's longer than theirs. If the HAL hangs, the thread outlives the
+    // run, so it holds on to the report of this run instead of reading ds.section_report_.
+    std::shared_ptr<SectionReport> report = section_report_;
+    std::packaged_task<bool()> dumpstate_task([board, dumpstate_device, report]() -> bool {
+        uint64_t start = Nanotime();
+        android::hardware::Return<void> status =
+            dumpstate_device->dumpstateBoard(board->handle.get());
+        if (report != nullptr) {
+            SectionReport::Section section;
+            section.title = "IDumpstateDevice::dumpstateBoard()";
+            section.start_ns = start;
+            section.duration_ns = Nanotime() - start;
+            section.status = status.isOk() ? OK : UNKNOWN_ERROR;
+            for (size_t i = 0; i < board->paths.size(); i++) {
+                struct stat st;
+                if (fstat(board->handle.get()->data[i], &st) == 0) {
+                    section.bytes += st.st_size;
+                }
+            }
+            report->Add(std::move(section));
+        }
+        if (!status.isOk()) {
+            MYLOGE("dumpstateBoard failed: %s\n", status.description().c_str());
+            return false;
+        }
+        return true;
+    });
+    board->result = dumpstate_task.get_future();
+    board->start = std::chrono::steady_clock::now();
+    std::thread(std::move(dumpstate_task)).detach();
+    board_dump_ = board;
+}
+
+void Dumpstate::DumpstateBoard() {
+    DurationReporter duration_reporter("dumpstate_board()");
+    printf("========================================================\n");
+    printf("== Board\n");
+    printf("========================================================\n");
+
+    // Releases the files when done; the HAL thread may still hold on to them if it hung.
+    std::shared_ptr<BoardDump> board = std::move(board_dump_);
+    if (board == nullptr) {
+        return;
     }
 
     // Given that bugreport is required to diagnose failures, it's better to
     // set an arbitrary amount of timeout for IDumpstateDevice than to block the
     // rest of bugreport. In the timeout case, we will kill dumpstate board HAL
-    // and grab whatever dumped
-    std::packaged_task<bool()>
-            dumpstate_task([paths, dumpstate_device, &handle]() -> bool {
-            android::hardware::Return<void> status = dumpstate_device->dumpstateBoard(handle.get());
-            if (!status.isOk()) {
-                MYLOGE("dumpstateBoard failed: %s\n", status.description().c_str());
-                return false;
-            }
-            return true;
-        });
-
-    auto result = dumpstate_task.get_future();
-    std::thread(std::move(dumpstate_task)).detach();
-
+    // and grab whatever dumped. The timeout counts from when the HAL was called.
     constexpr size_t timeout_sec = 30;
-    if (result.wait_for(std::chrono::seconds(timeout_sec)) != std::future_status::ready) {
+    bool timed_out = false;
+    if (board->result.wait_until(board->start + std::chrono::seconds(timeout_sec)) !=
+        std::future_status::ready) {
+        timed_out = true;
+        duration_reporter.SetStatus(TIMED_OUT, true);
         MYLOGE("dumpstateBoard timed out after %zus, killing dumpstate vendor HAL\n", timeout_sec);
         if (!android::base::SetProperty("ctl.interface_restart",
                                         android::base::StringPrintf("%s/default",
@@ -1871,15 +2802,21 @@ void Dumpstate::DumpstateBoard() {
     }
     // Wait some time for init to kill dumpstate vendor HAL
     constexpr size_t killing_timeout_sec = 10;
-    if (result.wait_for(std::chrono::seconds(killing_timeout_sec)) != std::future_status::ready) {
+    if (board->result.wait_for(std::chrono::seconds(killing_timeout_sec)) !=
+        std::future_status::ready) {
         MYLOGE("killing dumpstateBoard timed out after %zus, continue and "
                "there might be racing in content\n", killing_timeout_sec);
+    } else if (!timed_out && !board->result.get()) {
+        duration_reporter.SetStatus(UNKNOWN_ERROR);
     }
+    MYLOGD("dumpstateBoard took %.3fs\n",
+           std::chrono::duration<float>(std::chrono::steady_clock::now() - board->start).count());
 
+    const std::vector<std::string>& paths = board->paths;
     auto file_sizes = std::make_unique<ssize_t[]>(paths.size());
     for (size_t i = 0; i < paths.size(); i++) {
         struct stat s;
-        if (fstat(handle.get()->data[i], &s) == -1) {
+        if (fstat(board->handle.get()->data[i], &s) == -1) {
             MYLOGE("Failed to fstat %s: %s\n", kDumpstateBoardFiles[i].c_str(),
                    strerror(errno));
             file_sizes[i] = -1;
@@ -1931,8 +2868,12 @@ static void register_sig_handler() {
 
 bool Dumpstate::FinishZipFile() {
     std::string entry_name = base_name_ + "-" + name_ + ".txt";
-    MYLOGD("Adding main entry (%s) from %s to .zip bugreport\n", entry_name.c_str(),
-           tmp_path_.c_str());
+    if (main_entry_stream_ != nullptr) {
+        MYLOGD("Finishing main entry (%s) of .zip bugreport\n", entry_name.c_str());
+    } else {
+        MYLOGD("Adding main entry (%s) from %s to .zip bugreport\n", entry_name.c_str(),
+               tmp_path_.c_str());
+    }
     // Final timestamp
     char date[80];
     time_t the_real_now_please_stand_up = time(nullptr);
@@ -1940,7 +2881,32 @@ bool Dumpstate::FinishZipFile() {
     MYLOGD("dumpstate id %d finished around %s (%ld s)\n", ds.id_, date,
            the_real_now_please_stand_up - ds.now_);
 
-    if (!ds.AddZipEntry(entry_name, tmp_path_)) {
+    if (main_entry_stream_ != nullptr) {
+        std::shared_ptr<MainEntryStream> stream = main_entry_stream_;
+        bool ok = StopMainEntry();
+        std::vector<DeferredZipEntry> entries = TakeDeferredZipEntries();
+        if (!ok) {
+            MYLOGE("Failed to stream text entry to .zip file\n");
+            return false;
+        }
+        if (stream->name == entry_name) {
+            RecordZipEntryStats(entry_name, stream->start_ns, stream->cpu_ns, OK);
+        } else if (stream->text_ok && stream->entries_before == 1) {
+            // The suffix changed since the main entry was started.
+            MYLOGD("Rewriting .zip bugreport to rename main entry from %s to %s\n",
+                   stream->name.c_str(), entry_name.c_str());
+            if (!RewriteZipFile(entry_name)) {
+                MYLOGE("Failed to rewrite .zip file\n");
+                return false;
+            }
+        } else {
+            MYLOGE("Unable to rename main entry from %s to %s\n", stream->name.c_str(),
+                   entry_name.c_str());
+            entry_name = stream->name;
+            RecordZipEntryStats(entry_name, stream->start_ns, stream->cpu_ns, OK);
+        }
+        WriteDeferredZipEntries(std::move(entries));
+    } else if (!ds.AddZipEntry(entry_name, tmp_path_)) {
         MYLOGE("Failed to add text entry to .zip file\n");
         return false;
     }
@@ -1949,6 +2915,17 @@ bool Dumpstate::FinishZipFile() {
         return false;
     }
 
+    PrintZipEntryStats();
+
+    if (section_report_ != nullptr) {
+        // Entries added from now on (including these) are not part of the summary.
+        std::string summary = section_report_->Format();
+        if (!AddTextZipEntry("dumpstate_sections.txt", summary) ||
+            !AddTextZipEntry("dumpstate_sections.pb", section_report_->Serialize())) {
+            MYLOGE("Failed to add section report to .zip file\n");
+        }
+    }
+
     // Add log file (which contains stderr output) to zip...
     fprintf(stderr, "dumpstate_log.txt entry on zip file logged up to here\n");
     if (!ds.AddZipEntry("dumpstate_log.txt", ds.log_path_.c_str())) {
@@ -2499,6 +3476,9 @@ Dumpstate::RunStatus Dumpstate::RunInternal(int32_t calling_uid,
         MYLOGE("Invalid options specified\n");
         return RunStatus::INVALID_INPUT;
     }
+    if (options_->do_zip_file) {
+        section_report_.reset(new SectionReport());
+    }
     /* set as high priority, and protect from OOM killer */
     setpriority(PRIO_PROCESS, 0, -20);
 
@@ -2546,6 +3526,18 @@ Dumpstate::RunStatus Dumpstate::RunInternal(int32_t calling_uid,
             ? android::base::StringPrintf("%s/dumpstate-stats.txt", bugreport_internal_dir_.c_str())
             : "";
     progress_.reset(new Progress(stats_path));
+    if (is_redirecting) {
+        const char* mode =
+            options_->telephony_only ? "telephony" : options_->wifi_only ? "wifi" : "full";
+        section_history_.reset(new SectionHistory(android::base::StringPrintf(
+            "%s/dumpstate-sections-%s.txt", bugreport_internal_dir_.c_str(), mode)));
+        has_section_history_ = section_history_->Load();
+        if (has_section_history_) {
+            progress_->SetInitialMax(
+                std::max(1L, lround(section_history_->ExpectedProgressDurationMs() /
+                                    kProgressUnitMs)));
+        }
+    }
 
     /* gets the sequential id */
     uint32_t last_id = android::base::GetIntProperty(PROPERTY_LAST_ID, 0);
@@ -2656,22 +3648,33 @@ Dumpstate::RunStatus Dumpstate::RunInternal(int32_t calling_uid,
                    strerror(errno));
         }
 
-        // Redirect stdout to tmp_path_. This is the main bugreport entry and will be
-        // moved into zip file later, if zipping.
+        // Redirect stdout to the main bugreport entry, which is compressed into the zip file
+        // while it's generated. Otherwise, redirect it to tmp_path_, which is moved into the
+        // zip file later, if zipping.
         TEMP_FAILURE_RETRY(dup_stdout_fd = dup(fileno(stdout)));
         // TODO: why not write to a file instead of stdout to overcome this problem?
-        /* TODO: rather than generating a text file now and zipping it later,
-           it would be more efficient to redirect stdout to the zip entry
-           directly, but the libziparchive doesn't support that option yet. */
-        if (!redirect_to_file(stdout, const_cast<char*>(tmp_path_.c_str()))) {
-            return ERROR;
-        }
-        if (chown(tmp_path_.c_str(), AID_SHELL, AID_SHELL)) {
-            MYLOGE("Unable to change ownership of temporary bugreport file %s: %s\n",
-                   tmp_path_.c_str(), strerror(errno));
+        if (!StartMainEntry()) {
+            if (!redirect_to_file(stdout, const_cast<char*>(tmp_path_.c_str()))) {
+                return ERROR;
+            }
+            if (chown(tmp_path_.c_str(), AID_SHELL, AID_SHELL)) {
+                MYLOGE("Unable to change ownership of temporary bugreport file %s: %s\n",
+                       tmp_path_.c_str(), strerror(errno));
+            }
         }
     }
 
+    // Whichever way this returns, stdout goes back to where it was, which also lets the main
+    // entry be stopped.
+    bool stdout_restored = !is_redirecting;
+    auto restore_stdout_guard =
+        android::base::make_scope_guard([this, &stdout_restored, &dup_stdout_fd]() {
+            if (!stdout_restored) {
+                TEMP_FAILURE_RETRY(dup2(dup_stdout_fd, fileno(stdout)));
+            }
+            AbandonMainEntry();
+        });
+
     // Don't buffer stdout
     setvbuf(stdout, nullptr, _IONBF, 0);
 
@@ -2680,6 +3683,11 @@ Dumpstate::RunStatus Dumpstate::RunInternal(int32_t calling_uid,
     // duration is logged into MYLOG instead.
     PrintHeader();
 
+    // The board dump runs alongside the other sections; wifi-only reports don't include it.
+    if (!options_->wifi_only) {
+        StartDumpstateBoard();
+    }
+
     if (options_->telephony_only) {
         DumpstateTelephonyOnly();
         DumpstateBoard();
@@ -2689,6 +3697,8 @@ Dumpstate::RunStatus Dumpstate::RunInternal(int32_t calling_uid,
         // Dump state for the default case. This also drops root.
         RunStatus s = DumpstateDefault();
         if (s != RunStatus::OK) {
+            // Removes the board dump files, unless the HAL still holds them.
+            board_dump_.reset();
             if (s == RunStatus::USER_CONSENT_TIMED_OUT) {
                 HandleUserConsentDenied();
             }
@@ -2699,6 +3709,7 @@ Dumpstate::RunStatus Dumpstate::RunInternal(int32_t calling_uid,
     /* close output if needed */
     if (is_redirecting) {
         TEMP_FAILURE_RETRY(dup2(dup_stdout_fd, fileno(stdout)));
+        stdout_restored = true;
     }
 
     // Rename, and/or zip the (now complete) .tmp file within the internal directory.
@@ -2757,7 +3768,13 @@ Dumpstate::RunStatus Dumpstate::RunInternal(int32_t calling_uid,
 
     MYLOGD("Final progress: %d/%d (estimated %d)\n", progress_->Get(), progress_->GetMax(),
            progress_->GetInitialMax());
-    progress_->Save();
+    // The legacy stats are in timeout units, which don't mix with the section history ones.
+    if (!has_section_history_) {
+        progress_->Save();
+    }
+    if (section_history_ != nullptr) {
+        section_history_->Save();
+    }
     MYLOGI("done (id %d)\n", id_);
 
     if (is_redirecting) {
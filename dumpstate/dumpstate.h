@@ -22,6 +22,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -34,6 +36,9 @@
 #include <ziparchive/zip_writer.h>
 
 #include "DumpstateUtil.h"
+#include "ProcSnapshot.h"
+#include "SectionHistory.h"
+#include "SectionReport.h"
 
 // Workaround for const char *args[MAX_ARGS_ARRAY_SIZE] variables until they're converted to
 // std::vector<std::string>
@@ -77,10 +82,17 @@ class DurationReporter {
 
     ~DurationReporter();
 
+    /* Sets the status reported for the section; 0 (the default) means success. */
+    void SetStatus(int32_t status, bool timed_out = false);
+
   private:
     std::string title_;
     bool logcat_only_;
     uint64_t started_;
+    uint64_t started_cpu_;
+    uint64_t started_bytes_;
+    int32_t status_ = 0;
+    bool timed_out_ = false;
 
     DISALLOW_COPY_AND_ASSIGN(DurationReporter);
 };
@@ -127,6 +139,9 @@ class Progress {
     // Returns `true` if the max progress increased as well.
     bool Inc(int32_t delta);
 
+    // Replaces the estimated max progress, e.g. with one derived from the history of each section.
+    void SetInitialMax(int32_t max);
+
     // Persist the stats.
     void Save();
 
@@ -277,6 +292,21 @@ class Dumpstate {
      */
     void AddDir(const std::string& dir, bool recursive);
 
+    /*
+     * Returns the size of the last entry added to the zip file: compressed if it was already
+     * written, or uncompressed if it's waiting for the main entry to be finished.
+     */
+    int64_t GetLastZipEntrySize() const;
+
+    /*
+     * Redirects `stdout` to the main entry of the zip file, which is compressed on a background
+     * thread while the bugreport is generated. Entries added meanwhile are written after it.
+     * The text is also copied to `tmp_path_`, in case the zip file can't be finished.
+     *
+     * Returns false if not zipping or if `stdout` could not be redirected.
+     */
+    bool StartMainEntry();
+
     /*
      * Takes a screenshot and save it to the given `path`.
      *
@@ -297,6 +327,11 @@ class Dumpstate {
     // Returns OK in all other cases.
     RunStatus DumpTraces(const char** path);
 
+    // Starts the IDumpstateDevice::dumpstateBoard() call in the background, so the board dump
+    // runs while the framework sections are being dumped.
+    void StartDumpstateBoard();
+
+    // Waits for the board dump started by StartDumpstateBoard() and adds its files to the zip.
     void DumpstateBoard();
 
     /*
@@ -304,12 +339,25 @@ class Dumpstate {
      */
     void UpdateProgress(int32_t delta);
 
+    /*
+     * Updates the overall progress after the section `title` finished, by its expected duration
+     * when there is a section history, or by `default_weight` otherwise. Untitled sections always
+     * count `default_weight`, converted to kProgressUnitMs units when there is a history.
+     */
+    void UpdateSectionProgress(const std::string& title, int32_t default_weight);
+
+    /*
+     * Returns the number of bytes written to the main entry so far. When it's being streamed, the
+     * bytes still in the pipe are not accounted for.
+     */
+    uint64_t GetOutputBytes() const;
+
     /* Prints the dumpstate header on `stdout`. */
     void PrintHeader() const;
 
     /*
-     * Adds the temporary report to the existing .zip file, closes the .zip file, and removes the
-     * temporary file.
+     * Finishes the main entry (or adds the temporary report) to the existing .zip file, closes the
+     * .zip file, and removes the temporary file.
      */
     bool FinishZipFile();
 
@@ -412,6 +460,18 @@ class Dumpstate {
 
     std::unique_ptr<Progress> progress_;
 
+    // Durations and sizes of the sections in previous runs; drives the progress when available.
+    std::unique_ptr<android::os::dumpstate::SectionHistory> section_history_;
+
+    // Whether section_history_ had previous runs, in which case the progress is measured in
+    // kProgressUnitMs units of expected duration.
+    bool has_section_history_ = false;
+    static constexpr int kProgressUnitMs = 10;
+
+    // Duration, CPU time, size and status of each section of the current run.
+    // Shared with the board dump thread, which may outlive the run.
+    std::shared_ptr<android::os::dumpstate::SectionReport> section_report_;
+
     // When set, defines a socket file-descriptor use to report progress to bugreportz.
     int control_socket_fd_ = -1;
 
@@ -431,7 +491,8 @@ class Dumpstate {
     std::string bugreport_internal_dir_ = DUMPSTATE_DIRECTORY;
 
     // Full path of the temporary file containing the bugreport, inside bugreport_internal_dir_.
-    // At the very end this file is pulled into the zip file.
+    // At the very end this file is pulled into the zip file, unless the main entry could be
+    // streamed into it directly.
     std::string tmp_path_;
 
     // Full path of the file containing the dumpstate logs, inside bugreport_internal_dir_.
@@ -501,8 +562,87 @@ class Dumpstate {
     // Used by GetInstance() only.
     explicit Dumpstate(const std::string& version = VERSION_CURRENT);
 
+    struct MainEntryStream;
+
+    struct BoardDump;
+
+    // An entry added to the zip file while the main entry was being streamed.
+    struct DeferredZipEntry {
+        std::string name;
+        time_t mtime;
+        // A file kept open to be read later, or -1 if the data was copied to `content`.
+        android::base::unique_fd fd;
+        off_t offset = 0;
+        std::string content;
+    };
+
+    // Regular files kept open as deferred entries, out of the fds dumpstate may have open.
+    static constexpr size_t kMinDeferredZipEntryFds = 64;
+    static constexpr size_t kReservedFds = 256;
+
+    static void StreamMainEntry(std::shared_ptr<MainEntryStream> stream, ZipWriter* zip_writer,
+                                time_t mtime);
+
+    bool IsStreamingMainEntry();
+
+    // Waits for the main entry to be finished. Returns whether it was written.
+    bool StopMainEntry();
+
+    // Stops the main entry, if still streaming it, and drops the entries deferred meanwhile.
+    void AbandonMainEntry();
+
+    // Takes the entries deferred while the main entry was streamed.
+    std::vector<DeferredZipEntry> TakeDeferredZipEntries();
+
+    void WriteDeferredZipEntries(std::vector<DeferredZipEntry> entries);
+
+    // Writes the zip file again with the main entry under `entry_name`, from `tmp_path_`.
+    bool RewriteZipFile(const std::string& entry_name);
+
+    android::status_t DeferZipEntryFromFd(const std::string& entry_name, int fd,
+                                          std::chrono::milliseconds timeout);
+
+    // Writes the data of fd to a new entry. Stops after `max_bytes` when it is not negative.
+    android::status_t WriteZipEntryFromFd(const std::string& entry_name, int fd, time_t mtime,
+                                          std::chrono::milliseconds timeout,
+                                          int64_t max_bytes = -1);
+
+    bool WriteZipEntryFromContent(const std::string& entry_name, const std::string& content,
+                                  time_t mtime);
+
+    // Sizes and compression cost of an entry written to the zip file.
+    struct ZipEntryStats {
+        std::string name;
+        // False if the data was stored as is.
+        bool compressed;
+        uint64_t uncompressed_size;
+        uint64_t compressed_size;
+        uint64_t cpu_ns;
+    };
+
+    // Records the stats of the entry that was just written, which started at `start_ns`.
+    void RecordZipEntryStats(const std::string& entry_name, uint64_t start_ns, uint64_t cpu_ns,
+                             android::status_t status);
+
+    // Prints a summary of zip_entry_stats_ on `stderr`.
+    void PrintZipEntryStats() const;
+
     android::sp<ConsentCallback> consent_callback_;
 
+    std::shared_ptr<MainEntryStream> main_entry_stream_;
+
+    // Set between StartDumpstateBoard() and DumpstateBoard().
+    std::shared_ptr<BoardDump> board_dump_;
+
+    std::mutex zip_entries_lock_;
+    bool streaming_main_entry_ = false;
+    std::vector<DeferredZipEntry> deferred_zip_entries_;
+    size_t deferred_zip_entry_fds_ = 0;
+    size_t max_deferred_zip_entry_fds_ = kMinDeferredZipEntryFds;
+    int64_t last_deferred_zip_entry_size_ = -1;
+
+    std::vector<ZipEntryStats> zip_entry_stats_;
+
     DISALLOW_COPY_AND_ASSIGN(Dumpstate);
 };
 
@@ -565,9 +705,6 @@ void for_each_tid(for_each_tid_func func, const char *header);
 /* Displays a blocked processes in-kernel wait channel */
 void show_wchan(int pid, int tid, const char *name);
 
-/* Displays a processes times */
-void show_showtime(int pid, const char *name);
-
 /* Runs "showmap" for a process */
 void do_showmap(int pid, const char *name);
 
@@ -599,4 +736,24 @@ int run_main(int argc, char* argv[]);
 }
 #endif
 
+typedef void(for_each_process_func)(const android::os::dumpstate::ProcSnapshot::Process&);
+
+/* for each process in a previously captured snapshot, run the specified function */
+void for_each_pid(const android::os::dumpstate::ProcSnapshot& snapshot, for_each_pid_func func,
+                  const char* header);
+
+/* for each thread in a previously captured snapshot, run the specified function */
+void for_each_tid(const android::os::dumpstate::ProcSnapshot& snapshot, for_each_tid_func func,
+                  const char* header);
+
+/* for each process in a previously captured snapshot, run the specified function */
+void for_each_process(const android::os::dumpstate::ProcSnapshot& snapshot,
+                      for_each_process_func func, const char* header);
+
+/* Returns true if data starts like a file in an already compressed format (gzip, zip, png, ...). */
+bool IsCompressedData(const uint8_t* data, size_t len);
+
+/* Displays a processes times */
+void show_showtime(const android::os::dumpstate::ProcSnapshot::Process& process);
+
 #endif /* FRAMEWORK_NATIVE_CMD_DUMPSTATE_H_ */
@@ -19,6 +19,10 @@
 
 #include "DumpstateInternal.h"
 #include "DumpstateService.h"
+#include "LogCollector.h"
+#include "SectionHistory.h"
+#include "SectionReport.h"
+#include "ShowMap.h"
 #include "android/os/BnDumpstate.h"
 #include "dumpstate.h"
 
@@ -29,7 +33,9 @@
 #include <libgen.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <deque>
 #include <thread>
 
 #include <android-base/file.h>
@@ -37,6 +43,7 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <cutils/properties.h>
+#include <ziparchive/zip_archive.h>
 
 namespace android {
 namespace os {
@@ -46,6 +53,7 @@ using ::testing::EndsWith;
 using ::testing::HasSubstr;
 using ::testing::IsNull;
 using ::testing::IsEmpty;
+using ::testing::Not;
 using ::testing::NotNull;
 using ::testing::StrEq;
 using ::testing::StartsWith;
@@ -584,6 +592,8 @@ TEST_F(DumpOptionsTest, ValidateOptionsRemoteMode) {
     EXPECT_TRUE(options_.ValidateOptions());
 }
 
+static constexpr uint64_t NANOS_PER_MSEC = 1000000;
+
 class DumpstateTest : public DumpstateBaseTest {
   public:
     void SetUp() {
@@ -645,12 +655,72 @@ class DumpstateTest : public DumpstateBaseTest {
         return message;
     }
 
+    // Starts a zipped bugreport at `zip_path`, then streams `text` into its main entry.
+    void StreamMainEntry(const std::string& zip_path, const std::string& dir,
+                         const std::string& text) {
+        ds.base_name_ = "bugreport";
+        ds.name_ = "old";
+        ds.path_ = zip_path;
+        ds.tmp_path_ = dir + "/bugreport.tmp";
+        ds.log_path_ = dir + "/dumpstate_log.txt";
+        WriteStringToFile("", ds.log_path_);
+        ds.zip_file.reset(fopen(zip_path.c_str(), "wb"));
+        ASSERT_THAT(ds.zip_file, NotNull());
+        // Otherwise writing to /dev/full would only fail when flushed.
+        setvbuf(ds.zip_file.get(), nullptr, _IONBF, 0);
+        ds.zip_writer_.reset(new ZipWriter(ds.zip_file.get()));
+        ds.AddTextZipEntry("version.txt", ds.version_);
+
+        android::base::unique_fd old_stdout(dup(STDOUT_FILENO));
+        ASSERT_TRUE(ds.StartMainEntry());
+        EXPECT_TRUE(android::base::WriteStringToFd(text, STDOUT_FILENO));
+        dup2(old_stdout.get(), STDOUT_FILENO);
+    }
+
+    // Finishes the zip file started by StreamMainEntry(), keeping `stderr` where it was.
+    bool FinishZipFile() {
+        android::base::unique_fd old_stderr(dup(STDERR_FILENO));
+        bool ok = ds.FinishZipFile();
+        dup2(old_stderr.get(), STDERR_FILENO);
+        ds.zip_writer_.reset();
+        ds.zip_file.reset();
+        ds.main_entry_stream_.reset();
+        return ok;
+    }
+
     // `stdout` and `stderr` from the last command ran.
     std::string out, err;
 
     Dumpstate& ds = Dumpstate::GetInstance();
 };
 
+TEST_F(DumpstateTest, SectionProgressOfRepeatedTitle) {
+    auto history = std::make_unique<SectionHistory>();
+    for (int i = 0; i < 7; i++) {
+        history->Record("DUMPSYS", 100 * NANOS_PER_MSEC, 0);
+    }
+    history->MarkProgress("DUMPSYS");
+    history->Save();
+    ds.section_history_ = std::move(history);
+    ds.has_section_history_ = true;
+    long expected_max = lround(ds.section_history_->ExpectedProgressDurationMs() /
+                               Dumpstate::kProgressUnitMs);
+    ds.progress_.reset(new Progress(expected_max, 0, 1.2));
+
+    for (int i = 0; i < 7; i++) {
+        ds.UpdateSectionProgress("DUMPSYS", 30);
+    }
+    EXPECT_EQ(expected_max, ds.progress_->Get());
+    EXPECT_EQ(expected_max, ds.progress_->GetMax());
+
+    // Untitled sections count their default weight, in the same units.
+    ds.UpdateSectionProgress("", 5);
+    EXPECT_EQ(expected_max + 5000 / Dumpstate::kProgressUnitMs, ds.progress_->Get());
+
+    ds.section_history_.reset();
+    ds.has_section_history_ = false;
+}
+
 TEST_F(DumpstateTest, RunCommandNoArgs) {
     EXPECT_EQ(-1, RunCommand("", {}));
 }
@@ -1100,6 +1170,48 @@ TEST_F(DumpstateTest, DumpFileUpdateProgress) {
     ds.listener_.clear();
 }
 
+TEST_F(DumpstateTest, StreamedMainEntryIsKeptAsTextIfZipFails) {
+    TemporaryDir dir;
+    StreamMainEntry("/dev/full", dir.path, "I AM THE MAIN ENTRY\n");
+    EXPECT_FALSE(FinishZipFile());
+
+    // The text bugreport is sent instead.
+    std::string text;
+    ReadFileToString(ds.tmp_path_, &text);
+    EXPECT_THAT(text, StrEq("I AM THE MAIN ENTRY\n"));
+}
+
+TEST_F(DumpstateTest, StreamedMainEntryGetsChangedSuffix) {
+    TemporaryDir dir;
+    std::string zip_path = std::string(dir.path) + "/bugreport.zip";
+    StreamMainEntry(zip_path, dir.path, "I AM THE MAIN ENTRY\n");
+    EXPECT_TRUE(ds.AddTextZipEntry("deferred.txt", "I AM DEFERRED\n"));
+    ds.name_ = "new";
+    ASSERT_TRUE(FinishZipFile());
+    EXPECT_NE(0, access(ds.tmp_path_.c_str(), F_OK));
+
+    ZipArchiveHandle handle;
+    ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+    auto read_entry = [&handle](const std::string& name) {
+        ZipEntry entry;
+        if (FindEntry(handle, ZipString(name.c_str()), &entry) != 0) {
+            return std::string("(missing)");
+        }
+        std::string content(entry.uncompressed_length, '\0');
+        if (ExtractToMemory(handle, &entry, reinterpret_cast<uint8_t*>(&content[0]),
+                            content.size()) != 0) {
+            return std::string("(unreadable)");
+        }
+        return content;
+    };
+    EXPECT_THAT(read_entry("version.txt"), StrEq(ds.version_));
+    EXPECT_THAT(read_entry("bugreport-new.txt"), StrEq("I AM THE MAIN ENTRY\n"));
+    EXPECT_THAT(read_entry("bugreport-old.txt"), StrEq("(missing)"));
+    EXPECT_THAT(read_entry("main_entry.txt"), StrEq("bugreport-new.txt"));
+    EXPECT_THAT(read_entry("deferred.txt"), StrEq("I AM DEFERRED\n"));
+    CloseArchive(handle);
+}
+
 class DumpstateServiceTest : public DumpstateBaseTest {
   public:
     DumpstateService dss;
@@ -1584,6 +1696,101 @@ TEST_F(DumpstateUtilTest, RunCommandIsKilled) {
                            " --pid --sleep 20' failed: killed by signal 15\n"));
 }
 
+TEST_F(DumpstateUtilTest, RunCommandConcurrently) {
+    const int kNumCommands = 4;
+    std::vector<int> fds;
+    std::vector<std::string> paths;
+    for (int i = 0; i < kNumCommands; i++) {
+        CreateFd(android::base::StringPrintf("RunCommandConcurrently%d.txt", i));
+        fds.push_back(fd);
+        paths.push_back(kTestDataPath +
+                        android::base::StringPrintf("RunCommandConcurrently%d.txt", i));
+    }
+
+    // The last command times out while the others are still being waited for.
+    uint64_t start = Nanotime();
+    std::vector<int> statuses(kNumCommands);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kNumCommands; i++) {
+        threads.emplace_back([&, i]() {
+            if (i == kNumCommands - 1) {
+                statuses[i] = RunCommandToFd(fds[i], "", {kSimpleCommand, "--sleep", "3"},
+                                             CommandOptions::WithTimeout(1).Build());
+            } else {
+                statuses[i] = RunCommandToFd(fds[i], "", {kSimpleCommand, "--sleep", "2"},
+                                             CommandOptions::WithTimeout(10).Build());
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    // Run one after the other, these would take 7s.
+    EXPECT_LT(Nanotime() - start, 5 * NANOS_PER_SEC);
+
+    for (int i = 0; i < kNumCommands; i++) {
+        close(fds[i]);
+        std::string output;
+        ReadFileToString(paths[i], &output);
+        if (i == kNumCommands - 1) {
+            EXPECT_EQ(-1, statuses[i]);
+            EXPECT_THAT(output, StartsWith("stdout line1\n*** command '" + kSimpleCommand +
+                                           " --sleep 3' timed out after 1"));
+        } else {
+            EXPECT_EQ(0, statuses[i]);
+            EXPECT_THAT(output, StrEq("stdout line1\nstdout line2\n"));
+        }
+    }
+}
+
+TEST_F(DumpstateUtilTest, FailureStreakCountsInIssueOrder) {
+    FailureStreak streak(3);
+
+    // Commands 0, 2 and 4 fail first, interleaved with successes that finish later: three
+    // failures in completion order, but never two in a row in issue order.
+    streak.Record(0, true);
+    streak.Record(2, true);
+    streak.Record(4, true);
+    EXPECT_FALSE(streak.Exceeded());
+    streak.Record(1, false);
+    streak.Record(3, false);
+    EXPECT_FALSE(streak.Exceeded());
+
+    // Commands 5 to 7 fail, completing in reverse order.
+    streak.Record(7, true);
+    streak.Record(6, true);
+    EXPECT_FALSE(streak.Exceeded());
+    streak.Record(5, true);
+    EXPECT_TRUE(streak.Exceeded());
+}
+
+TEST_F(DumpstateUtilTest, FailureStreakFromConcurrentCommands) {
+    CreateFd("FailureStreakFromConcurrentCommands.txt");
+
+    // Commands are issued in index order. Every other one times out, so the failures all
+    // complete one after the other, after the successful commands issued between them.
+    const int kNumCommands = 5;
+    FailureStreak streak(2);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kNumCommands; i++) {
+        threads.emplace_back([&, i]() {
+            int status;
+            if (i % 2 == 0) {
+                status = RunCommandToFd(fd, "", {kSimpleCommand, "--sleep", "3"},
+                                        CommandOptions::WithTimeout(1).Build());
+            } else {
+                status = RunCommandToFd(fd, "", {kSimpleCommand});
+            }
+            streak.Record(i, status != 0);
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    close(fd);
+    EXPECT_FALSE(streak.Exceeded());
+}
+
 TEST_F(DumpstateUtilTest, RunCommandAsRootUserBuild) {
     if (!IsStandalone()) {
         // TODO: temporarily disabled because it might cause other tests to fail after dropping
@@ -1773,6 +1980,420 @@ TEST_F(DumpstateUtilTest, FindingPidWithNotExistingProcess) {
     EXPECT_THAT(err, StrEq("can't find the pid\n"));
 }
 
+TEST(ProcSnapshotTest, ParseProcStat) {
+    // Fields 4 to 42 hold their own index.
+    std::string stat = "1234 (a (b) c) S";
+    for (int i = 4; i <= 42; i++) {
+        stat += " " + std::to_string(i);
+    }
+    stat += " 43 44\n";
+
+    ProcSnapshot::Process process;
+    ASSERT_TRUE(ParseProcStat(stat.c_str(), stat.size(), &process));
+    EXPECT_EQ("a (b) c", process.comm);
+    EXPECT_EQ('S', process.state);
+    EXPECT_EQ(4, process.ppid);
+    EXPECT_EQ(14U, process.utime);
+    EXPECT_EQ(15U, process.stime);
+    EXPECT_EQ(42U, process.iotime);
+}
+
+TEST(ProcSnapshotTest, ParseProcStatMalformed) {
+    ProcSnapshot::Process process;
+    std::string stat = "1234 (no closing paren S 1 2 3";
+    EXPECT_FALSE(ParseProcStat(stat.c_str(), stat.size(), &process));
+    stat = "1234 (truncated) S 1 2 3";
+    EXPECT_FALSE(ParseProcStat(stat.c_str(), stat.size(), &process));
+}
+
+TEST(ProcSnapshotTest, CaptureIncludesSelf) {
+    ProcSnapshot snapshot;
+    ASSERT_TRUE(snapshot.Capture(ProcSnapshot::WITH_THREADS | ProcSnapshot::WITH_EXE));
+
+    int previous_pid = 0;
+    const ProcSnapshot::Process* self = nullptr;
+    for (const auto& process : snapshot.processes()) {
+        EXPECT_LT(previous_pid, process.pid);
+        previous_pid = process.pid;
+        if (process.pid == getpid()) {
+            self = &process;
+        }
+    }
+
+    ASSERT_THAT(self, NotNull());
+    EXPECT_TRUE(self->has_stat);
+    EXPECT_EQ(getppid(), self->ppid);
+    EXPECT_FALSE(self->exe.empty());
+}
+
+TEST(ProcSnapshotTest, CaptureExeOnly) {
+    ProcSnapshot snapshot;
+    ASSERT_TRUE(snapshot.Capture(ProcSnapshot::EXE_ONLY));
+
+    for (const auto& process : snapshot.processes()) {
+        if (process.pid == getpid()) {
+            EXPECT_FALSE(process.exe.empty());
+            EXPECT_FALSE(process.has_stat);
+            EXPECT_TRUE(process.name.empty());
+            EXPECT_THAT(snapshot.ReadName(process), Not(IsEmpty()));
+            return;
+        }
+    }
+    FAIL() << "pid " << getpid() << " not in snapshot";
+}
+
+TEST(ShowMapTest, ParseSmaps) {
+    std::string smaps =
+        "7000000000-7000001000 r-xp 00000000 fc:00 123    /system/lib64/libfoo.so\n"
+        "Size:                  4 kB\n"
+        "Rss:                   4 kB\n"
+        "Pss:                   2 kB\n"
+        "Shared_Clean:          4 kB\n"
+        "VmFlags: rd ex mr mw me\n"
+        "7000001000-7000002000 rw-p 00000000 00:00 0\n"
+        "Size:                  4 kB\n"
+        "Private_Dirty:         4 kB\n"
+        "7000003000-7000005000 rw-p 00001000 fc:00 123    /system/lib64/libfoo.so\n"
+        "Size:                  8 kB\n"
+        "Swap:                  8 kB\n"
+        "SwapPss:               3 kB\n"
+        "7100000000-7100001000 rw-p 00000000 00:00 0\n"
+        "Size:                  4 kB\n";
+
+    std::vector<MapInfo> maps = ParseSmaps(smaps);
+    ASSERT_EQ(2U, maps.size());
+
+    EXPECT_EQ("/system/lib64/libfoo.so", maps[0].name);
+    EXPECT_EQ(3, maps[0].count);
+    EXPECT_EQ(16U, maps[0].size);
+    EXPECT_EQ(4U, maps[0].rss);
+    EXPECT_EQ(2U, maps[0].pss);
+    EXPECT_EQ(4U, maps[0].shared_clean);
+    EXPECT_EQ(4U, maps[0].private_dirty);
+    EXPECT_EQ(8U, maps[0].swap);
+    EXPECT_EQ(3U, maps[0].swap_pss);
+    EXPECT_FALSE(maps[0].is_bss);
+
+    EXPECT_EQ("[anon]", maps[1].name);
+    EXPECT_EQ(1, maps[1].count);
+    EXPECT_EQ(4U, maps[1].size);
+
+    std::string out;
+    FormatShowMap(maps, &out);
+    EXPECT_THAT(out, HasSubstr("      16        4        2        4        0        0        4"
+                               "        8        3    3 /system/lib64/libfoo.so\n"));
+    EXPECT_THAT(out, EndsWith("      20        4        2        4        0        0        4"
+                              "        8        3    4 TOTAL\n"));
+}
+
+TEST(SectionHistoryTest, SaveAndLoad) {
+    TemporaryFile file;
+    SectionHistory history(file.path);
+    EXPECT_FALSE(history.Load());
+
+    history.Record("DUMPSYS", 2000 * NANOS_PER_MSEC, 1000);
+    history.Record("DUMPSYS", 1000 * NANOS_PER_MSEC, 500);
+    history.MarkProgress("DUMPSYS");
+    history.Record("DUMP TRACES", 5 * NANOS_PER_MSEC, 10);
+    history.RecordUntitledProgress(5000);
+    history.RecordUntitledProgress(1000);
+    history.Save();
+
+    SectionHistory loaded(file.path);
+    ASSERT_TRUE(loaded.Load());
+    // Sections that run more than once are averaged per run.
+    EXPECT_FLOAT_EQ(1500, loaded.ExpectedDurationMs("DUMPSYS"));
+    EXPECT_FLOAT_EQ(750, loaded.sections().at("DUMPSYS").bytes);
+    EXPECT_FLOAT_EQ(2, loaded.sections().at("DUMPSYS").runs);
+    EXPECT_FLOAT_EQ(5, loaded.ExpectedDurationMs("DUMP TRACES"));
+    EXPECT_FLOAT_EQ(-1, loaded.ExpectedDurationMs("UNKNOWN"));
+    // Only sections that update the progress count, including the untitled ones.
+    EXPECT_FLOAT_EQ(3000 + 6000, loaded.ExpectedProgressDurationMs());
+}
+
+TEST(SectionHistoryTest, MovingAverage) {
+    SectionHistory history;
+    history.Record("DUMPSYS", 1000 * NANOS_PER_MSEC, 0);
+    history.Save();
+    history.Record("DUMPSYS", 2000 * NANOS_PER_MSEC, 0);
+    history.Save();
+    EXPECT_FLOAT_EQ(1000 + SectionHistory::kAlpha * 1000, history.ExpectedDurationMs("DUMPSYS"));
+}
+
+TEST(SectionHistoryTest, RepeatedTitle) {
+    SectionHistory history;
+    for (int i = 0; i < 7; i++) {
+        history.Record("DUMPSYS", 100 * NANOS_PER_MSEC, 10);
+    }
+    history.MarkProgress("DUMPSYS");
+    history.Save();
+    EXPECT_FLOAT_EQ(100, history.ExpectedDurationMs("DUMPSYS"));
+    EXPECT_FLOAT_EQ(700, history.ExpectedProgressDurationMs());
+
+    // The number of runs is averaged like the duration.
+    for (int i = 0; i < 3; i++) {
+        history.Record("DUMPSYS", 100 * NANOS_PER_MSEC, 10);
+    }
+    history.Save();
+    float runs = 3 * SectionHistory::kAlpha + 7 * (1 - SectionHistory::kAlpha);
+    EXPECT_FLOAT_EQ(runs, history.sections().at("DUMPSYS").runs);
+    EXPECT_FLOAT_EQ(100, history.ExpectedDurationMs("DUMPSYS"));
+    EXPECT_FLOAT_EQ(100 * runs, history.ExpectedProgressDurationMs());
+}
+
+TEST(SectionHistoryTest, ForgetsRemovedSections) {
+    SectionHistory history;
+    history.Record("REMOVED", 1000 * NANOS_PER_MSEC, 0);
+    history.MarkProgress("REMOVED");
+    history.Save();
+    for (int i = 0; i < SectionHistory::kMaxMissedRuns; i++) {
+        history.Record("DUMPSYS", 1000 * NANOS_PER_MSEC, 0);
+        history.Save();
+        EXPECT_FLOAT_EQ(1000, history.ExpectedDurationMs("REMOVED"));
+        // It's not expected to run this time.
+        EXPECT_FLOAT_EQ(0, history.ExpectedProgressDurationMs());
+    }
+    history.Save();
+    EXPECT_FLOAT_EQ(-1, history.ExpectedDurationMs("REMOVED"));
+}
+
+TEST(SectionHistoryTest, IgnoresInvalidLines) {
+    TemporaryFile file;
+    ASSERT_TRUE(android::base::WriteStringToFile(
+        "sections v2\n"
+        "garbage\n"
+        "12.5 100 1 0\n"
+        "12.5 100 1 0 1 SECTION WITH SPACES\n",
+        file.path));
+    SectionHistory history(file.path);
+    ASSERT_TRUE(history.Load());
+    EXPECT_EQ(1U, history.sections().size());
+    EXPECT_FLOAT_EQ(12.5, history.ExpectedDurationMs("SECTION WITH SPACES"));
+
+    ASSERT_TRUE(android::base::WriteStringToFile("5 1000\n", file.path));
+    EXPECT_FALSE(history.Load());
+}
+
+TEST(SectionHistoryTest, SlowestFirst) {
+    SectionHistory history;
+    history.Record("FAST", 10 * NANOS_PER_MSEC, 0);
+    history.Record("SLOW", 1000 * NANOS_PER_MSEC, 0);
+    history.Record("MEDIUM", 100 * NANOS_PER_MSEC, 0);
+    history.Save();
+    EXPECT_THAT(history.SlowestFirst({"FAST", "NEW", "MEDIUM", "SLOW", "NEWER"}),
+                ::testing::ElementsAre(3, 2, 0, 1, 4));
+}
+
+TEST(SectionReportTest, SerializeAndParse) {
+    SectionReport report;
+    SectionReport::Section section;
+    section.title = "DUMPSYS";
+    section.start_ns = Nanotime();
+    section.duration_ns = 1234567890123;
+    section.cpu_ns = 42;
+    section.bytes = 1 << 20;
+    report.Add(section);
+
+    section = SectionReport::Section();
+    section.title = "proto/activity.proto";
+    section.kind = SectionReport::ZIP_ENTRY;
+    section.depth = 2;
+    section.status = -110;
+    section.timed_out = true;
+    report.Add(section);
+
+    std::vector<SectionReport::Section> parsed;
+    ASSERT_TRUE(SectionReport::Parse(report.Serialize(), &parsed));
+    std::vector<SectionReport::Section> expected = report.sections();
+    ASSERT_EQ(expected.size(), parsed.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        EXPECT_EQ(expected[i].title, parsed[i].title);
+        EXPECT_EQ(expected[i].kind, parsed[i].kind);
+        EXPECT_EQ(expected[i].depth, parsed[i].depth);
+        EXPECT_EQ(expected[i].start_ns, parsed[i].start_ns);
+        EXPECT_EQ(expected[i].duration_ns, parsed[i].duration_ns);
+        EXPECT_EQ(expected[i].cpu_ns, parsed[i].cpu_ns);
+        EXPECT_EQ(expected[i].bytes, parsed[i].bytes);
+        EXPECT_EQ(expected[i].status, parsed[i].status);
+        EXPECT_EQ(expected[i].timed_out, parsed[i].timed_out);
+    }
+}
+
+TEST(SectionReportTest, ParseRejectsTruncatedData) {
+    SectionReport report;
+    SectionReport::Section section;
+    section.title = "DUMPSYS";
+    report.Add(section);
+    std::string data = report.Serialize();
+
+    std::vector<SectionReport::Section> parsed;
+    EXPECT_FALSE(SectionReport::Parse(data.substr(0, data.size() - 1), &parsed));
+    EXPECT_TRUE(SectionReport::Parse("", &parsed));
+    EXPECT_THAT(parsed, IsEmpty());
+}
+
+TEST(SectionReportTest, Format) {
+    SectionReport report;
+    SectionReport::Section section;
+    section.title = "DUMPSYS";
+    section.start_ns = Nanotime();
+    section.duration_ns = 2 * NANOS_PER_SEC;
+    section.bytes = 100;
+    report.Add(section);
+    section.title = "DUMPSYS - activity";
+    section.depth = 1;
+    section.duration_ns = NANOS_PER_SEC;
+    section.status = -110;
+    section.timed_out = true;
+    report.Add(section);
+
+    std::string out = report.Format();
+    EXPECT_THAT(out, StartsWith("2 sections (1 timed out, 0 failed): "));
+    // Nested sections are not counted twice.
+    EXPECT_THAT(out, HasSubstr(" 100 bytes\n"));
+    EXPECT_THAT(out, HasSubstr("   2.000s    0.000s          100      ok    0 DUMPSYS\n"));
+    EXPECT_THAT(out, HasSubstr("   1.000s    0.000s          100 TIMEOUT -110 "
+                               "  DUMPSYS - activity\n"));
+}
+
+TEST(SectionReportTest, AddFromAnotherThread) {
+    // Like the board dump thread, which adds its section whenever the HAL returns.
+    auto report = std::make_shared<SectionReport>();
+    std::thread adder([report]() {
+        SectionReport::Section section;
+        section.title = "IDumpstateDevice::dumpstateBoard()";
+        for (int i = 0; i < 1000; i++) {
+            report->Add(section);
+        }
+    });
+    for (int i = 0; i < 100; i++) {
+        std::vector<SectionReport::Section> parsed;
+        EXPECT_TRUE(SectionReport::Parse(report->Serialize(), &parsed));
+        report->Format();
+    }
+    adder.join();
+    EXPECT_EQ(1000U, report->sections().size());
+}
+
+TEST(LogTailTest, KeepsNewestLines) {
+    LogTail tail(10);
+    for (const char* line : {"one\n", "two\n", "three\n"}) {
+        tail.Append(line, strlen(line));
+    }
+    EXPECT_EQ("two\nthree\n", tail.Lines());
+    EXPECT_EQ(1U, tail.dropped_lines());
+    EXPECT_EQ(4U, tail.dropped_bytes());
+
+    // Lines wrap around the end of the buffer.
+    std::string line = "00123";
+    for (int i = 0; i < 100; i++) {
+        line[0] = '0' + i % 10;
+        tail.Append(line.data(), line.size());
+    }
+    EXPECT_EQ("8012390123", tail.Lines());
+    EXPECT_EQ(101U, tail.dropped_lines());
+}
+
+TEST(LogTailTest, MatchesNaiveTail) {
+    const size_t max_bytes = 64;
+    LogTail tail(max_bytes);
+    std::deque<std::string> expected;
+    size_t expected_bytes = 0;
+    size_t expected_dropped = 0;
+    for (int i = 0; i < 1000; i++) {
+        std::string line = std::string(i * 7 % 23, 'a' + i % 26) + "\n";
+        tail.Append(line.data(), line.size());
+        expected.push_back(line);
+        expected_bytes += line.size();
+        while (expected_bytes > max_bytes) {
+            expected_bytes -= expected.front().size();
+            expected.pop_front();
+            expected_dropped++;
+        }
+        std::string lines;
+        for (const std::string& kept : expected) {
+            lines += kept;
+        }
+        ASSERT_EQ(lines, tail.Lines()) << "after line " << i;
+        ASSERT_EQ(expected_dropped, tail.dropped_lines());
+    }
+
+    std::string lines = tail.Lines();
+    EXPECT_EQ(lines, tail.TakeLines());
+    EXPECT_THAT(tail.Lines(), IsEmpty());
+}
+
+TEST(LogTailTest, DropsLinesLargerThanBudget) {
+    LogTail tail(4);
+    std::string line = "too long\n";
+    tail.Append(line.data(), line.size());
+    EXPECT_THAT(tail.Lines(), IsEmpty());
+    EXPECT_EQ(1U, tail.dropped_lines());
+    EXPECT_EQ(line.size(), tail.dropped_bytes());
+}
+
+TEST(ZipEntryTest, IsCompressedData) {
+    auto is_compressed = [](const std::string& data) {
+        return IsCompressedData(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    };
+    EXPECT_TRUE(is_compressed(std::string("\x1f\x8b\x08\x00", 4)));
+    EXPECT_TRUE(is_compressed(std::string("PK\x03\x04\x14\x00", 6)));
+    EXPECT_TRUE(is_compressed("\x89PNG\r\n\x1a\n"));
+    EXPECT_TRUE(is_compressed(std::string("\x28\xb5\x2f\xfd", 4)));
+    EXPECT_FALSE(is_compressed("========================================================\n"));
+    EXPECT_FALSE(is_compressed("PK"));
+    EXPECT_FALSE(is_compressed(""));
+}
+
+TEST(ShowMapTest, MatchesShowmap) {
+    // A child that does nothing, so its mappings can't change between the two reads.
+    pid_t pid = fork();
+    ASSERT_NE(-1, pid);
+    if (pid == 0) {
+        while (true) {
+            pause();
+        }
+    }
+
+    std::string smaps;
+    bool read_smaps =
+        android::base::ReadFileToString(android::base::StringPrintf("/proc/%d/smaps", pid), &smaps);
+    TemporaryFile showmap;
+    int status = RunCommandToFd(showmap.fd, "", {"showmap", "-q", std::to_string(pid)});
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    ASSERT_TRUE(read_smaps);
+    ASSERT_EQ(0, status);
+
+    std::string expected;
+    ASSERT_TRUE(android::base::ReadFileToString(showmap.path, &expected));
+    std::string actual;
+    FormatShowMap(ParseSmaps(smaps), &actual);
+    EXPECT_EQ(expected, actual);
+}
+
+TEST(ShowMapTest, DumpShowMapsIncludesSelf) {
+    ProcSnapshot snapshot;
+    ASSERT_TRUE(snapshot.Capture());
+    std::string name;
+    for (const auto& process : snapshot.processes()) {
+        if (process.pid == getpid()) {
+            name = process.name;
+        }
+    }
+
+    TemporaryFile out;
+    DumpShowMaps(snapshot, out.fd, 4, 10000);
+
+    std::string output;
+    ASSERT_TRUE(android::base::ReadFileToString(out.path, &output));
+    std::string header = android::base::StringPrintf(
+        "------ SHOW MAP %d (%s) (showmap -q %d) ------\n", getpid(), name.c_str(), getpid());
+    size_t pos = output.find(header);
+    ASSERT_NE(std::string::npos, pos);
+    EXPECT_THAT(output.substr(pos + header.size()), StartsWith(" virtual "));
+}
+
 }  // namespace dumpstate
 }  // namespace os
 }  // namespace android
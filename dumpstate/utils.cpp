@@ -38,6 +38,7 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
@@ -58,7 +59,9 @@
 // TODO: remove once moved to namespace
 using android::os::dumpstate::CommandOptions;
 using android::os::dumpstate::DumpFileToFd;
+using android::os::dumpstate::ProcSnapshot;
 using android::os::dumpstate::PropertiesHelper;
+using android::os::dumpstate::SectionReport;
 
 // Keep in sync with
 // frameworks/base/services/core/java/com/android/server/am/ActivityManagerService.java
@@ -93,16 +96,46 @@ Dumpstate& Dumpstate::GetInstance() {
     return singleton_;
 }
 
+// Number of DurationReporters alive in the current thread.
+static thread_local uint32_t duration_reporter_depth = 0;
+
 DurationReporter::DurationReporter(const std::string& title, bool logcat_only)
     : title_(title), logcat_only_(logcat_only) {
     if (!title_.empty()) {
         started_ = Nanotime();
+        started_cpu_ = SectionReport::CpuNanotime();
+        started_bytes_ = ds.GetOutputBytes();
+        duration_reporter_depth++;
     }
 }
 
+void DurationReporter::SetStatus(int32_t status, bool timed_out) {
+    status_ = status;
+    timed_out_ = timed_out;
+}
+
 DurationReporter::~DurationReporter() {
     if (!title_.empty()) {
-        float elapsed = (float)(Nanotime() - started_) / NANOS_PER_SEC;
+        duration_reporter_depth--;
+        uint64_t elapsed_ns = Nanotime() - started_;
+        uint64_t bytes = ds.GetOutputBytes();
+        bytes = bytes > started_bytes_ ? bytes - started_bytes_ : 0;
+        if (ds.section_history_ != nullptr) {
+            ds.section_history_->Record(title_, elapsed_ns, bytes);
+        }
+        if (ds.section_report_ != nullptr) {
+            SectionReport::Section section;
+            section.title = title_;
+            section.depth = duration_reporter_depth;
+            section.start_ns = started_;
+            section.duration_ns = elapsed_ns;
+            section.cpu_ns = SectionReport::CpuNanotime() - started_cpu_;
+            section.bytes = bytes;
+            section.status = status_;
+            section.timed_out = timed_out_;
+            ds.section_report_->Add(std::move(section));
+        }
+        float elapsed = (float)elapsed_ns / NANOS_PER_SEC;
         if (elapsed < .5f) {
             return;
         }
@@ -205,6 +238,12 @@ bool Progress::Inc(int32_t delta_sec) {
     return changed;
 }
 
+void Progress::SetInitialMax(int32_t max) {
+    MYLOGI("Estimated max progress from section history: %d\n", max);
+    initial_max_ = max;
+    max_ = max;
+}
+
 int32_t Progress::GetMax() const {
     return max_;
 }
@@ -269,141 +308,67 @@ void for_each_userid(void (*func)(int), const char *header) {
     closedir(d);
 }
 
-static void __for_each_pid(void (*helper)(int, const char *, void *), const char *header, void *arg) {
-    DIR *d;
-    struct dirent *de;
-
-    if (!(d = opendir("/proc"))) {
-        printf("Failed to open /proc (%s)\n", strerror(errno));
-        return;
-    }
+// Runs func for each process of the snapshot, reporting the duration under kind(header).
+static void ForEachProcess(const ProcSnapshot& snapshot, const char* kind, const char* header,
+                           const std::function<void(const ProcSnapshot::Process&)>& func) {
+    std::string title = header == nullptr ? kind
+                                          : android::base::StringPrintf("%s(%s)", kind, header);
+    DurationReporter duration_reporter(title);
+    if (PropertiesHelper::IsDryRun()) return;
 
     if (header) printf("\n------ %s ------\n", header);
-    while ((de = readdir(d))) {
+    for (const ProcSnapshot::Process& process : snapshot.processes()) {
         if (ds.IsUserConsentDenied()) {
             MYLOGE(
                 "Returning early because user denied consent to share bugreport with calling app.");
-            closedir(d);
             return;
         }
-        int pid;
-        int fd;
-        char cmdpath[255];
-        char cmdline[255];
-
-        if (!(pid = atoi(de->d_name))) {
-            continue;
-        }
-
-        memset(cmdline, 0, sizeof(cmdline));
-
-        snprintf(cmdpath, sizeof(cmdpath), "/proc/%d/cmdline", pid);
-        if ((fd = TEMP_FAILURE_RETRY(open(cmdpath, O_RDONLY | O_CLOEXEC))) >= 0) {
-            TEMP_FAILURE_RETRY(read(fd, cmdline, sizeof(cmdline) - 2));
-            close(fd);
-            if (cmdline[0]) {
-                helper(pid, cmdline, arg);
-                continue;
-            }
-        }
-
-        // if no cmdline, a kernel thread has comm
-        snprintf(cmdpath, sizeof(cmdpath), "/proc/%d/comm", pid);
-        if ((fd = TEMP_FAILURE_RETRY(open(cmdpath, O_RDONLY | O_CLOEXEC))) >= 0) {
-            TEMP_FAILURE_RETRY(read(fd, cmdline + 1, sizeof(cmdline) - 4));
-            close(fd);
-            if (cmdline[1]) {
-                cmdline[0] = '[';
-                size_t len = strcspn(cmdline, "\f\b\r\n");
-                cmdline[len] = ']';
-                cmdline[len+1] = '\0';
-            }
-        }
-        if (!cmdline[0]) {
-            strcpy(cmdline, "N/A");
-        }
-        helper(pid, cmdline, arg);
+        func(process);
     }
-
-    closedir(d);
 }
 
-static void for_each_pid_helper(int pid, const char *cmdline, void *arg) {
-    for_each_pid_func *func = (for_each_pid_func*) arg;
-    func(pid, cmdline);
+// Captures a snapshot for the for_each_*() variants that don't take one.
+static bool CaptureSnapshot(ProcSnapshot* snapshot, int flags) {
+    if (PropertiesHelper::IsDryRun()) return true;
+    if (!snapshot->Capture(flags)) {
+        printf("Failed to open /proc (%s)\n", strerror(errno));
+        return false;
+    }
+    return true;
 }
 
-void for_each_pid(for_each_pid_func func, const char *header) {
-    std::string title = header == nullptr ? "for_each_pid"
-                                          : android::base::StringPrintf("for_each_pid(%s)", header);
-    DurationReporter duration_reporter(title);
-    if (PropertiesHelper::IsDryRun()) return;
-
-    __for_each_pid(for_each_pid_helper, header, (void *) func);
+void for_each_pid(const ProcSnapshot& snapshot, for_each_pid_func func, const char* header) {
+    ForEachProcess(snapshot, "for_each_pid", header, [func](const ProcSnapshot::Process& process) {
+        func(process.pid, process.name.c_str());
+    });
 }
 
-static void for_each_tid_helper(int pid, const char *cmdline, void *arg) {
-    DIR *d;
-    struct dirent *de;
-    char taskpath[255];
-    for_each_tid_func *func = (for_each_tid_func *) arg;
-
-    snprintf(taskpath, sizeof(taskpath), "/proc/%d/task", pid);
-
-    if (!(d = opendir(taskpath))) {
-        printf("Failed to open %s (%s)\n", taskpath, strerror(errno));
-        return;
+void for_each_pid(for_each_pid_func func, const char *header) {
+    ProcSnapshot snapshot;
+    if (CaptureSnapshot(&snapshot, 0)) {
+        for_each_pid(snapshot, func, header);
     }
+}
 
-    func(pid, pid, cmdline);
-
-    while ((de = readdir(d))) {
-        if (ds.IsUserConsentDenied()) {
-            MYLOGE(
-                "Returning early because user denied consent to share bugreport with calling app.");
-            closedir(d);
-            return;
-        }
-        int tid;
-        int fd;
-        char commpath[255];
-        char comm[255];
-
-        if (!(tid = atoi(de->d_name))) {
-            continue;
-        }
-
-        if (tid == pid)
-            continue;
-
-        snprintf(commpath, sizeof(commpath), "/proc/%d/comm", tid);
-        memset(comm, 0, sizeof(comm));
-        if ((fd = TEMP_FAILURE_RETRY(open(commpath, O_RDONLY | O_CLOEXEC))) < 0) {
-            strcpy(comm, "N/A");
-        } else {
-            char *c;
-            TEMP_FAILURE_RETRY(read(fd, comm, sizeof(comm) - 2));
-            close(fd);
-
-            c = strrchr(comm, '\n');
-            if (c) {
-                *c = '\0';
-            }
+void for_each_tid(const ProcSnapshot& snapshot, for_each_tid_func func, const char* header) {
+    ForEachProcess(snapshot, "for_each_tid", header, [func](const ProcSnapshot::Process& process) {
+        func(process.pid, process.pid, process.name.c_str());
+        for (const ProcSnapshot::Thread& thread : process.threads) {
+            func(process.pid, thread.tid, thread.comm.c_str());
         }
-        func(pid, tid, comm);
-    }
-
-    closedir(d);
+    });
 }
 
 void for_each_tid(for_each_tid_func func, const char *header) {
-    std::string title = header == nullptr ? "for_each_tid"
-                                          : android::base::StringPrintf("for_each_tid(%s)", header);
-    DurationReporter duration_reporter(title);
-
-    if (PropertiesHelper::IsDryRun()) return;
+    ProcSnapshot snapshot;
+    if (CaptureSnapshot(&snapshot, ProcSnapshot::WITH_THREADS)) {
+        for_each_tid(snapshot, func, header);
+    }
+}
 
-    __for_each_pid(for_each_tid_helper, header, (void *) func);
+void for_each_process(const ProcSnapshot& snapshot, for_each_process_func func,
+                      const char* header) {
+    ForEachProcess(snapshot, "for_each_process", header, func);
 }
 
 void show_wchan(int pid, int tid, const char *name) {
@@ -473,42 +438,17 @@ static void snprdec(char *buffer, size_t len, size_t spc, unsigned permille) {
              "%*s", (spc > offset) ? (int)(spc - offset) : 0, str);
 }
 
-void show_showtime(int pid, const char *name) {
+void show_showtime(const ProcSnapshot::Process& process) {
     if (PropertiesHelper::IsDryRun()) return;
 
-    char path[255];
-    char buffer[1023];
-    int fd, ret, save_errno;
-
-    memset(buffer, 0, sizeof(buffer));
-
-    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
-    if ((fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC))) < 0) {
-        printf("Failed to open '%s' (%s)\n", path, strerror(errno));
-        return;
-    }
-
-    ret = TEMP_FAILURE_RETRY(read(fd, buffer, sizeof(buffer)));
-    save_errno = errno;
-    close(fd);
-
-    if (ret < 0) {
-        printf("Failed to read '%s' (%s)\n", path, strerror(save_errno));
-        return;
-    }
-
-    // field 14 is utime
-    // field 15 is stime
-    // field 42 is iotime
-    unsigned long long utime = 0, stime = 0, iotime = 0;
-    if (sscanf(buffer,
-               "%*u %*s %*s %*d %*d %*d %*d %*d %*d %*d %*d "
-               "%*d %*d %llu %llu %*d %*d %*d %*d %*d %*d "
-               "%*d %*d %*d %*d %*d %*d %*d %*d %*d %*d "
-               "%*d %*d %*d %*d %*d %*d %*d %*d %*d %llu ",
-               &utime, &stime, &iotime) != 3) {
+    if (!process.has_stat) {
+        if (process.stat_errno != 0) {
+            printf("Failed to open '/proc/%d/stat' (%s)\n", process.pid,
+                   strerror(process.stat_errno));
+        }
         return;
     }
+    unsigned long long utime = process.utime, stime = process.stime, iotime = process.iotime;
 
     unsigned long long total = utime + stime;
     if (!total) {
@@ -521,7 +461,9 @@ void show_showtime(int pid, const char *name) {
     }
 
     // try to beautify and stabilize columns at <80 characters
-    snprintf(buffer, sizeof(buffer), "%-6d%s", pid, name);
+    char buffer[1023];
+    const char* name = process.name.c_str();
+    snprintf(buffer, sizeof(buffer), "%-6d%s", process.pid, name);
     if ((name[0] != '[') || utime) {
         snprcent(buffer, sizeof(buffer), 57, utime);
     }
@@ -580,8 +522,9 @@ int Dumpstate::DumpFile(const std::string& title, const std::string& path) {
     DurationReporter duration_reporter(title);
 
     int status = DumpFileToFd(STDOUT_FILENO, title, path);
+    duration_reporter.SetStatus(status);
 
-    UpdateProgress(WEIGHT_FILE);
+    UpdateSectionProgress(title, WEIGHT_FILE);
 
     return status;
 }
@@ -699,13 +642,16 @@ int Dumpstate::RunCommand(const std::string& title, const std::vector<std::strin
                           const CommandOptions& options) {
     DurationReporter duration_reporter(title);
 
+    uint64_t start = Nanotime();
     int status = RunCommandToFd(STDOUT_FILENO, title, full_command, options);
+    // RunCommandToFd() doesn't tell timeouts apart from other failures.
+    duration_reporter.SetStatus(
+        status, status == -1 && Nanotime() - start >= options.TimeoutInMs() * 1000000ULL);
 
-    /* TODO: for now we're simplifying the progress calculation by using the
-     * timeout as the weight. It's a good approximation for most cases, except when calling dumpsys,
-     * where its weight should be much higher proportionally to its timeout.
-     * Ideally, it should use a options.EstimatedDuration() instead...*/
-    UpdateProgress(options.Timeout());
+    // Without a history of previous runs, the timeout is used as the weight. It's a rough
+    // approximation, especially for dumpsys, whose weight should be much higher proportionally to
+    // its timeout.
+    UpdateSectionProgress(title, options.Timeout());
 
     return status;
 }
@@ -826,6 +772,30 @@ void dump_route_tables() {
     fclose(fp);
 }
 
+void Dumpstate::UpdateSectionProgress(const std::string& title, int32_t default_weight) {
+    if (section_history_ == nullptr) {
+        UpdateProgress(default_weight);
+        return;
+    }
+    if (title.empty()) {
+        // Untitled sections can't be told apart, so their default weight (in seconds) stands for
+        // their duration, both in the history and in the progress.
+        float weight_ms = default_weight * 1000.0f;
+        section_history_->RecordUntitledProgress(weight_ms);
+        UpdateProgress(has_section_history_ ? lround(weight_ms / kProgressUnitMs) : default_weight);
+        return;
+    }
+    // Remembered for the next runs, which will know how long the section takes.
+    section_history_->MarkProgress(title);
+    if (!has_section_history_) {
+        UpdateProgress(default_weight);
+        return;
+    }
+    // Called once per run of the section, so this adds up to the expected duration of all runs.
+    float duration_ms = section_history_->ExpectedDurationMs(title);
+    UpdateProgress(duration_ms > 0 ? lround(duration_ms / kProgressUnitMs) : 0);
+}
+
 // TODO: make this function thread safe if sections are generated in parallel.
 void Dumpstate::UpdateProgress(int32_t delta_sec) {
     if (progress_ == nullptr) {
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DexoptStats.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <deque>
+#include <mutex>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace installd {
+
+// Number of child invocations kept in memory.
+static constexpr size_t kMaxDexoptStats = 256;
+
+// Binary export format, all integers little endian:
+//   header:  "DXST" u32 version, u32 record count
+//   record:  u8 tool, i32 status, i64 start_time_ms, wall_time_ms, user_time_ms,
+//            sys_time_ms, max_rss_kb, read_bytes, write_bytes, output_bytes,
+//            then package, location, compiler_filter, reason as u32 length + bytes.
+static constexpr char kBinaryMagic[] = "DXST";
+static constexpr uint32_t kBinaryVersion = 1;
+
+static std::mutex gStatsLock;
+static std::deque<DexoptStats> gStats;
+
+static int64_t timeval_to_ms(const struct timeval& tv) {
+    return static_cast<int64_t>(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+DexoptStats::DexoptStats(Tool tool, const std::string& package, const std::string& location)
+      : tool(tool),
+        package(package),
+        location(location),
+        start_time_ms(std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count()),
+        mStart(std::chrono::steady_clock::now()) {
+}
+
+void DexoptStats::addOutputFd(int fd) {
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        output_bytes += st.st_size;
+    }
+}
+
+// Reads read_bytes/write_bytes from /proc/<pid>/io. The child must not be reaped yet.
+static void read_proc_io(pid_t pid, DexoptStats* stats) {
+    std::string content;
+    if (!android::base::ReadFileToString(StringPrintf("/proc/%d/io", pid), &content)) {
+        return;
+    }
+    for (const auto& line : android::base::Split(content, "\n")) {
+        int64_t* target = nullptr;
+        size_t prefix_len = 0;
+        if (android::base::StartsWith(line, "read_bytes: ")) {
+            target = &stats->read_bytes;
+            prefix_len = strlen("read_bytes: ");
+        } else if (android::base::StartsWith(line, "write_bytes: ")) {
+            target = &stats->write_bytes;
+            prefix_len = strlen("write_bytes: ");
+        }
+        if (target != nullptr && !android::base::ParseInt(line.substr(prefix_len), target)) {
+            *target = -1;
+        }
+    }
+}
+
+int wait_child_with_stats(pid_t pid, DexoptStats* stats) {
+    // Wait for the child to exit without reaping it so that /proc/<pid>/io is still there.
+    siginfo_t info;
+    if (TEMP_FAILURE_RETRY(waitid(P_PID, pid, &info, WEXITED | WNOWAIT)) == 0) {
+        read_proc_io(pid, stats);
+    }
+
+    int status;
+    struct rusage usage;
+    pid_t got_pid = TEMP_FAILURE_RETRY(wait4(pid, &status, 0, &usage));
+    stats->wall_time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - stats->mStart).count();
+    if (got_pid != pid) {
+        PLOG(WARNING) << "wait4 failed: wanted " << pid << ", got " << got_pid;
+        stats->status = 1;
+        return 1;
+    }
+
+    stats->user_time_ms = timeval_to_ms(usage.ru_utime);
+    stats->sys_time_ms = timeval_to_ms(usage.ru_stime);
+    stats->max_rss_kb = usage.ru_maxrss;
+    stats->status = status;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return 0;
+    } else {
+        return status;      /* always nonzero */
+    }
+}
+
+void record_dexopt_stats(const DexoptStats& stats) {
+    LOG(DEBUG) << (stats.tool == DexoptStats::kDex2oat ? "dex2oat" : "profman")
+            << " " << stats.location << " wall=" << stats.wall_time_ms << "ms"
+            << " cpu=" << (stats.user_time_ms + stats.sys_time_ms) << "ms"
+            << " rss=" << stats.max_rss_kb << "kB";
+
+    std::lock_guard<std::mutex> lock(gStatsLock);
+    if (gStats.size() == kMaxDexoptStats) {
+        gStats.pop_front();
+    }
+    gStats.push_back(stats);
+}
+
+void dump_dexopt_stats(std::ostream& out) {
+    std::lock_guard<std::mutex> lock(gStatsLock);
+    out << "Dexopt child processes (last " << gStats.size() << "):" << std::endl;
+    out << StringPrintf("    %-7s %8s %8s %8s %8s %10s %10s %10s %-14s %-12s %s",
+            "tool", "wall_ms", "user_ms", "sys_ms", "rss_kB", "read_kB", "write_kB",
+            "out_kB", "filter", "reason", "location") << std::endl;
+
+    int64_t total_wall = 0;
+    int64_t total_cpu = 0;
+    for (const auto& s : gStats) {
+        out << StringPrintf("    %-7s %8" PRId64 " %8" PRId64 " %8" PRId64 " %8" PRId64
+                " %10" PRId64 " %10" PRId64 " %10" PRId64 " %-14s %-12s %s",
+                s.tool == DexoptStats::kDex2oat ? "dex2oat" : "profman",
+                s.wall_time_ms, s.user_time_ms, s.sys_time_ms, s.max_rss_kb,
+                s.read_bytes < 0 ? -1 : s.read_bytes / 1024,
+                s.write_bytes < 0 ? -1 : s.write_bytes / 1024,
+                s.output_bytes / 1024,
+                s.compiler_filter.empty() ? "-" : s.compiler_filter.c_str(),
+                s.reason.empty() ? "-" : s.reason.c_str(),
+                s.location.c_str());
+        if (s.status != 0) {
+            out << StringPrintf(" (status=0x%x)", s.status);
+        }
+        out << std::endl;
+        total_wall += s.wall_time_ms;
+        total_cpu += s.user_time_ms + s.sys_time_ms;
+    }
+    out << "    total wall_ms=" << total_wall << " cpu_ms=" << total_cpu << std::endl;
+}
+
+static void append_u32(std::string* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+static void append_i32(std::string* out, int32_t value) {
+    append_u32(out, static_cast<uint32_t>(value));
+}
+
+static void append_i64(std::string* out, int64_t value) {
+    uint64_t v = static_cast<uint64_t>(value);
+    for (int i = 0; i < 8; i++) {
+        out->push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
+}
+
+static void append_string(std::string* out, const std::string& value) {
+    append_u32(out, value.size());
+    out->append(value);
+}
+
+bool write_dexopt_stats_binary(int fd) {
+    std::string blob;
+    {
+        std::lock_guard<std::mutex> lock(gStatsLock);
+        blob.append(kBinaryMagic, 4);
+        append_u32(&blob, kBinaryVersion);
+        append_u32(&blob, gStats.size());
+        for (const auto& s : gStats) {
+            blob.push_back(static_cast<char>(s.tool));
+            append_i32(&blob, s.status);
+            append_i64(&blob, s.start_time_ms);
+            append_i64(&blob, s.wall_time_ms);
+            append_i64(&blob, s.user_time_ms);
+            append_i64(&blob, s.sys_time_ms);
+            append_i64(&blob, s.max_rss_kb);
+            append_i64(&blob, s.read_bytes);
+            append_i64(&blob, s.write_bytes);
+            append_i64(&blob, s.output_bytes);
+            append_string(&blob, s.package);
+            append_string(&blob, s.location);
+            append_string(&blob, s.compiler_filter);
+            append_string(&blob, s.reason);
+        }
+    }
+    return android::base::WriteFully(fd, blob.data(), blob.size());
+}
+
+}  // namespace installd
+}  // namespace android
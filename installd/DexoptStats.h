@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_INSTALLD_DEXOPT_STATS_H
+#define ANDROID_INSTALLD_DEXOPT_STATS_H
+
+#include <chrono>
+#include <ostream>
+#include <string>
+
+#include <sys/types.h>
+
+namespace android {
+namespace installd {
+
+/**
+ * Resource accounting for a single dex2oat or profman child process.
+ */
+struct DexoptStats {
+    enum Tool : uint8_t {
+        kDex2oat = 0,
+        kProfman = 1,
+    };
+
+    DexoptStats(Tool tool, const std::string& package, const std::string& location);
+
+    Tool tool;
+    std::string package;
+    std::string location;
+    std::string compiler_filter;
+    std::string reason;
+
+    // Wall clock time (ms since epoch) at which the child was started.
+    int64_t start_time_ms;
+    int64_t wall_time_ms = 0;
+    int64_t user_time_ms = 0;
+    int64_t sys_time_ms = 0;
+    int64_t max_rss_kb = 0;
+    // Storage I/O as reported by /proc/<pid>/io, or -1 if it could not be read.
+    int64_t read_bytes = -1;
+    int64_t write_bytes = -1;
+    // Total size of the generated artifacts (oat/vdex/art or reference profile).
+    int64_t output_bytes = 0;
+    // Raw wait status of the child.
+    int32_t status = 0;
+
+    // Adds the size of the file behind fd to output_bytes. Ignores invalid fds.
+    void addOutputFd(int fd);
+
+  private:
+    std::chrono::steady_clock::time_point mStart;
+
+    friend int wait_child_with_stats(pid_t pid, DexoptStats* stats);
+};
+
+/**
+ * Same contract as wait_child(), but also collects the rusage and I/O counters of the
+ * child into stats.
+ */
+int wait_child_with_stats(pid_t pid, DexoptStats* stats);
+
+/**
+ * Appends stats to the bounded in-memory history. The oldest record is dropped when full.
+ */
+void record_dexopt_stats(const DexoptStats& stats);
+
+/**
+ * Prints the history as a human readable table.
+ */
+void dump_dexopt_stats(std::ostream& out);
+
+/**
+ * Writes the history to fd using the compact binary format described in DexoptStats.cpp.
+ */
+bool write_dexopt_stats_binary(int fd);
+
+}  // namespace installd
+}  // namespace android
+
+#endif  // ANDROID_INSTALLD_DEXOPT_STATS_H
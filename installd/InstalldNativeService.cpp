@@ -65,6 +65,7 @@
 #include "view_compiler.h"
 
 #include "CacheTracker.h"
+#include "DexoptStats.h"
 #include "MatchExtensionGen.h"
 #include "QuotaUtils.h"
 
@@ -102,6 +103,18 @@ static constexpr int kVerityPageSize = 4096;
 static constexpr size_t kSha256Size = 32;
 static constexpr const char* kPropApkVerityMode = "ro.apk_verity.mode";
 
+// Maximum number of profman children running at once for mergeProfilesForPackages.
+static constexpr size_t kMaxConcurrentProfileMerges = 4;
+
+// Maximum number of packages relabeled at once by restoreconAppDataForPackages.
+static constexpr size_t kMaxConcurrentRestorecons = 4;
+
+// Maximum number of packages or user directories prepared at once by createAppDataForPackages
+// and fixupAppData.
+static constexpr size_t kMaxConcurrentAppDataJobs = 4;
+
+static constexpr const char* kRestoreconIndexDir = "/data/misc/installd";
+
 namespace {
 
 constexpr const char* kDump = "android.permission.DUMP";
@@ -264,13 +277,19 @@ status_t InstalldNativeService::start() {
     return android::OK;
 }
 
-status_t InstalldNativeService::dump(int fd, const Vector<String16> & /* args */) {
+status_t InstalldNativeService::dump(int fd, const Vector<String16> & args) {
     auto out = std::fstream(StringPrintf("/proc/self/fd/%d", fd));
     const binder::Status dump_permission = checkPermission(kDump);
     if (!dump_permission.isOk()) {
         out << dump_permission.toString8() << endl;
         return PERMISSION_DENIED;
     }
+
+    // Machine readable export of the dexopt child process history only.
+    if (args.size() > 0 && args[0] == String16("--dexopt-stats-binary")) {
+        return write_dexopt_stats_binary(fd) ? NO_ERROR : UNKNOWN_ERROR;
+    }
+
     std::lock_guard<std::recursive_mutex> lock(mLock);
 
     out << "installd is happy!" << endl;
@@ -291,6 +310,9 @@ status_t InstalldNativeService::dump(int fd, const Vector<String16> & /* args */
         }
     }
 
+    out << endl;
+    dump_dexopt_stats(out);
+
     out << endl;
     out.flush();
 
@@ -412,7 +434,92 @@ binder::Status InstalldNativeService::createAppData(const std::unique_ptr<std::s
     CHECK_ARGUMENT_PACKAGE_NAME(packageName);
     std::lock_guard<std::recursive_mutex> lock(mLock);
 
+    return createAppDataLocked(getRestoreconIndex(uuid), uuid ? uuid->c_str() : nullptr,
+            packageName, userId, flags, appId, seInfo, targetSdkVersion, _aidl_return);
+}
+
+binder::Status InstalldNativeService::createAppDataForPackages(
+        const std::unique_ptr<std::string>& uuid, const std::vector<std::string>& packageNames,
+        int32_t userId, int32_t flags, const std::vector<int32_t>& appIds,
+        const std::vector<std::string>& seInfos, const std::vector<int32_t>& targetSdkVersions,
+        std::vector<int64_t>* _aidl_return) {
+    ENFORCE_UID(AID_SYSTEM);
+    CHECK_ARGUMENT_UUID(uuid);
+    if (appIds.size() != packageNames.size() || seInfos.size() != packageNames.size()
+            || targetSdkVersions.size() != packageNames.size()) {
+        return error("Mismatched argument sizes");
+    }
+    for (const auto& packageName : packageNames) {
+        CHECK_ARGUMENT_PACKAGE_NAME(packageName);
+    }
+    std::lock_guard<std::recursive_mutex> lock(mLock);
+
+    RestoreconIndex& restoreconIndex = getRestoreconIndex(uuid);
     const char* uuid_ = uuid ? uuid->c_str() : nullptr;
+    const size_t count = packageNames.size();
+    std::vector<binder::Status> results(count);
+    _aidl_return->assign(count, -1);
+
+    run_in_parallel(count, kMaxConcurrentAppDataJobs, [&](size_t i) {
+        const char* pkgname = packageNames[i].c_str();
+        auto ce_path = create_data_user_ce_package_path(uuid_, userId, pkgname);
+        auto de_path = create_data_user_de_package_path(uuid_, userId, pkgname);
+        auto cur_profile_path = create_primary_current_profile_package_dir_path(userId,
+                packageNames[i]);
+        auto ref_profile_path = create_primary_reference_profile_package_dir_path(
+                packageNames[i]);
+        bool ce_existing = (access(ce_path.c_str(), F_OK) == 0);
+        bool de_existing = (access(de_path.c_str(), F_OK) == 0);
+        bool cur_profile_existing = (access(cur_profile_path.c_str(), F_OK) == 0);
+        bool ref_profile_existing = (access(ref_profile_path.c_str(), F_OK) == 0);
+
+        results[i] = createAppDataLocked(restoreconIndex, uuid_, packageNames[i], userId, flags,
+                appIds[i], seInfos[i], targetSdkVersions[i], &(*_aidl_return)[i]);
+
+        // Don't leave half-prepared data behind for packages that failed; a retry will
+        // start from scratch. That includes the restorecon index entries written for the
+        // directories, or a recreated directory could be taken for a labeled one.
+        if (!results[i].isOk()) {
+            if ((flags & FLAG_STORAGE_CE) && !ce_existing) {
+                delete_dir_contents_and_dir(ce_path, true);
+                restoreconIndex.remove(userId, FLAG_STORAGE_CE, packageNames[i]);
+            }
+            if ((flags & FLAG_STORAGE_DE) && !de_existing) {
+                delete_dir_contents_and_dir(de_path, true);
+                restoreconIndex.remove(userId, FLAG_STORAGE_DE, packageNames[i]);
+            }
+            // Profile directories are prepared along with the DE directory.
+            if ((flags & FLAG_STORAGE_DE) && !cur_profile_existing) {
+                delete_dir_contents_and_dir(cur_profile_path, true);
+            }
+            if ((flags & FLAG_STORAGE_DE) && !ref_profile_existing) {
+                delete_dir_contents_and_dir(ref_profile_path, true);
+            }
+            (*_aidl_return)[i] = -1;
+        }
+    });
+
+    // Report every failure, in the order the packages were given.
+    std::string errors;
+    for (size_t i = 0; i < count; i++) {
+        if (!results[i].isOk()) {
+            errors += packageNames[i] + ": " + results[i].exceptionMessage().c_str() + "; ";
+        }
+    }
+    if (!errors.empty()) {
+        return error("Failed to create app data: " + errors);
+    }
+    return ok();
+}
+
+/**
+ * Prepare the CE and/or DE data directories of a single package. Only touches thread-safe
+ * state, so it can run on multiple threads.
+ */
+binder::Status InstalldNativeService::createAppDataLocked(RestoreconIndex& restoreconIndex,
+        const char* uuid_, const std::string& packageName, int32_t userId, int32_t flags,
+        int32_t appId, const std::string& seInfo, int32_t targetSdkVersion,
+        int64_t* _aidl_return) {
     const char* pkgname = packageName.c_str();
 
     // Assume invalid inode unless filled in below
@@ -437,11 +544,16 @@ binder::Status InstalldNativeService::createAppData(const std::unique_ptr<std::s
             return error("Failed to prepare " + path);
         }
 
-        // Consider restorecon over contents if label changed
-        if (restorecon_app_data_lazy(path, seInfo, uid, existing) ||
-                restorecon_app_data_lazy(path, "cache", seInfo, uid, existing) ||
-                restorecon_app_data_lazy(path, "code_cache", seInfo, uid, existing)) {
-            return error("Failed to restorecon " + path);
+        // Consider restorecon over contents if label changed, unless the tree was already
+        // labeled for this uid/seinfo under the current policy
+        if (!restoreconIndex.isUpToDate(userId, FLAG_STORAGE_CE, packageName, uid, seInfo,
+                path)) {
+            if (restorecon_app_data_lazy(path, seInfo, uid, existing) ||
+                    restorecon_app_data_lazy(path, "cache", seInfo, uid, existing) ||
+                    restorecon_app_data_lazy(path, "code_cache", seInfo, uid, existing)) {
+                return error("Failed to restorecon " + path);
+            }
+            restoreconIndex.markLabeled(userId, FLAG_STORAGE_CE, packageName, uid, seInfo, path);
         }
 
         // Remember inode numbers of cache directories so that we can clear
@@ -468,11 +580,16 @@ binder::Status InstalldNativeService::createAppData(const std::unique_ptr<std::s
             return error("Failed to prepare " + path);
         }
 
-        // Consider restorecon over contents if label changed
-        if (restorecon_app_data_lazy(path, seInfo, uid, existing) ||
-                restorecon_app_data_lazy(path, "cache", seInfo, uid, existing) ||
-                restorecon_app_data_lazy(path, "code_cache", seInfo, uid, existing)) {
-            return error("Failed to restorecon " + path);
+        // Consider restorecon over contents if label changed, unless the tree was already
+        // labeled for this uid/seinfo under the current policy
+        if (!restoreconIndex.isUpToDate(userId, FLAG_STORAGE_DE, packageName, uid, seInfo,
+                path)) {
+            if (restorecon_app_data_lazy(path, seInfo, uid, existing) ||
+                    restorecon_app_data_lazy(path, "cache", seInfo, uid, existing) ||
+                    restorecon_app_data_lazy(path, "code_cache", seInfo, uid, existing)) {
+                return error("Failed to restorecon " + path);
+            }
+            restoreconIndex.markLabeled(userId, FLAG_STORAGE_DE, packageName, uid, seInfo, path);
         }
 
         if (!prepare_app_profile_dir(packageName, appId, userId)) {
@@ -533,6 +650,8 @@ binder::Status InstalldNativeService::clearAppProfiles(const std::string& packag
     CHECK_ARGUMENT_PACKAGE_NAME(packageName);
     std::lock_guard<std::recursive_mutex> lock(mLock);
 
+    mMergedProfileFingerprints.erase(packageName + "/" + profileName);
+
     binder::Status res = ok();
     if (!clear_primary_reference_profile(packageName, profileName)) {
         res = error("Failed to clear reference profile for " + packageName);
@@ -643,6 +762,15 @@ binder::Status InstalldNativeService::destroyAppProfiles(const std::string& pack
     CHECK_ARGUMENT_PACKAGE_NAME(packageName);
     std::lock_guard<std::recursive_mutex> lock(mLock);
 
+    const std::string prefix = packageName + "/";
+    for (auto it = mMergedProfileFingerprints.begin(); it != mMergedProfileFingerprints.end();) {
+        if (android::base::StartsWith(it->first, prefix)) {
+            it = mMergedProfileFingerprints.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
     binder::Status res = ok();
     std::vector<userid_t> users = get_known_users(/*volume_uuid*/ nullptr);
     for (auto user : users) {
@@ -667,17 +795,20 @@ binder::Status InstalldNativeService::destroyAppData(const std::unique_ptr<std::
     const char* pkgname = packageName.c_str();
 
     binder::Status res = ok();
+    RestoreconIndex& restoreconIndex = getRestoreconIndex(uuid);
     if (flags & FLAG_STORAGE_CE) {
         auto path = create_data_user_ce_package_path(uuid_, userId, pkgname, ceDataInode);
         if (delete_dir_contents_and_dir(path) != 0) {
             res = error("Failed to delete " + path);
         }
+        restoreconIndex.remove(userId, FLAG_STORAGE_CE, packageName);
     }
     if (flags & FLAG_STORAGE_DE) {
         auto path = create_data_user_de_package_path(uuid_, userId, pkgname);
         if (delete_dir_contents_and_dir(path) != 0) {
             res = error("Failed to delete " + path);
         }
+        restoreconIndex.remove(userId, FLAG_STORAGE_DE, packageName);
         destroy_app_current_profiles(packageName, userId);
         // TODO(calin): If the package is still installed by other users it's probably
         // beneficial to keep the reference profile around.
@@ -716,105 +847,125 @@ static gid_t get_cache_gid(uid_t uid) {
     return (gid != -1) ? gid : uid;
 }
 
-binder::Status InstalldNativeService::fixupAppData(const std::unique_ptr<std::string>& uuid,
-        int32_t flags) {
-    ENFORCE_UID(AID_SYSTEM);
-    CHECK_ARGUMENT_UUID(uuid);
-    std::lock_guard<std::recursive_mutex> lock(mLock);
-
-    const char* uuid_ = uuid ? uuid->c_str() : nullptr;
-    for (auto user : get_known_users(uuid_)) {
-        ATRACE_BEGIN("fixup user");
-        FTS* fts;
-        FTSENT* p;
-        auto ce_path = create_data_user_ce_path(uuid_, user);
-        auto de_path = create_data_user_de_path(uuid_, user);
-        char *argv[] = { (char*) ce_path.c_str(), (char*) de_path.c_str(), nullptr };
-        if (!(fts = fts_open(argv, FTS_PHYSICAL | FTS_NOCHDIR | FTS_XDEV, nullptr))) {
-            return error("Failed to fts_open");
-        }
-        while ((p = fts_read(fts)) != nullptr) {
-            if (p->fts_info == FTS_D && p->fts_level == 1) {
-                // Track down inodes of cache directories
-                uint64_t raw = 0;
-                ino_t inode_cache = 0;
-                ino_t inode_code_cache = 0;
-                if (getxattr(p->fts_path, kXattrInodeCache, &raw, sizeof(raw)) == sizeof(raw)) {
-                    inode_cache = raw;
-                }
-                if (getxattr(p->fts_path, kXattrInodeCodeCache, &raw, sizeof(raw)) == sizeof(raw)) {
-                    inode_code_cache = raw;
-                }
+/**
+ * Fix up the GIDs of all app data under the given user data directory (CE or DE).
+ */
+static binder::Status fixup_user_app_data(const std::string& user_path, int32_t flags) {
+    ATRACE_BEGIN("fixup user");
+    FTS* fts;
+    FTSENT* p;
+    char *argv[] = { (char*) user_path.c_str(), nullptr };
+    if (!(fts = fts_open(argv, FTS_PHYSICAL | FTS_NOCHDIR | FTS_XDEV, nullptr))) {
+        ATRACE_END();
+        return error("Failed to fts_open");
+    }
+    while ((p = fts_read(fts)) != nullptr) {
+        if (p->fts_info == FTS_D && p->fts_level == 1) {
+            // Track down inodes of cache directories
+            uint64_t raw = 0;
+            ino_t inode_cache = 0;
+            ino_t inode_code_cache = 0;
+            if (getxattr(p->fts_path, kXattrInodeCache, &raw, sizeof(raw)) == sizeof(raw)) {
+                inode_cache = raw;
+            }
+            if (getxattr(p->fts_path, kXattrInodeCodeCache, &raw, sizeof(raw)) == sizeof(raw)) {
+                inode_code_cache = raw;
+            }
 
-                // Figure out expected GID of each child
-                FTSENT* child = fts_children(fts, 0);
-                while (child != nullptr) {
-                    if ((child->fts_statp->st_ino == inode_cache)
-                            || (child->fts_statp->st_ino == inode_code_cache)
-                            || !strcmp(child->fts_name, "cache")
-                            || !strcmp(child->fts_name, "code_cache")) {
-                        child->fts_number = get_cache_gid(p->fts_statp->st_uid);
-                    } else {
-                        child->fts_number = p->fts_statp->st_uid;
-                    }
-                    child = child->fts_link;
-                }
-            } else if (p->fts_level >= 2) {
-                if (p->fts_level > 2) {
-                    // Inherit GID from parent once we're deeper into tree
-                    p->fts_number = p->fts_parent->fts_number;
+            // Figure out expected GID of each child
+            FTSENT* child = fts_children(fts, 0);
+            while (child != nullptr) {
+                if ((child->fts_statp->st_ino == inode_cache)
+                        || (child->fts_statp->st_ino == inode_code_cache)
+                        || !strcmp(child->fts_name, "cache")
+                        || !strcmp(child->fts_name, "code_cache")) {
+                    child->fts_number = get_cache_gid(p->fts_statp->st_uid);
+                } else {
+                    child->fts_number = p->fts_statp->st_uid;
                 }
+                child = child->fts_link;
+            }
+        } else if (p->fts_level >= 2) {
+            if (p->fts_level > 2) {
+                // Inherit GID from parent once we're deeper into tree
+                p->fts_number = p->fts_parent->fts_number;
+            }
 
-                uid_t uid = p->fts_parent->fts_statp->st_uid;
-                gid_t cache_gid = get_cache_gid(uid);
-                gid_t expected = p->fts_number;
-                gid_t actual = p->fts_statp->st_gid;
-                if (actual == expected) {
+            uid_t uid = p->fts_parent->fts_statp->st_uid;
+            gid_t cache_gid = get_cache_gid(uid);
+            gid_t expected = p->fts_number;
+            gid_t actual = p->fts_statp->st_gid;
+            if (actual == expected) {
 #if FIXUP_DEBUG
-                    LOG(DEBUG) << "Ignoring " << p->fts_path << " with expected GID " << expected;
+                LOG(DEBUG) << "Ignoring " << p->fts_path << " with expected GID " << expected;
 #endif
-                    if (!(flags & FLAG_FORCE)) {
-                        fts_set(fts, p, FTS_SKIP);
-                    }
-                } else if ((actual == uid) || (actual == cache_gid)) {
-                    // Only consider fixing up when current GID belongs to app
-                    if (p->fts_info != FTS_D) {
-                        LOG(INFO) << "Fixing " << p->fts_path << " with unexpected GID " << actual
-                                << " instead of " << expected;
-                    }
-                    switch (p->fts_info) {
-                    case FTS_DP:
-                        // If we're moving towards cache GID, we need to set S_ISGID
-                        if (expected == cache_gid) {
-                            if (chmod(p->fts_path, 02771) != 0) {
-                                PLOG(WARNING) << "Failed to chmod " << p->fts_path;
-                            }
-                        }
-                        [[fallthrough]]; // also set GID
-                    case FTS_F:
-                        if (chown(p->fts_path, -1, expected) != 0) {
-                            PLOG(WARNING) << "Failed to chown " << p->fts_path;
-                        }
-                        break;
-                    case FTS_SL:
-                    case FTS_SLNONE:
-                        if (lchown(p->fts_path, -1, expected) != 0) {
-                            PLOG(WARNING) << "Failed to chown " << p->fts_path;
+                if (!(flags & FLAG_FORCE)) {
+                    fts_set(fts, p, FTS_SKIP);
+                }
+            } else if ((actual == uid) || (actual == cache_gid)) {
+                // Only consider fixing up when current GID belongs to app
+                if (p->fts_info != FTS_D) {
+                    LOG(INFO) << "Fixing " << p->fts_path << " with unexpected GID " << actual
+                            << " instead of " << expected;
+                }
+                switch (p->fts_info) {
+                case FTS_DP:
+                    // If we're moving towards cache GID, we need to set S_ISGID
+                    if (expected == cache_gid) {
+                        if (chmod(p->fts_path, 02771) != 0) {
+                            PLOG(WARNING) << "Failed to chmod " << p->fts_path;
                         }
-                        break;
                     }
-                } else {
-                    // Ignore all other GID transitions, since they're kinda shady
-                    LOG(WARNING) << "Ignoring " << p->fts_path << " with unexpected GID " << actual
-                            << " instead of " << expected;
-                    if (!(flags & FLAG_FORCE)) {
-                        fts_set(fts, p, FTS_SKIP);
+                    [[fallthrough]]; // also set GID
+                case FTS_F:
+                    if (chown(p->fts_path, -1, expected) != 0) {
+                        PLOG(WARNING) << "Failed to chown " << p->fts_path;
+                    }
+                    break;
+                case FTS_SL:
+                case FTS_SLNONE:
+                    if (lchown(p->fts_path, -1, expected) != 0) {
+                        PLOG(WARNING) << "Failed to chown " << p->fts_path;
                     }
+                    break;
+                }
+            } else {
+                // Ignore all other GID transitions, since they're kinda shady
+                LOG(WARNING) << "Ignoring " << p->fts_path << " with unexpected GID " << actual
+                        << " instead of " << expected;
+                if (!(flags & FLAG_FORCE)) {
+                    fts_set(fts, p, FTS_SKIP);
                 }
             }
         }
-        fts_close(fts);
-        ATRACE_END();
+    }
+    fts_close(fts);
+    ATRACE_END();
+    return ok();
+}
+
+binder::Status InstalldNativeService::fixupAppData(const std::unique_ptr<std::string>& uuid,
+        int32_t flags) {
+    ENFORCE_UID(AID_SYSTEM);
+    CHECK_ARGUMENT_UUID(uuid);
+    std::lock_guard<std::recursive_mutex> lock(mLock);
+
+    const char* uuid_ = uuid ? uuid->c_str() : nullptr;
+    std::vector<std::string> paths;
+    for (auto user : get_known_users(uuid_)) {
+        paths.push_back(create_data_user_ce_path(uuid_, user));
+        paths.push_back(create_data_user_de_path(uuid_, user));
+    }
+
+    // Every user data directory is an independent tree; walk them concurrently.
+    std::vector<binder::Status> results(paths.size());
+    run_in_parallel(paths.size(), kMaxConcurrentAppDataJobs, [&](size_t i) {
+        results[i] = fixup_user_app_data(paths[i], flags);
+    });
+    for (const auto& result : results) {
+        if (!result.isOk()) {
+            return result;
+        }
     }
     return ok();
 }
@@ -1202,6 +1353,7 @@ binder::Status InstalldNativeService::destroyUserData(const std::unique_ptr<std:
 
     const char* uuid_ = uuid ? uuid->c_str() : nullptr;
     binder::Status res = ok();
+    getRestoreconIndex(uuid).removeUser(userId);
     if (flags & FLAG_STORAGE_DE) {
         auto path = create_data_user_de_path(uuid_, userId);
         if (delete_dir_contents_and_dir(path, true) != 0) {
@@ -2057,6 +2209,55 @@ binder::Status InstalldNativeService::mergeProfiles(int32_t uid, const std::stri
     std::lock_guard<std::recursive_mutex> lock(mLock);
 
     *_aidl_return = analyze_primary_profiles(uid, packageName, profileName);
+    mMergedProfileFingerprints[packageName + "/" + profileName] =
+            get_primary_current_profiles_fingerprint(packageName, profileName);
+    return ok();
+}
+
+binder::Status InstalldNativeService::mergeProfilesForPackages(const std::vector<int32_t>& uids,
+        const std::vector<std::string>& packageNames, const std::vector<std::string>& profileNames,
+        std::vector<bool>* _aidl_return) {
+    ENFORCE_UID(AID_SYSTEM);
+    if (uids.size() != packageNames.size() || profileNames.size() != packageNames.size()) {
+        return error("Mismatched argument sizes");
+    }
+    for (const auto& packageName : packageNames) {
+        CHECK_ARGUMENT_PACKAGE_NAME(packageName);
+    }
+    std::lock_guard<std::recursive_mutex> lock(mLock);
+
+    const size_t count = packageNames.size();
+    std::vector<std::string> keys(count);
+    std::vector<std::string> fingerprints(count);
+    std::vector<uint8_t> results(count, false);
+    std::vector<uint8_t> skipped(count, false);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = packageNames[i] + "/" + profileNames[i];
+        fingerprints[i] = get_primary_current_profiles_fingerprint(packageNames[i],
+                profileNames[i]);
+        // Nothing new was recorded since the last merge, so there is nothing to compile for.
+        auto it = mMergedProfileFingerprints.find(keys[i]);
+        skipped[i] = it != mMergedProfileFingerprints.end() && it->second == fingerprints[i];
+    }
+
+    // Each merge runs in its own profman child; keep a few of them going at once.
+    run_in_parallel(count, kMaxConcurrentProfileMerges, [&](size_t i) {
+        if (skipped[i]) {
+            return;
+        }
+        results[i] = analyze_primary_profiles(uids[i], packageNames[i], profileNames[i]);
+        // The merge might have cleared the current profiles, so fingerprint them again.
+        fingerprints[i] = get_primary_current_profiles_fingerprint(packageNames[i],
+                profileNames[i]);
+    });
+
+    _aidl_return->resize(count);
+    for (size_t i = 0; i < count; i++) {
+        (*_aidl_return)[i] = results[i];
+        mMergedProfileFingerprints[keys[i]] = fingerprints[i];
+    }
+    LOG(DEBUG) << "Merged profiles for " << count << " packages, skipped "
+            << std::count(skipped.begin(), skipped.end(), true) << " unchanged";
     return ok();
 }
 
@@ -2456,25 +2657,77 @@ binder::Status InstalldNativeService::restoreconAppData(const std::unique_ptr<st
     CHECK_ARGUMENT_PACKAGE_NAME(packageName);
     std::lock_guard<std::recursive_mutex> lock(mLock);
 
+    return restoreconAppDataLocked(getRestoreconIndex(uuid), uuid ? uuid->c_str() : nullptr,
+            packageName, userId, flags, appId, seInfo);
+}
+
+binder::Status InstalldNativeService::restoreconAppDataForPackages(
+        const std::unique_ptr<std::string>& uuid, const std::vector<std::string>& packageNames,
+        int32_t userId, int32_t flags, const std::vector<int32_t>& appIds,
+        const std::vector<std::string>& seInfos) {
+    ENFORCE_UID(AID_SYSTEM);
+    CHECK_ARGUMENT_UUID(uuid);
+    if (appIds.size() != packageNames.size() || seInfos.size() != packageNames.size()) {
+        return error("Mismatched argument sizes");
+    }
+    for (const auto& packageName : packageNames) {
+        CHECK_ARGUMENT_PACKAGE_NAME(packageName);
+    }
+    std::lock_guard<std::recursive_mutex> lock(mLock);
+
+    RestoreconIndex& index = getRestoreconIndex(uuid);
+    const char* uuid_ = uuid ? uuid->c_str() : nullptr;
+    std::vector<binder::Status> results(packageNames.size());
+    run_in_parallel(packageNames.size(), kMaxConcurrentRestorecons, [&](size_t i) {
+        results[i] = restoreconAppDataLocked(index, uuid_, packageNames[i], userId, flags,
+                appIds[i], seInfos[i]);
+    });
+
+    // Report the first failure in input order.
+    for (const auto& result : results) {
+        if (!result.isOk()) {
+            return result;
+        }
+    }
+    return ok();
+}
+
+/**
+ * Recursively restorecon the app data of a single package. Trees whose index entry still
+ * matches (same uid, seinfo and policy, directories neither recreated nor relabeled since the
+ * last full relabel) are skipped, unless FLAG_FORCE is set. Only touches thread-safe state, so
+ * it can run on multiple threads.
+ */
+binder::Status InstalldNativeService::restoreconAppDataLocked(RestoreconIndex& index,
+        const char* uuid, const std::string& packageName, int32_t userId, int32_t flags,
+        int32_t appId, const std::string& seInfo) {
     binder::Status res = ok();
 
     // SELINUX_ANDROID_RESTORECON_DATADATA flag is set by libselinux. Not needed here.
     unsigned int seflags = SELINUX_ANDROID_RESTORECON_RECURSE;
-    const char* uuid_ = uuid ? uuid->c_str() : nullptr;
     const char* pkgName = packageName.c_str();
     const char* seinfo = seInfo.c_str();
+    const bool force = (flags & FLAG_FORCE) != 0;
 
     uid_t uid = multiuser_get_uid(userId, appId);
     if (flags & FLAG_STORAGE_CE) {
-        auto path = create_data_user_ce_package_path(uuid_, userId, pkgName);
-        if (selinux_android_restorecon_pkgdir(path.c_str(), seinfo, uid, seflags) < 0) {
+        auto path = create_data_user_ce_package_path(uuid, userId, pkgName);
+        if (!force && index.isUpToDate(userId, FLAG_STORAGE_CE, packageName, uid, seInfo, path)) {
+            // Nothing changed since the last full relabel.
+        } else if (selinux_android_restorecon_pkgdir(path.c_str(), seinfo, uid, seflags) < 0) {
             res = error("restorecon failed for " + path);
+        } else {
+            index.markLabeled(userId, FLAG_STORAGE_CE, packageName, uid, seInfo, path);
         }
     }
     if (flags & FLAG_STORAGE_DE) {
-        auto path = create_data_user_de_package_path(uuid_, userId, pkgName);
-        if (selinux_android_restorecon_pkgdir(path.c_str(), seinfo, uid, seflags) < 0) {
+        auto path = create_data_user_de_package_path(uuid, userId, pkgName);
+        if (!force && index.isUpToDate(userId, FLAG_STORAGE_DE, packageName, uid, seInfo, path)) {
+            // Nothing changed since the last full relabel.
+        } else if (selinux_android_restorecon_pkgdir(path.c_str(), seinfo, uid, seflags) < 0) {
             res = error("restorecon failed for " + path);
+        } else {
+            index.markLabeled(userId, FLAG_STORAGE_DE, packageName, uid, seInfo, path);
         }
     }
     return res;
@@ -2731,6 +2984,23 @@ binder::Status InstalldNativeService::reconcileSecondaryDexFile(
     return result ? ok() : error();
 }
 
+binder::Status InstalldNativeService::reconcileSecondaryDexFiles(
+        const std::vector<std::string>& dexPaths, const std::string& packageName, int32_t uid,
+        const std::vector<std::string>& isas, const std::unique_ptr<std::string>& volumeUuid,
+        int32_t storage_flag, std::vector<int32_t>* _aidl_return) {
+    ENFORCE_UID(AID_SYSTEM);
+    CHECK_ARGUMENT_UUID(volumeUuid);
+    CHECK_ARGUMENT_PACKAGE_NAME(packageName);
+    for (const auto& dexPath : dexPaths) {
+        CHECK_ARGUMENT_PATH(dexPath);
+    }
+    std::lock_guard<std::recursive_mutex> lock(mLock);
+
+    bool result = android::installd::reconcile_secondary_dex_files(
+            dexPaths, packageName, uid, isas, volumeUuid, storage_flag, _aidl_return);
+    return result ? ok() : error();
+}
+
 binder::Status InstalldNativeService::hashSecondaryDexFile(
         const std::string& dexPath, const std::string& packageName, int32_t uid,
         const std::unique_ptr<std::string>& volumeUuid, int32_t storageFlag,
@@ -2783,6 +3053,22 @@ binder::Status InstalldNativeService::invalidateMounts() {
     return ok();
 }
 
+RestoreconIndex& InstalldNativeService::getRestoreconIndex(
+        const std::unique_ptr<std::string>& uuid) {
+    std::lock_guard<std::recursive_mutex> lock(mLock);
+    const std::string key = uuid ? *uuid : "";
+    auto& index = mRestoreconIndexes[key];
+    if (index == nullptr) {
+        if (create_dir_if_needed(kRestoreconIndexDir, 0700) != 0) {
+            PLOG(WARNING) << "Failed to prepare " << kRestoreconIndexDir;
+        }
+        std::string path = StringPrintf("%s/restorecon_index%s%s", kRestoreconIndexDir,
+                key.empty() ? "" : "_", key.c_str());
+        index = std::make_unique<RestoreconIndex>(path);
+    }
+    return *index;
+}
+
 std::string InstalldNativeService::findDataMediaPath(
         const std::unique_ptr<std::string>& uuid, userid_t userid) {
     std::lock_guard<std::recursive_mutex> lock(mMountsLock);
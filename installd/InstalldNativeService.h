@@ -30,6 +30,7 @@
 
 #include "android/os/BnInstalld.h"
 #include "installd_constants.h"
+#include "RestoreconIndex.h"
 
 namespace android {
 namespace installd {
@@ -48,9 +49,16 @@ public:
     binder::Status createAppData(const std::unique_ptr<std::string>& uuid,
             const std::string& packageName, int32_t userId, int32_t flags, int32_t appId,
             const std::string& seInfo, int32_t targetSdkVersion, int64_t* _aidl_return);
+    binder::Status createAppDataForPackages(const std::unique_ptr<std::string>& uuid,
+            const std::vector<std::string>& packageNames, int32_t userId, int32_t flags,
+            const std::vector<int32_t>& appIds, const std::vector<std::string>& seInfos,
+            const std::vector<int32_t>& targetSdkVersions, std::vector<int64_t>* _aidl_return);
     binder::Status restoreconAppData(const std::unique_ptr<std::string>& uuid,
             const std::string& packageName, int32_t userId, int32_t flags, int32_t appId,
             const std::string& seInfo);
+    binder::Status restoreconAppDataForPackages(const std::unique_ptr<std::string>& uuid,
+            const std::vector<std::string>& packageNames, int32_t userId, int32_t flags,
+            const std::vector<int32_t>& appIds, const std::vector<std::string>& seInfos);
     binder::Status migrateAppData(const std::unique_ptr<std::string>& uuid,
             const std::string& packageName, int32_t userId, int32_t flags);
     binder::Status clearAppData(const std::unique_ptr<std::string>& uuid,
@@ -106,6 +114,9 @@ public:
 
     binder::Status mergeProfiles(int32_t uid, const std::string& packageName,
             const std::string& profileName, bool* _aidl_return);
+    binder::Status mergeProfilesForPackages(const std::vector<int32_t>& uids,
+            const std::vector<std::string>& packageNames,
+            const std::vector<std::string>& profileNames, std::vector<bool>* _aidl_return);
     binder::Status dumpProfiles(int32_t uid, const std::string& packageName,
             const std::string& profileName, const std::string& codePath, bool* _aidl_return);
     binder::Status copySystemProfile(const std::string& systemProfile,
@@ -142,6 +153,10 @@ public:
     binder::Status reconcileSecondaryDexFile(const std::string& dexPath,
         const std::string& packageName, int32_t uid, const std::vector<std::string>& isa,
         const std::unique_ptr<std::string>& volumeUuid, int32_t storage_flag, bool* _aidl_return);
+    binder::Status reconcileSecondaryDexFiles(const std::vector<std::string>& dexPaths,
+        const std::string& packageName, int32_t uid, const std::vector<std::string>& isas,
+        const std::unique_ptr<std::string>& volumeUuid, int32_t storage_flag,
+        std::vector<int32_t>* _aidl_return);
     binder::Status hashSecondaryDexFile(const std::string& dexPath,
         const std::string& packageName, int32_t uid, const std::unique_ptr<std::string>& volumeUuid,
         int32_t storageFlag, std::vector<uint8_t>* _aidl_return);
@@ -169,7 +184,21 @@ private:
     /* Map from UID to cache quota size */
     std::unordered_map<uid_t, int64_t> mCacheQuotas;
 
+    /* Map from "package/profile" to the current profiles fingerprint after the last merge */
+    std::unordered_map<std::string, std::string> mMergedProfileFingerprints;
+
+    /* Map from volume UUID to the index of app data trees with up-to-date labels */
+    std::unordered_map<std::string, std::unique_ptr<RestoreconIndex>> mRestoreconIndexes;
+
     std::string findDataMediaPath(const std::unique_ptr<std::string>& uuid, userid_t userid);
+
+    RestoreconIndex& getRestoreconIndex(const std::unique_ptr<std::string>& uuid);
+    binder::Status createAppDataLocked(RestoreconIndex& restoreconIndex, const char* uuid,
+            const std::string& packageName, int32_t userId, int32_t flags, int32_t appId,
+            const std::string& seInfo, int32_t targetSdkVersion, int64_t* _aidl_return);
+    binder::Status restoreconAppDataLocked(RestoreconIndex& index, const char* uuid,
+            const std::string& packageName, int32_t userId, int32_t flags, int32_t appId,
+            const std::string& seInfo);
 };
 
 }  // namespace installd
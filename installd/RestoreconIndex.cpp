@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RestoreconIndex.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <array>
+#include <sstream>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <openssl/sha.h>
+#include <private/android_filesystem_config.h>
+#include <selinux/selinux.h>
+
+#include "installd_constants.h"
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+
+namespace android {
+namespace installd {
+
+static constexpr const char* kHeaderPrefix = "restorecon-index v2 ";
+
+// The label of an app data directory is derived from these files; any change to them
+// invalidates the whole index.
+static constexpr const char* kPolicyFiles[] = {
+    "/system/etc/selinux/plat_file_contexts",
+    "/system/etc/selinux/plat_seapp_contexts",
+    "/product/etc/selinux/product_file_contexts",
+    "/product/etc/selinux/product_seapp_contexts",
+    "/vendor/etc/selinux/vendor_file_contexts",
+    "/vendor/etc/selinux/vendor_seapp_contexts",
+    "/vendor/etc/selinux/nonplat_seapp_contexts",
+    "/odm/etc/selinux/odm_file_contexts",
+    "/odm/etc/selinux/odm_seapp_contexts",
+};
+
+static std::string make_key(userid_t user, int storageFlag, const std::string& packageName) {
+    return StringPrintf("%u %s %s", user, (storageFlag & FLAG_STORAGE_CE) ? "ce" : "de",
+            packageName.c_str());
+}
+
+static void erase_user_entries(std::unordered_map<std::string, RestoreconIndex::Entry>* entries,
+        userid_t user) {
+    std::string prefix = StringPrintf("%u ", user);
+    for (auto it = entries->begin(); it != entries->end();) {
+        if (android::base::StartsWith(it->first, prefix)) {
+            it = entries->erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+static ino_t get_inode(const std::string& path) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+    return st.st_ino;
+}
+
+static std::string get_label(const std::string& path) {
+    char* con = nullptr;
+    if (lgetfilecon(path.c_str(), &con) < 0) {
+        return "";
+    }
+    std::string label(con);
+    freecon(con);
+    return label;
+}
+
+static std::string format_entry(const std::string& key, const RestoreconIndex::Entry& e) {
+    return StringPrintf("+ %s %u %" PRIu64 " %" PRIu64 " %" PRIu64 " %s %s\n", key.c_str(),
+            e.uid, static_cast<uint64_t>(e.inode), static_cast<uint64_t>(e.cacheInode),
+            static_cast<uint64_t>(e.codeCacheInode), e.seInfo.c_str(), e.label.c_str());
+}
+
+RestoreconIndex::RestoreconIndex(const std::string& path) : mPath(path), mLoaded(false) {
+}
+
+const std::string& RestoreconIndex::getPolicyHash() {
+    static const std::string hash = []() {
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        for (const char* file : kPolicyFiles) {
+            std::string content;
+            if (!android::base::ReadFileToString(file, &content)) {
+                continue;
+            }
+            SHA256_Update(&ctx, file, strlen(file) + 1);
+            SHA256_Update(&ctx, content.data(), content.size());
+        }
+        std::array<uint8_t, SHA256_DIGEST_LENGTH> digest;
+        SHA256_Final(digest.data(), &ctx);
+        std::string result;
+        for (uint8_t b : digest) {
+            android::base::StringAppendF(&result, "%02x", b);
+        }
+        return result;
+    }();
+    return hash;
+}
+
+void RestoreconIndex::loadLocked() {
+    if (mLoaded) {
+        return;
+    }
+    mLoaded = true;
+
+    std::string content;
+    if (!android::base::ReadFileToString(mPath, &content)) {
+        rewriteLocked();
+        return;
+    }
+
+    std::vector<std::string> lines = android::base::Split(content, "\n");
+    if (lines.empty() || lines[0] != kHeaderPrefix + getPolicyHash()) {
+        LOG(INFO) << "SELinux policy changed; discarding " << mPath;
+        rewriteLocked();
+        return;
+    }
+
+    size_t records = 0;
+    for (size_t i = 1; i < lines.size(); i++) {
+        std::istringstream in(lines[i]);
+        std::string op;
+        userid_t user;
+        std::string storage;
+        std::string packageName;
+        if (!(in >> op >> user)) {
+            continue;
+        }
+        records++;
+        if (op == "-user") {
+            erase_user_entries(&mEntries, user);
+            continue;
+        }
+        if (!(in >> storage >> packageName)) {
+            continue;
+        }
+        std::string key = StringPrintf("%u %s %s", user, storage.c_str(), packageName.c_str());
+        if (op == "-") {
+            mEntries.erase(key);
+        } else if (op == "+") {
+            Entry entry;
+            if (in >> entry.uid >> entry.inode >> entry.cacheInode >> entry.codeCacheInode
+                    >> entry.seInfo >> entry.label) {
+                mEntries[key] = entry;
+            }
+        }
+    }
+
+    // Compact the journal once it mostly contains superseded records.
+    if (records > 2 * mEntries.size() + 64) {
+        rewriteLocked();
+    }
+}
+
+void RestoreconIndex::rewriteLocked() {
+    std::string content = kHeaderPrefix + getPolicyHash() + "\n";
+    for (const auto& it : mEntries) {
+        content += format_entry(it.first, it.second);
+    }
+    std::string tmpPath = mPath + ".tmp";
+    if (!android::base::WriteStringToFile(content, tmpPath, 0600, AID_ROOT, AID_ROOT)
+            || rename(tmpPath.c_str(), mPath.c_str()) != 0) {
+        PLOG(WARNING) << "Failed to write " << mPath;
+        unlink(tmpPath.c_str());
+    }
+}
+
+void RestoreconIndex::appendLocked(const std::string& line) {
+    unique_fd fd(TEMP_FAILURE_RETRY(
+            open(mPath.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC | O_NOFOLLOW)));
+    if (fd == -1 || !android::base::WriteStringToFd(line, fd)) {
+        PLOG(WARNING) << "Failed to update " << mPath;
+    }
+}
+
+bool RestoreconIndex::isUpToDate(userid_t user, int storageFlag, const std::string& packageName,
+        uid_t uid, const std::string& seInfo, const std::string& path) {
+    std::lock_guard<std::mutex> lock(mLock);
+    loadLocked();
+
+    auto it = mEntries.find(make_key(user, storageFlag, packageName));
+    if (it == mEntries.end()) {
+        return false;
+    }
+    const Entry& e = it->second;
+    return e.uid == uid && e.seInfo == seInfo
+            && e.inode != 0 && e.inode == get_inode(path)
+            && e.cacheInode == get_inode(path + "/cache")
+            && e.codeCacheInode == get_inode(path + "/code_cache")
+            && e.label == get_label(path);
+}
+
+void RestoreconIndex::markLabeled(userid_t user, int storageFlag, const std::string& packageName,
+        uid_t uid, const std::string& seInfo, const std::string& path) {
+    // seInfo is stored as a single token.
+    if (seInfo.empty() || seInfo.find_first_of(" \t\n") != std::string::npos) {
+        return;
+    }
+    Entry entry = { uid, get_inode(path), get_inode(path + "/cache"),
+            get_inode(path + "/code_cache"), seInfo, get_label(path) };
+    if (entry.inode == 0 || entry.label.empty()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mLock);
+    loadLocked();
+
+    std::string key = make_key(user, storageFlag, packageName);
+    auto it = mEntries.find(key);
+    if (it != mEntries.end() && it->second.uid == entry.uid && it->second.inode == entry.inode
+            && it->second.cacheInode == entry.cacheInode
+            && it->second.codeCacheInode == entry.codeCacheInode
+            && it->second.seInfo == entry.seInfo && it->second.label == entry.label) {
+        return;
+    }
+    mEntries[key] = entry;
+    appendLocked(format_entry(key, entry));
+}
+
+void RestoreconIndex::remove(userid_t user, int storageFlag, const std::string& packageName) {
+    std::lock_guard<std::mutex> lock(mLock);
+    loadLocked();
+
+    std::string key = make_key(user, storageFlag, packageName);
+    if (mEntries.erase(key) > 0) {
+        appendLocked("- " + key + "\n");
+    }
+}
+
+void RestoreconIndex::removeUser(userid_t user) {
+    std::lock_guard<std::mutex> lock(mLock);
+    loadLocked();
+
+    erase_user_entries(&mEntries, user);
+    appendLocked(StringPrintf("-user %u\n", user));
+}
+
+}  // namespace installd
+}  // namespace android
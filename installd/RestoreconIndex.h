@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_INSTALLD_RESTORECON_INDEX_H
+#define ANDROID_INSTALLD_RESTORECON_INDEX_H
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <sys/types.h>
+
+#include <android-base/macros.h>
+#include <cutils/multiuser.h>
+
+namespace android {
+namespace installd {
+
+/**
+ * Persistent record of the app data directories of a single volume that were fully
+ * restorecon'd, keyed by (user, storage, package). Each entry records the label that the
+ * relabel left on the data directory. An entry is only trusted while the SELinux contexts,
+ * the app uid, its seinfo, the inodes of the data directory and its cache directories and
+ * the current label of the data directory all match, i.e. while the package was not
+ * reassigned, its directories were not recreated and nothing relabeled them since. Files
+ * created below the directory since then were created by the app itself and inherit the
+ * label of their parent, so a matching entry means a recursive restorecon would not change
+ * anything. Callers that cannot rely on that (e.g. after tampering with files from outside
+ * the app) pass FLAG_FORCE to bypass the index.
+ *
+ * The index is an append-only journal which is compacted when loaded. Losing updates is
+ * harmless: entries are only added after a successful restorecon, so the worst case is
+ * relabeling a tree that was already correct.
+ *
+ * All methods are thread-safe.
+ */
+class RestoreconIndex {
+public:
+    explicit RestoreconIndex(const std::string& path);
+
+    // Returns true if the data directory at path was labeled for uid/seInfo under the
+    // current policy and was neither recreated nor relabeled since.
+    bool isUpToDate(userid_t user, int storageFlag, const std::string& packageName, uid_t uid,
+            const std::string& seInfo, const std::string& path);
+    // Records that the data directory at path was successfully labeled for uid/seInfo.
+    void markLabeled(userid_t user, int storageFlag, const std::string& packageName, uid_t uid,
+            const std::string& seInfo, const std::string& path);
+
+    void remove(userid_t user, int storageFlag, const std::string& packageName);
+    void removeUser(userid_t user);
+
+    // Hash of the SELinux contexts the labels of app data depend on.
+    static const std::string& getPolicyHash();
+
+    struct Entry {
+        uid_t uid;
+        ino_t inode;
+        ino_t cacheInode;
+        ino_t codeCacheInode;
+        std::string seInfo;
+        std::string label;
+    };
+
+private:
+    std::mutex mLock;
+    const std::string mPath;
+    bool mLoaded;
+    std::unordered_map<std::string, Entry> mEntries;
+
+    void loadLocked();
+    void rewriteLocked();
+    void appendLocked(const std::string& line);
+
+    DISALLOW_COPY_AND_ASSIGN(RestoreconIndex);
+};
+
+}  // namespace installd
+}  // namespace android
+
+#endif  // ANDROID_INSTALLD_RESTORECON_INDEX_H
@@ -17,6 +17,7 @@
 
 #include <array>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/capability.h>
@@ -29,6 +30,7 @@
 #include <unistd.h>
 
 #include <iomanip>
+#include <mutex>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -48,6 +50,7 @@
 #include <server_configurable_flags/get_flags.h>
 #include <system/thread_defs.h>
 
+#include "DexoptStats.h"
 #include "dexopt.h"
 #include "dexopt_return_codes.h"
 #include "globals.h"
@@ -60,6 +63,7 @@ using android::base::GetBoolProperty;
 using android::base::GetProperty;
 using android::base::ReadFdToString;
 using android::base::ReadFully;
+using android::base::StringAppendF;
 using android::base::StringPrintf;
 using android::base::WriteFully;
 using android::base::unique_fd;
@@ -224,6 +228,13 @@ class ExecVHelper {
 
     [[ noreturn ]]
     void Exec(int exit_code) {
+        // Only called in the child: the fds it was handed survive the exec, all others close.
+        for (int fd : kept_fds_) {
+            int flags = fcntl(fd, F_GETFD);
+            if (flags != -1) {
+                fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+            }
+        }
         execv(argv_[0], (char * const *)&argv_[0]);
         PLOG(ERROR) << "execv(" << argv_[0] << ") failed";
         exit(exit_code);
@@ -244,12 +255,22 @@ class ExecVHelper {
         }
     }
 
+    // Pass fd on to the child even if it was opened with O_CLOEXEC.
+    void KeepFd(int fd) {
+        if (fd >= 0) {
+            kept_fds_.push_back(fd);
+        }
+    }
+
   protected:
     // Holder arrays for backing arg storage.
     std::vector<std::string> args_;
 
     // Argument poiners.
     std::vector<const char*> argv_;
+
+    // Fds referenced by the arguments.
+    std::vector<int> kept_fds_;
 };
 
 static std::string MapPropertyToArg(const std::string& property,
@@ -463,6 +484,7 @@ class RunDex2Oat : public ExecVHelper {
         std::string profile_arg;
         if (profile_fd != -1) {
             profile_arg = StringPrintf("--profile-file-fd=%d", profile_fd);
+            KeepFd(profile_fd);
         }
 
         // Get the directory of the apk to pass as a base classpath directory.
@@ -627,6 +649,9 @@ static unique_fd open_profile(uid_t uid, const std::string& profile, int32_t fla
     //   - primary profiles should not contain symlinks in their paths
     //   - secondary dex paths should have been already resolved and validated
     flags |= O_NOFOLLOW;
+    // Profiles are merged concurrently, so a child forked for one package must not inherit
+    // the profiles of another. Children keep the fds they are given through KeepFd().
+    flags |= O_CLOEXEC;
 
     // Check if we need to create the profile
     // Reference profiles and snapshots are created on the fly; so they might not exist beforehand.
@@ -724,14 +749,17 @@ class RunProfman : public ExecVHelper {
         }
         if (reference_profile_fd != -1) {
             AddArg("--reference-profile-file-fd=" + std::to_string(reference_profile_fd.get()));
+            KeepFd(reference_profile_fd.get());
         }
 
         for (const unique_fd& fd : profile_fds) {
             AddArg("--profile-file-fd=" + std::to_string(fd.get()));
+            KeepFd(fd.get());
         }
 
         for (const unique_fd& fd : apk_fds) {
             AddArg("--apk-fd=" + std::to_string(fd.get()));
+            KeepFd(fd.get());
         }
 
         for (const std::string& dex_location : dex_locations) {
@@ -788,6 +816,7 @@ class RunProfman : public ExecVHelper {
                    const unique_fd& output_fd) {
         AddArg("--dump-only");
         AddArg(StringPrintf("--dump-output-to-fd=%d", output_fd.get()));
+        KeepFd(output_fd.get());
         SetupArgs(profiles_fd,
                   reference_profile_fd,
                   apk_fds,
@@ -806,6 +835,31 @@ class RunProfman : public ExecVHelper {
     std::vector<unique_fd> apk_fds_;
 };
 
+// Profman children are forked and exec'd one at a time, so at most one child holds a copy of
+// installd's fd table while it is still running installd code (see ExecVHelper::Exec).
+static std::mutex gProfmanForkLock;
+
+static pid_t fork_profman() {
+    std::lock_guard<std::mutex> lock(gProfmanForkLock);
+    // The child's end of the pipe is closed by its exec (or exit), which wakes up the parent.
+    int exec_pipe[2];
+    if (pipe2(exec_pipe, O_CLOEXEC) != 0) {
+        PLOG(WARNING) << "pipe2 failed, not waiting for profman to exec";
+        return fork();
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        return 0;
+    }
+    close(exec_pipe[1]);
+    if (pid > 0) {
+        char c;
+        TEMP_FAILURE_RETRY(read(exec_pipe[0], &c, sizeof(c)));
+    }
+    close(exec_pipe[0]);
+    return pid;
+}
+
 
 
 // Decides if profile guided compilation is needed or not based on existing profiles.
@@ -828,14 +882,18 @@ static bool analyze_profiles(uid_t uid, const std::string& package_name,
 
     RunProfman profman_merge;
     profman_merge.SetupMerge(profiles_fd, reference_profile_fd);
-    pid_t pid = fork();
+    DexoptStats stats(DexoptStats::kProfman, package_name, location);
+    stats.reason = "merge";
+    pid_t pid = fork_profman();
     if (pid == 0) {
         /* child -- drop privileges before continuing */
         drop_capabilities(uid);
         profman_merge.Exec();
     }
     /* parent */
-    int return_code = wait_child(pid);
+    int return_code = wait_child_with_stats(pid, &stats);
+    stats.addOutputFd(reference_profile_fd.get());
+    record_dexopt_stats(stats);
     bool need_to_compile = false;
     bool should_clear_current_profiles = false;
     bool should_clear_reference_profile = false;
@@ -905,6 +963,23 @@ bool analyze_primary_profiles(uid_t uid, const std::string& package_name,
     return analyze_profiles(uid, package_name, profile_name, /*is_secondary_dex*/false);
 }
 
+std::string get_primary_current_profiles_fingerprint(const std::string& package_name,
+        const std::string& profile_name) {
+    std::string fingerprint;
+    for (auto user : get_known_users(/*volume_uuid*/ nullptr)) {
+        std::string profile = create_current_profile_path(user, package_name, profile_name,
+                /*is_secondary_dex*/ false);
+        struct stat st;
+        if (stat(profile.c_str(), &st) != 0) {
+            continue;
+        }
+        StringAppendF(&fingerprint, "%u:%" PRId64 ":%" PRId64 ".%09ld;", user,
+                static_cast<int64_t>(st.st_size), static_cast<int64_t>(st.st_mtim.tv_sec),
+                st.st_mtim.tv_nsec);
+    }
+    return fingerprint;
+}
+
 bool dump_profiles(int32_t uid, const std::string& pkgname, const std::string& profile_name,
         const std::string& code_path) {
     std::vector<unique_fd> profile_fds;
@@ -943,14 +1018,18 @@ bool dump_profiles(int32_t uid, const std::string& pkgname, const std::string& p
 
     RunProfman profman_dump;
     profman_dump.SetupDump(profile_fds, reference_profile_fd, dex_locations, apk_fds, output_fd);
-    pid_t pid = fork();
+    DexoptStats stats(DexoptStats::kProfman, pkgname, profile_name);
+    stats.reason = "dump";
+    pid_t pid = fork_profman();
     if (pid == 0) {
         /* child -- drop privileges before continuing */
         drop_capabilities(uid);
         profman_dump.Exec();
     }
     /* parent */
-    int return_code = wait_child(pid);
+    int return_code = wait_child_with_stats(pid, &stats);
+    stats.addOutputFd(output_fd.get());
+    record_dexopt_stats(stats);
     if (!WIFEXITED(return_code)) {
         LOG(WARNING) << "profman failed for package " << pkgname << ": "
                 << return_code;
@@ -2157,6 +2236,10 @@ int dexopt(const char* dex_path, uid_t uid, const char* pkgname, const char* ins
                       dex_metadata_fd.get(),
                       compilation_reason);
 
+    DexoptStats stats(DexoptStats::kDex2oat, pkgname, dex_path);
+    stats.compiler_filter = compiler_filter == nullptr ? "" : compiler_filter;
+    stats.reason = compilation_reason == nullptr ? "" : compilation_reason;
+
     pid_t pid = fork();
     if (pid == 0) {
         /* child -- drop privileges before continuing */
@@ -2170,7 +2253,11 @@ int dexopt(const char* dex_path, uid_t uid, const char* pkgname, const char* ins
 
         runner.Exec(DexoptReturnCodes::kDex2oatExec);
     } else {
-        int res = wait_child(pid);
+        int res = wait_child_with_stats(pid, &stats);
+        stats.addOutputFd(out_oat_fd.get());
+        stats.addOutputFd(out_vdex_fd.get());
+        stats.addOutputFd(image_fd.get());
+        record_dexopt_stats(stats);
         if (res == 0) {
             LOG(VERBOSE) << "DexInv: --- END '" << dex_path << "' (success) ---";
         } else {
@@ -2227,6 +2314,115 @@ enum ReconcileSecondaryDexResult {
     kReconcileSecondaryDexAccessIOError = 4,
 };
 
+// Validate the secondary dex 'dex_path' and, if it no longer exists, delete its generated
+// oat/vdex/art files and profiles for every isa in 'isas'.
+// Must be called from a child process which already dropped the capabilities to 'uid'.
+static ReconcileSecondaryDexResult reconcile_secondary_dex_file_as_app(
+        const std::string& dex_path, const std::string& pkgname, int uid,
+        const std::vector<std::string>& isas, const char* volume_uuid, int storage_flag) {
+    if (!validate_secondary_dex_path(pkgname, dex_path, volume_uuid, uid, storage_flag)) {
+        LOG(ERROR) << "Could not validate secondary dex path " << dex_path;
+        return kReconcileSecondaryDexValidationError;
+    }
+
+    SecondaryDexAccess access_check = check_secondary_dex_access(dex_path);
+    switch (access_check) {
+        case kSecondaryDexAccessDoesNotExist:
+             // File does not exist. Proceed with cleaning.
+            break;
+        case kSecondaryDexAccessReadOk: return kReconcileSecondaryDexExists;
+        case kSecondaryDexAccessIOError: return kReconcileSecondaryDexAccessIOError;
+        case kSecondaryDexAccessPermissionError: return kReconcileSecondaryDexValidationError;
+        default:
+            LOG(ERROR) << "Unexpected result from check_secondary_dex_access: " << access_check;
+            return kReconcileSecondaryDexValidationError;
+    }
+
+    // The secondary dex does not exist anymore or it's. Clear any generated files.
+    char oat_path[PKG_PATH_MAX];
+    char oat_dir[PKG_PATH_MAX];
+    char oat_isa_dir[PKG_PATH_MAX];
+    bool result = true;
+    for (size_t i = 0; i < isas.size(); i++) {
+        std::string error_msg;
+        if (!create_secondary_dex_oat_layout(
+                dex_path,isas[i], oat_dir, oat_isa_dir, oat_path, &error_msg)) {
+            LOG(ERROR) << error_msg;
+            return kReconcileSecondaryDexValidationError;
+        }
+
+        // Delete oat/vdex/art files.
+        result = unlink_if_exists(oat_path) && result;
+        result = unlink_if_exists(create_vdex_filename(oat_path)) && result;
+        result = unlink_if_exists(create_image_filename(oat_path)) && result;
+
+        // Delete profiles.
+        std::string current_profile = create_current_profile_path(
+            multiuser_get_user_id(uid), pkgname, dex_path, /*is_secondary*/true);
+        std::string reference_profile = create_reference_profile_path(
+            pkgname, dex_path, /*is_secondary*/true);
+        result = unlink_if_exists(current_profile) && result;
+        result = unlink_if_exists(reference_profile) && result;
+
+        // We upgraded once the location of current profile for secondary dex files.
+        // Check for any previous left-overs and remove them as well.
+        std::string old_current_profile = dex_path + ".prof";
+        result = unlink_if_exists(old_current_profile);
+
+        // Try removing the directories as well, they might be empty.
+        result = rmdir_if_empty(oat_isa_dir) && result;
+        result = rmdir_if_empty(oat_dir) && result;
+    }
+    if (!result) {
+        PLOG(ERROR) << "Failed to clean secondary dex artifacts for location " << dex_path;
+    }
+    return result ? kReconcileSecondaryDexCleanedUp : kReconcileSecondaryDexAccessIOError;
+}
+
+// Translate the result of reconcile_secondary_dex_file_as_app into the public contract of
+// reconcile_secondary_dex_file (see below).
+static bool process_reconcile_secondary_dex_result(const std::string& dex_path, int return_code,
+        /*out*/bool* out_secondary_dex_exists) {
+    LOG(DEBUG) << "Reconcile secondary dex path " << dex_path << " result=" << return_code;
+
+    switch (return_code) {
+        case kReconcileSecondaryDexCleanedUp:
+        case kReconcileSecondaryDexValidationError:
+            // If we couldn't validate assume the dex file does not exist.
+            // This will purge the entry from the PM records.
+            *out_secondary_dex_exists = false;
+            return true;
+        case kReconcileSecondaryDexExists:
+            *out_secondary_dex_exists = true;
+            return true;
+        case kReconcileSecondaryDexAccessIOError:
+            // We had an access IO error.
+            // Return false so that we can try again.
+            // The value of out_secondary_dex_exists does not matter in this case and by convention
+            // is set to false.
+            *out_secondary_dex_exists = false;
+            return false;
+        default:
+            LOG(ERROR) << "Unexpected code from reconcile_secondary_dex_file: " << return_code;
+            *out_secondary_dex_exists = false;
+            return false;
+    }
+}
+
+static bool validate_reconcile_secondary_dex_args(const char* caller,
+        const std::vector<std::string>& isas, int storage_flag) {
+    if (isas.size() == 0) {
+        LOG(ERROR) << caller << " called with empty isas vector";
+        return false;
+    }
+
+    if (storage_flag != FLAG_STORAGE_CE && storage_flag != FLAG_STORAGE_DE) {
+        LOG(ERROR) << caller << " called with invalid storage_flag: " << storage_flag;
+        return false;
+    }
+    return true;
+}
+
 // Reconcile the secondary dex 'dex_path' and its generated oat files.
 // Return true if all the parameters are valid and the secondary dex file was
 //   processed successfully (i.e. the dex_path either exists, or if not, its corresponding
@@ -2240,14 +2436,8 @@ bool reconcile_secondary_dex_file(const std::string& dex_path,
         const std::unique_ptr<std::string>& volume_uuid, int storage_flag,
         /*out*/bool* out_secondary_dex_exists) {
     *out_secondary_dex_exists = false;  // start by assuming the file does not exist.
-    if (isas.size() == 0) {
-        LOG(ERROR) << "reconcile_secondary_dex_file called with empty isas vector";
-        return false;
-    }
-
-    if (storage_flag != FLAG_STORAGE_CE && storage_flag != FLAG_STORAGE_DE) {
-        LOG(ERROR) << "reconcile_secondary_dex_file called with invalid storage_flag: "
-                << storage_flag;
+    if (!validate_reconcile_secondary_dex_args("reconcile_secondary_dex_file", isas,
+            storage_flag)) {
         return false;
     }
 
@@ -2259,97 +2449,95 @@ bool reconcile_secondary_dex_file(const std::string& dex_path,
         drop_capabilities(uid);
 
         const char* volume_uuid_cstr = volume_uuid == nullptr ? nullptr : volume_uuid->c_str();
-        if (!validate_secondary_dex_path(pkgname, dex_path, volume_uuid_cstr,
-                uid, storage_flag)) {
-            LOG(ERROR) << "Could not validate secondary dex path " << dex_path;
-            _exit(kReconcileSecondaryDexValidationError);
-        }
+        _exit(reconcile_secondary_dex_file_as_app(
+                dex_path, pkgname, uid, isas, volume_uuid_cstr, storage_flag));
+    }
 
-        SecondaryDexAccess access_check = check_secondary_dex_access(dex_path);
-        switch (access_check) {
-            case kSecondaryDexAccessDoesNotExist:
-                 // File does not exist. Proceed with cleaning.
-                break;
-            case kSecondaryDexAccessReadOk: _exit(kReconcileSecondaryDexExists);
-            case kSecondaryDexAccessIOError: _exit(kReconcileSecondaryDexAccessIOError);
-            case kSecondaryDexAccessPermissionError: _exit(kReconcileSecondaryDexValidationError);
-            default:
-                LOG(ERROR) << "Unexpected result from check_secondary_dex_access: " << access_check;
-                _exit(kReconcileSecondaryDexValidationError);
-        }
-
-        // The secondary dex does not exist anymore or it's. Clear any generated files.
-        char oat_path[PKG_PATH_MAX];
-        char oat_dir[PKG_PATH_MAX];
-        char oat_isa_dir[PKG_PATH_MAX];
-        bool result = true;
-        for (size_t i = 0; i < isas.size(); i++) {
-            std::string error_msg;
-            if (!create_secondary_dex_oat_layout(
-                    dex_path,isas[i], oat_dir, oat_isa_dir, oat_path, &error_msg)) {
-                LOG(ERROR) << error_msg;
-                _exit(kReconcileSecondaryDexValidationError);
-            }
+    int return_code = wait_child(pid);
+    if (!WIFEXITED(return_code)) {
+        LOG(WARNING) << "reconcile dex failed for location " << dex_path << ": " << return_code;
+    } else {
+        return_code = WEXITSTATUS(return_code);
+    }
+
+    return process_reconcile_secondary_dex_result(dex_path, return_code,
+            out_secondary_dex_exists);
+}
 
-            // Delete oat/vdex/art files.
-            result = unlink_if_exists(oat_path) && result;
-            result = unlink_if_exists(create_vdex_filename(oat_path)) && result;
-            result = unlink_if_exists(create_image_filename(oat_path)) && result;
+// Bulk version of reconcile_secondary_dex_file.
+// All the dex paths belong to the same package and are reconciled in a single child process
+// running with the capabilities of 'uid', instead of forking once per file.
+// out_results will contain one entry per dex path, in the same order:
+//   kReconcileSecondaryDexFileExists if the dex file still exists,
+//   kReconcileSecondaryDexFileDeleted if it does not exist (or could not be validated) and its
+//     compiler artifacts were cleaned up,
+//   kReconcileSecondaryDexFileError if processing failed and should be retried.
+// Returns false if the arguments are invalid or the child process could not be run, in which
+// case out_results is empty.
+bool reconcile_secondary_dex_files(const std::vector<std::string>& dex_paths,
+        const std::string& pkgname, int uid, const std::vector<std::string>& isas,
+        const std::unique_ptr<std::string>& volume_uuid, int storage_flag,
+        /*out*/std::vector<int32_t>* out_results) {
+    out_results->clear();
+    if (!validate_reconcile_secondary_dex_args("reconcile_secondary_dex_files", isas,
+            storage_flag)) {
+        return false;
+    }
+    if (dex_paths.empty()) {
+        return true;
+    }
 
-            // Delete profiles.
-            std::string current_profile = create_current_profile_path(
-                multiuser_get_user_id(uid), pkgname, dex_path, /*is_secondary*/true);
-            std::string reference_profile = create_reference_profile_path(
-                pkgname, dex_path, /*is_secondary*/true);
-            result = unlink_if_exists(current_profile) && result;
-            result = unlink_if_exists(reference_profile) && result;
+    // Pipe to get the per-file results back from our child process.
+    unique_fd pipe_read, pipe_write;
+    if (!Pipe(&pipe_read, &pipe_write)) {
+        PLOG(ERROR) << "Failed to create pipe";
+        return false;
+    }
 
-            // We upgraded once the location of current profile for secondary dex files.
-            // Check for any previous left-overs and remove them as well.
-            std::string old_current_profile = dex_path + ".prof";
-            result = unlink_if_exists(old_current_profile);
+    // As a security measure we want to unlink art artifacts with the reduced capabilities
+    // of the package user id. So we fork and drop capabilities in the child.
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* child -- drop privileges before continuing */
+        drop_capabilities(uid);
+        pipe_read.reset();
 
-            // Try removing the directories as well, they might be empty.
-            result = rmdir_if_empty(oat_isa_dir) && result;
-            result = rmdir_if_empty(oat_dir) && result;
+        const char* volume_uuid_cstr = volume_uuid == nullptr ? nullptr : volume_uuid->c_str();
+        std::vector<uint8_t> codes(dex_paths.size());
+        for (size_t i = 0; i < dex_paths.size(); i++) {
+            codes[i] = reconcile_secondary_dex_file_as_app(
+                    dex_paths[i], pkgname, uid, isas, volume_uuid_cstr, storage_flag);
         }
-        if (!result) {
-            PLOG(ERROR) << "Failed to clean secondary dex artifacts for location " << dex_path;
+        if (!WriteFully(pipe_write, codes.data(), codes.size())) {
+            _exit(kReconcileSecondaryDexAccessIOError);
         }
-        _exit(result ? kReconcileSecondaryDexCleanedUp : kReconcileSecondaryDexAccessIOError);
+        _exit(0);
     }
 
+    // parent
+    pipe_write.reset();
+
+    std::vector<uint8_t> codes(dex_paths.size());
+    bool read_ok = ReadFully(pipe_read, codes.data(), codes.size());
     int return_code = wait_child(pid);
-    if (!WIFEXITED(return_code)) {
-        LOG(WARNING) << "reconcile dex failed for location " << dex_path << ": " << return_code;
-    } else {
-        return_code = WEXITSTATUS(return_code);
+    if (!read_ok || return_code != 0) {
+        LOG(WARNING) << "reconcile dex failed for package " << pkgname << ": " << return_code;
+        // We don't know how far the child got; report every file as retryable.
+        out_results->assign(dex_paths.size(), kReconcileSecondaryDexFileError);
+        return true;
     }
 
-    LOG(DEBUG) << "Reconcile secondary dex path " << dex_path << " result=" << return_code;
-
-    switch (return_code) {
-        case kReconcileSecondaryDexCleanedUp:
-        case kReconcileSecondaryDexValidationError:
-            // If we couldn't validate assume the dex file does not exist.
-            // This will purge the entry from the PM records.
-            *out_secondary_dex_exists = false;
-            return true;
-        case kReconcileSecondaryDexExists:
-            *out_secondary_dex_exists = true;
-            return true;
-        case kReconcileSecondaryDexAccessIOError:
-            // We had an access IO error.
-            // Return false so that we can try again.
-            // The value of out_secondary_dex_exists does not matter in this case and by convention
-            // is set to false.
-            *out_secondary_dex_exists = false;
-            return false;
-        default:
-            LOG(ERROR) << "Unexpected code from reconcile_secondary_dex_file: " << return_code;
-            *out_secondary_dex_exists = false;
-            return false;
+    out_results->reserve(dex_paths.size());
+    for (size_t i = 0; i < dex_paths.size(); i++) {
+        bool exists;
+        if (!process_reconcile_secondary_dex_result(dex_paths[i], codes[i], &exists)) {
+            out_results->push_back(kReconcileSecondaryDexFileError);
+        } else {
+            out_results->push_back(exists ? kReconcileSecondaryDexFileExists
+                                          : kReconcileSecondaryDexFileDeleted);
+        }
     }
+    return true;
 }
 
 // Compute and return the hash (SHA-256) of the secondary dex file at dex_path.
@@ -2734,7 +2922,9 @@ static bool create_app_profile_snapshot(int32_t app_id,
 
     RunProfman args;
     args.SetupMerge(profiles_fd, snapshot_fd, apk_fds, dex_locations);
-    pid_t pid = fork();
+    DexoptStats stats(DexoptStats::kProfman, package_name, profile_name);
+    stats.reason = "snapshot";
+    pid_t pid = fork_profman();
     if (pid == 0) {
         /* child -- drop privileges before continuing */
         drop_capabilities(app_shared_gid);
@@ -2742,7 +2932,9 @@ static bool create_app_profile_snapshot(int32_t app_id,
     }
 
     /* parent */
-    int return_code = wait_child(pid);
+    int return_code = wait_child_with_stats(pid, &stats);
+    stats.addOutputFd(snapshot_fd.get());
+    record_dexopt_stats(stats);
     if (!WIFEXITED(return_code)) {
         LOG(WARNING) << "profman failed for " << package_name << ":" << profile_name;
         return false;
@@ -2824,7 +3016,9 @@ static bool create_boot_image_profile_snapshot(const std::string& package_name,
                         apk_fds,
                         dex_locations,
                         /*store_aggregation_counters=*/true);
-        pid_t pid = fork();
+        DexoptStats stats(DexoptStats::kProfman, package_name, profile_name);
+        stats.reason = "boot-snapshot";
+        pid_t pid = fork_profman();
         if (pid == 0) {
             /* child -- drop privileges before continuing */
             drop_capabilities(AID_SYSTEM);
@@ -2835,7 +3029,9 @@ static bool create_boot_image_profile_snapshot(const std::string& package_name,
         }
 
         /* parent */
-        int return_code = wait_child(pid);
+        int return_code = wait_child_with_stats(pid, &stats);
+        stats.addOutputFd(snapshot_fd.get());
+        record_dexopt_stats(stats);
         if (!WIFEXITED(return_code)) {
             PLOG(WARNING) << "profman failed for " << package_name << ":" << profile_name;
             return false;
@@ -2878,8 +3074,9 @@ bool prepare_app_profile(const std::string& package_name,
     unique_fd ref_profile_fd = open_reference_profile(uid, package_name, profile_name,
             /*read_write*/ true, /*is_secondary_dex*/ false);
     unique_fd dex_metadata_fd(TEMP_FAILURE_RETRY(
-            open(dex_metadata->c_str(), O_RDONLY | O_NOFOLLOW)));
-    unique_fd apk_fd(TEMP_FAILURE_RETRY(open(code_path.c_str(), O_RDONLY | O_NOFOLLOW)));
+            open(dex_metadata->c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+    unique_fd apk_fd(TEMP_FAILURE_RETRY(
+            open(code_path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
     if (apk_fd < 0) {
         PLOG(ERROR) << "Could not open code path " << code_path;
         return false;
@@ -2890,7 +3087,9 @@ bool prepare_app_profile(const std::string& package_name,
                             std::move(ref_profile_fd),
                             std::move(apk_fd),
                             code_path);
-    pid_t pid = fork();
+    DexoptStats stats(DexoptStats::kProfman, package_name, profile_name);
+    stats.reason = "dex-metadata";
+    pid_t pid = fork_profman();
     if (pid == 0) {
         /* child -- drop privileges before continuing */
         gid_t app_shared_gid = multiuser_get_shared_gid(user_id, app_id);
@@ -2901,7 +3100,8 @@ bool prepare_app_profile(const std::string& package_name,
     }
 
     /* parent */
-    int return_code = wait_child(pid);
+    int return_code = wait_child_with_stats(pid, &stats);
+    record_dexopt_stats(stats);
     if (!WIFEXITED(return_code)) {
         PLOG(WARNING) << "profman failed for " << package_name << ":" << profile_name;
         return false;
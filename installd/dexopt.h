@@ -60,6 +60,12 @@ bool analyze_primary_profiles(uid_t uid,
                               const std::string& pkgname,
                               const std::string& profile_name);
 
+// Return a fingerprint (size and modification time of every user's current profile) of the
+// current profiles for the given profile name. The fingerprint changes whenever a current profile
+// is updated, created or removed, and is used to skip merges when nothing changed.
+std::string get_primary_current_profiles_fingerprint(const std::string& pkgname,
+                                                     const std::string& profile_name);
+
 // Create a snapshot of the profile information for the given package profile.
 // If appId is -1, the method creates the profile snapshot for the boot image.
 //
@@ -107,6 +113,11 @@ bool reconcile_secondary_dex_file(const std::string& dex_path,
         const std::unique_ptr<std::string>& volumeUuid, int storage_flag,
         /*out*/bool* out_secondary_dex_exists);
 
+bool reconcile_secondary_dex_files(const std::vector<std::string>& dex_paths,
+        const std::string& pkgname, int uid, const std::vector<std::string>& isas,
+        const std::unique_ptr<std::string>& volume_uuid, int storage_flag,
+        /*out*/std::vector<int32_t>* out_results);
+
 bool hash_secondary_dex_file(const std::string& dex_path,
         const std::string& pkgname, int uid, const std::unique_ptr<std::string>& volume_uuid,
         int storage_flag, std::vector<uint8_t>* out_secondary_dex_hash);
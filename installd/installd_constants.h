@@ -75,6 +75,12 @@ constexpr int DEXOPT_MASK =
 constexpr int FLAG_STORAGE_DE = 1 << 0;
 constexpr int FLAG_STORAGE_CE = 1 << 1;
 
+// Per-file results of reconcileSecondaryDexFiles.
+// NOTE: keep in sync with IInstalld.aidl
+constexpr int kReconcileSecondaryDexFileExists = 0;
+constexpr int kReconcileSecondaryDexFileDeleted = 1;
+constexpr int kReconcileSecondaryDexFileError = 2;
+
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
 
 }  // namespace installd
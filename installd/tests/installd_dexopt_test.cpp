@@ -36,6 +36,7 @@
 #include <selinux/avc.h>
 
 #include "binder_test_utils.h"
+#include "DexoptStats.h"
 #include "dexopt.h"
 #include "InstalldNativeService.h"
 #include "globals.h"
@@ -625,6 +626,59 @@ TEST_F(DexoptTest, DexoptPrimaryPublic) {
                         DEX2OAT_FROM_SCRATCH);
 }
 
+TEST_F(DexoptTest, DexoptPrimaryRecordsStats) {
+    LOG(INFO) << "DexoptPrimaryRecordsStats";
+    CompilePrimaryDexOk("verify",
+                        DEXOPT_BOOTCOMPLETE | DEXOPT_PUBLIC,
+                        app_oat_dir_.c_str(),
+                        kTestAppGid,
+                        DEX2OAT_FROM_SCRATCH);
+
+    TemporaryFile tmp;
+    ASSERT_TRUE(write_dexopt_stats_binary(tmp.fd));
+    std::string blob;
+    ASSERT_TRUE(android::base::ReadFileToString(tmp.path, &blob));
+    ASSERT_GE(blob.size(), 12U);
+    ASSERT_EQ("DXST", blob.substr(0, 4));
+    uint32_t count;
+    memcpy(&count, blob.data() + 8, sizeof(count));
+    ASSERT_GE(count, 1U);
+}
+
+TEST_F(DexoptTest, DexoptStatsBinaryStatusIsSigned) {
+    LOG(INFO) << "DexoptStatsBinaryStatusIsSigned";
+    DexoptStats stats(DexoptStats::kProfman, "com.installd.test.stats", "base.apk");
+    stats.status = -1;
+    record_dexopt_stats(stats);
+
+    TemporaryFile tmp;
+    ASSERT_TRUE(write_dexopt_stats_binary(tmp.fd));
+    std::string blob;
+    ASSERT_TRUE(android::base::ReadFileToString(tmp.path, &blob));
+    uint32_t count;
+    ASSERT_GE(blob.size(), 12U);
+    memcpy(&count, blob.data() + 8, sizeof(count));
+    ASSERT_GE(count, 1U);
+
+    // Skip to the last record: u8 tool, i32 status, 8 x i64, then 4 strings.
+    size_t offset = 12;
+    size_t last = offset;
+    for (uint32_t i = 0; i < count; i++) {
+        last = offset;
+        offset += 1 + 4 + 8 * 8;
+        for (int j = 0; j < 4; j++) {
+            uint32_t length;
+            ASSERT_LE(offset + sizeof(length), blob.size());
+            memcpy(&length, blob.data() + offset, sizeof(length));
+            offset += sizeof(length) + length;
+        }
+    }
+    ASSERT_EQ(blob.size(), offset);
+    int32_t status;
+    memcpy(&status, blob.data() + last + 1, sizeof(status));
+    ASSERT_EQ(-1, status);
+}
+
 TEST_F(DexoptTest, DexoptPrimaryFailedInvalidFilter) {
     LOG(INFO) << "DexoptPrimaryFailedInvalidFilter";
     binder::Status status;
@@ -807,6 +861,22 @@ TEST_F(ReconcileTest, ReconcileSecondaryAcessViaDifferentUidError) {
         /*binder_ok*/ true, /*dex_ok */ false, /*odex_deleted*/ false, kSystemUid);
 }
 
+TEST_F(ReconcileTest, ReconcileSecondaryDexFilesBulk) {
+    LOG(INFO) << "ReconcileSecondaryDexFilesBulk";
+    std::string missing_dex = app_private_dir_ce_ + "/missing_ce.jar";
+    std::vector<std::string> dex_paths = { secondary_dex_ce_, missing_dex, secondary_dex_ce_link_ };
+    std::vector<std::string> isas = { kRuntimeIsa };
+    std::vector<int32_t> results;
+    binder::Status status = service_->reconcileSecondaryDexFiles(
+        dex_paths, package_name_, kTestAppUid, isas, volume_uuid_, FLAG_STORAGE_CE, &results);
+    ASSERT_TRUE(status.isOk()) << status.toString8().c_str();
+    ASSERT_EQ(3U, results.size());
+    ASSERT_EQ(kReconcileSecondaryDexFileExists, results[0]);
+    ASSERT_EQ(kReconcileSecondaryDexFileDeleted, results[1]);
+    ASSERT_EQ(kReconcileSecondaryDexFileExists, results[2]);
+    ASSERT_EQ(0, access(GetSecondaryDexArtifact(secondary_dex_ce_, "odex").c_str(), F_OK));
+}
+
 class ProfileTest : public DexoptTest {
   protected:
     std::string cur_profile_;
@@ -1027,6 +1097,22 @@ TEST_F(ProfileTest, ProfileMergeFailWrongPackage) {
     mergePackageProfiles("not.there", "primary.prof", /*expected_result*/ false);
 }
 
+TEST_F(ProfileTest, ProfileMergeForPackagesSkipsUnchanged) {
+    LOG(INFO) << "ProfileMergeForPackagesSkipsUnchanged";
+
+    SetupProfiles(/*setup_ref*/ true);
+    std::vector<int32_t> uids = { kTestAppUid, kTestAppUid };
+    std::vector<std::string> packages = { package_name_, "not.there" };
+    std::vector<std::string> profiles = { "primary.prof", "primary.prof" };
+    std::vector<bool> results;
+    ASSERT_BINDER_SUCCESS(service_->mergeProfilesForPackages(uids, packages, profiles, &results));
+    ASSERT_EQ(std::vector<bool>({ true, false }), results);
+
+    // Nothing changed since the previous merge; no recompilation should be requested.
+    ASSERT_BINDER_SUCCESS(service_->mergeProfilesForPackages(uids, packages, profiles, &results));
+    ASSERT_EQ(std::vector<bool>({ false, false }), results);
+}
+
 TEST_F(ProfileTest, ProfileDirOk) {
     LOG(INFO) << "ProfileDirOk";
 
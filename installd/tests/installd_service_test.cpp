@@ -162,6 +162,101 @@ TEST_F(ServiceTest, FixupAppData_Moved) {
     EXPECT_EQ(10000, stat_gid("com.example/bar/file"));
 }
 
+TEST_F(ServiceTest, CreateAppDataForPackages_MismatchedArguments) {
+    LOG(INFO) << "CreateAppDataForPackages_MismatchedArguments";
+
+    std::vector<int64_t> ceDataInodes;
+    EXPECT_FALSE(service->createAppDataForPackages(testUuid, { "com.example", "com.example2" },
+            0, FLAG_STORAGE_DE, { 10000 }, { "default", "default" }, { 28, 28 },
+            &ceDataInodes).isOk());
+    EXPECT_EQ(-1, access(get_full_path("com.example").c_str(), F_OK));
+}
+
+TEST_F(ServiceTest, CreateAppDataForPackages) {
+    LOG(INFO) << "CreateAppDataForPackages";
+
+    std::vector<std::string> packageNames = { "com.example", "com.example2", "com.example3" };
+    std::vector<int64_t> ceDataInodes;
+    ASSERT_BINDER_SUCCESS(service->createAppDataForPackages(testUuid, packageNames, 0,
+            FLAG_STORAGE_CE, { 10000, 10001, 10002 }, { "default", "default", "default" },
+            { 28, 28, 28 }, &ceDataInodes));
+
+    ASSERT_EQ(packageNames.size(), ceDataInodes.size());
+    for (size_t i = 0; i < packageNames.size(); i++) {
+        const std::string path = get_full_path(packageNames[i].c_str());
+        struct stat st;
+        ASSERT_EQ(0, ::stat(path.c_str(), &st)) << path;
+        EXPECT_EQ(10000 + i, st.st_uid);
+        EXPECT_EQ(static_cast<int64_t>(st.st_ino), ceDataInodes[i]);
+        EXPECT_EQ(0, access((path + "/cache").c_str(), F_OK));
+        EXPECT_EQ(0, access((path + "/code_cache").c_str(), F_OK));
+    }
+}
+
+TEST_F(ServiceTest, CreateAppDataForPackages_RollsBackFailedPackage) {
+    LOG(INFO) << "CreateAppDataForPackages_RollsBackFailedPackage";
+
+    // The DE directory of com.example2 can't be created, so its new CE directory must go.
+    system("mkdir -p /data/local/tmp/user_de/0");
+    auto cleanup = android::base::make_scope_guard([] {
+        system("rm -rf /data/local/tmp/user_de");
+    });
+    ASSERT_TRUE(android::base::WriteStringToFile("",
+            "/data/local/tmp/user_de/0/com.example2"));
+
+    std::vector<int64_t> ceDataInodes;
+    EXPECT_FALSE(service->createAppDataForPackages(testUuid, { "com.example", "com.example2" },
+            0, FLAG_STORAGE_CE | FLAG_STORAGE_DE, { 10000, 10001 }, { "default", "default" },
+            { 28, 28 }, &ceDataInodes).isOk());
+
+    ASSERT_EQ(2U, ceDataInodes.size());
+    EXPECT_NE(-1, ceDataInodes[0]);
+    EXPECT_EQ(0, access(get_full_path("com.example").c_str(), F_OK));
+    EXPECT_EQ(-1, ceDataInodes[1]);
+    EXPECT_EQ(-1, access(get_full_path("com.example2").c_str(), F_OK));
+
+    // The entry recorded for the deleted CE directory was dropped from the index as well.
+    std::string journal;
+    ASSERT_TRUE(android::base::ReadFileToString("/data/misc/installd/restorecon_index_TEST",
+            &journal));
+    size_t added = journal.rfind("+ 0 ce com.example2 ");
+    size_t removed = journal.rfind("- 0 ce com.example2\n");
+    if (added != std::string::npos) {
+        EXPECT_NE(std::string::npos, removed);
+        EXPECT_GT(removed, added);
+    }
+}
+
+TEST_F(ServiceTest, CreateAppDataForPackages_RollsBackProfileDirs) {
+    LOG(INFO) << "CreateAppDataForPackages_RollsBackProfileDirs";
+
+    if (!android::base::GetBoolProperty("dalvik.vm.usejitprofiles", false)) {
+        return;
+    }
+
+    // The reference profile directory can't be created, so the current profile directory
+    // created just before it must go.
+    const std::string curProfile = create_primary_current_profile_package_dir_path(0,
+            "com.example");
+    const std::string refProfile = create_primary_reference_profile_package_dir_path(
+            "com.example");
+    ASSERT_EQ(-1, access(curProfile.c_str(), F_OK));
+    ASSERT_EQ(-1, access(refProfile.c_str(), F_OK));
+    auto cleanup = android::base::make_scope_guard([&] {
+        unlink(refProfile.c_str());
+        delete_dir_contents_and_dir(curProfile, true);
+    });
+    ASSERT_TRUE(android::base::WriteStringToFile("", refProfile));
+
+    std::vector<int64_t> ceDataInodes;
+    EXPECT_FALSE(service->createAppDataForPackages(testUuid, { "com.example" }, 0,
+            FLAG_STORAGE_DE, { 10000 }, { "default" }, { 28 }, &ceDataInodes).isOk());
+
+    EXPECT_EQ(-1, access(curProfile.c_str(), F_OK));
+    // The file that was there before is left alone.
+    EXPECT_EQ(0, access(refProfile.c_str(), F_OK));
+}
+
 TEST_F(ServiceTest, HashSecondaryDex) {
     LOG(INFO) << "HashSecondaryDex";
 
@@ -16,13 +16,17 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/scopeguard.h>
 #include <gtest/gtest.h>
+#include <selinux/selinux.h>
 
 #include "InstalldNativeService.h"
 #include "MatchExtensionGen.h"
+#include "RestoreconIndex.h"
 #include "globals.h"
 #include "utils.h"
 
@@ -628,5 +632,67 @@ TEST_F(UtilsTest, TestCreateDirIfNeeded) {
     ASSERT_NE(0, create_dir_if_needed("/data/local/tmp/user/0/bar/baz", 0700));
 }
 
+TEST_F(UtilsTest, TestRestoreconIndex) {
+    system("mkdir -p /data/local/tmp/user/0/com.example/cache");
+    system("mkdir -p /data/local/tmp/user/0/com.example/code_cache");
+
+    auto deleter = [&]() {
+        delete_dir_contents_and_dir("/data/local/tmp/user/0", true /* ignore_if_missing */);
+        unlink("/data/local/tmp/restorecon_index");
+    };
+    auto scope_guard = android::base::make_scope_guard(deleter);
+
+    const std::string path = "/data/local/tmp/user/0/com.example";
+    {
+        RestoreconIndex index("/data/local/tmp/restorecon_index");
+        EXPECT_FALSE(index.isUpToDate(0, FLAG_STORAGE_DE, "com.example", 10050, "default", path));
+        index.markLabeled(0, FLAG_STORAGE_DE, "com.example", 10050, "default", path);
+        EXPECT_TRUE(index.isUpToDate(0, FLAG_STORAGE_DE, "com.example", 10050, "default", path));
+        EXPECT_FALSE(index.isUpToDate(0, FLAG_STORAGE_CE, "com.example", 10050, "default", path));
+        EXPECT_FALSE(index.isUpToDate(0, FLAG_STORAGE_DE, "com.example", 10051, "default", path));
+        EXPECT_FALSE(index.isUpToDate(0, FLAG_STORAGE_DE, "com.example", 10050, "platform", path));
+    }
+
+    // The index survives reloading, but not the cache directory being recreated.
+    {
+        RestoreconIndex index("/data/local/tmp/restorecon_index");
+        EXPECT_TRUE(index.isUpToDate(0, FLAG_STORAGE_DE, "com.example", 10050, "default", path));
+        system("rm -rf /data/local/tmp/user/0/com.example/cache");
+        system("mkdir /data/local/tmp/user/0/com.example/cache");
+        EXPECT_FALSE(index.isUpToDate(0, FLAG_STORAGE_DE, "com.example", 10050, "default", path));
+        index.markLabeled(0, FLAG_STORAGE_DE, "com.example", 10050, "default", path);
+        index.removeUser(0);
+        EXPECT_FALSE(index.isUpToDate(0, FLAG_STORAGE_DE, "com.example", 10050, "default", path));
+    }
+
+    // An entry is only trusted while the directory still carries the label it recorded.
+    char* con = nullptr;
+    ASSERT_EQ(0, lgetfilecon(path.c_str(), &con));
+    std::string label(con);
+    freecon(con);
+    auto write_entry = [&](const std::string& entryLabel) {
+        struct stat st, cache, codeCache;
+        ASSERT_EQ(0, lstat(path.c_str(), &st));
+        ASSERT_EQ(0, lstat((path + "/cache").c_str(), &cache));
+        ASSERT_EQ(0, lstat((path + "/code_cache").c_str(), &codeCache));
+        std::string content = "restorecon-index v2 " + RestoreconIndex::getPolicyHash() + "\n"
+                + "+ 0 de com.example 10050 " + std::to_string(st.st_ino) + " "
+                + std::to_string(cache.st_ino) + " " + std::to_string(codeCache.st_ino)
+                + " default " + entryLabel + "\n";
+        ASSERT_TRUE(android::base::WriteStringToFile(content, "/data/local/tmp/restorecon_index"));
+    };
+    write_entry(label);
+    {
+        RestoreconIndex index("/data/local/tmp/restorecon_index");
+        EXPECT_TRUE(index.isUpToDate(0, FLAG_STORAGE_DE, "com.example", 10050, "default", path));
+    }
+    write_entry("u:object_r:system_data_file:s0" == label
+            ? "u:object_r:app_data_file:s0" : "u:object_r:system_data_file:s0");
+    {
+        RestoreconIndex index("/data/local/tmp/restorecon_index");
+        EXPECT_FALSE(index.isUpToDate(0, FLAG_STORAGE_DE, "com.example", 10050, "default", path));
+    }
+}
+
 }  // namespace installd
 }  // namespace android
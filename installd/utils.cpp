@@ -26,6 +26,10 @@
 #include <sys/xattr.h>
 #include <sys/statvfs.h>
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
 #include <android-base/logging.h>
 #include <android-base/strings.h>
 #include <android-base/stringprintf.h>
@@ -1151,5 +1155,33 @@ void drop_capabilities(uid_t uid) {
     }
 }
 
+void run_in_parallel(size_t count, size_t max_threads, const std::function<void(size_t)>& fn) {
+    size_t num_threads = std::min(count, std::max<size_t>(max_threads, 1));
+    if (num_threads <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+
+    // The calling thread participates as well.
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1);
+    for (size_t t = 1; t < num_threads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
 }  // namespace installd
 }  // namespace android
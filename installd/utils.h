@@ -18,6 +18,7 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -158,6 +159,10 @@ bool collect_profiles(std::vector<std::string>* profiles_paths);
 
 void drop_capabilities(uid_t uid);
 
+// Invoke fn(i) for every i in [0, count) using at most max_threads worker threads.
+// Returns once all the invocations finished. fn must be safe to call concurrently.
+void run_in_parallel(size_t count, size_t max_threads, const std::function<void(size_t)>& fn);
+
 }  // namespace installd
 }  // namespace android
 
@@ -16,16 +16,23 @@
 
 #include "ListCommand.h"
 
+#include <ctype.h>
 #include <getopt.h>
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
-#include <regex>
 #include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -53,6 +60,30 @@ using ::android::hidl::manager::V1_0::IServiceManager;
 namespace android {
 namespace lshal {
 
+// Maximum number of binderized services that are fetched, or dumped, at the same time.
+static constexpr size_t MAX_FETCH_THREADS = 16;
+
+// How long each HAL has to write its --debug output.
+static constexpr std::chrono::milliseconds DEBUG_CALL_WAIT{5000};
+
+// Call f(i) for each i in [0, count), from up to MAX_FETCH_THREADS threads at once.
+static void forEachConcurrently(size_t count, const std::function<void(size_t)>& f) {
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t i = next++; i < count; i = next++) {
+            f(i);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < std::min(count, MAX_FETCH_THREADS); i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+}
+
 vintf::SchemaType toSchemaType(Partition p) {
     return (p == Partition::SYSTEM) ? vintf::SchemaType::FRAMEWORK : vintf::SchemaType::DEVICE;
 }
@@ -159,16 +190,30 @@ bool match(const vintf::MatrixInstance& instance, const FqInstance& fqInstance,
             (!fqInstance.hasInstance() || instance.matchInstance(fqInstance.getInstance()));
 }
 
-template <typename ObjectType>
-VintfInfo getVintfInfo(const std::shared_ptr<const ObjectType>& object,
-                       const FqInstance& fqInstance, vintf::TransportArch ta, VintfInfo value) {
-    bool found = false;
+template <typename ObjectType, typename InstanceType>
+void addVintfInstances(const std::shared_ptr<const ObjectType>& object,
+                       const FqInstance& fqInstance, VintfInfo source,
+                       std::vector<std::pair<VintfInfo, InstanceType>>* instances) {
+    if (object == nullptr) {
+        return;
+    }
     (void)object->forEachInstanceOfVersion(fqInstance.getPackage(), fqInstance.getVersion(),
-                                           [&](const auto& instance) {
-                                               found = match(instance, fqInstance, ta);
-                                               return !found; // continue if not found
+                                           [&](const InstanceType& instance) {
+                                               instances->emplace_back(source, instance);
+                                               return true; // continue
                                            });
-    return found ? value : VINTF_INFO_EMPTY;
+}
+
+template <typename InstanceType>
+VintfInfo getVintfInfo(const std::vector<std::pair<VintfInfo, InstanceType>>& instances,
+                       const FqInstance& fqInstance, vintf::TransportArch ta) {
+    VintfInfo info = VINTF_INFO_EMPTY;
+    for (const auto& [source, instance] : instances) {
+        if (match(instance, fqInstance, ta)) {
+            info |= source;
+        }
+    }
+    return info;
 }
 
 std::shared_ptr<const vintf::HalManifest> ListCommand::getDeviceManifest() const {
@@ -187,8 +232,32 @@ std::shared_ptr<const vintf::CompatibilityMatrix> ListCommand::getFrameworkMatri
     return vintf::VintfObject::GetFrameworkCompatibilityMatrix();
 }
 
+const ListCommand::VintfInstances& ListCommand::getVintfInstances(const FqInstance& fqInstance) {
+    const vintf::Version version{fqInstance.getVersion()};
+    const std::string key = fqInstance.getPackage() + "@" + vintf::to_string(version);
+    auto it = mVintfInstances.find(key);
+    if (it != mVintfInstances.end()) {
+        return it->second;
+    }
+
+    if (!mVintfObjectsLoaded) {
+        mDeviceManifest = getDeviceManifest();
+        mFrameworkManifest = getFrameworkManifest();
+        mDeviceMatrix = getDeviceMatrix();
+        mFrameworkMatrix = getFrameworkMatrix();
+        mVintfObjectsLoaded = true;
+    }
+    VintfInstances& instances = mVintfInstances[key];
+    addVintfInstances(mDeviceManifest, fqInstance, DEVICE_MANIFEST, &instances.manifestInstances);
+    addVintfInstances(mFrameworkManifest, fqInstance, FRAMEWORK_MANIFEST,
+                      &instances.manifestInstances);
+    addVintfInstances(mDeviceMatrix, fqInstance, DEVICE_MATRIX, &instances.matrixInstances);
+    addVintfInstances(mFrameworkMatrix, fqInstance, FRAMEWORK_MATRIX, &instances.matrixInstances);
+    return instances;
+}
+
 VintfInfo ListCommand::getVintfInfo(const std::string& fqInstanceName,
-                                    vintf::TransportArch ta) const {
+                                    vintf::TransportArch ta) {
     FqInstance fqInstance;
     if (!fqInstance.setTo(fqInstanceName) &&
         // Ignore interface / instance for passthrough libs
@@ -197,99 +266,167 @@ VintfInfo ListCommand::getVintfInfo(const std::string& fqInstanceName,
         return VINTF_INFO_EMPTY;
     }
 
-    return lshal::getVintfInfo(getDeviceManifest(), fqInstance, ta, DEVICE_MANIFEST) |
-            lshal::getVintfInfo(getFrameworkManifest(), fqInstance, ta, FRAMEWORK_MANIFEST) |
-            lshal::getVintfInfo(getDeviceMatrix(), fqInstance, ta, DEVICE_MATRIX) |
-            lshal::getVintfInfo(getFrameworkMatrix(), fqInstance, ta, FRAMEWORK_MATRIX);
+    const VintfInstances& instances = getVintfInstances(fqInstance);
+    return lshal::getVintfInfo(instances.manifestInstances, fqInstance, ta) |
+            lshal::getVintfInfo(instances.matrixInstances, fqInstance, ta);
 }
 
-static bool scanBinderContext(pid_t pid,
-        const std::string &contextName,
-        std::function<void(const std::string&)> eachLine) {
-    std::ifstream ifs("/d/binder/proc/" + std::to_string(pid));
-    if (!ifs.is_open()) {
-        return false;
-    }
+namespace {
 
-    static const std::regex kContextLine("^context (\\w+)$");
+// Helpers to parse lines of binder debugfs files in place.
 
-    bool isDesiredContext = false;
-    std::string line;
-    std::smatch match;
-    while(getline(ifs, line)) {
-        if (std::regex_search(line, match, kContextLine)) {
-            isDesiredContext = match.str(1) == contextName;
-            continue;
-        }
+bool consumePrefix(std::string_view* s, std::string_view prefix) {
+    if (s->substr(0, prefix.size()) != prefix) {
+        return false;
+    }
+    s->remove_prefix(prefix.size());
+    return true;
+}
 
-        if (!isDesiredContext) {
-            continue;
-        }
+// Returns true if at least one space was skipped.
+bool consumeSpaces(std::string_view* s) {
+    size_t n = 0;
+    while (n < s->size() && isspace((*s)[n])) {
+        n++;
+    }
+    s->remove_prefix(n);
+    return n > 0;
+}
 
-        eachLine(line);
+template <typename T>
+bool consumeNumber(std::string_view* s, T* value, int base = 10) {
+    auto result = std::from_chars(s->data(), s->data() + s->size(), *value, base);
+    if (result.ec != std::errc()) {
+        return false;
     }
+    s->remove_prefix(result.ptr - s->data());
     return true;
 }
 
-bool ListCommand::getPidInfo(
-        pid_t serverPid, PidInfo *pidInfo) const {
-    static const std::regex kReferencePrefix("^\\s*node \\d+:\\s+u([0-9a-f]+)\\s+c([0-9a-f]+)\\s+");
-    static const std::regex kThreadPrefix("^\\s*thread \\d+:\\s+l\\s+(\\d)(\\d)");
-
-    std::smatch match;
-    return scanBinderContext(serverPid, "hwbinder", [&](const std::string& line) {
-        if (std::regex_search(line, match, kReferencePrefix)) {
-            const std::string &ptrString = "0x" + match.str(2); // use number after c
-            uint64_t ptr;
-            if (!::android::base::ParseUint(ptrString.c_str(), &ptr)) {
-                // Should not reach here, but just be tolerant.
-                err() << "Could not parse number " << ptrString << std::endl;
-                return;
-            }
-            const std::string proc = " proc ";
-            auto pos = line.rfind(proc);
-            if (pos != std::string::npos) {
-                for (const std::string &pidStr : split(line.substr(pos + proc.size()), ' ')) {
-                    int32_t pid;
-                    if (!::android::base::ParseInt(pidStr, &pid)) {
-                        err() << "Could not parse number " << pidStr << std::endl;
-                        return;
-                    }
-                    pidInfo->refPids[ptr].push_back(pid);
-                }
-            }
-
+// "node <id>: u<ptr> c<cookie> ... proc <pid> <pid> ..."
+// Records the pids that reference the node, keyed by its cookie.
+void parseNodeLine(std::string_view line, PidInfo* pidInfo,
+                   const NullableOStream<std::ostream>& err) {
+    uint32_t id;
+    uint64_t ptr;
+    if (!consumeNumber(&line, &id) || !consumePrefix(&line, ":") || !consumeSpaces(&line) ||
+        !consumePrefix(&line, "u") || !consumeNumber(&line, &ptr, 16) || !consumeSpaces(&line) ||
+        !consumePrefix(&line, "c") || !consumeNumber(&line, &ptr, 16) || !consumeSpaces(&line)) {
+        return;
+    }
+    constexpr std::string_view proc = " proc ";
+    auto pos = line.rfind(proc);
+    if (pos == std::string_view::npos) {
+        return;
+    }
+    line.remove_prefix(pos + proc.size());
+    Pids& refPids = pidInfo->refPids[ptr];
+    while (!line.empty()) {
+        int32_t pid;
+        if (!consumeNumber(&line, &pid) || !(line.empty() || consumePrefix(&line, " "))) {
+            err << "Could not parse number " << line << std::endl;
             return;
         }
+        refPids.push_back(pid);
+    }
+}
 
-        if (std::regex_search(line, match, kThreadPrefix)) {
-            // "1" is waiting in binder driver
-            // "2" is poll. It's impossible to tell if these are in use.
-            //     and HIDL default code doesn't use it.
-            bool isInUse = match.str(1) != "1";
-            // "0" is a thread that has called into binder
-            // "1" is looper thread
-            // "2" is main looper thread
-            bool isHwbinderThread = match.str(2) != "0";
-
-            if (!isHwbinderThread) {
-                return;
-            }
+// "thread <id>: l <looper state><looper type> ..."
+void parseThreadLine(std::string_view line, PidInfo* pidInfo) {
+    uint32_t id;
+    if (!consumeNumber(&line, &id) || !consumePrefix(&line, ":") || !consumeSpaces(&line) ||
+        !consumePrefix(&line, "l") || !consumeSpaces(&line) || line.size() < 2 ||
+        !isdigit(line[0]) || !isdigit(line[1])) {
+        return;
+    }
+    // "1" is waiting in binder driver
+    // "2" is poll. It's impossible to tell if these are in use.
+    //     and HIDL default code doesn't use it.
+    bool isInUse = line[0] != '1';
+    // "0" is a thread that has called into binder
+    // "1" is looper thread
+    // "2" is main looper thread
+    bool isHwbinderThread = line[1] != '0';
+
+    if (!isHwbinderThread) {
+        return;
+    }
+
+    if (isInUse) {
+        pidInfo->threadUsage++;
+    }
+
+    pidInfo->threadCount++;
+}
 
-            if (isInUse) {
-                pidInfo->threadUsage++;
+}  // namespace
+
+void parseBinderPidInfos(std::string_view content, std::string_view contextName,
+                         std::map<pid_t, PidInfo>* pidInfos,
+                         const NullableOStream<std::ostream>& err) {
+    pid_t pid = NO_PID;
+    // The process being parsed, if it is in the desired context.
+    PidInfo* pidInfo = nullptr;
+    while (!content.empty()) {
+        size_t end = content.find('\n');
+        std::string_view line = content.substr(0, end);
+        content.remove_prefix(end == std::string_view::npos ? content.size() : end + 1);
+
+        if (consumePrefix(&line, "proc ")) {
+            pidInfo = nullptr;
+            if (!consumeNumber(&line, &pid) || !line.empty()) {
+                pid = NO_PID;
             }
+            continue;
+        }
+        if (consumePrefix(&line, "context ")) {
+            pidInfo = (pid != NO_PID && line == contextName) ? &(*pidInfos)[pid] : nullptr;
+            continue;
+        }
+        if (pidInfo == nullptr) {
+            continue;
+        }
 
-            pidInfo->threadCount++;
-            return;
+        consumeSpaces(&line);
+        if (consumePrefix(&line, "node ")) {
+            parseNodeLine(line, pidInfo, err);
+        } else if (consumePrefix(&line, "thread ")) {
+            parseThreadLine(line, pidInfo);
         }
+    }
+}
 
-        // not reference or thread line
-        return;
-    });
+bool ListCommand::getPidInfo(
+        pid_t serverPid, PidInfo *pidInfo) const {
+    // /d/binder/state has the same information as /d/binder/proc/<pid>, for all processes at
+    // once, so it is read and parsed only once. Processes that started since are read from
+    // their own file.
+    if (!mBinderStateRead) {
+        mBinderStateRead = true;
+        std::string content;
+        if (::android::base::ReadFileToString("/d/binder/state", &content)) {
+            parseBinderPidInfos(content, "hwbinder", &mBinderStatePidInfos, err());
+        }
+    }
+    auto it = mBinderStatePidInfos.find(serverPid);
+    if (it != mBinderStatePidInfos.end()) {
+        *pidInfo = it->second;
+        return true;
+    }
+
+    std::string content;
+    if (!::android::base::ReadFileToString("/d/binder/proc/" + std::to_string(serverPid),
+                                           &content)) {
+        return false;
+    }
+    std::map<pid_t, PidInfo> pidInfos;
+    parseBinderPidInfos(content, "hwbinder", &pidInfos, err());
+    *pidInfo = pidInfos[serverPid];
+    return true;
 }
 
 const PidInfo* ListCommand::getPidInfoCached(pid_t serverPid) {
+    std::lock_guard<std::mutex> lock(mCacheLock);
     auto pair = mCachedPidInfos.insert({serverPid, PidInfo{}});
     if (pair.second /* did insertion take place? */) {
         if (!getPidInfo(serverPid, &pair.first->second)) {
@@ -354,24 +491,33 @@ void ListCommand::postprocess() {
             entry.vintfInfo = getVintfInfo(entry.interfaceName, {entry.transport, entry.arch});
         }
     });
-    // use a double for loop here because lshal doesn't care about efficiency.
-    for (TableEntry &packageEntry : mImplementationsTable) {
-        std::string packageName = packageEntry.interfaceName;
+    // Passthrough interfaces that don't know their bitness take it from the implementation of
+    // their package@version, which is looked up in an index rather than by scanning all
+    // implementations for each interface.
+    std::unordered_map<std::string, vintf::Arch> implementationArchs;
+    for (const TableEntry &packageEntry : mImplementationsTable) {
+        if (packageEntry.arch == vintf::Arch::ARCH_EMPTY) {
+            continue;
+        }
+        const std::string &packageName = packageEntry.interfaceName;
         FQName fqPackageName;
         if (!FQName::parse(packageName.substr(0, packageName.find("::")), &fqPackageName)) {
             continue;
         }
-        for (TableEntry &interfaceEntry : mPassthroughRefTable) {
-            if (interfaceEntry.arch != vintf::Arch::ARCH_EMPTY) {
-                continue;
-            }
-            FQName interfaceName;
-            if (!FQName::parse(splitFirst(interfaceEntry.interfaceName, '/').first, &interfaceName)) {
-                continue;
-            }
-            if (interfaceName.getPackageAndVersion() == fqPackageName) {
-                interfaceEntry.arch = packageEntry.arch;
-            }
+        // The first implementation wins.
+        implementationArchs.emplace(fqPackageName.string(), packageEntry.arch);
+    }
+    for (TableEntry &interfaceEntry : mPassthroughRefTable) {
+        if (interfaceEntry.arch != vintf::Arch::ARCH_EMPTY) {
+            continue;
+        }
+        FQName interfaceName;
+        if (!FQName::parse(splitFirst(interfaceEntry.interfaceName, '/').first, &interfaceName)) {
+            continue;
+        }
+        auto it = implementationArchs.find(interfaceName.getPackageAndVersion().string());
+        if (it != implementationArchs.end()) {
+            interfaceEntry.arch = it->second;
         }
     }
 
@@ -530,6 +676,45 @@ static vintf::Arch fromBaseArchitecture(::android::hidl::base::V1_0::DebugInfo::
     }
 }
 
+std::map<std::string, std::string> ListCommand::fetchDebugInfos(const Table& table) const {
+    // debug() of some HALs is slow, so they are dumped concurrently, each into its own buffer.
+    std::vector<std::string> names;
+    for (const TableEntry& entry : table) {
+        names.push_back(entry.interfaceName);
+    }
+    std::vector<std::string> debugInfos(names.size());
+    forEachConcurrently(names.size(), [&](size_t i) {
+        std::stringstream ss;
+        auto pair = splitFirst(names[i], '/');
+        auto start = std::chrono::steady_clock::now();
+        Status status = mLshal.emitDebugInfo(pair.first, pair.second, {},
+                                             false /* excludesParentInstances */, ss,
+                                             NullableOStream<std::ostream>(nullptr),
+                                             DEBUG_CALL_WAIT);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start);
+        std::string output = ss.str();
+        if (!output.empty() && output.back() != '\n') {
+            output += '\n';
+        }
+        if (status & TIMEOUT_ERROR) {
+            output += "[debug() did not finish within " + std::to_string(DEBUG_CALL_WAIT.count()) +
+                    "ms, output may be truncated]";
+        } else if (output.empty()) {
+            return;
+        } else {
+            output += "[debug() took " + std::to_string(elapsed.count()) + "ms]";
+        }
+        debugInfos[i] = std::move(output);
+    });
+
+    std::map<std::string, std::string> ret;
+    for (size_t i = 0; i < names.size(); i++) {
+        ret.emplace(std::move(names[i]), std::move(debugInfos[i]));
+    }
+    return ret;
+}
+
 void ListCommand::dumpTable(const NullableOStream<std::ostream>& out) const {
     if (mNeat) {
         std::vector<const Table*> tables;
@@ -548,13 +733,9 @@ void ListCommand::dumpTable(const NullableOStream<std::ostream>& out) const {
         // on the "mServicesTable".
         std::function<std::string(const std::string&)> emitDebugInfo = nullptr;
         if (mEmitDebugInfo && &table == &mServicesTable) {
-            emitDebugInfo = [this](const auto& iName) {
-                std::stringstream ss;
-                auto pair = splitFirst(iName, '/');
-                mLshal.emitDebugInfo(pair.first, pair.second, {},
-                                     false /* excludesParentInstances */, ss,
-                                     NullableOStream<std::ostream>(nullptr));
-                return ss.str();
+            emitDebugInfo = [debugInfos = fetchDebugInfos(table)](const auto& iName) {
+                auto it = debugInfos.find(iName);
+                return it != debugInfos.end() ? it->second : std::string();
             };
         }
         table.createTextTable(mNeat, emitDebugInfo).dump(out.buf());
@@ -666,7 +847,6 @@ Status ListCommand::fetchBinderized(const sp<IServiceManager> &manager) {
         return DUMP_BINDERIZED_ERROR;
     }
 
-    Status status = OK;
     std::map<std::string, TableEntry> allTableEntries;
     for (const auto &fqInstanceName : fqInstanceNames) {
         // create entry and default assign all fields.
@@ -674,10 +854,29 @@ Status ListCommand::fetchBinderized(const sp<IServiceManager> &manager) {
         entry.interfaceName = fqInstanceName;
         entry.transport = mode;
         entry.serviceStatus = ServiceStatus::NON_RESPONSIVE;
+    }
 
-        status |= fetchBinderizedEntry(manager, &entry);
+    // Each entry takes a few IPCs, which can each take up to IPC_CALL_WAIT on a hung service, so
+    // entries are fetched concurrently. Warnings are collected per entry and emitted in order.
+    struct Fetch {
+        TableEntry* entry;
+        Status status = OK;
+        std::stringstream errors;
+    };
+    std::vector<Fetch> fetches(allTableEntries.size());
+    size_t i = 0;
+    for (auto& pair : allTableEntries) {
+        fetches[i++].entry = &pair.second;
     }
+    forEachConcurrently(fetches.size(), [&](size_t j) {
+        fetches[j].status = fetchBinderizedEntry(manager, fetches[j].entry, fetches[j].errors);
+    });
 
+    Status status = OK;
+    for (auto& fetch : fetches) {
+        err() << fetch.errors.str();
+        status |= fetch.status;
+    }
     for (auto& pair : allTableEntries) {
         putEntry(HalType::BINDERIZED_SERVICES, std::move(pair.second));
     }
@@ -685,10 +884,10 @@ Status ListCommand::fetchBinderized(const sp<IServiceManager> &manager) {
 }
 
 Status ListCommand::fetchBinderizedEntry(const sp<IServiceManager> &manager,
-                                         TableEntry *entry) {
+                                         TableEntry *entry, std::ostream &errors) {
     Status status = OK;
     const auto handleError = [&](Status additionalError, const std::string& msg) {
-        err() << "Warning: Skipping \"" << entry->interfaceName << "\": " << msg << std::endl;
+        errors << "Warning: Skipping \"" << entry->interfaceName << "\": " << msg << std::endl;
         status |= DUMP_BINDERIZED_ERROR | additionalError;
     };
 
@@ -744,6 +943,16 @@ Status ListCommand::fetchBinderizedEntry(const sp<IServiceManager> &manager,
 
     // hash
     do {
+        const auto hashKey = std::make_pair(serviceName, entry->serverPid);
+        if (entry->serverPid != NO_PID) {
+            std::lock_guard<std::mutex> lock(mCacheLock);
+            auto it = mCachedHashes.find(hashKey);
+            if (it != mCachedHashes.end()) {
+                entry->hash = it->second;
+                break;
+            }
+        }
+
         ssize_t hashIndex = -1;
         auto ifaceChainRet = timeoutIPC(service, &IBase::interfaceChain, [&] (const auto& c) {
             for (size_t i = 0; i < c.size(); ++i) {
@@ -777,6 +986,11 @@ Status ListCommand::fetchBinderizedEntry(const sp<IServiceManager> &manager,
         });
         if (!hashRet.isOk()) {
             handleError(TRANSACTION_ERROR, "getHashChain failed: " + hashRet.description());
+            break;
+        }
+        if (entry->serverPid != NO_PID && !entry->hash.empty()) {
+            std::lock_guard<std::mutex> lock(mCacheLock);
+            mCachedHashes.emplace(hashKey, entry->hash);
         }
     } while (0);
     if (status == OK) {
@@ -822,15 +1036,30 @@ Status ListCommand::fetchLazyHals() {
     if (!shouldFetchHalType(HalType::LAZY_HALS)) { return OK; }
     Status status = OK;
 
+    // Index the fetched HALs, rather than scanning them for each manifest entry.
+    std::unordered_set<std::string> hwbinderNames;
+    for (const TableEntry& existing : mServicesTable) {
+        hwbinderNames.insert(existing.interfaceName);
+    }
+    PassthroughVersions passthroughVersions;
+    for (const TableEntry& existing : mImplementationsTable) {
+        FqInstance existingFqInstance;
+        if (!existingFqInstance.setTo(getPackageAndVersion(existing.interfaceName))) {
+            continue;
+        }
+        passthroughVersions[existingFqInstance.getPackage()].push_back(
+                vintf::Version{existingFqInstance.getVersion()});
+    }
+
     for (const TableEntry& manifestEntry : mManifestHalsTable) {
         if (manifestEntry.transport == vintf::Transport::HWBINDER) {
-            if (!hasHwbinderEntry(manifestEntry)) {
+            if (hwbinderNames.count(manifestEntry.interfaceName) == 0) {
                 mLazyHalsTable.add(TableEntry(manifestEntry));
             }
             continue;
         }
         if (manifestEntry.transport == vintf::Transport::PASSTHROUGH) {
-            if (!hasPassthroughEntry(manifestEntry)) {
+            if (!hasPassthroughEntry(manifestEntry, passthroughVersions)) {
                 mLazyHalsTable.add(TableEntry(manifestEntry));
             }
             continue;
@@ -842,31 +1071,21 @@ Status ListCommand::fetchLazyHals() {
     return status;
 }
 
-bool ListCommand::hasHwbinderEntry(const TableEntry& entry) const {
-    for (const TableEntry& existing : mServicesTable) {
-        if (existing.interfaceName == entry.interfaceName) {
-            return true;
-        }
-    }
-    return false;
-}
-
-bool ListCommand::hasPassthroughEntry(const TableEntry& entry) const {
+bool ListCommand::hasPassthroughEntry(const TableEntry& entry,
+                                      const PassthroughVersions& passthroughVersions) const {
     FqInstance entryFqInstance;
     if (!entryFqInstance.setTo(entry.interfaceName)) {
         return false; // cannot parse, so add it anyway.
     }
-    for (const TableEntry& existing : mImplementationsTable) {
-        FqInstance existingFqInstance;
-        if (!existingFqInstance.setTo(getPackageAndVersion(existing.interfaceName))) {
-            continue;
-        }
-
-        // For example, manifest may say graphics.mapper@2.1 but passthroughServiceManager
-        // can only list graphics.mapper@2.0.
-        if (entryFqInstance.getPackage() == existingFqInstance.getPackage() &&
-            vintf::Version{entryFqInstance.getVersion()}
-                .minorAtLeast(vintf::Version{existingFqInstance.getVersion()})) {
+    auto it = passthroughVersions.find(entryFqInstance.getPackage());
+    if (it == passthroughVersions.end()) {
+        return false;
+    }
+    // For example, manifest may say graphics.mapper@2.1 but passthroughServiceManager
+    // can only list graphics.mapper@2.0.
+    vintf::Version entryVersion{entryFqInstance.getVersion()};
+    for (const vintf::Version& existingVersion : it->second) {
+        if (entryVersion.minorAtLeast(existingVersion)) {
             return true;
         }
     }
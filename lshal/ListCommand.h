@@ -21,7 +21,10 @@
 #include <stdint.h>
 
 #include <fstream>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include <android-base/macros.h>
@@ -47,6 +50,12 @@ struct PidInfo {
     uint32_t threadCount; // number of threads total
 };
 
+// Adds the information on the contextName context of every process in content, which is the
+// content of /d/binder/state or /d/binder/proc/<pid>, to pidInfos.
+void parseBinderPidInfos(std::string_view content, std::string_view contextName,
+                         std::map<pid_t, PidInfo>* pidInfos,
+                         const NullableOStream<std::ostream>& err);
+
 enum class HalType {
     BINDERIZED_SERVICES = 0,
     PASSTHROUGH_CLIENTS,
@@ -102,8 +111,10 @@ protected:
     Status fetchManifestHals();
     Status fetchLazyHals();
 
+    // Fetch the information of a single binderized service. Called concurrently for different
+    // entries; warnings are written to errors instead of err() so they can be emitted in order.
     Status fetchBinderizedEntry(const sp<::android::hidl::manager::V1_0::IServiceManager> &manager,
-                                TableEntry *entry);
+                                TableEntry *entry, std::ostream &errors);
 
     // Get relevant information for a PID by parsing files under /d/binder.
     // It is a virtual member function so that it can be mocked.
@@ -112,6 +123,8 @@ protected:
     const PidInfo* getPidInfoCached(pid_t serverPid);
 
     void dumpTable(const NullableOStream<std::ostream>& out) const;
+    // Collect the debug() output of each entry, keyed by interface name.
+    std::map<std::string, std::string> fetchDebugInfos(const Table& table) const;
     void dumpVintf(const NullableOStream<std::ostream>& out) const;
     void addLine(TextTable *table, const std::string &interfaceName, const std::string &transport,
                  const std::string &arch, const std::string &threadUsage, const std::string &server,
@@ -129,7 +142,7 @@ protected:
     virtual Partition getPartition(pid_t pid);
     Partition resolvePartition(Partition processPartition, const FqInstance &fqInstance) const;
 
-    VintfInfo getVintfInfo(const std::string &fqInstanceName, vintf::TransportArch ta) const;
+    VintfInfo getVintfInfo(const std::string &fqInstanceName, vintf::TransportArch ta);
     // Allow to mock these functions for testing.
     virtual std::shared_ptr<const vintf::HalManifest> getDeviceManifest() const;
     virtual std::shared_ptr<const vintf::CompatibilityMatrix> getDeviceMatrix() const;
@@ -155,9 +168,20 @@ protected:
 
     void initFetchTypes();
 
-    // Helper functions ti add HALs that are listed in VINTF manifest to LAZY_HALS table.
-    bool hasHwbinderEntry(const TableEntry& entry) const;
-    bool hasPassthroughEntry(const TableEntry& entry) const;
+    // Helper function to add HALs that are listed in VINTF manifest to LAZY_HALS table.
+    // Versions of the passthrough implementations, keyed by package.
+    using PassthroughVersions = std::unordered_map<std::string, std::vector<vintf::Version>>;
+    bool hasPassthroughEntry(const TableEntry& entry,
+                             const PassthroughVersions& passthroughVersions) const;
+
+    // Instances of a package@version in the VINTF manifests and matrices, each with the
+    // manifest or matrix that declares it.
+    struct VintfInstances {
+        std::vector<std::pair<VintfInfo, vintf::ManifestInstance>> manifestInstances;
+        std::vector<std::pair<VintfInfo, vintf::MatrixInstance>> matrixInstances;
+    };
+    // Retrieve from mVintfInstances, and look up the manifests and matrices if necessary.
+    const VintfInstances& getVintfInstances(const FqInstance& fqInstance);
 
     Table mServicesTable{};
     Table mPassthroughRefTable{};
@@ -190,9 +214,30 @@ protected:
     // Cache for getPidInfo.
     std::map<pid_t, PidInfo> mCachedPidInfos;
 
+    // Contents of /d/binder/state, read by the first call to getPidInfo.
+    mutable bool mBinderStateRead = false;
+    mutable std::map<pid_t, PidInfo> mBinderStatePidInfos;
+
+    // Cache for the hash of an interface, keyed by interface and server PID. A process serves
+    // the same hash for every instance of an interface, so it is only asked once.
+    std::map<std::pair<std::string, pid_t>, std::string> mCachedHashes;
+
+    // Guards mCachedPidInfos, mBinderStatePidInfos and mCachedHashes while binderized services
+    // are fetched.
+    std::mutex mCacheLock;
+
     // Cache for getPartition.
     std::map<pid_t, Partition> mPartitions;
 
+    // Cache for getVintfInstances, keyed by package@version.
+    std::unordered_map<std::string, VintfInstances> mVintfInstances;
+    // The manifests and matrices, retrieved once by getVintfInstances.
+    bool mVintfObjectsLoaded = false;
+    std::shared_ptr<const vintf::HalManifest> mDeviceManifest;
+    std::shared_ptr<const vintf::HalManifest> mFrameworkManifest;
+    std::shared_ptr<const vintf::CompatibilityMatrix> mDeviceMatrix;
+    std::shared_ptr<const vintf::CompatibilityMatrix> mFrameworkMatrix;
+
     RegisteredOptions mOptions;
     // All selected columns
     std::vector<TableColumnType> mSelectedColumns;
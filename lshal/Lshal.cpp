@@ -19,6 +19,10 @@
 
 #include "Lshal.h"
 
+#include <string.h>
+#include <unistd.h>
+
+#include <memory>
 #include <set>
 #include <string>
 
@@ -28,6 +32,7 @@
 #include "DebugCommand.h"
 #include "ListCommand.h"
 #include "PipeRelay.h"
+#include "Timeout.h"
 
 namespace android {
 namespace lshal {
@@ -81,15 +86,11 @@ void Lshal::usage() {
     });
 }
 
-// A unique_ptr type using a custom deleter function.
-template<typename T>
-using deleted_unique_ptr = std::unique_ptr<T, std::function<void(T *)> >;
-
 static hardware::hidl_vec<hardware::hidl_string> convert(const std::vector<std::string> &v) {
     hardware::hidl_vec<hardware::hidl_string> hv;
     hv.resize(v.size());
     for (size_t i = 0; i < v.size(); ++i) {
-        hv[i].setToExternal(v[i].c_str(), v[i].size());
+        hv[i] = v[i];
     }
     return hv;
 }
@@ -100,11 +101,16 @@ Status Lshal::emitDebugInfo(
         const std::vector<std::string> &options,
         bool excludesParentInstances,
         std::ostream &out,
-        NullableOStream<std::ostream> err) const {
+        NullableOStream<std::ostream> err,
+        std::chrono::milliseconds timeout) const {
     using android::hidl::base::V1_0::IBase;
     using android::hardware::details::getDescriptor;
 
-    hardware::Return<sp<IBase>> retBase = serviceManager()->get(interfaceName, instanceName);
+    // get() starts the HAL if it is lazy, which may take as long as debug() itself.
+    hardware::Return<sp<IBase>> retBase = timeout == std::chrono::milliseconds::zero()
+            ? serviceManager()->get(interfaceName, instanceName)
+            : timeoutIPC(timeout, serviceManager(), &IServiceManager::get, interfaceName,
+                         instanceName);
 
     if (!retBase.isOk()) {
         std::string msg = "Cannot get " + interfaceName + "/" + instanceName + ": "
@@ -144,17 +150,45 @@ Status Lshal::emitDebugInfo(
         return IO_ERROR;
     }
 
-    deleted_unique_ptr<native_handle_t> fdHandle(
+    // With a timeout, debug() may still be running after this returns, so it gets its own copy
+    // of the fd and of the options. The copy of the fd is closed as soon as debug() returns, so
+    // that the relay sees the end of the output.
+    std::shared_ptr<native_handle_t> fdHandle(
         native_handle_create(1 /* numFds */, 0 /* numInts */),
-        native_handle_delete);
-
-    fdHandle->data[0] = relay.fd();
+        [](native_handle_t* handle) {
+            native_handle_close(handle);
+            native_handle_delete(handle);
+        });
+
+    fdHandle->data[0] = dup(relay.fd());
+    if (fdHandle->data[0] < 0) {
+        std::string msg = "Cannot dup relay fd: " + std::string(strerror(errno));
+        err << msg << std::endl;
+        LOG(ERROR) << msg;
+        return IO_ERROR;
+    }
 
-    hardware::Return<void> ret = base->debug(fdHandle.get(), convert(options));
+    auto ret = std::make_shared<hardware::Return<void>>();
+    auto debug = [base, fdHandle, hidlOptions = convert(options), ret]() mutable {
+        *ret = base->debug(fdHandle.get(), hidlOptions);
+        fdHandle.reset();
+        (void)ret->isOk();  // The caller may have stopped waiting for it.
+    };
+    if (timeout == std::chrono::milliseconds::zero()) {
+        debug();
+    } else if (!lshal::timeout(timeout, std::move(debug))) {
+        relay.setTimedOut();
+        std::string msg = "debug() on " + interfaceName + "/" + instanceName +
+                " did not finish within " + std::to_string(timeout.count()) +
+                "ms, output may be truncated.";
+        err << msg << std::endl;
+        LOG(ERROR) << msg;
+        return TIMEOUT_ERROR;
+    }
 
-    if (!ret.isOk()) {
+    if (!ret->isOk()) {
         std::string msg = "debug() FAILED on " + interfaceName + "/" + instanceName + ": "
-                + ret.description();
+                + ret->description();
         err << msg << std::endl;
         LOG(ERROR) << msg;
         return TRANSACTION_ERROR;
@@ -17,6 +17,7 @@
 #ifndef FRAMEWORK_NATIVE_CMDS_LSHAL_LSHAL_H_
 #define FRAMEWORK_NATIVE_CMDS_LSHAL_LSHAL_H_
 
+#include <chrono>
 #include <iostream>
 #include <string>
 
@@ -47,13 +48,17 @@ public:
     const sp<hidl::manager::V1_0::IServiceManager> &serviceManager() const;
     const sp<hidl::manager::V1_0::IServiceManager> &passthroughManager() const;
 
+    // Write the output of IBase::debug() of the given instance to out. If timeout is not zero,
+    // gives up on getting the instance, and then on debug(), after that long each. When debug()
+    // is given up on, TIMEOUT_ERROR is returned, and out has what the HAL had written by then.
     Status emitDebugInfo(
             const std::string &interfaceName,
             const std::string &instanceName,
             const std::vector<std::string> &options,
             bool excludesParentInstances,
             std::ostream &out,
-            NullableOStream<std::ostream> err) const;
+            NullableOStream<std::ostream> err,
+            std::chrono::milliseconds timeout = std::chrono::milliseconds::zero()) const;
 
     Command* selectCommand(const std::string& command) const;
 
@@ -16,12 +16,17 @@
 
 #include "PipeRelay.h"
 
-#include <sys/select.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <memory>
+#include <thread>
 
 #include <android-base/logging.h>
 #include <utils/Thread.h>
@@ -29,48 +34,62 @@
 namespace android {
 namespace lshal {
 
-static constexpr struct timeval READ_TIMEOUT { .tv_sec = 1, .tv_usec = 0 };
+static constexpr int READ_TIMEOUT_MS = 1000;
+
+// Debug output can be large, so it is read in large chunks, and the pipe is made large enough for
+// HALs not to block on it while the relay thread is writing out the previous chunk.
+static constexpr size_t READ_BUFFER_SIZE = 64 * 1024;
+static constexpr int PIPE_SIZE = 1024 * 1024;
 
 struct PipeRelay::RelayThread : public Thread {
-    explicit RelayThread(int fd, std::ostream &os);
+    explicit RelayThread(int fd, int wakeFd, std::ostream &os);
 
     bool threadLoop() override;
     void setFinished();
+    void setTimedOut();
 
 private:
+    void drain();
+
     int mFd;
+    int mWakeFd;
     std::ostream &mOutStream;
+    std::unique_ptr<char[]> mBuffer;
 
     // If we were to use requestExit() and exitPending() instead, threadLoop()
     // may not run at all by the time ~PipeRelay is called (i.e. debug() has
     // returned from HAL). By using our own flag, we ensure that select() and
     // read() are executed until data are drained.
     std::atomic_bool mFinished;
+    std::atomic_bool mTimedOut;
 
     DISALLOW_COPY_AND_ASSIGN(RelayThread);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 
-PipeRelay::RelayThread::RelayThread(int fd, std::ostream &os)
-      : mFd(fd), mOutStream(os), mFinished(false) {}
+PipeRelay::RelayThread::RelayThread(int fd, int wakeFd, std::ostream &os)
+      : mFd(fd), mWakeFd(wakeFd), mOutStream(os), mBuffer(new char[READ_BUFFER_SIZE]),
+        mFinished(false), mTimedOut(false) {}
 
 bool PipeRelay::RelayThread::threadLoop() {
-    char buffer[1024];
-
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(mFd, &set);
-
-    struct timeval timeout = READ_TIMEOUT;
+    struct pollfd pfds[] = {
+        { .fd = mFd, .events = POLLIN },
+        { .fd = mWakeFd, .events = POLLIN },
+    };
 
-    int res = TEMP_FAILURE_RETRY(select(mFd + 1, &set, nullptr, nullptr, &timeout));
+    int res = TEMP_FAILURE_RETRY(poll(pfds, mWakeFd >= 0 ? 2 : 1, READ_TIMEOUT_MS));
     if (res < 0) {
-        PLOG(INFO) << "select() failed";
+        PLOG(INFO) << "poll() failed";
         return false;
     }
 
-    if (res == 0 || !FD_ISSET(mFd, &set)) {
+    if (mTimedOut) {
+        drain();
+        return false;
+    }
+
+    if (res == 0) {
         if (mFinished) {
             LOG(WARNING) << "debug: timeout reading from pipe, output may be truncated.";
             return false;
@@ -79,8 +98,8 @@ bool PipeRelay::RelayThread::threadLoop() {
         return true;
     }
 
-    // FD_ISSET(mFd, &set) == true. Data available, start reading
-    ssize_t n = TEMP_FAILURE_RETRY(read(mFd, buffer, sizeof(buffer)));
+    // Data available, or the write end was closed.
+    ssize_t n = TEMP_FAILURE_RETRY(read(mFd, mBuffer.get(), READ_BUFFER_SIZE));
 
     if (n < 0) {
         PLOG(ERROR) << "read() failed";
@@ -90,7 +109,7 @@ bool PipeRelay::RelayThread::threadLoop() {
         return false;
     }
 
-    mOutStream.write(buffer, n);
+    mOutStream.write(mBuffer.get(), n);
 
     return true;
 }
@@ -99,18 +118,68 @@ void PipeRelay::RelayThread::setFinished() {
     mFinished = true;
 }
 
+void PipeRelay::RelayThread::setTimedOut() {
+    mTimedOut = true;
+}
+
+// Relays what is in the pipe now, but nothing written after: a writer that timed out may keep
+// writing for as long as it likes.
+void PipeRelay::RelayThread::drain() {
+    int pending = 0;
+    if (ioctl(mFd, FIONREAD, &pending) < 0) {
+        PLOG(ERROR) << "ioctl(FIONREAD) failed";
+        return;
+    }
+    if (fcntl(mFd, F_SETFL, fcntl(mFd, F_GETFL) | O_NONBLOCK) < 0) {
+        PLOG(ERROR) << "Could not make the pipe non-blocking";
+        return;
+    }
+    while (pending > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(
+                read(mFd, mBuffer.get(), std::min<size_t>(pending, READ_BUFFER_SIZE)));
+        if (n <= 0) {
+            // EAGAIN: someone else read it; 0: the write end was closed.
+            break;
+        }
+        mOutStream.write(mBuffer.get(), n);
+        pending -= n;
+    }
+}
+
+// Reads and throws away what is written to fd until the write end is closed, then closes fd.
+static void discardUntilClosed(int fd) {
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+        PLOG(WARNING) << "Could not make the pipe blocking";
+    }
+    std::unique_ptr<char[]> buffer(new char[READ_BUFFER_SIZE]);
+    while (TEMP_FAILURE_RETRY(read(fd, buffer.get(), READ_BUFFER_SIZE)) > 0) {
+    }
+    close(fd);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 PipeRelay::PipeRelay(std::ostream &os)
-    : mInitCheck(NO_INIT) {
-    int res = pipe(mFds);
+    : mInitCheck(NO_INIT), mWakeFd(-1), mTimedOut(false) {
+    int res = pipe2(mFds, O_CLOEXEC);
 
     if (res < 0) {
         mInitCheck = -errno;
         return;
     }
 
-    mThread = new RelayThread(mFds[0], os);
+    // Best effort; the default size only makes HALs wait for the relay thread more often.
+    if (fcntl(mFds[1], F_SETPIPE_SZ, PIPE_SIZE) < 0) {
+        PLOG(VERBOSE) << "Could not grow pipe";
+    }
+
+    // Without it, the relay only stops once the writer stops writing for READ_TIMEOUT_MS.
+    mWakeFd = eventfd(0, EFD_CLOEXEC);
+    if (mWakeFd < 0) {
+        PLOG(WARNING) << "Could not create eventfd";
+    }
+
+    mThread = new RelayThread(mFds[0], mWakeFd, os);
     mInitCheck = mThread->run("RelayThread");
 }
 
@@ -130,7 +199,15 @@ PipeRelay::~PipeRelay() {
         mThread.clear();
     }
 
+    // The writer that timed out holds its own copy of the write end, and is done once it closes
+    // it. Until then, the read end is kept open so that its writes still succeed.
+    if (mTimedOut && mFds[0] >= 0) {
+        std::thread(discardUntilClosed, mFds[0]).detach();
+        mFds[0] = -1;
+    }
+
     CloseFd(&mFds[0]);
+    CloseFd(&mWakeFd);
 }
 
 status_t PipeRelay::initCheck() const {
@@ -141,5 +218,16 @@ int PipeRelay::fd() const {
     return mFds[1];
 }
 
+void PipeRelay::setTimedOut() {
+    mTimedOut = true;
+    if (mThread == nullptr) {
+        return;
+    }
+    mThread->setTimedOut();
+    if (mWakeFd >= 0 && eventfd_write(mWakeFd, 1) < 0) {
+        PLOG(WARNING) << "Could not wake up the relay thread";
+    }
+}
+
 }  // namespace lshal
 }  // namespace android
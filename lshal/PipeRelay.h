@@ -39,12 +39,21 @@ struct PipeRelay {
     // connection.
     int fd() const;
 
+    // The writer did not finish in time, and may keep writing: only what it
+    // has written so far is relayed, and the relay stops right after. What
+    // it writes later is read and thrown away until it closes its end, so
+    // that it doesn't fail with EPIPE.
+    void setTimedOut();
+
 private:
     struct RelayThread;
 
     status_t mInitCheck;
     int mFds[2];
+    // Wakes up the relay thread when the writer times out.
+    int mWakeFd;
     sp<RelayThread> mThread;
+    bool mTimedOut;
 
     static void CloseFd(int *fd);
 
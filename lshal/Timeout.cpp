@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Timeout.h"
+
+#include <thread>
+
+namespace android {
+namespace lshal {
+
+struct DeadlineExecutor::Future::Task {
+    enum class State { QUEUED, RUNNING, FINISHED, CANCELLED };
+
+    std::function<void(void)> func;
+    Clock::duration timeout;
+    // Set when the task starts running.
+    Clock::time_point deadline;
+    State state = State::QUEUED;
+};
+
+DeadlineExecutor& DeadlineExecutor::instance() {
+    // Never destroyed: abandoned calls may still be running when lshal exits.
+    static DeadlineExecutor* executor = new DeadlineExecutor(IPC_THREADS);
+    return *executor;
+}
+
+DeadlineExecutor::DeadlineExecutor(size_t numThreads) {
+    for (size_t i = 0; i < numThreads; ++i) {
+        startThread();
+    }
+}
+
+void DeadlineExecutor::startThread() {
+    std::thread([this] { threadLoop(); }).detach();
+}
+
+void DeadlineExecutor::threadLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        mQueued.wait(lock, [this] { return !mQueue.empty(); });
+        std::shared_ptr<Future::Task> task = std::move(mQueue.front());
+        mQueue.pop_front();
+
+        task->state = Future::Task::State::RUNNING;
+        task->deadline = Clock::now() + task->timeout;
+        mStateChanged.notify_all();
+        lock.unlock();
+        task->func();
+        lock.lock();
+
+        if (task->state == Future::Task::State::CANCELLED) {
+            // The task was abandoned while it ran, and another thread has
+            // already replaced this one.
+            return;
+        }
+        task->state = Future::Task::State::FINISHED;
+        mStateChanged.notify_all();
+    }
+}
+
+DeadlineExecutor::Future DeadlineExecutor::submit(Clock::duration timeout,
+                                                  std::function<void(void)>&& func) {
+    auto task = std::make_shared<Future::Task>();
+    task->func = std::move(func);
+    task->timeout = timeout;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueue.push_back(task);
+    }
+    mQueued.notify_one();
+    return Future(this, std::move(task));
+}
+
+bool DeadlineExecutor::Future::wait() {
+    std::unique_lock<std::mutex> lock(mExecutor->mMutex);
+    mExecutor->mStateChanged.wait(lock, [this] {
+        return mTask->state != Task::State::QUEUED;
+    });
+    if (mExecutor->mStateChanged.wait_until(lock, mTask->deadline, [this] {
+            return mTask->state == Task::State::FINISHED;
+        })) {
+        return true;
+    }
+    mExecutor->startThread();
+    mTask->state = Task::State::CANCELLED;
+    return false;
+}
+
+}  // namespace lshal
+}  // namespace android
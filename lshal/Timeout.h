@@ -14,12 +14,21 @@
  * limitations under the License.
  */
 
+#ifndef FRAMEWORK_NATIVE_CMDS_LSHAL_TIMEOUT_H_
+#define FRAMEWORK_NATIVE_CMDS_LSHAL_TIMEOUT_H_
+
 #include <condition_variable>
 #include <chrono>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <mutex>
-#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
+#include <android-base/macros.h>
+#include <hidl/HidlSupport.h>
 #include <hidl/Status.h>
 
 namespace android {
@@ -27,71 +36,149 @@ namespace lshal {
 
 static constexpr std::chrono::milliseconds IPC_CALL_WAIT{500};
 
-class BackgroundTaskState {
+// Number of threads that run IPCs for timeoutIPC. Enough for every thread of
+// ListCommand::fetchBinderized to have a call in flight.
+static constexpr size_t IPC_THREADS = 16;
+
+// Runs tasks on a fixed set of worker threads, each task with a timeout.
+//
+// The timeout of a task starts when a worker starts running it, so that calls
+// queued behind others, e.g. when more threads call at once than there are
+// workers, are not charged for the wait. A task that is still running at its
+// deadline can't be interrupted (a stuck hwbinder call can't be cancelled), so
+// it is abandoned: its worker leaves the pool once the task returns, and a new
+// worker takes its place right away. The wait for a worker is thus bounded by
+// the timeouts of the tasks ahead.
+class DeadlineExecutor {
 public:
-    explicit BackgroundTaskState(std::function<void(void)> &&func)
-            : mFunc(std::forward<decltype(func)>(func)) {}
-    void notify() {
-        std::unique_lock<std::mutex> lock(mMutex);
-        mFinished = true;
-        lock.unlock();
-        mCondVar.notify_all();
-    }
-    template<class C, class D>
-    bool wait(std::chrono::time_point<C, D> end) {
-        std::unique_lock<std::mutex> lock(mMutex);
-        mCondVar.wait_until(lock, end, [this](){ return this->mFinished; });
-        return mFinished;
-    }
-    void operator()() {
-        mFunc();
-    }
+    using Clock = std::chrono::steady_clock;
+
+    class Future {
+    public:
+        // Wait until the task has finished, or until its timeout has elapsed
+        // since it started. Returns false, and cancels the task, if it did not
+        // finish in time.
+        bool wait();
+
+    private:
+        friend class DeadlineExecutor;
+        struct Task;
+        Future(DeadlineExecutor* executor, std::shared_ptr<Task> task)
+              : mExecutor(executor), mTask(std::move(task)) {}
+
+        DeadlineExecutor* mExecutor;
+        std::shared_ptr<Task> mTask;
+    };
+
+    // The executor used by timeoutIPC. Its threads are started on first use.
+    static DeadlineExecutor& instance();
+
+    Future submit(Clock::duration timeout, std::function<void(void)>&& func);
+
 private:
+    explicit DeadlineExecutor(size_t numThreads);
+    void startThread();
+    void threadLoop();
+
     std::mutex mMutex;
-    std::condition_variable mCondVar;
-    bool mFinished = false;
-    std::function<void(void)> mFunc;
-};
+    // Signaled when a task is queued.
+    std::condition_variable mQueued;
+    // Signaled when a task starts running or finishes.
+    std::condition_variable mStateChanged;
+    std::deque<std::shared_ptr<Future::Task>> mQueue;
 
-void *callAndNotify(void *data) {
-    BackgroundTaskState &state = *static_cast<BackgroundTaskState *>(data);
-    state();
-    state.notify();
-    return nullptr;
-}
+    DISALLOW_COPY_AND_ASSIGN(DeadlineExecutor);
+};
 
+// Run func in the background, and wait for at most delay for it to finish.
+// func may still be running when this returns false, so it must not refer to
+// anything on the caller's stack.
 template<class R, class P>
 bool timeout(std::chrono::duration<R, P> delay, std::function<void(void)> &&func) {
-    auto now = std::chrono::system_clock::now();
-    BackgroundTaskState state{std::forward<decltype(func)>(func)};
-    pthread_t thread;
-    if (pthread_create(&thread, nullptr, callAndNotify, &state)) {
-        std::cerr << "FATAL: could not create background thread." << std::endl;
-        return false;
-    }
-    bool success = state.wait(now + delay);
-    if (!success) {
-        pthread_kill(thread, SIGINT);
-    }
-    pthread_join(thread, nullptr);
-    return success;
+    return DeadlineExecutor::instance()
+            .submit(std::chrono::duration_cast<DeadlineExecutor::Clock::duration>(delay),
+                    std::move(func))
+            .wait();
+}
+
+namespace details {
+
+template<class T>
+struct IsStdFunction : std::false_type {};
+template<class Signature>
+struct IsStdFunction<std::function<Signature>> : std::true_type {};
+
+template<class Method>
+struct MethodParameters;
+template<class R, class C, class... P>
+struct MethodParameters<R (C::*)(P...)> {
+    using type = std::tuple<P...>;
+};
+
+// Parameters of a HIDL method are either values (strings, handles, vectors,
+// interfaces, ...) or the callback that receives its results, which is the
+// only one the generated code declares as a std::function (e.g.
+// IBase::interfaceChain_cb). The parameter decides, as the argument given for
+// a callback is usually a generic lambda.
+template<class Method, size_t Index>
+using IsCallback = IsStdFunction<std::decay_t<
+        std::tuple_element_t<Index, typename MethodParameters<std::decay_t<Method>>::type>>>;
+
+template<class State, class A>
+std::decay_t<A> guardArgument(const std::shared_ptr<State>& /* state */, A &&arg,
+                              std::false_type /* isCallback */) {
+    return std::forward<A>(arg);
+}
+
+// Callbacks usually write to the caller's stack, so they are skipped once the
+// caller has given up on the call.
+template<class State, class Callback>
+auto guardArgument(const std::shared_ptr<State>& state, Callback &&callback,
+                   std::true_type /* isCallback */) {
+    return [state, callback = std::forward<Callback>(callback)](auto&&... results) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!state->abandoned) {
+            callback(std::forward<decltype(results)>(results)...);
+        }
+    };
+}
+
+template<class State, class Function, class I, size_t... Indices, class... Args>
+auto bindCall(const std::shared_ptr<State>& state, Function &&func, const sp<I> &interfaceObject,
+              std::index_sequence<Indices...> /* indices */, Args &&... args) {
+    return std::bind(std::forward<Function>(func), interfaceObject,
+            guardArgument(state, std::forward<Args>(args), IsCallback<Function, Indices>{})...);
 }
 
+}  // namespace details
+
 template<class R, class P, class Function, class I, class... Args>
 typename std::result_of<Function(I *, Args...)>::type
 timeoutIPC(std::chrono::duration<R, P> wait, const sp<I> &interfaceObject, Function &&func,
            Args &&... args) {
     using ::android::hardware::Status;
-    typename std::result_of<Function(I *, Args...)>::type ret{Status::ok()};
-    auto boundFunc = std::bind(std::forward<Function>(func),
-            interfaceObject.get(), std::forward<Args>(args)...);
-    bool success = timeout(wait, [&ret, &boundFunc] {
-        ret = std::move(boundFunc());
+    using Ret = typename std::result_of<Function(I *, Args...)>::type;
+
+    // Shared with the call, which may outlive this function if it times out.
+    struct State {
+        std::mutex mutex;
+        bool abandoned = false;
+        Ret ret{Status::ok()};
+    };
+    auto state = std::make_shared<State>();
+    auto boundFunc = details::bindCall(state, std::forward<Function>(func), interfaceObject,
+            std::index_sequence_for<Args...>{}, std::forward<Args>(args)...);
+    bool success = timeout(wait, [state, boundFunc = std::move(boundFunc)]() mutable {
+        Ret ret = boundFunc();
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->ret = std::move(ret);
     });
+    std::lock_guard<std::mutex> lock(state->mutex);
     if (!success) {
+        state->abandoned = true;
         return Status::fromStatusT(TIMED_OUT);
     }
-    return ret;
+    return std::move(state->ret);
 }
 
 template<class Function, class I, class... Args>
@@ -103,3 +190,5 @@ timeoutIPC(const sp<I> &interfaceObject, Function &&func, Args &&... args) {
 
 }  // namespace lshal
 }  // namespace android
+
+#endif  // FRAMEWORK_NATIVE_CMDS_LSHAL_TIMEOUT_H_
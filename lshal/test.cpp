@@ -16,7 +16,15 @@
 
 #define LOG_TAG "Lshal"
 #include <android-base/logging.h>
-
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <future>
+#include <regex>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -30,6 +38,7 @@
 
 #include "ListCommand.h"
 #include "Lshal.h"
+#include "Timeout.h"
 
 #define NELEMS(array)   static_cast<int>(sizeof(array) / sizeof(array[0]))
 
@@ -44,6 +53,7 @@ using ::android::hardware::hidl_death_recipient;
 using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
+using android::base::StringPrintf;
 using android::vintf::Arch;
 using android::vintf::CompatibilityMatrix;
 using android::vintf::gCompatibilityMatrixConverter;
@@ -180,6 +190,101 @@ TEST_F(DebugTest, Debug3) {
     EXPECT_THAT(err.str(), HasSubstr("does not exist"));
 }
 
+TEST_F(DebugTest, DebugWithTimeout) {
+    std::stringstream debugOut;
+    EXPECT_EQ(0u, lshal->emitDebugInfo("android.hardware.tests.baz@1.0::IQuux", "default",
+                                       {"foo"}, false /* excludesParentInstances */, debugOut,
+                                       NullableOStream<std::ostream>(err), IPC_CALL_WAIT));
+    EXPECT_THAT(debugOut.str(), StrEq("android.hardware.tests.baz@1.0::IQuux\nfoo"));
+    EXPECT_THAT(err.str(), IsEmpty());
+}
+
+// A HAL whose debug() takes long: it either writes a line every 10ms, or nothing, until it is
+// stopped, its output is closed, or 3s have passed.
+class SlowQuux : public ::android::hardware::tests::baz::V1_0::implementation::Quux {
+public:
+    // returned is given whether all the writes succeeded.
+    SlowQuux(bool writes, std::shared_future<void> stopped,
+             std::shared_ptr<std::promise<bool>> returned)
+          : mWrites(writes), mStopped(stopped), mReturned(returned) {}
+
+    hardware::Return<void> debug(const hidl_handle& hh, const hidl_vec<hidl_string>&) override {
+        using std::literals::chrono_literals::operator""ms;
+        int fd = hh.getNativeHandle()->data[0];
+        bool ok = true;
+        for (int i = 0; i < 300 && mStopped.wait_for(10ms) == std::future_status::timeout; ++i) {
+            if (mWrites && write(fd, "line\n", 5) < 0) {
+                ok = false;
+                break;
+            }
+        }
+        mReturned->set_value(ok);
+        return hardware::Void();
+    }
+
+private:
+    bool mWrites;
+    std::shared_future<void> mStopped;
+    std::shared_ptr<std::promise<bool>> mReturned;
+};
+
+class DebugTimeoutTest : public DebugTest, public ::testing::WithParamInterface<bool> {};
+
+TEST_P(DebugTimeoutTest, ReturnsAtTimeout) {
+    using ::android::hardware::tests::baz::V1_0::IQuux;
+    using std::literals::chrono_literals::operator""ms;
+    // Writes to a closed pipe then fail the test instead of killing it.
+    auto oldSigpipe = signal(SIGPIPE, SIG_IGN);
+    std::promise<void> stop;
+    auto returned = std::make_shared<std::promise<bool>>();
+    sp<IBase> slow = new SlowQuux(GetParam() /* writes */, stop.get_future().share(), returned);
+    ON_CALL(*serviceManager, get(_, hidl_string("slow"))).WillByDefault(Invoke(
+        [slow](const auto&, const auto&) -> hardware::Return<sp<IBase>> { return slow; }));
+
+    std::stringstream debugOut;
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(TIMEOUT_ERROR, lshal->emitDebugInfo(IQuux::descriptor, "slow", {},
+                                                  false /* excludesParentInstances */, debugOut,
+                                                  NullableOStream<std::ostream>(err), 100ms));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    // The relay neither follows a HAL that keeps writing, nor waits for a silent one.
+    EXPECT_LT(elapsed, 500ms);
+    EXPECT_THAT(err.str(), HasSubstr("did not finish within 100ms"));
+    if (GetParam()) {
+        EXPECT_THAT(debugOut.str(), StartsWith("line\n"));
+    } else {
+        EXPECT_THAT(debugOut.str(), IsEmpty());
+    }
+
+    // The HAL keeps writing after it was given up on, and none of it fails.
+    std::this_thread::sleep_for(100ms);
+    stop.set_value();
+    EXPECT_TRUE(returned->get_future().get());
+    signal(SIGPIPE, oldSigpipe);
+}
+
+INSTANTIATE_TEST_CASE_P(Writes, DebugTimeoutTest, ::testing::Bool());
+
+TEST_F(DebugTest, GetPastTimeout) {
+    using std::literals::chrono_literals::operator""ms;
+    auto release = std::make_shared<std::promise<void>>();
+    std::shared_future<void> released = release->get_future().share();
+    ON_CALL(*serviceManager, get(_, hidl_string("stuck"))).WillByDefault(Invoke(
+        [released](const auto&, const auto&) -> hardware::Return<sp<IBase>> {
+            released.wait();
+            return nullptr;
+        }));
+
+    std::stringstream debugOut;
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_NE(0u, lshal->emitDebugInfo("android.hardware.tests.baz@1.0::IQuux", "stuck", {},
+                                       false /* excludesParentInstances */, debugOut,
+                                       NullableOStream<std::ostream>(err), 100ms));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 500ms);
+    EXPECT_THAT(err.str(), HasSubstr("Cannot get"));
+    release->set_value();
+}
+
 class MockLshal : public Lshal {
 public:
     MockLshal() {}
@@ -325,6 +430,21 @@ private:
     pid_t mId;
 };
 
+// A TestService whose debug() writes "debug of <id>", the later the lower its id is.
+class DebuggableTestService : public TestService {
+public:
+    DebuggableTestService(pid_t id, pid_t maxId) : TestService(id), mId(id), mMaxId(maxId) {}
+    hardware::Return<void> debug(const hidl_handle& hh, const hidl_vec<hidl_string>&) override {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10 * (mMaxId - mId)));
+        std::string content = "debug of " + std::to_string(mId);
+        (void)write(hh.getNativeHandle()->data[0], content.data(), content.size());
+        return hardware::Void();
+    }
+private:
+    pid_t mId;
+    pid_t mMaxId;
+};
+
 class ListTest : public ::testing::Test {
 public:
     virtual void SetUp() override {
@@ -410,6 +530,168 @@ TEST_F(ListTest, GetPidInfoCached) {
     EXPECT_NE(nullptr, mockList->getPidInfoCached(5));
 }
 
+TEST(BinderPidInfoTest, ParseState) {
+    const std::string state =
+            "binder state:\n"
+            "dead nodes:\n"
+            "  node 9: u0000000000000000 c0000000000000000 hs 0 hw 0 ls 0 lw 0 is 1 iw 1 tr 1"
+            " proc 7\n"
+            "proc 10\n"
+            "context binder\n"
+            "  thread 10: l 12 need_return 0 tr 0\n"
+            "  node 1: u00000000000000a0 c00000000000000b0 hs 1 hw 1 ls 0 lw 0 is 1 iw 1 tr 1"
+            " proc 30\n"
+            "proc 10\n"
+            "context hwbinder\n"
+            "  thread 10: l 12 need_return 0 tr 0\n"
+            "  thread 11: l 01 need_return 0 tr 0\n"
+            "  thread 12: l 00 need_return 0 tr 0\n"
+            "  node 2: u00000000000000c0 c00000000000000d0 hs 1 hw 1 ls 0 lw 0 is 2 iw 2 tr 1"
+            " proc 20 proc 21 22\n"
+            "  node 3: u00000000000000e0 c00000000000000f0 hs 1 hw 1 ls 0 lw 0 is 0 iw 0 tr 1\n"
+            "  ref 4: desc 0 node 1 s 1 w 1 d 0000000000000000\n"
+            "proc 20\n"
+            "context hwbinder\n"
+            "  thread 20: l 11 need_return 0 tr 0\n";
+
+    std::map<pid_t, PidInfo> pidInfos;
+    std::stringstream err;
+    parseBinderPidInfos(state, "hwbinder", &pidInfos, NullableOStream<std::ostream>(err));
+    EXPECT_EQ("", err.str());
+    ASSERT_EQ(2u, pidInfos.size());
+
+    const PidInfo& server = pidInfos[10];
+    EXPECT_EQ((std::map<uint64_t, Pids>{{0xd0, {21, 22}}}), server.refPids);
+    EXPECT_EQ(1u, server.threadUsage);
+    EXPECT_EQ(2u, server.threadCount);
+
+    const PidInfo& client = pidInfos[20];
+    EXPECT_TRUE(client.refPids.empty());
+    EXPECT_EQ(0u, client.threadUsage);
+    EXPECT_EQ(1u, client.threadCount);
+}
+
+// The regex parser getPidInfo used before parseBinderPidInfos, on the content of
+// /d/binder/proc/<pid>, to check the new parser against it.
+static bool regexParsePidInfo(const std::string& content, PidInfo* pidInfo) {
+    static const std::regex kContextLine("^context (\\w+)$");
+    static const std::regex kReferencePrefix("^\\s*node \\d+:\\s+u([0-9a-f]+)\\s+c([0-9a-f]+)\\s+");
+    static const std::regex kThreadPrefix("^\\s*thread \\d+:\\s+l\\s+(\\d)(\\d)");
+
+    std::istringstream in(content);
+    bool isDesiredContext = false;
+    std::string line;
+    std::smatch match;
+    while (getline(in, line)) {
+        if (std::regex_search(line, match, kContextLine)) {
+            isDesiredContext = match.str(1) == "hwbinder";
+            continue;
+        }
+        if (!isDesiredContext) {
+            continue;
+        }
+        if (std::regex_search(line, match, kReferencePrefix)) {
+            uint64_t ptr;
+            if (!::android::base::ParseUint(("0x" + match.str(2)).c_str(), &ptr)) {
+                return false;
+            }
+            auto pos = line.rfind(" proc ");
+            if (pos != std::string::npos) {
+                for (const std::string& pidStr : split(line.substr(pos + 6), ' ')) {
+                    int32_t pid;
+                    if (!::android::base::ParseInt(pidStr, &pid)) {
+                        return false;
+                    }
+                    pidInfo->refPids[ptr].push_back(pid);
+                }
+            }
+        } else if (std::regex_search(line, match, kThreadPrefix)) {
+            if (match.str(2) != "0") {
+                if (match.str(1) != "1") {
+                    pidInfo->threadUsage++;
+                }
+                pidInfo->threadCount++;
+            }
+        }
+    }
+    return true;
+}
+
+// A /d/binder/proc/<pid> file of a large server, with `nodes` nodes and as many refs in each
+// context.
+static std::string makeBinderProcFile(pid_t pid, size_t nodes) {
+    std::string content = "binder proc state:\n";
+    for (const char* context : {"binder", "hwbinder"}) {
+        content += StringPrintf("proc %d\ncontext %s\n", pid, context);
+        for (size_t i = 0; i < 32; ++i) {
+            content += StringPrintf("  thread %zu: l %zu%zu need_return 0 tr 0\n", 1000 + i,
+                                    i % 3, i % 3 == 0 ? 0 : 1 + i % 2);
+        }
+        for (size_t i = 0; i < nodes; ++i) {
+            content += StringPrintf("  node %zu: u%016zx c%016zx hs 1 hw 1 ls 0 lw 0 is 2 iw 2"
+                                    " tr 1 proc %zu proc %zu %zu\n", 10000 + i, 0x1000 + i * 16,
+                                    0x2000 + i * 16, 100 + i % 50, 200 + i % 70, 300 + i % 90);
+        }
+        for (size_t i = 0; i < nodes; ++i) {
+            content += StringPrintf("  ref %zu: desc %zu node %zu s 1 w 1 d 0000000000000000\n",
+                                    20000 + i, i, 10000 + i);
+        }
+        for (size_t i = 0; i < 16; ++i) {
+            content += StringPrintf("  buffer %zu: 0000000000000000 size 24:8:0 delivered\n", i);
+        }
+    }
+    return content;
+}
+
+static void expectSamePidInfo(const PidInfo& expected, const PidInfo& actual) {
+    EXPECT_EQ(expected.refPids, actual.refPids);
+    EXPECT_EQ(expected.threadUsage, actual.threadUsage);
+    EXPECT_EQ(expected.threadCount, actual.threadCount);
+}
+
+TEST(BinderPidInfoTest, MatchesRegexParser) {
+    std::string content = makeBinderProcFile(10, 100);
+    PidInfo expected{};
+    ASSERT_TRUE(regexParsePidInfo(content, &expected));
+    ASSERT_EQ(100u, expected.refPids.size());
+
+    std::map<pid_t, PidInfo> pidInfos;
+    std::stringstream err;
+    parseBinderPidInfos(content, "hwbinder", &pidInfos, NullableOStream<std::ostream>(err));
+    EXPECT_EQ("", err.str());
+    ASSERT_EQ(1u, pidInfos.count(10));
+    expectSamePidInfo(expected, pidInfos[10]);
+}
+
+// Not run by default: prints how long each parser takes on the file of a large server, e.g.
+//   lshal_test --gtest_also_run_disabled_tests --gtest_filter=*BenchmarkAgainstRegexParser
+TEST(BinderPidInfoTest, DISABLED_BenchmarkAgainstRegexParser) {
+    constexpr int kRuns = 20;
+    std::string content = makeBinderProcFile(10, 3000);
+
+    PidInfo expected{};
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRuns; ++i) {
+        expected = PidInfo{};
+        ASSERT_TRUE(regexParsePidInfo(content, &expected));
+    }
+    std::chrono::duration<double, std::milli> regexTime = std::chrono::steady_clock::now() - start;
+
+    std::map<pid_t, PidInfo> pidInfos;
+    NullableOStream<std::ostream> err(nullptr);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRuns; ++i) {
+        pidInfos.clear();
+        parseBinderPidInfos(content, "hwbinder", &pidInfos, err);
+    }
+    std::chrono::duration<double, std::milli> parserTime = std::chrono::steady_clock::now() - start;
+
+    ASSERT_EQ(1u, pidInfos.count(10));
+    expectSamePidInfo(expected, pidInfos[10]);
+    printf("%zu bytes: regex %.3fms, parseBinderPidInfos %.3fms per parse\n", content.size(),
+           regexTime.count() / kRuns, parserTime.count() / kRuns);
+}
+
 TEST_F(ListTest, Fetch) {
     optind = 1; // mimic Lshal::parseArg()
     ASSERT_EQ(0u, mockList->parseArgs(createArg({"lshal"})));
@@ -451,6 +733,110 @@ TEST_F(ListTest, Fetch) {
 
 }
 
+TEST_F(ListTest, FetchManyServices) {
+    const pid_t kNumServices = 40;
+    ON_CALL(*serviceManager, list(_)).WillByDefault(Invoke(
+        [&] (IServiceManager::list_cb cb) {
+            std::vector<hidl_string> names;
+            for (pid_t id = kNumServices; id > 0; --id) {
+                names.push_back(getFqInstanceName(id));
+            }
+            cb(names);
+            return hardware::Void();
+        }));
+
+    optind = 1; // mimic Lshal::parseArg()
+    ASSERT_EQ(0u, mockList->parseArgs(createArg({"lshal", "--types=b"})));
+    ASSERT_EQ(0u, mockList->fetch());
+
+    std::vector<std::string> names;
+    mockList->forEachTable([&](const Table& table) {
+        for (const auto& entry : table) {
+            pid_t id = getIdFromInstanceName(splitFirst(entry.interfaceName, '/').second);
+            EXPECT_EQ(getFqInstanceName(id), entry.interfaceName);
+            EXPECT_EQ(id, entry.serverPid);
+            EXPECT_EQ(getPtr(id), entry.serverObjectAddress);
+            EXPECT_EQ(getPidInfoFromId(id).threadUsage, entry.threadUsage);
+            EXPECT_EQ(getClients(id), entry.clientPids);
+            EXPECT_EQ(ServiceStatus::ALIVE, entry.serviceStatus);
+            names.push_back(entry.interfaceName);
+        }
+    });
+    EXPECT_EQ(static_cast<size_t>(kNumServices), names.size());
+    EXPECT_TRUE(std::is_sorted(names.begin(), names.end())) << "entries are not in order";
+    EXPECT_EQ("", err.str());
+}
+
+TEST_F(ListTest, DumpDebugInfoInTableOrder) {
+    const pid_t kNumServices = 8;
+    ON_CALL(*serviceManager, list(_)).WillByDefault(Invoke(
+        [&] (IServiceManager::list_cb cb) {
+            std::vector<hidl_string> names;
+            for (pid_t id = kNumServices; id > 0; --id) {
+                names.push_back(getFqInstanceName(id));
+            }
+            cb(names);
+            return hardware::Void();
+        }));
+    ON_CALL(*serviceManager, get(_, _)).WillByDefault(Invoke(
+        [&](const hidl_string&, const hidl_string& instance) {
+            return sp<IBase>(new DebuggableTestService(getIdFromInstanceName(instance),
+                                                       kNumServices));
+        }));
+
+    optind = 1; // mimic Lshal::parseArg()
+    EXPECT_EQ(0u, mockList->main(createArg({"lshal", "--types=b", "-i", "--debug"})));
+
+    // The dumps finish in the reverse order, but each is printed right under its own row.
+    std::string output = out.str();
+    size_t pos = 0;
+    for (pid_t id = 1; id <= kNumServices; ++id) {
+        size_t row = output.find(getFqInstanceName(id) + "\n", pos);
+        ASSERT_NE(std::string::npos, row) << "no row for " << id << " in order";
+        size_t debugInfo = output.find("debug of " + std::to_string(id) + "\n", row);
+        ASSERT_NE(std::string::npos, debugInfo) << "no debug info for " << id;
+        if (id < kNumServices) {
+            EXPECT_LT(debugInfo, output.find(getFqInstanceName(id + 1)))
+                    << "debug info of " << id << " is not right under its row";
+        }
+        pos = debugInfo;
+    }
+    EXPECT_THAT(output, HasSubstr("[debug() took "));
+    EXPECT_THAT(output, Not(HasSubstr("may be truncated")));
+    EXPECT_EQ("", err.str());
+}
+
+TEST_F(ListTest, PassthroughArchFromImplementation) {
+    using A = DebugInfo::Architecture;
+    ON_CALL(*serviceManager, debugDump(_)).WillByDefault(Invoke(
+        [] (IServiceManager::debugDump_cb cb) {
+            cb({InstanceDebugInfo{getInterfaceName(3), getInstanceName(3), 3,
+                                  getClients(3), A::UNKNOWN}});
+            return hardware::Void();
+        }));
+    ON_CALL(*passthruManager, debugDump(_)).WillByDefault(Invoke(
+        [] (IServiceManager::debugDump_cb cb) {
+            cb({InstanceDebugInfo{getInterfaceName(3), getInstanceName(3), 3,
+                                  getClients(3), A::IS_64BIT},
+                InstanceDebugInfo{getInterfaceName(4), getInstanceName(4), 4,
+                                  getClients(4), A::IS_32BIT}});
+            return hardware::Void();
+        }));
+
+    optind = 1; // mimic Lshal::parseArg()
+    ASSERT_EQ(0u, mockList->parseArgs(createArg({"lshal", "--types=c,l"})));
+    ASSERT_EQ(0u, mockList->fetch());
+    mockList->internalPostprocess();
+
+    std::vector<Arch> archs;
+    mockList->forEachTable([&](const Table& table) {
+        for (const auto& entry : table) {
+            archs.push_back(entry.arch);
+        }
+    });
+    EXPECT_EQ((std::vector<Arch>{Arch::ARCH_64, Arch::ARCH_64, Arch::ARCH_32}), archs);
+}
+
 TEST_F(ListTest, DumpVintf) {
     const std::string expected = "<manifest version=\"1.0\" type=\"device\">\n"
                                  "    <hal format=\"hidl\">\n"
@@ -883,6 +1269,114 @@ TEST_F(HelpTest, UnknownOptionHelp2) {
     EXPECT_EQ("", out.str());
 }
 
+TEST(TimeoutTest, Finished) {
+    bool called = false;
+    EXPECT_TRUE(timeout(IPC_CALL_WAIT, [&called] { called = true; }));
+    EXPECT_TRUE(called);
+}
+
+TEST(TimeoutTest, StuckCallsDoNotBlockOthers) {
+    using std::literals::chrono_literals::operator""ms;
+    auto release = std::make_shared<std::promise<void>>();
+    std::shared_future<void> released = release->get_future().share();
+    // More stuck calls than there are threads to run them.
+    for (size_t i = 0; i < IPC_THREADS + 1; ++i) {
+        EXPECT_FALSE(timeout(10ms, [released] { released.wait(); }));
+    }
+    EXPECT_TRUE(timeout(IPC_CALL_WAIT, [] {}));
+    release->set_value();
+}
+
+TEST(TimeoutTest, CallbackSkippedAfterTimeout) {
+    using std::literals::chrono_literals::operator""ms;
+    sp<MockServiceManager> manager = new NiceMock<MockServiceManager>();
+    auto release = std::make_shared<std::promise<void>>();
+    auto returned = std::make_shared<std::promise<void>>();
+    std::shared_future<void> released = release->get_future().share();
+    ON_CALL(*manager, list(_)).WillByDefault(Invoke([released, returned](auto cb) {
+        released.wait();
+        cb({getFqInstanceName(1)});
+        returned->set_value();
+        return hardware::Void();
+    }));
+
+    std::vector<std::string> names;
+    auto ret = timeoutIPC(10ms, manager, &IServiceManager::list, [&names](const auto& received) {
+        for (const auto& name : received) names.push_back(name);
+    });
+    EXPECT_FALSE(ret.isOk());
+
+    auto finished = returned->get_future();
+    release->set_value();
+    finished.wait();
+    EXPECT_TRUE(names.empty()) << "callback ran after the call timed out";
+}
+
+// Only the parameters HIDL declares as std::function are callbacks, not other class types.
+static_assert(details::IsCallback<decltype(&IServiceManager::list), 0>::value, "list_cb");
+static_assert(!details::IsCallback<decltype(&IServiceManager::get), 0>::value, "hidl_string");
+static_assert(!details::IsCallback<decltype(&IServiceManager::add), 1>::value, "sp<IBase>");
+static_assert(!details::IsCallback<decltype(&IBase::debug), 0>::value, "hidl_handle");
+static_assert(!details::IsCallback<decltype(&IBase::debug), 1>::value, "hidl_vec");
+
+TEST(TimeoutTest, HidlClassArgumentsArePassedAsIs) {
+    sp<MockServiceManager> manager = new NiceMock<MockServiceManager>();
+    hidl_vec<hidl_string> options{"--foo"};
+    EXPECT_CALL(*manager, debug(_, options)).WillOnce(Invoke([](const auto&, const auto&) {
+        return hardware::Void();
+    }));
+    EXPECT_TRUE(timeoutIPC(manager, &IBase::debug, hidl_handle(), options).isOk());
+}
+
+TEST(TimeoutTest, QueuedCallsGetTheirWholeTimeout) {
+    using std::literals::chrono_literals::operator""ms;
+    // Keep every worker busy for longer than the timeout of the queued call, without timing out.
+    std::vector<std::thread> busy;
+    std::atomic<size_t> started{0};
+    for (size_t i = 0; i < IPC_THREADS; ++i) {
+        busy.emplace_back([&started] {
+            EXPECT_TRUE(timeout(IPC_CALL_WAIT, [&started] {
+                started++;
+                std::this_thread::sleep_for(200ms);
+            }));
+        });
+    }
+    while (started < IPC_THREADS) {
+        std::this_thread::sleep_for(1ms);
+    }
+    EXPECT_TRUE(timeout(50ms, [] {})) << "the call timed out while it was queued";
+    for (auto& thread : busy) {
+        thread.join();
+    }
+}
+
+// Not run by default: prints the time timeoutIPC adds to each call, e.g.
+//   lshal_test --gtest_also_run_disabled_tests --gtest_filter=*PerCallOverhead
+TEST(TimeoutTest, DISABLED_PerCallOverhead) {
+    constexpr int kCalls = 10000;
+    sp<MockServiceManager> manager = new NiceMock<MockServiceManager>();
+    ON_CALL(*manager, list(_)).WillByDefault(Invoke([](auto cb) {
+        cb({getFqInstanceName(1)});
+        return hardware::Void();
+    }));
+
+    size_t received = 0;
+    auto callback = [&received](const auto& names) { received += names.size(); };
+    auto measure = [&](const auto& call) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kCalls; ++i) {
+            EXPECT_TRUE(call().isOk());
+        }
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start)
+                .count() / kCalls;
+    };
+    double direct = measure([&] { return manager->list(callback); });
+    double timed = measure([&] { return timeoutIPC(manager, &IServiceManager::list, callback); });
+    EXPECT_EQ(2u * kCalls, received);
+    printf("%d calls: direct %.2fus, timeoutIPC %.2fus, overhead %.2fus per call\n", kCalls,
+           direct, timed, timed - direct);
+}
+
 } // namespace lshal
 } // namespace android
 
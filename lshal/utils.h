@@ -48,6 +48,8 @@ enum : unsigned int {
     BAD_IMPL                                = 1 << 9,
     // Cannot fetch VINTF data.
     VINTF_ERROR                             = 1 << 10,
+    // A call did not finish within its timeout, so its output may be incomplete.
+    TIMEOUT_ERROR                           = 1 << 11,
 };
 using Status = unsigned int;
 